@@ -0,0 +1,141 @@
+/**
+ * Packs the contents of the arduino data folder into a single read-only
+ * asset blob which is flashed into the device's "assets" partition.
+ *
+ * The device memory maps the partition and serves the files straight out of
+ * flash, so the layout here must match `assetPartition.h`:
+ *
+ *   Header (16 bytes)
+ *     char[4]  magic          "GBAS"
+ *     uint16   version        2
+ *     uint16   entryCount
+ *     uint32   blobSize       the size of the whole blob in bytes
+ *     uint32   buildId        an FNV-1a hash of every path and file in the blob
+ *
+ *   Entries (entryCount x 80 bytes)
+ *     char[64] path           the path of the file (ie. "/js/control.bnd.js.gz"), null padded
+ *     uint32   offset         the offset of the file data from the start of the blob
+ *     uint32   length         the length of the file data
+ *     uint32   hash           an FNV-1a hash of the file data (used for the ETag)
+ *     uint32   reserved
+ *
+ *   File data (each file aligned to 4 bytes)
+ *
+ * All integers are little endian.
+ *
+ * The build id is also written to `assets.id` in the source folder (as 8 hex
+ * digits) so that it ends up in the LITTLEFS image. The device only serves the
+ * blob while LITTLEFS holds the same build, so a web app updated over the air
+ * (which only replaces LITTLEFS) is never shadowed by an older blob.
+ *
+ * Usage: node pack-assets.js [sourceDir] [outputFile]
+ */
+const fs = require('fs');
+const path = require('path');
+
+const MAGIC = 'GBAS';
+const VERSION = 2;
+const HEADER_SIZE = 16;
+const ENTRY_SIZE = 80;
+const MAX_PATH_LENGTH = 64;
+
+// The size of the "assets" partition in partitions.csv
+const PARTITION_SIZE = 0xC0000;
+
+// The build id file written to the data folder (see ASSET_PARTITION_BUILD_ID_FILE)
+const BUILD_ID_FILE = '/assets.id';
+
+// Files in the data folder which must never end up in the blob
+const EXCLUDED_FILES = ['/config.json', '/config.a.bin', '/config.b.bin', BUILD_ID_FILE];
+
+const defaultSourceDir = path.resolve(__dirname, '../arduino/garage_bot/data');
+const defaultOutputFile = path.resolve(__dirname, '../arduino/garage_bot/assets.bin');
+
+/**
+ * Recursively list the files in a directory as device paths (ie. "/js/control.bnd.js")
+ */
+const listFiles = (rootDir, dir = rootDir) => fs.readdirSync(dir, { withFileTypes: true })
+  .flatMap((dirent) => {
+    const fullPath = path.join(dir, dirent.name);
+    if (dirent.isDirectory()) {
+      return listFiles(rootDir, fullPath);
+    }
+    return [`/${path.relative(rootDir, fullPath).split(path.sep).join('/')}`];
+  });
+
+/**
+ * 32 bit FNV-1a hash of a buffer
+ */
+const fnv1a = (buffer, seed = 0x811c9dc5) => {
+  let hash = seed;
+  for (let i = 0; i < buffer.length; i += 1) {
+    hash ^= buffer[i];
+    hash = Math.imul(hash, 0x01000193) >>> 0;
+  }
+  return hash >>> 0;
+};
+
+const align4 = (value) => (value + 3) & ~3;
+
+/**
+ * Build the asset blob from the files in a directory
+ */
+const packAssets = (sourceDir = defaultSourceDir, outputFile = defaultOutputFile) => {
+  const files = listFiles(sourceDir)
+    .filter((filePath) => !EXCLUDED_FILES.includes(filePath))
+    .sort();
+
+  files.forEach((filePath) => {
+    if (Buffer.byteLength(filePath) >= MAX_PATH_LENGTH) {
+      throw new Error(`Asset path is too long for the asset blob: ${filePath}`);
+    }
+  });
+
+  const contents = files.map((filePath) => fs.readFileSync(path.join(sourceDir, filePath)));
+
+  let offset = align4(HEADER_SIZE + (files.length * ENTRY_SIZE));
+  const offsets = contents.map((content) => {
+    const fileOffset = offset;
+    offset = align4(offset + content.length);
+    return fileOffset;
+  });
+  const blobSize = offset;
+
+  if (blobSize > PARTITION_SIZE) {
+    throw new Error(`Asset blob (${blobSize} bytes) is larger than the assets partition (${PARTITION_SIZE} bytes)`);
+  }
+
+  const blob = Buffer.alloc(blobSize);
+
+  blob.write(MAGIC, 0, 'ascii');
+  blob.writeUInt16LE(VERSION, 4);
+  blob.writeUInt16LE(files.length, 6);
+  blob.writeUInt32LE(blobSize, 8);
+
+  // The path terminator is included so that moving bytes between a path and its file changes the id
+  const buildId = files.reduce(
+    (hash, filePath, index) => fnv1a(contents[index], fnv1a(Buffer.from(`${filePath}\0`), hash)),
+    0x811c9dc5,
+  );
+  blob.writeUInt32LE(buildId, 12);
+
+  files.forEach((filePath, index) => {
+    const entryOffset = HEADER_SIZE + (index * ENTRY_SIZE);
+    blob.write(filePath, entryOffset, MAX_PATH_LENGTH - 1, 'utf8');
+    blob.writeUInt32LE(offsets[index], entryOffset + 64);
+    blob.writeUInt32LE(contents[index].length, entryOffset + 68);
+    blob.writeUInt32LE(fnv1a(contents[index]), entryOffset + 72);
+    contents[index].copy(blob, offsets[index]);
+  });
+
+  fs.writeFileSync(outputFile, blob);
+  fs.writeFileSync(path.join(sourceDir, BUILD_ID_FILE), buildId.toString(16).padStart(8, '0'));
+
+  console.log(`Packed ${files.length} assets (${blobSize} bytes, build ${buildId.toString(16).padStart(8, '0')}) into ${outputFile}`);
+};
+
+if (require.main === module) {
+  packAssets(process.argv[2], process.argv[3]);
+}
+
+module.exports = packAssets;
@@ -22,11 +22,13 @@ export type ConfigTransport = Pick<IConfig,
   'mqtt_enabled' |
   'mqtt_broker_address' |
   'mqtt_broker_port' |
+  'mqtt_tls_enabled' |
   'mqtt_device_id' |
   'mqtt_state_topic' |
   'mqtt_command_topic' |
   'mqtt_username' |
-  'mqtt_password'
+  'mqtt_password' |
+  'udp_command_key'
 >;
 
 const getConfigTransportFromConfig = (config: IConfig): ConfigTransport => ({
@@ -35,11 +37,13 @@ const getConfigTransportFromConfig = (config: IConfig): ConfigTransport => ({
   mqtt_enabled: config.mqtt_enabled,
   mqtt_broker_address: config.mqtt_broker_address,
   mqtt_broker_port: config.mqtt_broker_port,
+  mqtt_tls_enabled: config.mqtt_tls_enabled,
   mqtt_device_id: config.mqtt_device_id,
   mqtt_username: config.mqtt_username,
   mqtt_password: config.mqtt_password,
   mqtt_command_topic: config.mqtt_command_topic,
   mqtt_state_topic: config.mqtt_state_topic,
+  udp_command_key: config.udp_command_key,
 });
 
 export const ConfigPage: React.FC<PageProps> = (props) => {
@@ -72,8 +76,9 @@ export const ConfigPage: React.FC<PageProps> = (props) => {
     const payload = {
       ...configValues,
 
-      // Don't submit the password mask as a new password value
+      // Don't submit the password / key masks as new values
       mqtt_password: configValues.mqtt_password === '********' ? null : configValues.mqtt_password,
+      udp_command_key: configValues.udp_command_key === '********' ? null : configValues.udp_command_key,
     };
 
     try {
@@ -235,6 +240,20 @@ export const ConfigPage: React.FC<PageProps> = (props) => {
                   ].join(' <br/>')}
                 />
 
+                {/* MQTT TLS Enabled */}
+                <FormField
+                  id="mqtt_tls_enabled"
+                  fieldName="mqtt_tls_enabled"
+                  label="Use TLS"
+                  value={configValues.mqtt_tls_enabled}
+                  onChange={fieldChanged}
+                  type="checkbox"
+                  toolTip={[
+                    'Connect to the MQTT Broker with TLS',
+                    '(usually on port 8883)',
+                  ].join(' <br/>')}
+                />
+
                 {/* MQTT Device ID */}
                 <FormField
                   id="mqtt_device_id"
@@ -307,6 +326,23 @@ export const ConfigPage: React.FC<PageProps> = (props) => {
               </>
               )}
             </FormFieldGroup>
+
+            {/* UDP Command Config */}
+            <FormFieldGroup legend="UDP Command Config">
+              {/* UDP Command Key */}
+              <FormField
+                id="udp_command_key"
+                fieldName="udp_command_key"
+                type="text"
+                label="UDP Command Key"
+                value={configValues.udp_command_key}
+                onChange={fieldChanged}
+                toolTip={[
+                  'The secret that UDP commands are signed with.',
+                  'Leave empty to disable the UDP command server.',
+                ].join(' <br/>')}
+              />
+            </FormFieldGroup>
           </form>
           <div className="button-row">
             {/* Reset Button */}
@@ -75,11 +75,13 @@ export class DeviceProvider extends React.Component<DeviceProviderProps, DeviceP
         mqtt_enabled: false,
         mqtt_broker_address: null,
         mqtt_broker_port: null,
+        mqtt_tls_enabled: false,
         mqtt_device_id: null,
         mqtt_username: null,
         mqtt_password: null,
         mqtt_command_topic: null,
         mqtt_state_topic: null,
+        udp_command_key: null,
         top_ir_sensor_threshold: 0,
         bottom_ir_sensor_threshold: 0,
       },
@@ -31,6 +31,11 @@ class SocketClient extends events.EventEmitter {
   private _pingTimeout: undefined | ReturnType<typeof setTimeout>;
   private _pongTimeout: undefined | ReturnType<typeof setTimeout>;
   private _missedPings = 0;
+  private _lastMessageReceived = 0;
+
+  // The sequence number of the last event received from the device. Sent when reconnecting
+  // so that the device only has to send the events that were missed.
+  private _lastSequence: undefined | number;
 
   /**
    * @var keepConnectionOpen whether the socket client should attempt to maintain the connection to the device at all costs
@@ -98,9 +103,12 @@ class SocketClient extends events.EventEmitter {
 
 
   /**
-   * Once connected, a PING is periodically sent to the server.
-   * If the PONG is not received, the connection will be severed
-   * and an attempt to reconnect will commence.
+   * Once connected, the link is checked periodically.
+   *
+   * The device broadcasts sensor data every second (and pings the browser at the
+   * protocol level) so on a healthy link nothing needs to be sent. A text PING is
+   * only sent when nothing has been received for a while. If that PING goes
+   * unanswered, the connection will be severed and an attempt to reconnect will commence.
    */
   private sendPing = async () => {
     if (this._pingTimeout) {
@@ -114,6 +122,13 @@ class SocketClient extends events.EventEmitter {
     this._pingTimeout = setTimeout(() => {
       this._pingTimeout = undefined;
 
+      // The device has been heard from recently. No need to PING.
+      if (Date.now() - this._lastMessageReceived < PING_INTERVAL) {
+        this._missedPings = 0;
+        this.sendPing();
+        return;
+      }
+
       // Send the PING message
       if (this._socket?.readyState === 1) {
         this._socket.send('PING');
@@ -188,6 +203,7 @@ class SocketClient extends events.EventEmitter {
    */
   private handleSocketOpen = () => {
     this._error = null;
+    this._lastMessageReceived = Date.now();
     this.setState(SOCKET_CLIENT_STATE.CONNECTED);
     this.sendPing();
     console.info('Socket Connected.');
@@ -255,18 +271,24 @@ class SocketClient extends events.EventEmitter {
    * Fired when the client receives a message from the server
    */
   private handleSocketMessage = (e: MessageEvent) => {
-    // First, check to see if the message data is a "PONG" in response to our heartbeat ping
-    if (e.data === 'PONG') {
+    this._lastMessageReceived = Date.now();
+
+    // Any message from the device answers an outstanding PING
+    if (this._pongTimeout) {
       this.handlePongReceived();
     }
 
-    // Otherwise attempt to parse the message data as JSON
-    else {
+    // Anything other than a PONG is a JSON message
+    if (e.data !== 'PONG') {
       const data = JSON.parse(e.data);
 
       const message: A_SOCKET_SERVER_MESSAGE = data.m;
       const payload: Record<string, unknown> = data.p ?? {};
 
+      if (typeof data.s === 'number') {
+        this._lastSequence = data.s;
+      }
+
       // Keep the page alive if we receive a reboot message
       if (message === SOCKET_SERVER_MESSAGE.REBOOTING) {
         pageActivity.poke();
@@ -291,7 +313,9 @@ class SocketClient extends events.EventEmitter {
 
     // Reset some of the state values
     this._error = null;
-    this._socket = new WebSocket(this.host);
+    this._socket = new WebSocket(
+      this._lastSequence === undefined ? this.host : `${this.host}?s=${this._lastSequence}`,
+    );
 
     // Bind the websocket event listeners
     this._socket.onopen = this.handleSocketOpen;
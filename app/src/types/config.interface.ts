@@ -9,11 +9,13 @@ export interface IConfig
   mqtt_enabled: boolean;
   mqtt_broker_address: null | string;
   mqtt_broker_port: null | number;
+  mqtt_tls_enabled: boolean;
   mqtt_device_id: null | string;
   mqtt_username: null | string;
   mqtt_password: null | string;
   mqtt_command_topic: null | string;
   mqtt_state_topic: null | string;
+  udp_command_key: null | string;
   top_ir_sensor_threshold: number;
   bottom_ir_sensor_threshold: number;
 }
@@ -28,11 +30,13 @@ export const mapPayloadToConfig = (payload: Record<string, unknown>): IConfig =>
   mqtt_enabled: (payload.mqtt_enabled ?? false) as boolean,
   mqtt_broker_address: payload.mqtt_broker_address as string,
   mqtt_broker_port: payload.mqtt_broker_port as number,
+  mqtt_tls_enabled: (payload.mqtt_tls_enabled ?? false) as boolean,
   mqtt_device_id: payload.mqtt_device_id as string,
   mqtt_username: payload.mqtt_username as string,
   mqtt_password: payload.mqtt_password as string,
   mqtt_command_topic: payload.mqtt_command_topic as string,
   mqtt_state_topic: payload.mqtt_state_topic as string,
+  udp_command_key: payload.udp_command_key as string,
   top_ir_sensor_threshold: payload.top_ir_sensor_threshold as number,
   bottom_ir_sensor_threshold: payload.bottom_ir_sensor_threshold as number,
 });
@@ -8,6 +8,7 @@ const { merge } = require('webpack-merge');
 const packageJson = require('./package.json');
 const paths = require('./webpack.paths');
 const common = require('./webpack.config.common.js');
+const GzipAssetsPlugin = require('./webpack.gzip-plugin');
 
 const appVersionSuffix = packageJson.version.replace(/\./g, '-');
 const tsConfigPath = path.resolve(__dirname, 'tsconfig.prod.json');
@@ -20,7 +21,8 @@ module.exports = merge(common, {
   output: {
     path: paths.dist,
     publicPath: '/',
-    filename: `js/[name].${appVersionSuffix}.bnd.js`,
+    // The content hash allows the device to serve the bundles with an immutable cache header
+    filename: `js/[name].${appVersionSuffix}.[contenthash:8].bnd.js`,
   },
 
   devtool: false,
@@ -71,6 +73,9 @@ module.exports = merge(common, {
       chunkFilename: '[id].css',
     }),
 
+    // Pre-compress the static assets for the device to serve
+    new GzipAssetsPlugin(),
+
     // Copy the build to the arduino data directory
     new FileManagerPlugin({
       events: {
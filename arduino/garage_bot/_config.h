@@ -69,9 +69,142 @@
 // The port that the web server is served on.
 #define WEB_SERVER_PORT 80          
 
-// How often the WiFi and MQTT clients should attempt to re-connect when disconnected
+// The Cache-Control header sent with the content hashed app bundles and styles
+#define STATIC_ASSET_IMMUTABLE_CACHE_CONTROL "public, max-age=31536000, immutable"
+
+// The minimum number of hex digits in the "[contenthash]" segment of a file name for it to be treated as immutable
+#define STATIC_ASSET_CONTENT_HASH_MIN_LENGTH 8
+
+// The maximum number of files (and app routes) in the static file manifest
+#define STATIC_FILE_MANIFEST_MAX_ENTRIES 48
+
+// The maximum length of the path of a static file (including the ".gz" and the null terminator)
+#define STATIC_FILE_MAX_PATH_LENGTH 64
+
+// The maximum number of HTML templates (pages with %VARIABLE% tokens) in the static file manifest
+#define STATIC_FILE_MANIFEST_MAX_TEMPLATES 4
+
+// The maximum number of static and variable segments in a compiled HTML template
+#define HTML_TEMPLATE_MAX_SEGMENTS 16
+
+// The maximum length of an HTML template variable name (ie. "FIRMWARE_VERSION")
+#define HTML_TEMPLATE_MAX_VARIABLE_LENGTH 32
+
+// The flash partition containing the packed web app assets (see partitions.csv and app/pack-assets.js)
+#define ASSET_PARTITION_LABEL "assets"
+#define ASSET_PARTITION_MAGIC "GBAS"
+#define ASSET_PARTITION_VERSION 2
+#define ASSET_PARTITION_MAX_PATH_LENGTH 64
+
+// Written to the data folder alongside the blob. Holds the build id of the web app in LITTLEFS (8 hex digits).
+#define ASSET_PARTITION_BUILD_ID_FILE "/assets.id"
+
+// How often the MQTT client should attempt to re-connect when disconnected
 #define RECONNECT_INTERVAL 30000
 
+// How long to wait for the MQTT broker to accept the TCP connection and acknowledge the CONNECT before giving up on the attempt
+#define MQTT_CONNECT_TIMEOUT 10000
+
+// The MQTT keep alive (seconds). A PINGREQ is sent when nothing else has been sent for this long.
+#define MQTT_KEEP_ALIVE 15
+
+// The largest MQTT packet that can be sent or received. Larger incoming packets are ignored.
+#define MQTT_MAX_PACKET_SIZE 1024
+
+// The PEM encoded CA certificate that the MQTT broker's certificate must be signed by (when TLS is enabled)
+#define MQTT_TLS_CA_CERT_FILE "/mqtt_ca.pem"
+
+// A new CA certificate is written here first and then renamed over MQTT_TLS_CA_CERT_FILE
+#define MQTT_TLS_CA_CERT_TEMP_FILE "/mqtt_ca.pem.tmp"
+
+// The largest CA certificate (or chain) that can be uploaded to /setmqttcacert
+#define MQTT_TLS_CA_CERT_MAX_SIZE 4096
+
+// Holds the encrypted data received from the MQTT broker until it is decrypted. Must be larger than the TCP receive window.
+#define MQTT_TLS_INPUT_BUFFER_SIZE 8192
+
+// The most that TLS adds to a packet when it is encrypted (record header, IV, MAC / tag and padding)
+#define MQTT_TLS_RECORD_OVERHEAD 64
+
+// How much decrypted data to hand to the MQTT packet reader at a time
+#define MQTT_TLS_READ_CHUNK_SIZE 256
+
+// The MQTT TLS handshake runs on its own task so the key exchange doesn't hold up the main loop
+#define MQTT_TLS_HANDSHAKE_TASK_STACK_SIZE 8192
+#define MQTT_TLS_HANDSHAKE_TASK_PRIORITY 1
+#define MQTT_TLS_HANDSHAKE_TASK_CORE 0
+
+// How often (ms) the TLS handshake task checks for room to send or for the handshake to be abandoned while it waits on the broker
+#define MQTT_TLS_HANDSHAKE_POLL_INTERVAL 20
+
+// The most messages waiting to be published to the MQTT broker. Messages on the same topic replace each other, so this only fills up with many topics.
+#define MQTT_OUTBOX_MAX_MESSAGES 8
+
+// How long to wait for the MQTT broker to acknowledge a message before sending it again
+#define MQTT_OUTBOX_RETRY_INTERVAL 5000
+
+// The availability ("online" / "offline") and IR sensor ("detected" / "clear") topics are published beneath the configured state topic
+#define MQTT_AVAILABILITY_TOPIC_SUFFIX "/availability"
+#define MQTT_TOP_SENSOR_TOPIC_SUFFIX "/top_sensor"
+#define MQTT_BOTTOM_SENSOR_TOPIC_SUFFIX "/bottom_sensor"
+
+// The Home Assistant MQTT discovery prefix and the maximum size of a single discovery config message
+#define MQTT_DISCOVERY_PREFIX "homeassistant"
+#define MQTT_DISCOVERY_MESSAGE_SIZE 768
+
+// The extra commands are received beneath the configured command topic (the command topic itself takes the door commands)
+#define MQTT_THRESHOLD_COMMAND_TOPIC_SUFFIX "/threshold/+"
+#define MQTT_REBOOT_COMMAND_TOPIC_SUFFIX "/reboot"
+#define MQTT_REGISTER_REMOTE_COMMAND_TOPIC_SUFFIX "/rf/register"
+
+// The most topics the MQTT client can subscribe to, and the size of the hash table used to look them up (must be larger than the max routes)
+#define MQTT_ROUTER_MAX_ROUTES 8
+#define MQTT_ROUTER_HASH_BUCKETS 16
+
+// The IR sensor readings and device health are published beneath the configured state topic
+#define MQTT_TELEMETRY_TOP_SENSOR_TOPIC_SUFFIX "/telemetry/top_sensor"
+#define MQTT_TELEMETRY_BOTTOM_SENSOR_TOPIC_SUFFIX "/telemetry/bottom_sensor"
+#define MQTT_TELEMETRY_HEALTH_TOPIC_SUFFIX "/telemetry/health"
+
+// Telemetry is published when it has changed by more than the deltas below, but no more often than the min interval. It is published every max interval regardless.
+#define MQTT_TELEMETRY_MIN_INTERVAL 10000
+#define MQTT_TELEMETRY_MAX_INTERVAL 300000
+#define MQTT_TELEMETRY_SENSOR_DELTA 50
+#define MQTT_TELEMETRY_HEAP_DELTA 4096
+#define MQTT_TELEMETRY_RSSI_DELTA 5
+
+// The size of the buffer that the telemetry json is written into
+#define MQTT_TELEMETRY_MESSAGE_SIZE 128
+
+// How long to wait for the WiFi hotspot to associate and assign an IP address before giving up on the attempt
+#define WIFI_CONNECT_TIMEOUT 15000
+
+// The WiFi reconnect delay starts at the minimum and doubles (with jitter) after each failed attempt up to the maximum
+#define WIFI_RECONNECT_BACKOFF_MIN 1000
+#define WIFI_RECONNECT_BACKOFF_MAX 60000
+
+// Uncomment this line to re-use the last DHCP lease (static IP) when fast reconnecting to the WiFi hotspot.
+// Skips the DHCP exchange but only do this if the router reserves the address for the device.
+// #define WIFI_REUSE_CACHED_IP
+
+// The maximum number of known WiFi networks the device can roam between
+#define MAX_WIFI_NETWORKS 4
+
+// How often the RSSI of the WiFi connection is sampled and how many samples are kept (for roaming and the status payload)
+#define WIFI_RSSI_SAMPLE_INTERVAL 5000
+#define WIFI_RSSI_HISTORY_SIZE 12
+
+// When the average of the most recent RSSI samples stays below the threshold, scan (in the background) for a better access point
+#define WIFI_ROAM_RSSI_THRESHOLD -75
+#define WIFI_ROAM_RSSI_SAMPLE_COUNT 3
+#define WIFI_ROAM_SCAN_INTERVAL 60000
+
+// How much stronger (dB) another access point has to be before roaming to it
+#define WIFI_ROAM_HYSTERESIS 8
+
+// Identifies a valid WiFi connection cache in RTC memory
+#define WIFI_CONNECTION_CACHE_MAGIC 0x47425743
+
 // How many milliseconds for each interval/tick in the LED timer
 #define LED_TIMER_CYCLE_MS 125
 
@@ -90,15 +223,83 @@
 // The maximum number of bytes we can expect to received from the client
 #define MAX_SOCKET_CLIENT_MESSAGE_SIZE 256
 
+// The maximum number of bytes we will accept in the body of an HTTP request (ie. /setconfig)
+#define MAX_HTTP_REQUEST_BODY_SIZE 1024
+
+// The multicast group and port that the door and sensor state is announced to on the local network
+#define LAN_ANNOUNCE_MULTICAST_ADDRESS 239, 255, 71, 66
+#define LAN_ANNOUNCE_PORT 47166
+
+// Keep the announcements on the local network
+#define LAN_ANNOUNCE_TTL 1
+
+// How often to re-announce the state when nothing has changed
+#define LAN_ANNOUNCE_HEARTBEAT_INTERVAL 30000
+
+// The version and size of the state announcement datagram (see lanAnnouncer.cpp)
+#define LAN_ANNOUNCE_VERSION 1
+#define LAN_ANNOUNCE_DATAGRAM_SIZE 11
+
+// The port that authenticated commands are accepted on over UDP (see udpCommandServer.cpp)
+#define UDP_COMMAND_PORT 47167
+
+// The version and sizes of the UDP command request / response frames (see udpCommandServer.cpp)
+#define UDP_COMMAND_VERSION 2
+#define UDP_COMMAND_MAC_SIZE 32
+#define UDP_COMMAND_REQUEST_SIZE 48
+#define UDP_COMMAND_RESPONSE_SIZE 60
+
+// The mDNS services advertised when connected to a WiFi network (see serviceAdvertiser.cpp)
+#define MDNS_HTTP_SERVICE "http"
+#define MDNS_BOT_SERVICE "garagebot"
+
+// The size of the buffer the /metrics response is rendered into
+#define METRICS_BUFFER_SIZE 12288
+
+// How often the web socket clients are sent a ping control frame (their pong is used to measure the round trip time)
+#define WS_PING_INTERVAL 5000
+
+// How often a keep alive is sent to the connected server-sent event (/events) clients
+#define SSE_KEEPALIVE_INTERVAL 15000
+
+// How long a server-sent event client should wait before reconnecting (sent to the client as the "retry" field)
+#define SSE_RECONNECT_DELAY 5000
+
+// The broadcast events (status / config changes) kept for clients that reconnect. The oldest are dropped when either limit is reached.
+#define SOCKET_EVENT_HISTORY_MAX_EVENTS 16
+#define SOCKET_EVENT_HISTORY_BUFFER_SIZE 4096
+
 // The maximum number of concurrent socket connections to accept
 #define MAX_SOCKET_CONNECTIONS 10
 
-// The maximum size of the config file in bytes
+// The number of commands that can be waiting for the main loop (must be a power of two)
+#define COMMAND_QUEUE_SIZE 16
+
+// The maximum size of the (legacy) json config file in bytes. Only read to migrate it to the binary config record.
 #define CONFIG_FILE_MAX_SIZE 2048
 
+// The legacy json config file
+#define CONFIG_JSON_FILE "/config.json"
+
+// The two files that the binary config record is written to alternately (see configRecord.cpp)
+#define CONFIG_SLOT_FILE_A "/config.a.bin"
+#define CONFIG_SLOT_FILE_B "/config.b.bin"
+
+// The version of the binary config record layout and the maximum size of a record in bytes
+#define CONFIG_RECORD_VERSION 1
+#define CONFIG_RECORD_MAX_SIZE 1024
+
+// Every saved config record is also kept in NVS so that it survives LITTLEFS being re-formatted or re-uploaded
+#define CONFIG_BACKUP_NVS_NAMESPACE "garagebot"
+#define CONFIG_BACKUP_NVS_KEY "config"
+
 // When assuming a door state - ignore sensors for this duration
 #define ASSUMED_DOOR_STATE_EXPIRY 5000
 
+// The IR sensor thresholds accepted from the app and MQTT (the largest difference between two 12 bit ADC readings)
+#define IR_SENSOR_THRESHOLD_MIN 0
+#define IR_SENSOR_THRESHOLD_MAX 4095
+
 // Defaults for some config values
 #define DEFAULT_IR_THRESHOLD 150
 #define DEFAULT_CONFIG_MDNS_NAME "garagebot"
@@ -108,6 +309,14 @@
 #define DEFAULT_CONFIG_MQTT_DEVICE_COMMAND_TOPIC "garage/door/command"
 #define DEFAULT_CONFIG_MQTT_DEVICE_STATE_TOPIC "garage/door/state"
 
+/**
+ * A known WiFi network
+ */
+struct WiFiNetwork {
+  String ssid                               = "";
+  String password                           = "";
+};
+
 /**
  * Config struct for storing and loading data from the SPIFFS partition
  */
@@ -124,11 +333,11 @@ struct Config {
   // Whether WiFi is enabled
   bool wifi_enabled                         = false;
   
-  // The SSID of the wifi network that the garage bot is configured to connect to
-  String wifi_ssid                          = "";
-  
-  // The Password of the wifi network that the garage bot is configured to connect to
-  String wifi_password                      = "";
+  // The known wifi networks that the garage bot can connect to (most recently configured first)
+  WiFiNetwork wifi_networks[MAX_WIFI_NETWORKS];
+
+  // The number of known wifi networks
+  byte wifi_network_count                   = 0;
   
   // Whether the device should attempt to integrate with an MQTT broker
   bool mqtt_enabled                         = false;
@@ -139,6 +348,9 @@ struct Config {
   // The MQTT Broker Port Number
   unsigned int mqtt_broker_port             = DEFAULT_CONFIG_MQTT_BROKER_PORT;
 
+  // Whether to connect to the MQTT Broker with TLS (the CA certificate is read from MQTT_TLS_CA_CERT_FILE)
+  bool mqtt_tls_enabled                     = false;
+
   // The Device ID to use when connecting to the MQTT Broker
   String mqtt_device_id                     = DEFAULT_CONFIG_MQTT_DEVICE_ID;
   
@@ -153,6 +365,9 @@ struct Config {
   
   // The MQTT topic used for communicating the state of the door (opened / closed / etc)
   String mqtt_state_topic                   = DEFAULT_CONFIG_MQTT_DEVICE_STATE_TOPIC;
+
+  // The shared key that UDP commands are signed with (HMAC-SHA256). The UDP command server is disabled when empty.
+  String udp_command_key                    = "";
   
   // The number of registered RF remote codes (5 Max)
   byte stored_rf_code_count                 = 0;
@@ -184,4 +399,18 @@ extern Config config;
 #define SOCKET_SERVER_MESSAGE_SENSOR_DATA "SD"
 #define SOCKET_SERVER_MESSAGE_REBOOTING "RB"
 
+/**
+ * Server-sent event names on the /events stream. The data of each event is the
+ * same message that is sent to the web socket clients.
+ */
+#define SSE_EVENT_STATUS_CHANGE "status"
+#define SSE_EVENT_CONFIG_CHANGE "config"
+#define SSE_EVENT_REBOOTING "rebooting"
+
+// Converts a two character socket message type (ie. "BP") into an integer that can be used in a switch
+#define SOCKET_MESSAGE_CODE(code) ((uint16_t)(((uint8_t)(code)[0] << 8) | (uint8_t)(code)[1]))
+
+// The websocket close code sent when a client sends a message that exceeds MAX_SOCKET_CLIENT_MESSAGE_SIZE
+#define WS_CLOSE_CODE_MESSAGE_TOO_BIG 1009
+
 #endif
@@ -0,0 +1,136 @@
+/*============================================================================*\
+ * Garage Bot - AssetPartition
+ * Peter Eldred 2021-08
+ *
+ * Memory maps the read-only "assets" flash partition which holds the web app
+ * files packed into a single blob by `app/pack-assets.js`. Once mapped, the
+ * file contents can be handed straight to the web server without going
+ * through the file system.
+ *
+ * The blob layout must match `app/pack-assets.js`.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "esp_partition.h"
+#include "_config.h"
+#include "assetPartition.h"
+
+
+/**
+ * Constructor
+ */
+AssetPartition::AssetPartition() {}
+
+
+/**
+ * Find, map and validate the assets partition
+ *
+ * @return bool whether a valid asset blob is available
+ */
+bool AssetPartition::init() {
+  #ifdef SERIAL_DEBUG
+  Serial.print("Mapping asset partition...");
+  #endif
+
+  available = false;
+  entryCount = 0;
+
+  const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, ASSET_PARTITION_LABEL);
+  if (!partition) {
+    #ifdef SERIAL_DEBUG
+    Serial.println(" no partition found. Assets will be served from LITTLEFS.");
+    #endif
+    return false;
+  }
+
+  const void *mapped = NULL;
+  if (esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &mapped, &_mmapHandle) != ESP_OK) {
+    #ifdef SERIAL_DEBUG
+    Serial.println(" failed to map the partition. Assets will be served from LITTLEFS.");
+    #endif
+    return false;
+  }
+
+  if (!assetBlobIsValid((const uint8_t*)mapped, partition->size)) {
+    spi_flash_munmap(_mmapHandle);
+    #ifdef SERIAL_DEBUG
+    Serial.println(" no valid asset blob. Assets will be served from LITTLEFS.");
+    #endif
+    return false;
+  }
+
+  const AssetBlobHeader *header = (const AssetBlobHeader*)mapped;
+  _blob = (const uint8_t*)mapped;
+  entryCount = header->entryCount;
+  buildId = header->buildId;
+
+  available = true;
+
+  #ifdef SERIAL_DEBUG
+  Serial.print(" done. ");
+  Serial.print(entryCount);
+  Serial.print(" assets, build ");
+  Serial.println(buildId, HEX);
+  #endif
+
+  return true;
+}
+
+
+/**
+ * Validate the header and every entry of an asset blob
+ *
+ * @param blob the start of the blob
+ * @param size the number of bytes available at blob (the size of the partition)
+ * @return bool false if the blob is erased, foreign, from an incompatible packer or has entries outside of the blob
+ */
+bool assetBlobIsValid(const uint8_t *blob, uint32_t size) {
+  if (size < sizeof(AssetBlobHeader)) {
+    return false;
+  }
+
+  // An erased (or foreign) partition won't have a valid header
+  const AssetBlobHeader *header = (const AssetBlobHeader*)blob;
+  bool valid = (memcmp(header->magic, ASSET_PARTITION_MAGIC, 4) == 0)
+    && (header->version == ASSET_PARTITION_VERSION)
+    && (header->blobSize <= size)
+    && ((sizeof(AssetBlobHeader) + (header->entryCount * sizeof(AssetBlobEntry))) <= header->blobSize);
+
+  if (!valid) {
+    return false;
+  }
+
+  // Make sure none of the entries point outside of the blob
+  const AssetBlobEntry *entries = (const AssetBlobEntry*)(blob + sizeof(AssetBlobHeader));
+  for (uint16_t i = 0; i < header->entryCount; i++) {
+    const AssetBlobEntry *entry = &entries[i];
+    if ((entry->offset > header->blobSize) || (entry->length > (header->blobSize - entry->offset)) || (entry->path[ASSET_PARTITION_MAX_PATH_LENGTH - 1] != '\0')) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+/**
+ * Get the record describing a file in the blob
+ *
+ * @param index the index of the file (0 to entryCount - 1)
+ */
+const AssetBlobEntry* AssetPartition::getEntry(uint16_t index) {
+  if (!_blob || (index >= entryCount)) {
+    return NULL;
+  }
+  return (const AssetBlobEntry*)(_blob + sizeof(AssetBlobHeader) + (index * sizeof(AssetBlobEntry)));
+}
+
+
+/**
+ * Get a pointer to the contents of a file in the blob
+ *
+ * @param entry the record describing the file
+ */
+const uint8_t* AssetPartition::getData(const AssetBlobEntry *entry) {
+  return _blob + entry->offset;
+}
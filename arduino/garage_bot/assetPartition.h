@@ -0,0 +1,65 @@
+/*============================================================================*\
+ * Garage Bot - AssetPartition
+ * Peter Eldred 2021-08
+ *
+ * Memory maps the read-only "assets" flash partition which holds the web app
+ * files packed into a single blob by `app/pack-assets.js`. Once mapped, the
+ * file contents can be handed straight to the web server without going
+ * through the file system.
+ *
+ * The blob carries a build id which `app/pack-assets.js` also writes to the
+ * data folder. The static file manifest only serves the blob while the web
+ * app in LITTLEFS is the same build, so a U_SPIFFS OTA update (which doesn't
+ * touch the asset partition) is never shadowed by a stale blob.
+ *
+ * The blob layout must match `app/pack-assets.js`.
+\*============================================================================*/
+
+#ifndef ASSET_PARTITION_H
+#define ASSET_PARTITION_H
+
+#include "Arduino.h"
+#include "esp_partition.h"
+#include "_config.h"
+
+// The header at the start of the blob
+struct AssetBlobHeader {
+  char magic[4];                                  // ASSET_PARTITION_MAGIC
+  uint16_t version;                               // ASSET_PARTITION_VERSION
+  uint16_t entryCount;                            // The number of AssetBlobEntry records following the header
+  uint32_t blobSize;                              // The size of the whole blob in bytes
+  uint32_t buildId;                               // A hash of every path and file in the blob
+};
+
+// Describes a single file in the blob
+struct AssetBlobEntry {
+  char path[ASSET_PARTITION_MAX_PATH_LENGTH];     // The path of the file (ie. "/js/control.bnd.js.gz")
+  uint32_t offset;                                // The offset of the file data from the start of the blob
+  uint32_t length;                                // The length of the file data
+  uint32_t hash;                                  // A hash of the file data (used for the ETag)
+  uint32_t reserved;
+};
+
+class AssetPartition {
+  public:
+    AssetPartition();
+
+    bool init();                                  // Find, map and validate the assets partition
+
+    bool available = false;                       // Whether a valid asset blob has been mapped
+    uint16_t entryCount = 0;                      // The number of files in the blob
+    uint32_t buildId = 0;                         // The build id of the blob (compare with ASSET_PARTITION_BUILD_ID_FILE)
+
+    const AssetBlobEntry* getEntry(uint16_t index);           // Get the record describing a file in the blob
+    const uint8_t* getData(const AssetBlobEntry *entry);      // Get a pointer to the contents of a file in the blob
+
+  private:
+    const uint8_t *_blob = NULL;                  // The start of the mapped partition
+    spi_flash_mmap_handle_t _mmapHandle;          // The handle of the memory mapping
+};
+
+bool assetBlobIsValid(const uint8_t *blob, uint32_t size);   // Validate the header and every entry of an asset blob
+
+extern AssetPartition assetPartition;
+
+#endif
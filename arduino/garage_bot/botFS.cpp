@@ -3,13 +3,27 @@
  * Peter Eldred 2021-04
  * 
  * File System wrapper for simplifying interactions with LITTLEFS
+ *
+ * The config is stored as a binary record (see configRecord.cpp) which is
+ * written alternately to two slot files. Each save goes to the slot that
+ * doesn't hold the newest record and carries the next generation number, so
+ * losing power part way through a save leaves the previous config intact in
+ * the other slot. On boot the newest slot with a valid record is loaded. A
+ * config.json written by older firmware is migrated to the binary record.
+ *
+ * Every saved record is also copied to NVS. Re-partitioning the flash (or
+ * uploading a new LITTLEFS image) wipes the file system but not NVS, so when
+ * neither slot holds a valid record the config is restored from the copy.
 \*============================================================================*/
 
 #include "Arduino.h"
 #include "ArduinoJson.h"
 #include "LITTLEFS.h"
+#include "Preferences.h"
 #include "_config.h"
 #include "botFS.h"
+#include "configRecord.h"
+#include "htmlTemplate.h"
 #include "reboot.h"
 
 
@@ -46,21 +60,34 @@ bool BotFS::init() {
 
   // Load the config from the onboard SPI File System
   if (!loadConfig()) {
-    #ifdef SERIAL_DEBUG
-    Serial.println("  - Creating new Config File... ");
-    #endif
-  }
+    // Restore the NVS copy of the config (ie. after re-partitioning), otherwise migrate the json
+    // config written by older firmware (or start with the defaults)
+    bool restoring = _loadConfigBackup();
+    bool migrating = !restoring && _loadJSONConfig();
 
-  // Save the config back to the SPI File System
-  if (!saveConfig()) {
     #ifdef SERIAL_DEBUG
-    Serial.println("  ! Failed to create new config file on LITTLEFS.");
+    if (restoring) {
+      Serial.println("  - Restoring the config from NVS...");
+    } else {
+      Serial.println(migrating ? "  - Migrating 'LITTLEFS/config.json' to the binary config..." : "  - Creating new Config File... ");
+    }
     #endif
-    
-    return false;
+
+    // Save the config back to the SPI File System
+    if (!saveConfig()) {
+      #ifdef SERIAL_DEBUG
+      Serial.println("  ! Failed to create new config file on LITTLEFS.");
+      #endif
+      
+      return false;
+    }
   }
 
+  // Make sure the config survives the file system being wiped (a no-op unless it changed)
+  _backupConfig();
+
   #ifdef SERIAL_DEBUG
+  _printConfig();
   Serial.println("BotFS initialised.\n");
   #endif
 
@@ -69,10 +96,150 @@ bool BotFS::init() {
 
 
 /**
- * Open up the config.json file on the LITTLEFS partition and store the milky goodness within
+ * Load the newest valid config record from the two config slots
+ *
+ * @return bool false if neither slot holds a valid record
  */
 bool BotFS::loadConfig() {
-  File configFile = LITTLEFS.open("/config.json", "r");
+  uint32_t generations[2];
+  bool valid[2];
+  for (byte slot = 0; slot < 2; slot++) {
+    size_t length;
+    valid[slot] = _readConfigSlot(slot, length) && configRecordValidate(_record, length, generations[slot]);
+  }
+
+  // Newest first (the generation wraps around, so compare the difference)
+  byte order[2] = {0, 1};
+  if (valid[0] && valid[1] && ((int32_t)(generations[1] - generations[0]) > 0)) {
+    order[0] = 1;
+    order[1] = 0;
+  }
+
+  for (byte i = 0; i < 2; i++) {
+    byte slot = order[i];
+    if (!valid[slot]) {
+      continue;
+    }
+
+    // The buffer holds whichever slot was read last
+    size_t length;
+    if (_readConfigSlot(slot, length) && configRecordDecode(_record, length, config)) {
+      _generation = generations[slot];
+      _activeSlot = slot;
+
+      #ifdef SERIAL_DEBUG
+      Serial.print("  - Config loaded from 'LITTLEFS");
+      Serial.print(_getConfigSlotFile(slot));
+      Serial.print("' (generation ");
+      Serial.print(_generation);
+      Serial.println(")");
+      #endif
+
+      return true;
+    }
+  }
+
+  #ifdef SERIAL_DEBUG
+  Serial.println("  ! No valid config record found");
+  #endif
+
+  return false;
+}
+
+
+/**
+ * The file that a config slot is written to
+ */
+const char* BotFS::_getConfigSlotFile(byte slot) {
+  return (slot == 0) ? CONFIG_SLOT_FILE_A : CONFIG_SLOT_FILE_B;
+}
+
+
+/**
+ * Read the contents of a config slot into the record buffer
+ *
+ * @param slot the slot to read (0 or 1)
+ * @param length populated with the number of bytes read
+ * @return bool false if the slot doesn't exist or is too large to be a config record
+ */
+bool BotFS::_readConfigSlot(byte slot, size_t &length) {
+  File slotFile = LITTLEFS.open(_getConfigSlotFile(slot), "r");
+  if (!slotFile) {
+    return false;
+  }
+
+  length = slotFile.size();
+  bool read = (length <= sizeof(_record)) && (slotFile.read(_record, length) == length);
+  slotFile.close();
+
+  return read;
+}
+
+
+/**
+ * Load the copy of the config record kept in NVS
+ *
+ * @return bool false if there is no copy or it isn't a valid record
+ */
+bool BotFS::_loadConfigBackup() {
+  Preferences preferences;
+  if (!preferences.begin(CONFIG_BACKUP_NVS_NAMESPACE, true)) {
+    return false;
+  }
+
+  size_t length = preferences.getBytesLength(CONFIG_BACKUP_NVS_KEY);
+  bool read = (length > 0) && (length <= sizeof(_record)) && (preferences.getBytes(CONFIG_BACKUP_NVS_KEY, _record, length) == length);
+  preferences.end();
+
+  uint32_t generation;
+  if (!read || !configRecordValidate(_record, length, generation) || !configRecordDecode(_record, length, config)) {
+    return false;
+  }
+
+  // Carry on from the restored generation
+  _generation = generation;
+
+  return true;
+}
+
+
+/**
+ * Copy the current config record to NVS
+ *
+ * Called on every boot (so that a device updated from older firmware gets a copy before it is
+ * re-partitioned) and every save. The write is skipped when NVS already holds the current generation.
+ */
+void BotFS::_backupConfig() {
+  Preferences preferences;
+  if (!preferences.begin(CONFIG_BACKUP_NVS_NAMESPACE, false)) {
+    return;
+  }
+
+  size_t length = preferences.getBytesLength(CONFIG_BACKUP_NVS_KEY);
+  uint32_t generation;
+  bool current = (length > 0) && (length <= sizeof(_record))
+    && (preferences.getBytes(CONFIG_BACKUP_NVS_KEY, _record, length) == length)
+    && configRecordValidate(_record, length, generation)
+    && (generation == _generation);
+
+  if (!current) {
+    length = configRecordEncode(_record, sizeof(_record), config, _generation);
+    if ((length == 0) || (preferences.putBytes(CONFIG_BACKUP_NVS_KEY, _record, length) != length)) {
+      #ifdef SERIAL_DEBUG
+      Serial.println("  ! Failed to copy the config to NVS");
+      #endif
+    }
+  }
+
+  preferences.end();
+}
+
+
+/**
+ * Open up the (legacy) config.json file on the LITTLEFS partition and store the milky goodness within
+ */
+bool BotFS::_loadJSONConfig() {
+  File configFile = LITTLEFS.open(CONFIG_JSON_FILE, "r");
   if (!configFile) {
     #ifdef SERIAL_DEBUG
     Serial.println("  ! Failed to open config file");
@@ -85,6 +252,7 @@ bool BotFS::loadConfig() {
     #ifdef SERIAL_DEBUG
     Serial.println("  ! Error - config file size is too large");
     #endif
+    configFile.close();
     return false;
   }
 
@@ -96,12 +264,16 @@ bool BotFS::loadConfig() {
   // Deserialize the JSON document
   DeserializationError error = deserializeJson(doc, configFile);
 
-  #ifdef SERIAL_DEBUG
   if (error) {
-    Serial.println("  ! Failed to read file, using default configuration: ");
-  } else {
-    Serial.println("  - Config loaded from 'LITTLEFS/config.json': ");
+    #ifdef SERIAL_DEBUG
+    Serial.println("  ! Failed to read file, using default configuration");
+    #endif
+    configFile.close();
+    return false;
   }
+
+  #ifdef SERIAL_DEBUG
+  Serial.println("  - Config loaded from 'LITTLEFS/config.json'");
   #endif
 
   // Update the global variables from the json doc
@@ -109,18 +281,43 @@ bool BotFS::loadConfig() {
   config.device_name = doc["device_name"] | config.device_name;
   JsonVariant wifiEnabled = doc["wifi_enabled"];
   config.wifi_enabled = wifiEnabled.isNull() ? config.wifi_enabled : wifiEnabled.as<bool>();
-  config.wifi_ssid = doc["wifi_ssid"] | config.wifi_ssid;
-  config.wifi_password = doc["wifi_password"] | config.wifi_password;
+  JsonArray wifiNetworks = doc["wifi_networks"];
+  config.wifi_network_count = 0;
+  if (wifiNetworks) {
+    for (JsonObject wifiNetwork : wifiNetworks) {
+      if (config.wifi_network_count >= MAX_WIFI_NETWORKS) {
+        break;
+      }
+      config.wifi_networks[config.wifi_network_count].ssid = wifiNetwork["ssid"] | "";
+      config.wifi_networks[config.wifi_network_count].password = wifiNetwork["password"] | "";
+      if (!config.wifi_networks[config.wifi_network_count].ssid.equals("")) {
+        config.wifi_network_count += 1;
+      }
+    }
+  }
+
+  // Migrate the single network from config files written by older firmware
+  else {
+    String legacySSID = doc["wifi_ssid"] | "";
+    if (!legacySSID.equals("")) {
+      config.wifi_networks[0].ssid = legacySSID;
+      config.wifi_networks[0].password = doc["wifi_password"] | "";
+      config.wifi_network_count = 1;
+    }
+  }
   JsonVariant mqttEnabled = doc["mqtt_enabled"];
   config.mqtt_enabled = mqttEnabled.isNull() ? config.mqtt_enabled : mqttEnabled.as<bool>();
   config.mqtt_broker_address = doc["mqtt_broker_address"] | config.mqtt_broker_address;
   JsonVariant mqttPort = doc["mqtt_broker_port"];
   config.mqtt_broker_port = mqttPort.isNull() ? config.mqtt_broker_port : mqttPort.as<int>();
+  JsonVariant mqttTLSEnabled = doc["mqtt_tls_enabled"];
+  config.mqtt_tls_enabled = mqttTLSEnabled.isNull() ? config.mqtt_tls_enabled : mqttTLSEnabled.as<bool>();
   config.mqtt_device_id = doc["mqtt_device_id"] | config.mqtt_device_id;
   config.mqtt_username = doc["mqtt_username"] | config.mqtt_username;
   config.mqtt_password = doc["mqtt_password"] | config.mqtt_password;
   config.mqtt_command_topic = doc["mqtt_command_topic"] | config.mqtt_command_topic;
   config.mqtt_state_topic = doc["mqtt_state_topic"] | config.mqtt_state_topic;
+  config.udp_command_key = doc["udp_command_key"] | config.udp_command_key;
   config.stored_rf_code_count = doc["stored_rf_code_count"] | config.stored_rf_code_count;
   JsonArray rfCodes = doc["rf_codes"];
   for (byte i = 0; i < 5; i++) {
@@ -136,7 +333,15 @@ bool BotFS::loadConfig() {
   }
 
   configFile.close();
-    
+
+  return true;
+}
+
+
+/**
+ * Print the current config
+ */
+void BotFS::_printConfig() {
   #ifdef SERIAL_DEBUG
   Serial.println("  - Current Config:");
   Serial.print("    + mDNS Name: ");
@@ -146,10 +351,12 @@ bool BotFS::loadConfig() {
   Serial.print("    + WiFi: ");
   Serial.println(config.wifi_enabled ? "Enabled" : "Disabled");
   if (config.wifi_enabled) {
-    Serial.print("    + WiFi SSID: ");
-    Serial.println(config.wifi_ssid);
-    Serial.print("    + WiFi Password: ");
-    Serial.println(config.wifi_password);
+    for (byte i = 0; i < config.wifi_network_count; i++) {
+      Serial.print("    + WiFi SSID: ");
+      Serial.print(config.wifi_networks[i].ssid);
+      Serial.print(", Password: ");
+      Serial.println(config.wifi_networks[i].password);
+    }
   }
   Serial.print("    + ");
   Serial.print(config.stored_rf_code_count);
@@ -166,6 +373,8 @@ bool BotFS::loadConfig() {
     Serial.println(config.mqtt_broker_address);
     Serial.print("    - Broker Port: ");
     Serial.println(config.mqtt_broker_port);
+    Serial.print("    - TLS: ");
+    Serial.println(config.mqtt_tls_enabled ? "Enabled" : "Disabled");
     Serial.print("    - Device ID: ");
     Serial.println(config.mqtt_device_id);
     Serial.print("    - Username: ");
@@ -177,14 +386,17 @@ bool BotFS::loadConfig() {
     Serial.print("    - State Topic: ");
     Serial.println(config.mqtt_state_topic);
   }
+  Serial.print("    + UDP Commands: ");
+  Serial.println(config.udp_command_key.equals("") ? "Disabled" : "Enabled");
   #endif
-    
-  return true;
 }
 
 
 /**
  * Save the current configuration to LITTLEFS
+ *
+ * The record is written to the slot that doesn't hold the newest record, so a failed
+ * (or interrupted) write leaves the previous config to be loaded on the next boot.
  */
 bool BotFS::saveConfig() {
   // Wait for any current write operations to finish
@@ -192,56 +404,56 @@ bool BotFS::saveConfig() {
     delay(1);
   };
   _writingConfig = true;
+
+  uint32_t generation = _generation + 1;
+  byte slot = _activeSlot ^ 1;
+  const char *slotFileName = _getConfigSlotFile(slot);
   
   #ifdef SERIAL_DEBUG
-  Serial.println("  - Writing configuration to 'LITTLEFS/config.json'...");
+  Serial.print("  - Writing configuration to 'LITTLEFS");
+  Serial.print(slotFileName);
+  Serial.println("'...");
   #endif
 
-  // Open file for writing
-  File configFile = LITTLEFS.open("/config.json", "w");
-  if (!configFile) {
+  size_t length = configRecordEncode(_record, sizeof(_record), config, generation);
+  if (length == 0) {
     #ifdef SERIAL_DEBUG
-    Serial.println("  ! Failed to create 'LITTLEFS/config.json'!");
+    Serial.println("  ! The config is too large to be saved!");
     #endif
+    _writingConfig = false;
     return false;
   }
 
-  // Allocate a temporary JsonDocument
-  // Don't forget to change the capacity to match your requirements.
-  // Use arduinojson.org/assistant to compute the capacity.
-  StaticJsonDocument<CONFIG_FILE_MAX_SIZE> doc;
-
-  // Set the values in the document
-  doc["mdns_name"]                  = config.mdns_name;
-  doc["device_name"]                = config.device_name;
-  doc["wifi_enabled"]               = config.wifi_enabled;
-  doc["wifi_ssid"]                  = config.wifi_ssid;
-  doc["wifi_password"]              = config.wifi_password;
-  doc["mqtt_enabled"]               = config.mqtt_enabled;
-  doc["mqtt_broker_address"]        = config.mqtt_broker_address;
-  doc["mqtt_broker_port"]           = config.mqtt_broker_port;
-  doc["mqtt_device_id"]             = config.mqtt_device_id;
-  doc["mqtt_username"]              = config.mqtt_username;
-  doc["mqtt_password"]              = config.mqtt_password;
-  doc["mqtt_command_topic"]         = config.mqtt_command_topic;
-  doc["mqtt_state_topic"]           = config.mqtt_state_topic;
-  doc["stored_rf_code_count"]       = config.stored_rf_code_count;
-  doc["top_ir_sensor_threshold"]    = config.top_ir_sensor_threshold;
-  doc["bottom_ir_sensor_threshold"] = config.bottom_ir_sensor_threshold;
-  JsonArray rfCodes = doc.createNestedArray("rf_codes");
-  for (byte i = 0; i < 5; i++) {
-    rfCodes.add(config.rf_codes[i]);
+  // Open file for writing
+  File slotFile = LITTLEFS.open(slotFileName, "w");
+  if (!slotFile) {
+    #ifdef SERIAL_DEBUG
+    Serial.print("  ! Failed to create 'LITTLEFS");
+    Serial.print(slotFileName);
+    Serial.println("'!");
+    #endif
+    _writingConfig = false;
+    return false;
   }
 
-  // Serialize JSON to file
-  if (serializeJson(doc, configFile) == 0) {
+  size_t written = slotFile.write(_record, length);
+  slotFile.close();
+
+  if (written != length) {
     #ifdef SERIAL_DEBUG
-    Serial.println("  ! Failed to write to 'LITTLEFS/config.json'");
+    Serial.print("  ! Failed to write to 'LITTLEFS");
+    Serial.print(slotFileName);
+    Serial.println("'");
     #endif
+    _writingConfig = false;
+    return false;
   }
 
-  // Close the file
-  configFile.close();
+  // The next save goes to the other slot
+  _generation = generation;
+  _activeSlot = slot;
+
+  _backupConfig();
 
   _writingConfig = false;
   
@@ -260,8 +472,10 @@ void BotFS::resetWiFiConfig(bool enableWiFi) {
   #endif
 
   config.wifi_enabled = enableWiFi;
-  config.wifi_ssid = "";
-  config.wifi_password = "";
+  for (byte i = 0; i < MAX_WIFI_NETWORKS; i++) {
+    config.wifi_networks[i] = WiFiNetwork();
+  }
+  config.wifi_network_count = 0;
   
   saveConfig();
 
@@ -281,11 +495,20 @@ void BotFS::factoryReset() {
   
   #ifdef SERIAL_DEBUG
   Serial.println("Factory Reset:");
-  Serial.println("  - Deleteing 'LITTLEFS/config.json'...");
+  Serial.println("  - Deleteing the config from LITTLEFS...");
   #endif
 
-  // Delete the file
-  LITTLEFS.remove("/config.json");
+  // Delete both config slots (and the json config in case it was never migrated)
+  LITTLEFS.remove(CONFIG_SLOT_FILE_A);
+  LITTLEFS.remove(CONFIG_SLOT_FILE_B);
+  LITTLEFS.remove(CONFIG_JSON_FILE);
+
+  // And the NVS copy, otherwise it would be restored on the next boot
+  Preferences preferences;
+  if (preferences.begin(CONFIG_BACKUP_NVS_NAMESPACE, false)) {
+    preferences.remove(CONFIG_BACKUP_NVS_KEY);
+    preferences.end();
+  }
 
   #ifdef SERIAL_DEBUG
   Serial.println("  - Done");
@@ -300,12 +523,31 @@ void BotFS::factoryReset() {
 /**
  * Change the current Wifi Settings (triggered from the Configuration Website)
  * 
+ * The network is added to the front of the known networks (or moved there if it is already known).
+ * When the list is full the oldest network is forgotten.
+ * 
  * @param String newSSID the new WiFi SSID to save to the device
  * @param String newPassword the new WiFi Password to save to the device
  */
 void BotFS::setWiFiSettings(String newSSID, String newPassword) {
-    config.wifi_ssid = newSSID;
-    config.wifi_password = newPassword;
+    // Remove the network if it is already known
+    byte existing = config.wifi_network_count;
+    for (byte i = 0; i < config.wifi_network_count; i++) {
+      if (config.wifi_networks[i].ssid.equals(newSSID)) {
+        existing = i;
+        break;
+      }
+    }
+    if (existing == config.wifi_network_count && config.wifi_network_count < MAX_WIFI_NETWORKS) {
+      config.wifi_network_count += 1;
+    }
+
+    // Shuffle the other networks down to make room at the front
+    for (byte i = min(existing, (byte)(MAX_WIFI_NETWORKS - 1)); i > 0; i--) {
+      config.wifi_networks[i] = config.wifi_networks[i - 1];
+    }
+    config.wifi_networks[0].ssid = newSSID;
+    config.wifi_networks[0].password = newPassword;
 
     #ifdef SERIAL_DEBUG
     Serial.print("Configuring and saving new WiFi Hotspot details, SSID: '");
@@ -331,11 +573,13 @@ void BotFS::setWiFiSettings(String newSSID, String newPassword) {
  * @param bool mqttEnabled Whether the device should attempt to integrate with an MQTT broker
  * @param String mqttBrokerAddres The IP address of the MQTT Broker
  * @param unsigned int mqttBrokerPort The MQTT Broker Port Number
+ * @param bool mqttTLSEnabled Whether to connect to the MQTT Broker with TLS (using the CA certificate in MQTT_TLS_CA_CERT_FILE)
  * @param String mqttDeviceId The Device ID to use when connecting to the MQTT Broker
  * @param String mqttUsername The username when connecting to the MQTT broker
  * @param String mqttPassword The password when connecting to the MQTT broker
  * @param String mqttCommandTopic The MQTT topic used for communicating instructions (open / close etc)
  * @param String mqttStateTopic The MQTT topic used for communicating the state of the door (opened / closed / etc)
+ * @param String udpCommandKey The key that UDP commands are signed with (empty disables the UDP command server)
  */
 void BotFS::setGeneralConfig(
   String mdnsName,
@@ -343,25 +587,30 @@ void BotFS::setGeneralConfig(
   bool mqttEnabled,
   String mqttBrokerAddres,
   unsigned int mqttBrokerPort,
+  bool mqttTLSEnabled,
   String mqttDeviceId,
   String mqttUsername,
   String mqttPassword,
   String mqttCommandTopic,
-  String mqttStateTopic
+  String mqttStateTopic,
+  String udpCommandKey
 ) {
   // Prevent critical systens from running while a config update is in progress
   config.updating_config = true;
 
   config.mdns_name = mdnsName;
   config.device_name = deviceName;
+  HTMLTemplate::invalidateAll();
   config.mqtt_enabled = mqttEnabled;
   config.mqtt_broker_address = mqttBrokerAddres;
   config.mqtt_broker_port = mqttBrokerPort;
+  config.mqtt_tls_enabled = mqttTLSEnabled;
   config.mqtt_device_id = mqttDeviceId;
   config.mqtt_username = mqttUsername;
   config.mqtt_password = mqttPassword;
   config.mqtt_command_topic = mqttCommandTopic;
   config.mqtt_state_topic = mqttStateTopic;
+  config.udp_command_key = udpCommandKey;
   
   #ifdef SERIAL_DEBUG
   Serial.println("Configuring and saving General Config:");
@@ -377,6 +626,8 @@ void BotFS::setGeneralConfig(
     Serial.println(config.mqtt_broker_address);
     Serial.print("    - Broker Port: ");
     Serial.println(config.mqtt_broker_port);
+    Serial.print("    - TLS: ");
+    Serial.println(config.mqtt_tls_enabled ? "Enabled" : "Disabled");
     Serial.print("    - Device ID: ");
     Serial.println(config.mqtt_device_id);
     Serial.print("    - Username: ");
@@ -388,6 +639,8 @@ void BotFS::setGeneralConfig(
     Serial.print("    - State Topic: ");
     Serial.println(config.mqtt_state_topic);
   }
+  Serial.print("  - UDP Commands: ");
+  Serial.println(config.udp_command_key.equals("") ? "Disabled" : "Enabled");
   #endif
 
   // Save the updated config.
@@ -429,6 +682,60 @@ void BotFS::registerRFCode(unsigned long newCode) {
 }
 
 
+/**
+ * Read the CA certificate that the MQTT broker's certificate must be signed by
+ *
+ * @return String the PEM encoded certificate (empty if there isn't one)
+ */
+String BotFS::loadMQTTCACert() {
+  File certFile = LITTLEFS.open(MQTT_TLS_CA_CERT_FILE, "r");
+  if (!certFile) {
+    return "";
+  }
+
+  String cert = certFile.readString();
+  certFile.close();
+  return cert;
+}
+
+
+/**
+ * Replace the CA certificate that the MQTT broker's certificate must be signed by (triggered from /setmqttcacert)
+ *
+ * The certificate is written to a temporary file which is then renamed over the old one, so
+ * losing power part way through leaves the old certificate intact.
+ *
+ * @param String cert The PEM encoded certificate (or chain). An empty string removes the certificate.
+ */
+void BotFS::setMQTTCACert(String cert) {
+  // Prevent critical systems from running while a config update is in progress
+  config.updating_config = true;
+
+  bool success;
+  if (cert.equals("")) {
+    success = !LITTLEFS.exists(MQTT_TLS_CA_CERT_FILE) || LITTLEFS.remove(MQTT_TLS_CA_CERT_FILE);
+  } else {
+    File certFile = LITTLEFS.open(MQTT_TLS_CA_CERT_TEMP_FILE, "w");
+    success = certFile && (certFile.print(cert) == cert.length());
+    if (certFile) {
+      certFile.close();
+    }
+    success = success && LITTLEFS.rename(MQTT_TLS_CA_CERT_TEMP_FILE, MQTT_TLS_CA_CERT_FILE);
+  }
+
+  #ifdef SERIAL_DEBUG
+  if (!success) {
+    Serial.println("  ! Failed to replace 'LITTLEFS" MQTT_TLS_CA_CERT_FILE "'.");
+  } else {
+    Serial.println(cert.equals("") ? "Removed the MQTT CA certificate." : "Saved a new MQTT CA certificate.");
+  }
+  #endif
+
+  // The certificate is only read when the MQTT client starts
+  reboot();
+}
+
+
 /**
  * Change the threshold of an IR Sensor
  * 
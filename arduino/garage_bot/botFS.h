@@ -8,6 +8,7 @@
 #define BOTFS_H
 
 #include "Arduino.h"
+#include "_config.h"
 
 class BotFS {
   public:
@@ -18,13 +19,24 @@ class BotFS {
     void factoryReset();
     void setWiFiSettings(String newSSID, String newPassword);
     void setIRSensorThreshold(String sensorType, int newThreshold);
-    void setGeneralConfig(String mdnsName, String deviceName, bool mqttEnabled, String mqttBrokerAddres, unsigned int mqttBrokerPort, String mqttDeviceId, String mqttUsername, String mqttPassword, String mqttCommandTopic, String mqttStateTopic);
+    void setGeneralConfig(String mdnsName, String deviceName, bool mqttEnabled, String mqttBrokerAddres, unsigned int mqttBrokerPort, bool mqttTLSEnabled, String mqttDeviceId, String mqttUsername, String mqttPassword, String mqttCommandTopic, String mqttStateTopic, String udpCommandKey);
     void registerRFCode(unsigned long newCode);
+    String loadMQTTCACert();
+    void setMQTTCACert(String cert);
 
   private:
-    bool loadConfig();
+    bool loadConfig();                            // Load the newest valid config record
+    bool _loadConfigBackup();                     // Load the copy of the config record kept in NVS
+    void _backupConfig();                         // Copy the current config record to NVS
+    bool _loadJSONConfig();                       // Load the json config written by older firmware (to migrate it)
+    void _printConfig();                          // Print the current config (SERIAL_DEBUG only)
+    const char* _getConfigSlotFile(byte slot);    // The file that a config slot is written to
+    bool _readConfigSlot(byte slot, size_t &length);  // Read the contents of a config slot into the record buffer
 
     bool _writingConfig;
+    uint32_t _generation = 0;                     // The generation of the newest config record
+    byte _activeSlot = 1;                         // The slot holding the newest config record (the next save goes to the other one)
+    uint8_t _record[CONFIG_RECORD_MAX_SIZE];      // Config records are encoded / read here
 };
 
 extern BotFS botFS;
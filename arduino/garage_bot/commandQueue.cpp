@@ -0,0 +1,157 @@
+/*============================================================================*\
+ * Garage Bot - commandQueue
+ * Peter Eldred 2021-08
+ *
+ * A bounded lock-free multi-producer / single-consumer queue for handing
+ * commands received on the AsyncTCP task (web sockets, HTTP) off to the main
+ * loop, which is the only place that is allowed to touch the door control,
+ * sensors and file system.
+ *
+ * Based on Dmitry Vyukov's bounded MPMC queue. Each slot carries a sequence
+ * number which tells a producer whether the slot is free and tells the
+ * consumer whether the slot has been published.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "_config.h"
+#include "commandQueue.h"
+
+#if (COMMAND_QUEUE_SIZE & (COMMAND_QUEUE_SIZE - 1)) != 0
+#error COMMAND_QUEUE_SIZE must be a power of two
+#endif
+
+
+/**
+ * Constructor
+ */
+CommandQueue::CommandQueue() {
+  for (uint32_t i = 0; i < COMMAND_QUEUE_SIZE; i++) {
+    _slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  _enqueuePos.store(0, std::memory_order_relaxed);
+  droppedCount.store(0, std::memory_order_relaxed);
+}
+
+
+/**
+ * Stamp and push a command onto the queue
+ *
+ * @param type the type of command
+ * @param value a generic value associated with the command
+ * @param target a generic target associated with the command
+ * @param data (optional) heap allocated payload. Ownership passes to the queue only if this returns true
+ * @return bool false if the queue is full and the command was dropped
+ */
+bool CommandQueue::push(BotCommandType type, int value, byte target, void *data) {
+  BotCommand command;
+  command.type = type;
+  command.value = value;
+  command.target = target;
+  command.data = data;
+  command.receivedMicros = micros();
+
+  return push(command);
+}
+
+
+/**
+ * Push a command onto the queue.
+ * Can be called concurrently from any number of tasks.
+ *
+ * @param command the command to push
+ * @return bool false if the queue is full and the command was dropped
+ */
+bool CommandQueue::push(const BotCommand &command) {
+  uint32_t pos = _enqueuePos.load(std::memory_order_relaxed);
+
+  for (;;) {
+    Slot &slot = _slots[pos & (COMMAND_QUEUE_SIZE - 1)];
+    uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+    int32_t diff = (int32_t)sequence - (int32_t)pos;
+
+    // The slot is free - attempt to claim it
+    if (diff == 0) {
+      if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        slot.command = command;
+        slot.sequence.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+    }
+
+    // The slot still holds a command the main loop hasn't consumed yet. The queue is full.
+    else if (diff < 0) {
+      droppedCount.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    // Another producer got in first. Try again with the latest position.
+    else {
+      pos = _enqueuePos.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+
+/**
+ * Pop the next command off the queue.
+ * Must only be called from the main loop.
+ *
+ * @param command populated with the next command
+ * @return bool false if the queue is empty
+ */
+bool CommandQueue::pop(BotCommand &command) {
+  Slot &slot = _slots[_dequeuePos & (COMMAND_QUEUE_SIZE - 1)];
+  uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+
+  // Nothing has been published to this slot yet
+  if ((int32_t)sequence - (int32_t)(_dequeuePos + 1) < 0) {
+    return false;
+  }
+
+  command = slot.command;
+
+  // Hand the slot back to the producers for the next lap of the ring
+  slot.sequence.store(_dequeuePos + COMMAND_QUEUE_SIZE, std::memory_order_release);
+  _dequeuePos += 1;
+
+  return true;
+}
+
+
+/**
+ * Run
+ *
+ * Drain the queue and hand each command to the listener. Only the commands
+ * that were waiting when the drain began are executed so a flood of incoming
+ * commands can't starve the rest of the main loop.
+ *
+ * @param currentMillis the current milliseconds as passed down from the main loop
+ */
+void CommandQueue::run(unsigned long currentMillis) {
+  BotCommand command;
+
+  for (byte i = 0; i < COMMAND_QUEUE_SIZE; i++) {
+    if (!pop(command)) {
+      break;
+    }
+
+    if (onCommand) {
+      onCommand(command);
+    }
+
+    // Measure how long the command was waiting for (includes the execution time, ie. the relay activation)
+    lastLatencyMicros = micros() - command.receivedMicros;
+    if (lastLatencyMicros > maxLatencyMicros) {
+      maxLatencyMicros = lastLatencyMicros;
+    }
+    executedCount += 1;
+
+    #ifdef SERIAL_DEBUG
+    Serial.print("Command ");
+    Serial.print(command.type);
+    Serial.print(" executed. Latency: ");
+    Serial.print(lastLatencyMicros);
+    Serial.println("us");
+    #endif
+  }
+}
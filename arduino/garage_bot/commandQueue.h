@@ -0,0 +1,49 @@
+/*============================================================================*\
+ * Garage Bot - commandQueue
+ * Peter Eldred 2021-08
+ *
+ * A bounded lock-free multi-producer / single-consumer queue for handing
+ * commands received on the AsyncTCP task (web sockets, HTTP) off to the main
+ * loop, which is the only place that is allowed to touch the door control,
+ * sensors and file system.
+\*============================================================================*/
+
+#ifndef COMMANDQUEUE_H
+#define COMMANDQUEUE_H
+
+#include <atomic>
+#include "Arduino.h"
+#include "_config.h"
+#include "helpers.h"
+
+class CommandQueue {
+  public:
+    CommandQueue();
+
+    bool push(BotCommandType type, int value = 0, byte target = 0, void *data = NULL); // Safe to call from any task / core
+    bool push(const BotCommand &command);         // Safe to call from any task / core
+    bool pop(BotCommand &command);                // Only ever call from the main loop
+
+    void run(unsigned long currentMillis);        // Drain the queue and execute each command
+
+    botCommandFunction onCommand;                 // Fired (on the main loop) for each command popped off the queue
+
+    unsigned long lastLatencyMicros = 0;          // The time between receipt and execution of the most recent command
+    unsigned long maxLatencyMicros = 0;           // The worst time between receipt and execution since boot
+    uint32_t executedCount = 0;                   // The number of commands executed since boot
+    std::atomic<uint32_t> droppedCount;           // The number of commands dropped because the queue was full
+
+  private:
+    struct Slot {
+      std::atomic<uint32_t> sequence;             // Used by the producers and consumer to establish who owns the slot
+      BotCommand command;
+    };
+
+    Slot _slots[COMMAND_QUEUE_SIZE];
+    std::atomic<uint32_t> _enqueuePos;            // The next position a producer will claim
+    uint32_t _dequeuePos = 0;                     // The next position the consumer will read (main loop only)
+};
+
+extern CommandQueue commandQueue;
+
+#endif
@@ -0,0 +1,323 @@
+/*============================================================================*\
+ * Garage Bot - configRecord
+ * Peter Eldred 2021-08
+ *
+ * A compact, versioned and CRC checked binary encoding of the config. The
+ * encoder writes a complete record into a caller supplied buffer and the
+ * decoder validates a record before reading the config out of it. Nothing
+ * in here touches the file system (see BotFS for the A/B slots).
+ *
+ * The record (multi-byte values are little endian):
+ *
+ *   0-3    "GBCF"
+ *   4-5    version (CONFIG_RECORD_VERSION)
+ *   6-7    length of the payload
+ *   8-11   generation
+ *   12-    payload
+ *   last 4 CRC32 of everything before it
+ *
+ * The payload holds the config values in a fixed order. Strings are a one
+ * byte length followed by the characters (no null terminator).
+ *
+ *   flags (wifi_enabled 0x01, mqtt_enabled 0x02, mqtt_tls_enabled 0x04)
+ *   mdns_name, device_name
+ *   wifi_network_count followed by the ssid and password of each network
+ *   mqtt_broker_address, mqtt_broker_port (2), mqtt_device_id,
+ *   mqtt_username, mqtt_password, mqtt_command_topic, mqtt_state_topic
+ *   stored_rf_code_count, rf_codes (5 x 4)
+ *   top_ir_sensor_threshold (2), bottom_ir_sensor_threshold (2)
+ *   udp_command_key
+ *
+ * New config values are appended to the end of the payload. A record that
+ * ends before a value leaves it at its default, so records written by older
+ * firmware still load. CONFIG_RECORD_VERSION only changes when the existing
+ * layout does.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "rom/crc.h"
+#include "_config.h"
+#include "configRecord.h"
+
+// The length of the header and of the CRC that follows the payload
+#define CONFIG_RECORD_HEADER_SIZE 12
+#define CONFIG_RECORD_CRC_SIZE 4
+
+// The config flags
+#define CONFIG_FLAG_WIFI_ENABLED      0x01
+#define CONFIG_FLAG_MQTT_ENABLED      0x02
+#define CONFIG_FLAG_MQTT_TLS_ENABLED  0x04
+
+
+/**
+ * Writes values into a record, remembering if any of them didn't fit
+ */
+class RecordWriter {
+  public:
+    RecordWriter(uint8_t *buffer, size_t size) : _buffer(buffer), _size(size) {}
+
+    size_t pos = 0;
+    bool failed = false;
+
+    void writeUInt(uint32_t value, byte len) {
+      if (!_reserve(len)) {
+        return;
+      }
+      for (byte i = 0; i < len; i++) {
+        _buffer[pos++] = value & 0xFF;
+        value >>= 8;
+      }
+    }
+
+    void writeString(const String &value) {
+      if ((value.length() > 255) || !_reserve(1 + value.length())) {
+        failed = true;
+        return;
+      }
+      _buffer[pos++] = value.length();
+      memcpy(_buffer + pos, value.c_str(), value.length());
+      pos += value.length();
+    }
+
+  private:
+    uint8_t *_buffer;
+    size_t _size;
+
+    bool _reserve(size_t len) {
+      if ((pos + len) > _size) {
+        failed = true;
+      }
+      return !failed;
+    }
+};
+
+
+/**
+ * Reads values out of a record payload. Reading past the end of the payload
+ * leaves the value untouched and sets `ended` (ie. a record from older firmware).
+ */
+class RecordReader {
+  public:
+    RecordReader(const uint8_t *buffer, size_t length) : _buffer(buffer), _length(length) {}
+
+    bool ended = false;
+    bool malformed = false;
+
+    template <typename T> void readUInt(T &value, byte len) {
+      if (!_available(len)) {
+        return;
+      }
+      uint32_t result = 0;
+      for (byte i = 0; i < len; i++) {
+        result |= (uint32_t)_buffer[_pos++] << (8 * i);
+      }
+      value = result;
+    }
+
+    void readString(String &value) {
+      if (!_available(1)) {
+        return;
+      }
+
+      // A string that runs past the end of the payload can't be from a shorter (older) record
+      size_t len = _buffer[_pos];
+      if ((_pos + 1 + len) > _length) {
+        malformed = true;
+        ended = true;
+        return;
+      }
+
+      _pos += 1;
+      value = "";
+      value.reserve(len);
+      for (size_t i = 0; i < len; i++) {
+        value += (char)_buffer[_pos++];
+      }
+    }
+
+  private:
+    const uint8_t *_buffer;
+    size_t _length;
+    size_t _pos = 0;
+
+    bool _available(size_t len) {
+      if (!ended && ((_pos + len) > _length)) {
+        ended = true;
+      }
+      return !ended;
+    }
+};
+
+
+/**
+ * Read a little endian integer
+ */
+static uint32_t readUInt(const uint8_t *buffer, byte len) {
+  uint32_t value = 0;
+  for (byte i = 0; i < len; i++) {
+    value |= (uint32_t)buffer[i] << (8 * i);
+  }
+  return value;
+}
+
+
+/**
+ * Encode the config into a record
+ */
+size_t configRecordEncode(uint8_t *buffer, size_t size, const Config &config, uint32_t generation) {
+  if (size < (CONFIG_RECORD_HEADER_SIZE + CONFIG_RECORD_CRC_SIZE)) {
+    return 0;
+  }
+
+  // The payload first (the header needs its length)
+  RecordWriter writer(buffer + CONFIG_RECORD_HEADER_SIZE, size - CONFIG_RECORD_HEADER_SIZE - CONFIG_RECORD_CRC_SIZE);
+
+  byte flags = 0;
+  if (config.wifi_enabled) {
+    flags |= CONFIG_FLAG_WIFI_ENABLED;
+  }
+  if (config.mqtt_enabled) {
+    flags |= CONFIG_FLAG_MQTT_ENABLED;
+  }
+  if (config.mqtt_tls_enabled) {
+    flags |= CONFIG_FLAG_MQTT_TLS_ENABLED;
+  }
+  writer.writeUInt(flags, 1);
+
+  writer.writeString(config.mdns_name);
+  writer.writeString(config.device_name);
+
+  writer.writeUInt(config.wifi_network_count, 1);
+  for (byte i = 0; i < config.wifi_network_count; i++) {
+    writer.writeString(config.wifi_networks[i].ssid);
+    writer.writeString(config.wifi_networks[i].password);
+  }
+
+  writer.writeString(config.mqtt_broker_address);
+  writer.writeUInt(config.mqtt_broker_port, 2);
+  writer.writeString(config.mqtt_device_id);
+  writer.writeString(config.mqtt_username);
+  writer.writeString(config.mqtt_password);
+  writer.writeString(config.mqtt_command_topic);
+  writer.writeString(config.mqtt_state_topic);
+
+  writer.writeUInt(config.stored_rf_code_count, 1);
+  for (byte i = 0; i < 5; i++) {
+    writer.writeUInt(config.rf_codes[i], 4);
+  }
+
+  writer.writeUInt(config.top_ir_sensor_threshold, 2);
+  writer.writeUInt(config.bottom_ir_sensor_threshold, 2);
+
+  writer.writeString(config.udp_command_key);
+
+  if (writer.failed || (writer.pos > 0xFFFF)) {
+    return 0;
+  }
+
+  // Header
+  RecordWriter header(buffer, CONFIG_RECORD_HEADER_SIZE);
+  header.writeUInt('G' | ('B' << 8) | ('C' << 16) | ((uint32_t)'F' << 24), 4);
+  header.writeUInt(CONFIG_RECORD_VERSION, 2);
+  header.writeUInt(writer.pos, 2);
+  header.writeUInt(generation, 4);
+
+  // CRC
+  size_t length = CONFIG_RECORD_HEADER_SIZE + writer.pos;
+  RecordWriter crc(buffer + length, CONFIG_RECORD_CRC_SIZE);
+  crc.writeUInt(crc32_le(0, buffer, length), 4);
+
+  return length + CONFIG_RECORD_CRC_SIZE;
+}
+
+
+/**
+ * Check the magic, version, length and CRC of a record
+ */
+bool configRecordValidate(const uint8_t *buffer, size_t length, uint32_t &generation) {
+  if (length < (CONFIG_RECORD_HEADER_SIZE + CONFIG_RECORD_CRC_SIZE)) {
+    return false;
+  }
+
+  if ((buffer[0] != 'G') || (buffer[1] != 'B') || (buffer[2] != 'C') || (buffer[3] != 'F')) {
+    return false;
+  }
+
+  if (readUInt(buffer + 4, 2) != CONFIG_RECORD_VERSION) {
+    return false;
+  }
+
+  // The record has to be complete (a slot file may have been cut short by a power loss)
+  size_t payloadLength = readUInt(buffer + 6, 2);
+  if (length != (CONFIG_RECORD_HEADER_SIZE + payloadLength + CONFIG_RECORD_CRC_SIZE)) {
+    return false;
+  }
+
+  size_t crcPos = CONFIG_RECORD_HEADER_SIZE + payloadLength;
+  if (readUInt(buffer + crcPos, 4) != crc32_le(0, buffer, crcPos)) {
+    return false;
+  }
+
+  generation = readUInt(buffer + 8, 4);
+  return true;
+}
+
+
+/**
+ * Read the config out of a validated record
+ */
+bool configRecordDecode(const uint8_t *buffer, size_t length, Config &config) {
+  Config decoded = config;
+  RecordReader reader(buffer + CONFIG_RECORD_HEADER_SIZE, length - CONFIG_RECORD_HEADER_SIZE - CONFIG_RECORD_CRC_SIZE);
+
+  byte flags = 0;
+  reader.readUInt(flags, 1);
+  decoded.wifi_enabled = (flags & CONFIG_FLAG_WIFI_ENABLED) != 0;
+  decoded.mqtt_enabled = (flags & CONFIG_FLAG_MQTT_ENABLED) != 0;
+  decoded.mqtt_tls_enabled = (flags & CONFIG_FLAG_MQTT_TLS_ENABLED) != 0;
+
+  reader.readString(decoded.mdns_name);
+  reader.readString(decoded.device_name);
+
+  byte networkCount = 0;
+  reader.readUInt(networkCount, 1);
+  if (networkCount > MAX_WIFI_NETWORKS) {
+    return false;
+  }
+  for (byte i = 0; i < MAX_WIFI_NETWORKS; i++) {
+    decoded.wifi_networks[i] = WiFiNetwork();
+  }
+  for (byte i = 0; i < networkCount; i++) {
+    reader.readString(decoded.wifi_networks[i].ssid);
+    reader.readString(decoded.wifi_networks[i].password);
+  }
+  decoded.wifi_network_count = networkCount;
+
+  reader.readString(decoded.mqtt_broker_address);
+  reader.readUInt(decoded.mqtt_broker_port, 2);
+  reader.readString(decoded.mqtt_device_id);
+  reader.readString(decoded.mqtt_username);
+  reader.readString(decoded.mqtt_password);
+  reader.readString(decoded.mqtt_command_topic);
+  reader.readString(decoded.mqtt_state_topic);
+
+  reader.readUInt(decoded.stored_rf_code_count, 1);
+  for (byte i = 0; i < 5; i++) {
+    reader.readUInt(decoded.rf_codes[i], 4);
+  }
+  if (decoded.stored_rf_code_count > 5) {
+    return false;
+  }
+
+  reader.readUInt(decoded.top_ir_sensor_threshold, 2);
+  reader.readUInt(decoded.bottom_ir_sensor_threshold, 2);
+
+  reader.readString(decoded.udp_command_key);
+
+  if (reader.malformed) {
+    return false;
+  }
+
+  config = decoded;
+  return true;
+}
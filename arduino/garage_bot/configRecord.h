@@ -0,0 +1,40 @@
+/*============================================================================*\
+ * Garage Bot - configRecord
+ * Peter Eldred 2021-08
+ *
+ * A compact, versioned and CRC checked binary encoding of the config. The
+ * encoder writes a complete record into a caller supplied buffer and the
+ * decoder validates a record before reading the config out of it. Nothing
+ * in here touches the file system (see BotFS for the A/B slots).
+\*============================================================================*/
+
+#ifndef CONFIGRECORD_H
+#define CONFIGRECORD_H
+
+#include "Arduino.h"
+#include "_config.h"
+
+/**
+ * Encode the config into a record
+ *
+ * @param generation the generation of the record (incremented for every save)
+ * @return size_t the length of the record or 0 if it doesn't fit in the buffer (or a string is too long to encode)
+ */
+size_t configRecordEncode(uint8_t *buffer, size_t size, const Config &config, uint32_t generation);
+
+/**
+ * Check the magic, version, length and CRC of a record
+ *
+ * @param generation populated with the generation of the record
+ * @return bool false if the record is damaged or written by an incompatible firmware version
+ */
+bool configRecordValidate(const uint8_t *buffer, size_t length, uint32_t &generation);
+
+/**
+ * Read the config out of a validated record
+ *
+ * @return bool false if the record is malformed (the config is left untouched)
+ */
+bool configRecordDecode(const uint8_t *buffer, size_t length, Config &config);
+
+#endif
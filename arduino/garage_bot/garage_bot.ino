@@ -19,7 +19,7 @@
  *  - Async TCP Library for ESP32 Arduino (https://github.com/me-no-dev/AsyncTCP)
  *  - ESP Async Web Server (https://github.com/me-no-dev/ESPAsyncWebServer)
  *  - RCSwitch for 433mhz Receiver (https://github.com/sui77/rc-switch)
- *  - PubSubClient for MQTT Messaging (https://github.com/knolleary/pubsubclient)
+ *  - MQTT Messaging is implemented over AsyncTCP (see mqttPacket / mqttClient)
 \*============================================================================*/
 
 
@@ -48,7 +48,14 @@
 #include "remoteRepeater.h"
 #include "doorControl.h"
 #include "mqttClient.h"
+#include "lanAnnouncer.h"
+#include "udpCommandServer.h"
+#include "serviceAdvertiser.h"
 #include "otaUpdateManager.h"
+#include "commandQueue.h"
+#include "metrics.h"
+#include "assetPartition.h"
+#include "staticFileManifest.h"
 #include "reboot.h"
 
 
@@ -58,6 +65,7 @@
 const char* firmwareVersion = FIRMWARE_VERSION;                           // Firmware Version
 AsyncWebServer webServer(WEB_SERVER_PORT);                                // The Web Server for serving the control code
 AsyncWebSocket webSocket("/ws");                                          // The Web Socket for realtime comms with the client application
+AsyncEventSource eventSource("/events");                                  // Server-sent events for read-only clients (status and config changes)
 DNSServer dnsServer;                                                      // A DNS Server for use when in Access Point mode
 Config config;                                                            // The configuration struct for storing and reading from LITTLEFS
 BotFS botFS = BotFS();                                                    // A File System Wrapper for simplifying LITTLEFS interaction
@@ -74,12 +82,18 @@ RemoteRepeater remoteRepeater = RemoteRepeater();                         // The
 DoorControl doorControl = DoorControl();                                  // The object that manages the logical state of the door (open / closed / opening / closing)
 LEDTimer ledTimer = LEDTimer();                                           // A Timer to help with the flashing LEDs
 MQTTClient mqttClient = MQTTClient();                                     // The client which manages MQTT broadcasts and subscriptions
+LANAnnouncer lanAnnouncer = LANAnnouncer();                               // Announces the door state to the local network over UDP multicast
+UDPCommandServer udpCommandServer = UDPCommandServer();                   // Accepts authenticated door commands from the local network over UDP
+ServiceAdvertiser serviceAdvertiser = ServiceAdvertiser();                // Advertises the device and its state as mDNS services
 WiFiEngine wifiEngine = WiFiEngine();                                     // The Garage Bot's WiFi engine
-WiFiClient espClient;                                                     // Used by the MQTT PubSubClient
-PubSubClient pubSubClient = PubSubClient(espClient);                      // The MQTT PubSubClient
 OTAUpdateManager otaUpdateManager = OTAUpdateManager();                   // The Over The Air (OTA) update manager
+CommandQueue commandQueue = CommandQueue();                               // Hands commands received by the network tasks off to the main loop
+Metrics metrics = Metrics();                                              // Runtime metrics served on /metrics
+AssetPartition assetPartition = AssetPartition();                         // The flash mapped web app asset partition
+StaticFileManifest staticFileManifest = StaticFileManifest();             // An in-memory index of the static files served by the web server
 
 bool inError = false;                                                     // Whether the device is in an error state
+byte pendingNotifications = 0;                                            // The PendingNotification flags raised during the current loop iteration
 
 /**
  * Setup
@@ -112,6 +126,9 @@ void setup() {
     return;
   }
 
+  // Map the web app assets out of flash (falls back to LITTLEFS if the partition hasn't been flashed)
+  assetPartition.init();
+
   // Sensors
   topIRSensor.init(PIN_SENSOR_TOP_EMITTER, PIN_SENSOR_TOP_RECEIVER, config.top_ir_sensor_threshold);
   topIRSensor.onChange = topSensorChanged;
@@ -119,9 +136,9 @@ void setup() {
   bottomIRSensor.onChange = bottomSensorChanged;
 
   // Initialise the WiFi Engine (if enabled)
-  // This will automatically attempt to connect to a pre-configured
-  // WiFi hotspot and if unable to do so will broadcast an Access Point
-  if (config.wifi_enabled && !wifiEngine.init(&webServer, &webSocket, &dnsServer, &topIRSensor, &bottomIRSensor)) {
+  // This will start connecting to a pre-configured WiFi hotspot in the background
+  // (without blocking the rest of the boot) or broadcast an Access Point if there isn't one
+  if (config.wifi_enabled && !wifiEngine.init(&webServer, &webSocket, &eventSource, &dnsServer, &topIRSensor, &bottomIRSensor)) {
     // Failed to initialise the WiFi hotspot. Oh well. Bail.
     generalErrorOccurred("\n\nFAILED TO INITIALIZE THE WIFI ENGINE. HALTED!");
     return;
@@ -150,6 +167,12 @@ void setup() {
   doorControl.init();
   doorControl.onStateChange = doorControlStateChanged;
 
+  // Commands received from the web sockets / HTTP requests are executed by the main loop
+  commandQueue.onCommand = executeCommand;
+
+  // Metrics
+  metrics.init(&topIRSensor, &bottomIRSensor);
+
   if (config.wifi_enabled) {
     // If the wifi engine is in access point mode
     if (wifiEngine.wifiEngineMode == WEM_AP) {
@@ -162,15 +185,20 @@ void setup() {
       // Initialise the OTA manager
       otaUpdateManager.init();
 
+      // Announce the door state to the local network
+      lanAnnouncer.init(&topIRSensor, &bottomIRSensor);
+
+      // Accept authenticated commands from the local network
+      udpCommandServer.init(&topIRSensor, &bottomIRSensor);
+
       // Initialise the MQTT Client
       if (config.mqtt_enabled) {
-        mqttClient.init(&pubSubClient);
+        mqttClient.init(&topIRSensor, &bottomIRSensor);
         mqttClient.onStateChange = handleMQTTStateChanged;
       }
 
       // Listen to changes in the WiFi client's connectivity
       wifiEngine.onConnectedChanged = handleWiFiConnectedChanged;
-      wifiEngine.onVirtualButtonPressed = handleVirtualButtonPressed;
       handleWiFiConnectedChanged(wifiEngine.connected);
 
       // Allow incoming websocket connections
@@ -192,16 +220,28 @@ void setup() {
 void loop() {
   if (!inError) {
     unsigned long currentMillis = millis();
+    unsigned long runStart = micros();
 
-    // Run each of the delegated object controllers
+    metrics.countLoop(currentMillis);
+
+    // Run each of the delegated object controllers (timing each of them for the metrics)
     if (!config.updating_config) {
+      commandQueue.run(currentMillis);
+      runStart = metrics.recordRunTime(METRICS_COMPONENT_COMMAND_QUEUE, runStart);
       topIRSensor.run(currentMillis);
+      runStart = metrics.recordRunTime(METRICS_COMPONENT_TOP_IR_SENSOR, runStart);
       bottomIRSensor.run(currentMillis);
+      runStart = metrics.recordRunTime(METRICS_COMPONENT_BOTTOM_IR_SENSOR, runStart);
       ledTimer.run(currentMillis);
+      runStart = metrics.recordRunTime(METRICS_COMPONENT_LED_TIMER, runStart);
       panelButton.run(currentMillis);
+      runStart = metrics.recordRunTime(METRICS_COMPONENT_PANEL_BUTTON, runStart);
       rfReceiver.run(currentMillis);
+      runStart = metrics.recordRunTime(METRICS_COMPONENT_RF_RECEIVER, runStart);
       remoteRepeater.run(currentMillis);
+      runStart = metrics.recordRunTime(METRICS_COMPONENT_REMOTE_REPEATER, runStart);
       doorControl.run(currentMillis);
+      runStart = metrics.recordRunTime(METRICS_COMPONENT_DOOR_CONTROL, runStart);
     }
     
     // Wifi functions
@@ -209,24 +249,80 @@ void loop() {
       // The OTAUpdateManager processes requests to update the software
       if (!config.updating_config) {
         otaUpdateManager.run(currentMillis);
+        runStart = metrics.recordRunTime(METRICS_COMPONENT_OTA_UPDATE_MANAGER, runStart);
       }
 
       // The wifi engine.run will process Access Point requests and check and manage for wifi disconnections
       // This also sends sensor data to any connected socket clients
       wifiEngine.run(currentMillis);
+      runStart = metrics.recordRunTime(METRICS_COMPONENT_WIFI_ENGINE, runStart);
+
+      // Only announce to the local network when connected to it as a client
+      if (wifiEngine.wifiEngineMode == WEM_CLIENT) {
+        lanAnnouncer.run(currentMillis);
+        runStart = metrics.recordRunTime(METRICS_COMPONENT_LAN_ANNOUNCER, runStart);
+        udpCommandServer.run(currentMillis);
+        runStart = metrics.recordRunTime(METRICS_COMPONENT_UDP_COMMAND_SERVER, runStart);
+      }
     
       // Only run the MQTT loop if the wifi and mqtt services are enabled
       if (!config.updating_config && config.mqtt_enabled) {
         mqttClient.run(currentMillis);
+        metrics.recordRunTime(METRICS_COMPONENT_MQTT_CLIENT, runStart);
       }
     }
 
+    // Send everything that changed during this iteration to the clients / broker in one go
+    flushNotifications();
+
     // Check to see if the reboot flag has been tripped
     checkReboot();
   }
 }
 
 
+/**
+ * Send the changes raised during the loop iteration to the connected clients and the MQTT broker.
+ * However many changes were raised, each message is only serialized / published once.
+ */
+void flushNotifications() {
+  if (pendingNotifications == 0) {
+    return;
+  }
+
+  byte notifications = pendingNotifications;
+  pendingNotifications = 0;
+
+  if (!config.wifi_enabled) {
+    return;
+  }
+
+  if (notifications & NOTIFY_CLIENTS_CONFIG) {
+    wifiEngine.sendConfigToClients();
+  }
+
+  if (notifications & NOTIFY_CLIENTS_STATUS) {
+    wifiEngine.sendStatusToClients();
+  }
+
+  if ((notifications & (NOTIFY_BROKER_DOOR_STATE | NOTIFY_BROKER_SENSOR_STATE)) && (wifiEngine.wifiEngineMode == WEM_CLIENT)) {
+    lanAnnouncer.announce();
+  }
+
+  if ((notifications & NOTIFY_BROKER_DOOR_STATE) && (wifiEngine.wifiEngineMode == WEM_CLIENT)) {
+    serviceAdvertiser.update();
+  }
+
+  if ((notifications & NOTIFY_BROKER_DOOR_STATE) && config.mqtt_enabled) {
+    mqttClient.sendDoorStateToBroker();
+  }
+
+  if ((notifications & NOTIFY_BROKER_SENSOR_STATE) && config.mqtt_enabled) {
+    mqttClient.sendSensorStatesToBroker();
+  }
+}
+
+
 /**
  * Fired when the top sensor changes state
  * 
@@ -236,6 +332,7 @@ void topSensorChanged(SensorDetectionState detected) {
   topSensorLED.setState(detected == SENSOR_NOT_DETECTED);
 
   doorControl.setSensorStates(detected, bottomIRSensor.detected);
+  pendingNotifications |= NOTIFY_BROKER_SENSOR_STATE;
 
   #ifdef SERIAL_DEBUG
   Serial.print("Top: ");
@@ -253,6 +350,7 @@ void bottomSensorChanged(SensorDetectionState detected) {
   bottomSensorLED.setState(detected == SENSOR_NOT_DETECTED);
 
   doorControl.setSensorStates(topIRSensor.detected, detected);
+  pendingNotifications |= NOTIFY_BROKER_SENSOR_STATE;
 
   #ifdef SERIAL_DEBUG
   Serial.print("Bottom: ");
@@ -420,14 +518,8 @@ void updateLEDFlashes() {
  * Fired when the Door Control state changes
  */
 void doorControlStateChanged(DoorState newDoorState) {
-  // Notify any connected clients of the door state change
-  if (config.wifi_enabled) {
-    wifiEngine.sendStatusToClients();
-
-    if (config.mqtt_enabled) {
-      mqttClient.sendDoorStateToBroker();
-    }
-  }
+  // Notify any connected clients (and the MQTT broker) of the door state change at the end of the loop
+  pendingNotifications |= NOTIFY_CLIENTS_STATUS | NOTIFY_BROKER_DOOR_STATE;
 
   #ifdef SERIAL_DEBUG
   Serial.println(doorControl.getDoorStateAsString());
@@ -484,6 +576,79 @@ void handleVirtualButtonPressed(VirtualButtonType virtualButton) {
 }
 
 
+/**
+ * Fired by the Command Queue (on the main loop) for each command received by the network tasks
+ * 
+ * @param command the command to execute
+ */
+void executeCommand(BotCommand &command) {
+  switch (command.type) {
+    case BOT_COMMAND_VIRTUAL_BUTTON:
+      handleVirtualButtonPressed((VirtualButtonType)command.value);
+      break;
+
+    case BOT_COMMAND_SET_SENSOR_THRESHOLD:
+      if (command.target == IR_SENSOR_TOP) {
+        topIRSensor.setThreshold(command.value);
+      } else {
+        bottomIRSensor.setThreshold(command.value);
+      }
+      pendingNotifications |= NOTIFY_CLIENTS_CONFIG;
+      break;
+
+    case BOT_COMMAND_REBOOT:
+      reboot();
+      break;
+
+    case BOT_COMMAND_FORGET_WIFI:
+      botFS.resetWiFiConfig(true);
+      break;
+
+    case BOT_COMMAND_FACTORY_RESET:
+      botFS.factoryReset();
+      break;
+
+    case BOT_COMMAND_REGISTER_REMOTE:
+      rfReceiver.setMode(RF_RECEIVER_MODE_REGISTERING);
+      break;
+
+    case BOT_COMMAND_SET_WIFI: {
+      WiFiSettingsUpdate *update = (WiFiSettingsUpdate*)command.data;
+      botFS.setWiFiSettings(update->ssid, update->password);
+      delete update;
+      break;
+    }
+
+    case BOT_COMMAND_SET_CONFIG: {
+      GeneralConfigUpdate *update = (GeneralConfigUpdate*)command.data;
+      botFS.setGeneralConfig(
+        update->mdnsName,
+        update->deviceName,
+        update->mqttEnabled,
+        update->mqttBrokerAddress,
+        update->mqttBrokerPort,
+        update->mqttTLSEnabled,
+        update->mqttDeviceId,
+        update->mqttUsername,
+        update->mqttPassword,
+        update->mqttCommandTopic,
+        update->mqttStateTopic,
+        update->udpCommandKey
+      );
+      delete update;
+      break;
+    }
+
+    case BOT_COMMAND_SET_MQTT_CA_CERT: {
+      String *cert = (String*)command.data;
+      botFS.setMQTTCACert(*cert);
+      delete cert;
+      break;
+    }
+  }
+}
+
+
 /**
  * Fired by the MQTT Client when its state changes
  */
@@ -493,8 +658,6 @@ void handleMQTTStateChanged(MQTTState newState, String error) {
   Serial.println(mqttClient.getMQTTStateAsString());
   #endif
 
-  // Notify any connected clients of the MQTT Client state change
-  if (config.wifi_enabled) {
-    wifiEngine.sendStatusToClients();
-  }
+  // Notify any connected clients of the MQTT Client state change at the end of the loop
+  pendingNotifications |= NOTIFY_CLIENTS_STATUS;
 }
@@ -6,25 +6,88 @@
 \*============================================================================*/
 
 #include "Arduino.h"
+#include "_config.h"
 #include "helpers.h"
 
+// File extensions and their mime types
+static const struct {
+  const char *extension;
+  const char *mimeType;
+} MIME_TYPES[] = {
+  {".html", "text/html"},
+  {".css", "text/css"},
+  {".js", "text/javascript"},
+  {".json", "application/json"},
+  {".svg", "image/svg+xml"},
+  {".png", "image/png"},
+  {".ico", "image/x-icon"},
+  {".txt", "text/plain"},
+};
+
 /**
  * Determine the Mime Type of a file based on its extension
  * @param String& filename the name of the file to check
  * @return char* the calculated mime-type of the file in question
  */
-String getMimeType(const String& fileName){
-  // TODO: turn this into a mapped array at some point
-  if (fileName.endsWith(".html")) {
-    return F("text/html");
-  } else if (fileName.endsWith(".css")) {
-    return F("text/css");
-  } else if (fileName.endsWith(".js")) {
-    return F("text/javascript");
-  } else if (fileName.endsWith(".svg")) {
-    return F("image/svg+xml");
+const char* getMimeType(const String& fileName){
+  for (byte i = 0; i < (sizeof(MIME_TYPES) / sizeof(MIME_TYPES[0])); i++) {
+    if (fileName.endsWith(MIME_TYPES[i].extension)) {
+      return MIME_TYPES[i].mimeType;
+    }
+  }
+  return "text/plain";
+}
+
+
+/**
+ * Whether a static asset path refers to a content hashed file which will never
+ * change (and can therefore be cached by the browser forever)
+ * 
+ * Only files whose name has a "." delimited segment of at least
+ * STATIC_ASSET_CONTENT_HASH_MIN_LENGTH hex digits (the webpack "[contenthash]")
+ * qualify, ie. "/js/control.1-0-0.3fa81c0d.bnd.js". A bundle that is only
+ * versioned can be rebuilt under the same name, so it isn't immutable.
+ * 
+ * @param String& path the path of the file to check
+ */
+bool isImmutableAssetPath(const String& path){
+  int nameStart = path.lastIndexOf('/') + 1;
+  byte hexDigits = 0;
+  bool inFirstSegment = true;
+
+  for (unsigned int i = nameStart; i <= path.length(); i++) {
+    char c = (i < path.length()) ? path.charAt(i) : '.';
+
+    if (c == '.') {
+      // The first segment is the name of the file rather than a hash
+      if (!inFirstSegment && (hexDigits >= STATIC_ASSET_CONTENT_HASH_MIN_LENGTH)) {
+        return true;
+      }
+      inFirstSegment = false;
+      hexDigits = 0;
+    } else if (isxdigit(c) && (hexDigits < 255)) {
+      hexDigits += 1;
+    } else {
+      hexDigits = 0;
+
+      // Skip the rest of the segment
+      while (((i + 1) < path.length()) && (path.charAt(i + 1) != '.')) {
+        i++;
+      }
+    }
   }
-  return F("text/plain");
+
+  return false;
+}
+
+
+/**
+ * Whether a requested IR sensor threshold is within IR_SENSOR_THRESHOLD_MIN and IR_SENSOR_THRESHOLD_MAX
+ *
+ * @param threshold the requested threshold
+ */
+bool isValidIRSensorThreshold(long threshold){
+  return (threshold >= IR_SENSOR_THRESHOLD_MIN) && (threshold <= IR_SENSOR_THRESHOLD_MAX);
 }
 
 
@@ -44,3 +107,21 @@ VirtualButtonType toVirtualButtonType(const String& button){
 
   return ACTIVATE;
 }
+
+
+/**
+ * Convert a (not null terminated) string representation of a virtual button type
+ * to a VirtualButtonType enum value
+ * 
+ * @param button the string representation of the virtual button type
+ * @param len the length of the string
+ */
+VirtualButtonType toVirtualButtonType(const char *button, size_t len){
+  if ((len == 4) && (memcmp(button, "OPEN", 4) == 0)) {
+    return OPEN;
+  } else if ((len == 5) && (memcmp(button, "CLOSE", 5) == 0)) {
+    return CLOSE;
+  }
+
+  return ACTIVATE;
+}
@@ -8,7 +8,7 @@
 #ifndef HELPERS_H
 #define HELPERS_H
 
-#include "Arduino.h";
+#include "Arduino.h"
 
 // Used to keep track of the WiFi mode we're in
 enum WiFiEngineMode {
@@ -17,6 +17,26 @@ enum WiFiEngineMode {
   WEM_AP          // Serving a dedicated Access Point
 };
 
+// The state of the WiFi client's connection to the configured hotspot
+enum WiFiConnectionState {
+  WCS_IDLE,               // Not attempting to connect
+  WCS_SCANNING,           // Scanning for the strongest of the known networks
+  WCS_CONNECTING,         // Waiting for the hotspot to associate and assign an IP address
+  WCS_CONNECTED,          // Connected and assigned an IP address
+  WCS_WAITING_TO_RETRY    // Backing off before the next connection attempt
+};
+
+// The state of the MQTT client's connection to the broker
+enum MQTTConnectionState {
+  MQTT_CONNECTION_DISCONNECTED,         // Not connected (waiting for the reconnect interval)
+  MQTT_CONNECTION_TCP_CONNECTING,       // Waiting for the broker to accept the TCP connection
+  MQTT_CONNECTION_TCP_CONNECTED,        // The TCP connection is open and the CONNECT (or TLS handshake) needs to be sent
+  MQTT_CONNECTION_TLS_HANDSHAKE,        // Waiting for the TLS handshake to complete
+  MQTT_CONNECTION_WAITING_FOR_CONNACK,  // The CONNECT has been sent
+  MQTT_CONNECTION_ACCEPTED,             // The broker accepted the CONNECT and the subscriptions need to be sent
+  MQTT_CONNECTION_CONNECTED,            // Subscribed and publishing
+};
+
 // The different types of button presses that the front panel can have
 enum ButtonPressType {
   SIMPLE,           // The button was pressed
@@ -33,6 +53,25 @@ enum VirtualButtonType {
   CLOSE,          // Close the door
 };
 
+// Identifies which of the two IR sensors a command or message refers to
+enum IRSensorPosition {
+  IR_SENSOR_TOP,      // The sensor at the top of the door
+  IR_SENSOR_BOTTOM,   // The sensor at the bottom of the door
+};
+
+// The commands that can be handed off from the network tasks to the main loop
+enum BotCommandType {
+  BOT_COMMAND_VIRTUAL_BUTTON,         // A virtual button was pressed (value = VirtualButtonType)
+  BOT_COMMAND_SET_SENSOR_THRESHOLD,   // Change an IR sensor threshold (target = IRSensorPosition, value = threshold)
+  BOT_COMMAND_REBOOT,                 // Reboot the device
+  BOT_COMMAND_FORGET_WIFI,            // Forget the WiFi credentials and reboot into AP mode
+  BOT_COMMAND_FACTORY_RESET,          // Reset the device to factory defaults
+  BOT_COMMAND_SET_WIFI,               // Apply new WiFi credentials (data = WiFiSettingsUpdate*)
+  BOT_COMMAND_SET_CONFIG,             // Apply a new general config (data = GeneralConfigUpdate*)
+  BOT_COMMAND_SET_MQTT_CA_CERT,       // Replace the MQTT CA certificate (data = String*, empty removes it)
+  BOT_COMMAND_REGISTER_REMOTE,        // Start listening for a new RF remote to register
+};
+
 // Used to keep track of the mode the LED is in
 enum LEDMode {
   LED_SOLID,      // Solid
@@ -64,7 +103,7 @@ enum SensorDetectionState {
   SENSOR_DETECTED,          // Detection
 };
 
-// Wrapper around the MQTT PubSubClient state values
+// The state of the MQTT client as reported to the app (the connection failures mirror the MQTT CONNACK return codes)
 enum MQTTState {
   MQTT_STATE_CONNECTION_TIMEOUT,
   MQTT_STATE_CONNECTION_LOST,
@@ -82,6 +121,53 @@ enum MQTTState {
   MQTT_STATE_CONFIG_ERROR,
 };
 
+// Changes raised during a main loop iteration which are sent to the clients / broker once at the end of it
+enum PendingNotification {
+  NOTIFY_CLIENTS_STATUS       = 0x01,   // The device status (door state, MQTT state etc...) has changed
+  NOTIFY_CLIENTS_CONFIG       = 0x02,   // The device config has changed
+  NOTIFY_BROKER_DOOR_STATE    = 0x04,   // The door state has changed (sent to the broker and announced to the LAN)
+  NOTIFY_BROKER_SENSOR_STATE  = 0x08,   // One of the IR sensor states has changed (sent to the broker and announced to the LAN)
+};
+
+/**
+ * A small POD command passed from the AsyncTCP task to the main loop via the CommandQueue.
+ * When `data` is set it points to a heap allocated payload, ownership of which passes
+ * to whoever pops the command off the queue.
+ */
+struct BotCommand {
+  BotCommandType type;                // What the command is
+  int value;                          // A generic value (virtual button, threshold etc...)
+  byte target;                        // A generic target (sensor position etc...)
+  void *data;                         // (Optional) payload too large to fit in the command itself
+  unsigned long receivedMicros;       // The micros() the command was received (for measuring latency)
+};
+
+/**
+ * New WiFi settings received from the Access Point config page
+ */
+struct WiFiSettingsUpdate {
+  String ssid;
+  String password;
+};
+
+/**
+ * New general config received from the config page
+ */
+struct GeneralConfigUpdate {
+  String mdnsName;
+  String deviceName;
+  bool mqttEnabled;
+  String mqttBrokerAddress;
+  unsigned int mqttBrokerPort;
+  bool mqttTLSEnabled;
+  String mqttDeviceId;
+  String mqttUsername;
+  String mqttPassword;
+  String mqttCommandTopic;
+  String mqttStateTopic;
+  String udpCommandKey;
+};
+
 typedef void (*eventFiredFunction)();
 
 typedef void (*boolValueChangedFunction)(bool);
@@ -100,12 +186,26 @@ typedef void (*virtualButtonPressedFunction)(VirtualButtonType);
 
 typedef void (*sensorDetectionStateChangedFunction)(SensorDetectionState);
 
+typedef void (*botCommandFunction)(BotCommand&);
+
 /**
  * Determine the Mime Type of a file based on its extension
  * @param String& filename the name of the file to check
  * @return char* the calculated mime-type of the file in question
  */
-String getMimeType(const String& fileName);
+const char* getMimeType(const String& fileName);
+
+/**
+ * Whether a static asset path refers to a content hashed file which will never
+ * change (and can therefore be cached by the browser forever)
+ */
+bool isImmutableAssetPath(const String& path);
+
+/**
+ * Whether a requested IR sensor threshold is within IR_SENSOR_THRESHOLD_MIN
+ * and IR_SENSOR_THRESHOLD_MAX
+ */
+bool isValidIRSensorThreshold(long threshold);
 
 /**
  * Convert a string representation of a virtual button type
@@ -113,4 +213,10 @@ String getMimeType(const String& fileName);
  */
 VirtualButtonType toVirtualButtonType(const String& button);
 
+/**
+ * Convert a (not null terminated) string representation of a virtual button type
+ * to a VirtualButtonType enum value
+ */
+VirtualButtonType toVirtualButtonType(const char *button, size_t len);
+
 #endif
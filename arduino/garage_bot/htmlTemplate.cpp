@@ -0,0 +1,283 @@
+/*============================================================================*\
+ * Garage Bot - HTMLTemplate
+ * Peter Eldred 2021-08
+ *
+ * An HTML page containing `%VARIABLE%` tokens which is parsed once (at boot)
+ * into a list of static and variable segments. The rendered page is cached
+ * and only re-rendered after one of the variable values has changed, so a
+ * page request costs a single buffer send rather than a token scan and a
+ * String comparison per token.
+ *
+ * A render is never modified once published. Each response holds a reference
+ * to the render it is sending, so re-rendering just swaps in a new render and
+ * the old one is freed when the last response using it has finished.
+\*============================================================================*/
+
+#include <new>
+#include "Arduino.h"
+#include "_config.h"
+#include "htmlTemplate.h"
+#include "wifiEngine.h"
+
+// Starts at 1 so that a template which has never been rendered is always out of date
+std::atomic<uint32_t> HTMLTemplate::_variablesVersion(1);
+
+// The names of the variables as they appear in the template (between the % signs)
+static const struct {
+  const char *name;
+  HTMLTemplateVariable variable;
+} HTML_TEMPLATE_VARIABLES[] = {
+  {"FIRMWARE_VERSION", HTML_TEMPLATE_FIRMWARE_VERSION},
+  {"DEVICE_ADDRESS", HTML_TEMPLATE_DEVICE_ADDRESS},
+  {"DEVICE_NAME", HTML_TEMPLATE_DEVICE_NAME},
+};
+
+
+/**
+ * Get the current value of a template variable
+ */
+static String getVariableValue(HTMLTemplateVariable variable) {
+  switch (variable) {
+    case HTML_TEMPLATE_FIRMWARE_VERSION:
+      return FIRMWARE_VERSION;
+    case HTML_TEMPLATE_DEVICE_ADDRESS:
+      return wifiEngine.ipAddress;
+    case HTML_TEMPLATE_DEVICE_NAME:
+      return config.device_name;
+    default:
+      return "";
+  }
+}
+
+
+/**
+ * Constructor
+ */
+HTMLTemplate::HTMLTemplate() {}
+
+
+/**
+ * Call whenever the value of a template variable changes (ie. the IP address or device name)
+ * The templates will be re-rendered the next time they are requested.
+ */
+void HTMLTemplate::invalidateAll() {
+  _variablesVersion.fetch_add(1);
+}
+
+
+/**
+ * Parse the source into static and variable segments
+ *
+ * Unknown tokens are left in the page as they are and "%%" is rendered as a single "%".
+ *
+ * @param source the template source. Must remain valid for the life of the template.
+ * @param length the length of the source
+ * @param ownsSource whether the source was allocated with malloc and should be freed by the template
+ * @return bool false if the template has too many segments to compile
+ */
+bool HTMLTemplate::compile(const char *source, size_t length, bool ownsSource) {
+  if (_ownsSource) {
+    free((void*)_source);
+  }
+  if (_render) {
+    releaseRender(_render);
+    _render = NULL;
+  }
+  _renderedVersion = 0;
+
+  _source = source;
+  _ownsSource = ownsSource;
+  _segmentCount = 0;
+  _tooManySegments = false;
+
+  size_t staticStart = 0;
+  size_t i = 0;
+  while (i < length) {
+    if (source[i] != '%') {
+      i += 1;
+      continue;
+    }
+
+    // "%%" is an escaped "%"
+    if ((i + 1 < length) && (source[i + 1] == '%')) {
+      _addSegment(HTML_TEMPLATE_STATIC, staticStart, (i + 1) - staticStart);
+      i += 2;
+      staticStart = i;
+      continue;
+    }
+
+    // Find the closing "%" of the token
+    size_t tokenEnd = i + 1;
+    while ((tokenEnd < length) && (tokenEnd - i <= HTML_TEMPLATE_MAX_VARIABLE_LENGTH) && (source[tokenEnd] != '%')) {
+      tokenEnd += 1;
+    }
+    if ((tokenEnd >= length) || (source[tokenEnd] != '%')) {
+      i += 1;
+      continue;
+    }
+
+    // Is the token a known variable?
+    const char *name = source + i + 1;
+    size_t nameLength = tokenEnd - (i + 1);
+    HTMLTemplateVariable variable = HTML_TEMPLATE_STATIC;
+    for (byte v = 0; v < (sizeof(HTML_TEMPLATE_VARIABLES) / sizeof(HTML_TEMPLATE_VARIABLES[0])); v++) {
+      if ((strlen(HTML_TEMPLATE_VARIABLES[v].name) == nameLength) && (strncmp(HTML_TEMPLATE_VARIABLES[v].name, name, nameLength) == 0)) {
+        variable = HTML_TEMPLATE_VARIABLES[v].variable;
+        break;
+      }
+    }
+
+    if (variable == HTML_TEMPLATE_STATIC) {
+      #ifdef SERIAL_DEBUG
+      Serial.print("Unhandled HTML template variable: '");
+      Serial.write((const uint8_t*)name, nameLength);
+      Serial.println("'");
+      #endif
+
+      // Leave the unknown token in the page. The closing "%" may be the start of the next token.
+      i = tokenEnd;
+      continue;
+    }
+
+    _addSegment(HTML_TEMPLATE_STATIC, staticStart, i - staticStart);
+    _addSegment(variable, 0, 0);
+    i = tokenEnd + 1;
+    staticStart = i;
+  }
+
+  _addSegment(HTML_TEMPLATE_STATIC, staticStart, length - staticStart);
+
+  if (_tooManySegments) {
+    #ifdef SERIAL_DEBUG
+    Serial.println("  ! HTML template has too many segments");
+    #endif
+    _segmentCount = 0;
+    return false;
+  }
+
+  return true;
+}
+
+
+/**
+ * Get a reference to the rendered page. The page is only re-rendered if one of the variables has changed.
+ *
+ * Only call this from one task (the web server's) as the cached render is swapped when re-rendered.
+ * Every render returned must be passed to releaseRender() once it has been sent.
+ *
+ * @return HTMLTemplateRender* the rendered page or NULL if the template couldn't be rendered
+ */
+const HTMLTemplateRender* HTMLTemplate::acquireRender() {
+  uint32_t version = _variablesVersion.load();
+  if (!_render || (_renderedVersion != version)) {
+    HTMLTemplateRender *render = _renderPage();
+    if (!render) {
+      return NULL;
+    }
+
+    // Responses still sending the old render keep it alive until they finish
+    if (_render) {
+      releaseRender(_render);
+    }
+    _render = render;
+    _renderedVersion = version;
+  }
+
+  _render->references.fetch_add(1);
+  return _render;
+}
+
+
+/**
+ * Release a reference returned by acquireRender(). The render is freed when the last reference is released.
+ */
+void HTMLTemplate::releaseRender(const HTMLTemplateRender *render) {
+  HTMLTemplateRender *releasing = const_cast<HTMLTemplateRender*>(render);
+  if (releasing->references.fetch_sub(1) == 1) {
+    releasing->~HTMLTemplateRender();
+    free(releasing);
+  }
+}
+
+
+/**
+ * Render the page with the current variable values
+ *
+ * @return HTMLTemplateRender* a new render holding a single reference (or NULL)
+ */
+HTMLTemplateRender* HTMLTemplate::_renderPage() {
+  if (!_source || (_segmentCount == 0)) {
+    return NULL;
+  }
+
+  // Resolve the variables once and work out how big the page will be
+  String values[HTML_TEMPLATE_MAX_SEGMENTS];
+  size_t length = 0;
+  for (byte i = 0; i < _segmentCount; i++) {
+    if (_segments[i].variable == HTML_TEMPLATE_STATIC) {
+      length += _segments[i].length;
+    } else {
+      values[i] = getVariableValue(_segments[i].variable);
+      length += values[i].length();
+    }
+  }
+
+  // The page follows the render in the same allocation
+  void *memory = malloc(sizeof(HTMLTemplateRender) + length + 1);
+  if (!memory) {
+    return NULL;
+  }
+  HTMLTemplateRender *render = new (memory) HTMLTemplateRender();
+  render->references.store(1);
+  render->length = length;
+  render->page = (char*)memory + sizeof(HTMLTemplateRender);
+
+  char *pos = render->page;
+  for (byte i = 0; i < _segmentCount; i++) {
+    if (_segments[i].variable == HTML_TEMPLATE_STATIC) {
+      memcpy(pos, _source + _segments[i].offset, _segments[i].length);
+      pos += _segments[i].length;
+    } else {
+      memcpy(pos, values[i].c_str(), values[i].length());
+      pos += values[i].length();
+    }
+  }
+  *pos = '\0';
+
+  // The ETag is a hash of the rendered page
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)render->page[i]) * 16777619UL;
+  }
+  snprintf(render->etag, sizeof(render->etag), "\"%08x\"", (unsigned int)hash);
+
+  return render;
+}
+
+
+/**
+ * Append a segment (adjacent static segments are merged)
+ */
+void HTMLTemplate::_addSegment(HTMLTemplateVariable variable, uint32_t offset, uint32_t length) {
+  if ((variable == HTML_TEMPLATE_STATIC) && (length == 0)) {
+    return;
+  }
+
+  if ((variable == HTML_TEMPLATE_STATIC) && (_segmentCount > 0)) {
+    Segment *last = &_segments[_segmentCount - 1];
+    if ((last->variable == HTML_TEMPLATE_STATIC) && (last->offset + last->length == offset)) {
+      last->length += length;
+      return;
+    }
+  }
+
+  if (_segmentCount >= HTML_TEMPLATE_MAX_SEGMENTS) {
+    _tooManySegments = true;
+    return;
+  }
+
+  _segments[_segmentCount].variable = variable;
+  _segments[_segmentCount].offset = offset;
+  _segments[_segmentCount].length = length;
+  _segmentCount += 1;
+}
@@ -0,0 +1,71 @@
+/*============================================================================*\
+ * Garage Bot - HTMLTemplate
+ * Peter Eldred 2021-08
+ *
+ * An HTML page containing `%VARIABLE%` tokens which is parsed once (at boot)
+ * into a list of static and variable segments. The rendered page is cached
+ * and only re-rendered after one of the variable values has changed, so a
+ * page request costs a single buffer send rather than a token scan and a
+ * String comparison per token.
+ *
+ * A render is never modified once published. Each response holds a reference
+ * to the render it is sending, so re-rendering just swaps in a new render and
+ * the old one is freed when the last response using it has finished.
+\*============================================================================*/
+
+#ifndef HTML_TEMPLATE_H
+#define HTML_TEMPLATE_H
+
+#include <atomic>
+#include "Arduino.h"
+#include "_config.h"
+
+// The variables that can be used in an HTML template
+enum HTMLTemplateVariable {
+  HTML_TEMPLATE_STATIC,                           // Not a variable. Static content copied from the source.
+  HTML_TEMPLATE_FIRMWARE_VERSION,
+  HTML_TEMPLATE_DEVICE_ADDRESS,
+  HTML_TEMPLATE_DEVICE_NAME,
+};
+
+// A rendered page. Immutable once published.
+struct HTMLTemplateRender {
+  std::atomic<uint32_t> references;               // The template's reference plus one per response in flight
+  size_t length;                                  // The length of the page
+  char etag[11];                                  // The quoted ETag of the page
+  char *page;                                     // The page (allocated along with the render)
+};
+
+class HTMLTemplate {
+  public:
+    HTMLTemplate();
+
+    bool compile(const char *source, size_t length, bool ownsSource);  // Parse the source into segments
+    const HTMLTemplateRender* acquireRender();    // Get a reference to the rendered page (re-rendering it if any of the variables have changed)
+
+    static void releaseRender(const HTMLTemplateRender *render);  // Release a reference returned by acquireRender()
+    static void invalidateAll();                  // Call whenever the value of a template variable changes
+
+  private:
+    struct Segment {
+      HTMLTemplateVariable variable;              // The variable to insert (or HTML_TEMPLATE_STATIC)
+      uint32_t offset;                            // The offset of the static content in the source
+      uint32_t length;                            // The length of the static content
+    };
+
+    const char *_source = NULL;                   // The template source
+    bool _ownsSource = false;                     // Whether the source was allocated for (and should be freed by) the template
+    Segment _segments[HTML_TEMPLATE_MAX_SEGMENTS];
+    byte _segmentCount = 0;
+    bool _tooManySegments = false;                // Set when the source has more segments than HTML_TEMPLATE_MAX_SEGMENTS
+
+    HTMLTemplateRender *_render = NULL;           // The cached render (holds one reference)
+    uint32_t _renderedVersion = 0;                // The variables version that the cached page was rendered with
+
+    static std::atomic<uint32_t> _variablesVersion;   // Incremented whenever the value of a template variable changes
+
+    HTMLTemplateRender* _renderPage();            // Render the page with the current variable values
+    void _addSegment(HTMLTemplateVariable variable, uint32_t offset, uint32_t length);
+};
+
+#endif
@@ -78,6 +78,7 @@ void IRSensor::run(unsigned long currentMillis) {
 
     // Take an active reading now that the emitter is active
     _activeReadings[_readingIndex] = analogRead(_pin_receiver);
+    sampleCount += 1;
     
     // Turn off the emitter
     digitalWrite(_pin_emitter, LOW);
@@ -108,6 +109,7 @@ void IRSensor::run(unsigned long currentMillis) {
 
       // State Change in the detection - fire the on change event
       if (oldDetected != detected) {
+        detectionChangeCount += 1;
         if (onChange) {
           onChange(detected);
         }
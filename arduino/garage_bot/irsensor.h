@@ -26,6 +26,9 @@ class IRSensor {
     int averageAmbientReading = 0;                              // The average ambient reading
     int averageActiveReading = 0;                               // The average reading with the IR emitter activated
 
+    uint32_t sampleCount = 0;                                   // The number of active readings taken since boot
+    uint32_t detectionChangeCount = 0;                          // The number of times the detection state has flipped since boot
+
     sensorDetectionStateChangedFunction onChange;
   private:
     String _name;                                               // The name of the Sensor (for debugging)
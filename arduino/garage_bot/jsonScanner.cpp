@@ -0,0 +1,362 @@
+/*============================================================================*\
+ * Garage Bot - jsonScanner
+ * Peter Eldred 2021-08
+ *
+ * A tiny, allocation free JSON scanner for pulling individual values out of
+ * small messages (socket messages, MQTT payloads, HTTP request bodies) in
+ * place. It does not validate anything, it simply locates the bytes of a
+ * value. Strings are only unescaped when they are copied out.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "jsonScanner.h"
+
+
+/**
+ * Skip any whitespace
+ *
+ * @return size_t the position of the next non-whitespace character (or len)
+ */
+static size_t skipWhitespace(const char *json, size_t len, size_t pos) {
+  while ((pos < len) && ((json[pos] == ' ') || (json[pos] == '\t') || (json[pos] == '\r') || (json[pos] == '\n'))) {
+    pos++;
+  }
+  return pos;
+}
+
+
+/**
+ * Find the end of a string which begins at pos (pos points at the opening quote)
+ *
+ * @return size_t the position of the closing quote (or len if unterminated)
+ */
+static size_t scanString(const char *json, size_t len, size_t pos) {
+  pos++;
+  while (pos < len) {
+    if (json[pos] == '\\') {
+      pos += 2;
+    } else if (json[pos] == '"') {
+      return pos;
+    } else {
+      pos++;
+    }
+  }
+  return len;
+}
+
+
+/**
+ * Scan the value that begins at pos and describe it in a JsonSpan
+ *
+ * @return size_t the position immediately after the value (or len if malformed)
+ */
+static size_t scanValue(const char *json, size_t len, size_t pos, JsonSpan &value) {
+  value.type = JSON_SPAN_NONE;
+
+  if (pos >= len) {
+    return len;
+  }
+
+  char c = json[pos];
+
+  // String
+  if (c == '"') {
+    size_t end = scanString(json, len, pos);
+    if (end >= len) {
+      return len;
+    }
+    value.ptr = json + pos + 1;
+    value.len = end - pos - 1;
+    value.type = JSON_SPAN_STRING;
+    return end + 1;
+  }
+
+  // Object or Array - walk forward counting the depth (ignoring brackets in strings)
+  if ((c == '{') || (c == '[')) {
+    size_t start = pos;
+    int depth = 0;
+    while (pos < len) {
+      char d = json[pos];
+      if (d == '"') {
+        pos = scanString(json, len, pos);
+      } else if ((d == '{') || (d == '[')) {
+        depth++;
+      } else if ((d == '}') || (d == ']')) {
+        depth--;
+        if (depth == 0) {
+          value.ptr = json + start;
+          value.len = pos - start + 1;
+          value.type = (c == '{') ? JSON_SPAN_OBJECT : JSON_SPAN_ARRAY;
+          return pos + 1;
+        }
+      }
+      pos++;
+    }
+    return len;
+  }
+
+  // Literal (number, true, false, null)
+  size_t start = pos;
+  while ((pos < len) && (json[pos] != ',') && (json[pos] != '}') && (json[pos] != ']') && (json[pos] != ' ') && (json[pos] != '\t') && (json[pos] != '\r') && (json[pos] != '\n')) {
+    pos++;
+  }
+  if (pos == start) {
+    return len;
+  }
+  value.ptr = json + start;
+  value.len = pos - start;
+  value.type = JSON_SPAN_LITERAL;
+  return pos;
+}
+
+
+/**
+ * Find the value of a top level key in a JSON object
+ *
+ * @param json the JSON object (does not need to be null terminated)
+ * @param len the length of the JSON object
+ * @param key the (null terminated) key to find
+ * @param value populated with the location of the value
+ * @return bool true if the key was found
+ */
+bool jsonFindValue(const char *json, size_t len, const char *key, JsonSpan &value) {
+  size_t keyLen = strlen(key);
+  size_t pos = skipWhitespace(json, len, 0);
+
+  if ((pos >= len) || (json[pos] != '{')) {
+    return false;
+  }
+  pos++;
+
+  while (pos < len) {
+    pos = skipWhitespace(json, len, pos);
+    if ((pos >= len) || (json[pos] != '"')) {
+      return false;
+    }
+
+    // Key
+    size_t keyEnd = scanString(json, len, pos);
+    if (keyEnd >= len) {
+      return false;
+    }
+    bool keyMatches = ((keyEnd - pos - 1) == keyLen) && (memcmp(json + pos + 1, key, keyLen) == 0);
+
+    // Separator
+    pos = skipWhitespace(json, len, keyEnd + 1);
+    if ((pos >= len) || (json[pos] != ':')) {
+      return false;
+    }
+
+    // Value
+    pos = scanValue(json, len, skipWhitespace(json, len, pos + 1), value);
+    if (value.type == JSON_SPAN_NONE) {
+      return false;
+    }
+    if (keyMatches) {
+      return true;
+    }
+
+    // On to the next member
+    pos = skipWhitespace(json, len, pos);
+    if ((pos >= len) || (json[pos] != ',')) {
+      break;
+    }
+    pos++;
+  }
+
+  value.type = JSON_SPAN_NONE;
+  return false;
+}
+
+
+/**
+ * Find the value of a top level key in a JSON object that is itself a JsonSpan
+ */
+bool jsonFindValue(const JsonSpan &object, const char *key, JsonSpan &value) {
+  if (object.type != JSON_SPAN_OBJECT) {
+    value.type = JSON_SPAN_NONE;
+    return false;
+  }
+  return jsonFindValue(object.ptr, object.len, key, value);
+}
+
+
+/**
+ * Compare a string span against a null terminated string
+ */
+bool jsonSpanEquals(const JsonSpan &value, const char *str) {
+  size_t strLen = strlen(str);
+  return (value.type == JSON_SPAN_STRING) && (value.len == strLen) && (memcmp(value.ptr, str, strLen) == 0);
+}
+
+
+/**
+ * Check whether a span is the literal `null`
+ */
+bool jsonSpanIsNull(const JsonSpan &value) {
+  return (value.type == JSON_SPAN_LITERAL) && (value.len == 4) && (memcmp(value.ptr, "null", 4) == 0);
+}
+
+
+/**
+ * Convert a literal span into an integer
+ *
+ * @return bool false if the span is not a valid integer
+ */
+bool jsonSpanToInt(const JsonSpan &value, long &result) {
+  if ((value.type != JSON_SPAN_LITERAL) || (value.len == 0)) {
+    return false;
+  }
+
+  size_t pos = 0;
+  bool negative = false;
+  if (value.ptr[0] == '-') {
+    negative = true;
+    pos++;
+  }
+  if (pos >= value.len) {
+    return false;
+  }
+
+  long number = 0;
+  for (; pos < value.len; pos++) {
+    char c = value.ptr[pos];
+    // Truncate any fractional part
+    if (c == '.') {
+      break;
+    }
+    if ((c < '0') || (c > '9') || (number > 99999999L)) {
+      return false;
+    }
+    number = (number * 10) + (c - '0');
+  }
+
+  result = negative ? -number : number;
+  return true;
+}
+
+
+/**
+ * Convert a literal span into a boolean
+ *
+ * @return bool false if the span is not `true` or `false`
+ */
+bool jsonSpanToBool(const JsonSpan &value, bool &result) {
+  if (value.type != JSON_SPAN_LITERAL) {
+    return false;
+  }
+  if ((value.len == 4) && (memcmp(value.ptr, "true", 4) == 0)) {
+    result = true;
+    return true;
+  }
+  if ((value.len == 5) && (memcmp(value.ptr, "false", 5) == 0)) {
+    result = false;
+    return true;
+  }
+  return false;
+}
+
+
+/**
+ * Read the four hex digits of a \u escape
+ *
+ * @return bool false if they aren't all hex digits
+ */
+static bool readHex4(const char *hex, uint32_t &result) {
+  result = 0;
+  for (byte i = 0; i < 4; i++) {
+    char c = hex[i];
+    result <<= 4;
+    if ((c >= '0') && (c <= '9')) {
+      result |= c - '0';
+    } else if ((c >= 'a') && (c <= 'f')) {
+      result |= c - 'a' + 10;
+    } else if ((c >= 'A') && (c <= 'F')) {
+      result |= c - 'A' + 10;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+/**
+ * Copy a string span into a String, unescaping it along the way
+ *
+ * \u escapes are written out as UTF-8 (surrogate pairs included).
+ *
+ * @return bool false if the span is not a string or holds a malformed escape
+ */
+bool jsonSpanToString(const JsonSpan &value, String &result) {
+  if (value.type != JSON_SPAN_STRING) {
+    return false;
+  }
+
+  result = "";
+  result.reserve(value.len);
+
+  for (size_t pos = 0; pos < value.len; pos++) {
+    char c = value.ptr[pos];
+    if (c != '\\') {
+      result += c;
+      continue;
+    }
+
+    pos++;
+    if (pos >= value.len) {
+      return false;
+    }
+    switch (value.ptr[pos]) {
+      case '"': result += '"'; break;
+      case '\\': result += '\\'; break;
+      case '/': result += '/'; break;
+      case 'b': result += '\b'; break;
+      case 'f': result += '\f'; break;
+      case 'n': result += '\n'; break;
+      case 'r': result += '\r'; break;
+      case 't': result += '\t'; break;
+      case 'u': {
+        uint32_t codePoint;
+        if (((pos + 4) >= value.len) || !readHex4(value.ptr + pos + 1, codePoint)) {
+          return false;
+        }
+        pos += 4;
+
+        // A high surrogate must be followed by an escaped low surrogate
+        if ((codePoint >= 0xD800) && (codePoint <= 0xDBFF)) {
+          uint32_t low;
+          if (((pos + 6) >= value.len) || (value.ptr[pos + 1] != '\\') || (value.ptr[pos + 2] != 'u') ||
+            !readHex4(value.ptr + pos + 3, low) || (low < 0xDC00) || (low > 0xDFFF)) {
+            return false;
+          }
+          pos += 6;
+          codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+        } else if ((codePoint >= 0xDC00) && (codePoint <= 0xDFFF)) {
+          return false;
+        }
+
+        if (codePoint < 0x80) {
+          result += (char)codePoint;
+        } else if (codePoint < 0x800) {
+          result += (char)(0xC0 | (codePoint >> 6));
+          result += (char)(0x80 | (codePoint & 0x3F));
+        } else if (codePoint < 0x10000) {
+          result += (char)(0xE0 | (codePoint >> 12));
+          result += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+          result += (char)(0x80 | (codePoint & 0x3F));
+        } else {
+          result += (char)(0xF0 | (codePoint >> 18));
+          result += (char)(0x80 | ((codePoint >> 12) & 0x3F));
+          result += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+          result += (char)(0x80 | (codePoint & 0x3F));
+        }
+        break;
+      }
+      default:
+        return false;
+    }
+  }
+
+  return true;
+}
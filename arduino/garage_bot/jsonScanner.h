@@ -0,0 +1,79 @@
+/*============================================================================*\
+ * Garage Bot - jsonScanner
+ * Peter Eldred 2021-08
+ *
+ * A tiny, allocation free JSON scanner for pulling individual values out of
+ * small messages (socket messages, MQTT payloads, HTTP request bodies) in
+ * place. It does not validate anything, it simply locates the bytes of a
+ * value. Strings are only unescaped when they are copied out.
+\*============================================================================*/
+
+#ifndef JSONSCANNER_H
+#define JSONSCANNER_H
+
+#include "Arduino.h"
+
+// The kind of value a JsonSpan refers to
+enum JsonSpanType {
+  JSON_SPAN_NONE,       // Not found / invalid
+  JSON_SPAN_STRING,     // A string (the span excludes the quotes)
+  JSON_SPAN_OBJECT,     // An object (the span includes the braces)
+  JSON_SPAN_ARRAY,      // An array (the span includes the brackets)
+  JSON_SPAN_LITERAL,    // A number, true, false or null
+};
+
+// A reference to a value inside a larger JSON buffer
+struct JsonSpan {
+  const char *ptr = NULL;
+  size_t len = 0;
+  JsonSpanType type = JSON_SPAN_NONE;
+};
+
+/**
+ * Find the value of a top level key in a JSON object
+ *
+ * @param json the JSON object (does not need to be null terminated)
+ * @param len the length of the JSON object
+ * @param key the (null terminated) key to find
+ * @param value populated with the location of the value
+ * @return bool true if the key was found
+ */
+bool jsonFindValue(const char *json, size_t len, const char *key, JsonSpan &value);
+
+/**
+ * Find the value of a top level key in a JSON object that is itself a JsonSpan
+ */
+bool jsonFindValue(const JsonSpan &object, const char *key, JsonSpan &value);
+
+/**
+ * Compare a string span against a null terminated string
+ */
+bool jsonSpanEquals(const JsonSpan &value, const char *str);
+
+/**
+ * Check whether a span is the literal `null`
+ */
+bool jsonSpanIsNull(const JsonSpan &value);
+
+/**
+ * Convert a literal span into an integer
+ *
+ * @return bool false if the span is not a valid integer
+ */
+bool jsonSpanToInt(const JsonSpan &value, long &result);
+
+/**
+ * Convert a literal span into a boolean
+ *
+ * @return bool false if the span is not `true` or `false`
+ */
+bool jsonSpanToBool(const JsonSpan &value, bool &result);
+
+/**
+ * Copy a string span into a String, unescaping it along the way
+ *
+ * @return bool false if the span is not a string or holds a malformed escape
+ */
+bool jsonSpanToString(const JsonSpan &value, String &result);
+
+#endif
@@ -0,0 +1,111 @@
+/*============================================================================*\
+ * Garage Bot - lanAnnouncer
+ * Peter Eldred 2021-08
+ *
+ * Announces the state of the door and the IR sensors to the local network with
+ * a small UDP multicast datagram whenever it changes (and as a heartbeat), so
+ * local controllers can be notified without a broker or an open socket.
+ *
+ * Each datagram carries the full state, so a listener never needs anything
+ * but the latest one. UDP isn't reliable so the heartbeat also acts as the
+ * retry for a lost announcement. The datagram (multi-byte values are big
+ * endian):
+ *
+ *   0-1   "GB"
+ *   2     version (LAN_ANNOUNCE_VERSION)
+ *   3     LANAnnouncementType
+ *   4-7   sequence number (incremented for every datagram, restarts at 1 on boot)
+ *   8     DoorState
+ *   9     SensorDetectionState of the top sensor
+ *   10    SensorDetectionState of the bottom sensor
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "_config.h"
+#include "lanAnnouncer.h"
+#include "doorControl.h"
+#include "wifiEngine.h"
+
+
+/**
+ * Constructor
+ */
+LANAnnouncer::LANAnnouncer() {}
+
+
+/**
+ * Initialise
+ */
+void LANAnnouncer::init(IRSensor *topIRSensor, IRSensor *bottomIRSensor) {
+  _topIRSensor = topIRSensor;
+  _bottomIRSensor = bottomIRSensor;
+}
+
+
+/**
+ * Join the multicast group when the WiFi connects and send the heartbeat
+ *
+ * @param currentMillis the current milliseconds as passed down from the main loop
+ */
+void LANAnnouncer::run(unsigned long currentMillis) {
+  if (!wifiEngine.connected) {
+    if (_joined) {
+      _udp.close();
+      _joined = false;
+    }
+    return;
+  }
+
+  // The group has to be (re)joined on each WiFi connection
+  if (!_joined) {
+    _joined = _udp.listenMulticast(IPAddress(LAN_ANNOUNCE_MULTICAST_ADDRESS), LAN_ANNOUNCE_PORT, LAN_ANNOUNCE_TTL);
+    if (_joined) {
+      _send(LAN_ANNOUNCEMENT_STATE_CHANGE, currentMillis);
+    }
+    return;
+  }
+
+  if ((currentMillis - _lastSent) >= LAN_ANNOUNCE_HEARTBEAT_INTERVAL) {
+    _send(LAN_ANNOUNCEMENT_HEARTBEAT, currentMillis);
+  }
+}
+
+
+/**
+ * Announce a change in the door or sensor state
+ */
+void LANAnnouncer::announce() {
+  if (_joined) {
+    _send(LAN_ANNOUNCEMENT_STATE_CHANGE, millis());
+  }
+}
+
+
+/**
+ * Send a datagram with the current state
+ */
+void LANAnnouncer::_send(LANAnnouncementType type, unsigned long currentMillis) {
+  _sequence += 1;
+
+  uint8_t datagram[LAN_ANNOUNCE_DATAGRAM_SIZE];
+  datagram[0] = 'G';
+  datagram[1] = 'B';
+  datagram[2] = LAN_ANNOUNCE_VERSION;
+  datagram[3] = type;
+  datagram[4] = _sequence >> 24;
+  datagram[5] = _sequence >> 16;
+  datagram[6] = _sequence >> 8;
+  datagram[7] = _sequence;
+  datagram[8] = doorControl.getDoorState();
+  datagram[9] = _topIRSensor->detected;
+  datagram[10] = _bottomIRSensor->detected;
+
+  // Whether or not it made it out, don't try again until the next heartbeat
+  _lastSent = currentMillis;
+
+  if (_udp.writeTo(datagram, sizeof(datagram), IPAddress(LAN_ANNOUNCE_MULTICAST_ADDRESS), LAN_ANNOUNCE_PORT) == sizeof(datagram)) {
+    sentCount += 1;
+  } else {
+    failedCount += 1;
+  }
+}
@@ -0,0 +1,50 @@
+/*============================================================================*\
+ * Garage Bot - lanAnnouncer
+ * Peter Eldred 2021-08
+ *
+ * Announces the state of the door and the IR sensors to the local network with
+ * a small UDP multicast datagram whenever it changes (and as a heartbeat), so
+ * local controllers can be notified without a broker or an open socket.
+\*============================================================================*/
+
+#ifndef LANANNOUNCER_H
+#define LANANNOUNCER_H
+
+#include "Arduino.h"
+#include "AsyncUDP.h"
+#include "_config.h"
+#include "helpers.h"
+#include "irsensor.h"
+
+// Why a datagram was sent (byte 3 of the datagram)
+enum LANAnnouncementType {
+  LAN_ANNOUNCEMENT_STATE_CHANGE = 1,            // The door or sensor state changed
+  LAN_ANNOUNCEMENT_HEARTBEAT    = 2,            // Nothing has changed for LAN_ANNOUNCE_HEARTBEAT_INTERVAL
+};
+
+class LANAnnouncer {
+  public:
+    LANAnnouncer();
+
+    void init(IRSensor *topIRSensor, IRSensor *bottomIRSensor);
+    void run(unsigned long currentMillis);        // Join the multicast group when the WiFi connects and send the heartbeat
+    void announce();                              // Announce a change in the door or sensor state
+
+    uint32_t sentCount = 0;                       // The number of datagrams sent since boot
+    uint32_t failedCount = 0;                     // The number of datagrams that couldn't be sent since boot
+
+  private:
+    IRSensor *_topIRSensor;                       // A pointer to the top IR sensor passed into the init function
+    IRSensor *_bottomIRSensor;                    // A pointer to the bottom IR sensor passed into the init function
+
+    AsyncUDP _udp;
+    bool _joined = false;                         // Whether the multicast group has been joined on the current WiFi connection
+    uint32_t _sequence = 0;                       // The sequence number of the last datagram sent
+    unsigned long _lastSent = 0;                  // the millis() that the last datagram was sent
+
+    void _send(LANAnnouncementType type, unsigned long currentMillis);  // Send a datagram with the current state
+};
+
+extern LANAnnouncer lanAnnouncer;
+
+#endif
@@ -0,0 +1,256 @@
+/*============================================================================*\
+ * Garage Bot - Metrics
+ * Peter Eldred 2021-08
+ *
+ * Collects the device's runtime metrics and renders them for the /metrics
+ * endpoint in the Prometheus text exposition format.
+ *
+ * The counters live on the components that update them (ie. the RF receiver
+ * counts the codes it receives) and are only read here when scraped. A scrape
+ * renders into a fixed buffer so no memory is allocated to build the response.
+\*============================================================================*/
+
+#include <stdarg.h>
+#include "Arduino.h"
+#include "WiFi.h"
+#include "esp_timer.h"
+#include "ESPAsyncWebServer.h"
+#include "_config.h"
+#include "metrics.h"
+#include "irsensor.h"
+#include "commandQueue.h"
+#include "wifiEngine.h"
+#include "mqttClient.h"
+#include "rfReceiver.h"
+#include "lanAnnouncer.h"
+#include "udpCommandServer.h"
+#include "serviceAdvertiser.h"
+
+// The label values of each of the MetricsComponents
+static const char *METRICS_COMPONENT_NAMES[METRICS_COMPONENT_COUNT] = {
+  "command_queue",
+  "top_ir_sensor",
+  "bottom_ir_sensor",
+  "led_timer",
+  "panel_button",
+  "rf_receiver",
+  "remote_repeater",
+  "door_control",
+  "ota_update_manager",
+  "wifi_engine",
+  "lan_announcer",
+  "udp_command_server",
+  "mqtt_client",
+};
+
+
+/**
+ * Constructor
+ */
+Metrics::Metrics() {
+  _scrapeInProgress.store(false);
+  for (byte i = 0; i < METRICS_COMPONENT_COUNT; i++) {
+    _runMicrosTotal[i] = 0;
+    _runMicrosMax[i] = 0;
+  }
+}
+
+
+/**
+ * Initialise
+ */
+void Metrics::init(IRSensor *topIRSensor, IRSensor *bottomIRSensor) {
+  _topIRSensor = topIRSensor;
+  _bottomIRSensor = bottomIRSensor;
+}
+
+
+/**
+ * Call once per main loop iteration to track the loop rate
+ */
+void Metrics::countLoop(unsigned long currentMillis) {
+  _loopCount += 1;
+  if ((currentMillis - _loopCountStarted) >= 1000) {
+    loopsPerSecond = _loopCount;
+    _loopCount = 0;
+    _loopCountStarted = currentMillis;
+  }
+}
+
+
+/**
+ * Record the time a component's run() took
+ *
+ * @param component the component that was run
+ * @param startMicros the micros() before the component was run
+ * @return unsigned long the current micros() (to pass as the startMicros of the next component)
+ */
+unsigned long Metrics::recordRunTime(MetricsComponent component, unsigned long startMicros) {
+  unsigned long now = micros();
+  uint32_t elapsed = now - startMicros;
+  _runMicrosTotal[component] += elapsed;
+  if (elapsed > _runMicrosMax[component]) {
+    _runMicrosMax[component] = elapsed;
+  }
+  return now;
+}
+
+
+/**
+ * Respond to a /metrics request
+ *
+ * The response is sent straight out of the render buffer, so only one scrape can be in flight at a time.
+ */
+void Metrics::handleScrape(AsyncWebServerRequest *request) {
+  bool expected = false;
+  if (!_scrapeInProgress.compare_exchange_strong(expected, true)) {
+    AsyncWebServerResponse *response = request->beginResponse(503, "text/plain", "Scrape in progress");
+    response->addHeader("Retry-After", "1");
+    request->send(response);
+    return;
+  }
+
+  // Release the buffer once the response has been sent (or the client has gone away)
+  request->onDisconnect([](){
+    metrics._scrapeInProgress.store(false);
+  });
+
+  _render();
+
+  AsyncWebServerResponse *response = request->beginResponse_P(200, "text/plain; version=0.0.4", (const uint8_t*)_buffer, _length);
+  response->addHeader("Cache-Control", "no-store");
+  request->send(response);
+}
+
+
+/**
+ * Render all of the metrics into the buffer
+ */
+void Metrics::_render() {
+  _length = 0;
+  _buffer[0] = '\0';
+
+  // System
+  _appendMetric("garagebot_uptime_seconds", "counter", "Seconds since boot.", esp_timer_get_time() / 1000000.0);
+  _appendMetric("garagebot_heap_free_bytes", "gauge", "Free heap.", ESP.getFreeHeap());
+  _appendMetric("garagebot_heap_min_free_bytes", "gauge", "Lowest free heap since boot.", ESP.getMinFreeHeap());
+  _appendMetric("garagebot_heap_largest_free_block_bytes", "gauge", "Largest block that can be allocated.", ESP.getMaxAllocHeap());
+  _appendMetric("garagebot_loop_iterations_per_second", "gauge", "Main loop iterations in the last second.", loopsPerSecond);
+
+  // Component run() times
+  _append("# HELP garagebot_component_run_seconds_total Time spent in each component's run().\n# TYPE garagebot_component_run_seconds_total counter\n");
+  for (byte i = 0; i < METRICS_COMPONENT_COUNT; i++) {
+    _append("garagebot_component_run_seconds_total{component=\"%s\"} %.6f\n", METRICS_COMPONENT_NAMES[i], _runMicrosTotal[i] / 1000000.0);
+  }
+  _append("# HELP garagebot_component_run_max_seconds Longest single run() of each component since boot.\n# TYPE garagebot_component_run_max_seconds gauge\n");
+  for (byte i = 0; i < METRICS_COMPONENT_COUNT; i++) {
+    _append("garagebot_component_run_max_seconds{component=\"%s\"} %.6f\n", METRICS_COMPONENT_NAMES[i], _runMicrosMax[i] / 1000000.0);
+  }
+
+  // Command queue
+  _appendMetric("garagebot_commands_executed_total", "counter", "Commands executed by the main loop.", commandQueue.executedCount);
+  _appendMetric("garagebot_commands_dropped_total", "counter", "Commands dropped because the queue was full.", commandQueue.droppedCount.load());
+  _appendMetric("garagebot_command_latency_max_seconds", "gauge", "Longest time between a command being received and executed.", commandQueue.maxLatencyMicros / 1000000.0);
+
+  // WiFi
+  _appendMetric("garagebot_wifi_connected", "gauge", "Whether the WiFi client is connected.", wifiEngine.connected ? 1 : 0);
+  _appendMetric("garagebot_wifi_rssi_dbm", "gauge", "WiFi signal strength.", wifiEngine.connected ? WiFi.RSSI() : 0);
+  _appendMetric("garagebot_wifi_connects_total", "counter", "Successful WiFi connections.", wifiEngine.connectCount);
+  _appendMetric("garagebot_wifi_fast_connects_total", "counter", "Successful WiFi connections using the cached access point.", wifiEngine.fastConnectCount);
+  _appendMetric("garagebot_wifi_last_connect_seconds", "gauge", "Duration of the most recent WiFi connection.", wifiEngine.lastConnectDuration / 1000.0);
+  _appendMetric("garagebot_wifi_roams_total", "counter", "Moves to a stronger access point.", wifiEngine.roamCount);
+
+  // Web sockets
+  _appendMetric("garagebot_websocket_clients", "gauge", "Connected web socket clients.", wifiEngine.getSocketClientCount());
+  _appendMetric("garagebot_event_source_clients", "gauge", "Connected server-sent event (/events) clients.", wifiEngine.getEventSourceClientCount());
+  _append("# HELP garagebot_websocket_send_queue_messages Messages waiting to be sent to each web socket client.\n# TYPE garagebot_websocket_send_queue_messages gauge\n");
+  for (byte i = 0; i < MAX_SOCKET_CONNECTIONS; i++) {
+    uint32_t clientId;
+    size_t queueLength = wifiEngine.getSocketClientQueueLength(i, clientId);
+    if (clientId != 0) {
+      _append("garagebot_websocket_send_queue_messages{client=\"%u\"} %u\n", (unsigned int)clientId, (unsigned int)queueLength);
+    }
+  }
+
+  _append("# HELP garagebot_websocket_rtt_seconds Most recent ping round trip time of each web socket client.\n# TYPE garagebot_websocket_rtt_seconds gauge\n");
+  for (byte i = 0; i < MAX_SOCKET_CONNECTIONS; i++) {
+    uint32_t clientId;
+    uint32_t rtt = wifiEngine.getSocketClientRTT(i, clientId);
+    if ((clientId != 0) && (rtt != 0)) {
+      _append("garagebot_websocket_rtt_seconds{client=\"%u\"} %.6f\n", (unsigned int)clientId, rtt / 1000000.0);
+    }
+  }
+
+  // MQTT
+  _appendMetric("garagebot_mqtt_publishes_total", "counter", "MQTT messages published.", mqttClient.publishCount);
+  _appendMetric("garagebot_mqtt_publish_failures_total", "counter", "MQTT messages that failed to publish.", mqttClient.publishFailures);
+  _appendMetric("garagebot_mqtt_reconnects_total", "counter", "Attempts to reconnect to the MQTT broker.", mqttClient.reconnectCount);
+  _appendMetric("garagebot_mqtt_outbox_messages", "gauge", "MQTT messages waiting to be acknowledged by the broker.", mqttClient.outbox.depth());
+  _appendMetric("garagebot_mqtt_outbox_dropped_total", "counter", "MQTT messages dropped because the outbox was full.", mqttClient.outbox.droppedCount);
+  _appendMetric("garagebot_mqtt_outbox_replaced_total", "counter", "MQTT messages replaced by a newer message on the same topic before being delivered.", mqttClient.outbox.replacedCount);
+  _appendMetric("garagebot_mqtt_retransmits_total", "counter", "MQTT messages sent again because the broker didn't acknowledge them in time.", mqttClient.outbox.retransmitCount);
+  _append("# HELP garagebot_mqtt_delivery_latency_seconds Time between a message being queued and the broker acknowledging it.\n# TYPE garagebot_mqtt_delivery_latency_seconds summary\n");
+  _append("garagebot_mqtt_delivery_latency_seconds_sum %.3f\n", mqttClient.outbox.deliveryMillisTotal / 1000.0);
+  _append("garagebot_mqtt_delivery_latency_seconds_count %u\n", (unsigned int)mqttClient.outbox.deliveredCount);
+  _append("# HELP garagebot_mqtt_tls_handshakes_total Completed MQTT TLS handshakes.\n# TYPE garagebot_mqtt_tls_handshakes_total counter\n");
+  _append("garagebot_mqtt_tls_handshakes_total{type=\"full\"} %u\n", (unsigned int)mqttClient.tls.fullHandshakeCount);
+  _append("garagebot_mqtt_tls_handshakes_total{type=\"resumed\"} %u\n", (unsigned int)mqttClient.tls.resumedHandshakeCount);
+  _append("# HELP garagebot_mqtt_tls_handshake_seconds_total Time spent in completed MQTT TLS handshakes.\n# TYPE garagebot_mqtt_tls_handshake_seconds_total counter\n");
+  _append("garagebot_mqtt_tls_handshake_seconds_total{type=\"full\"} %.6f\n", mqttClient.tls.fullHandshakeMicrosTotal / 1000000.0);
+  _append("garagebot_mqtt_tls_handshake_seconds_total{type=\"resumed\"} %.6f\n", mqttClient.tls.resumedHandshakeMicrosTotal / 1000000.0);
+  _appendMetric("garagebot_mqtt_tls_last_handshake_seconds", "gauge", "Duration of the most recent MQTT TLS handshake.", mqttClient.tls.lastHandshakeMicros / 1000000.0);
+  _appendMetric("garagebot_mqtt_delivery_latency_max_seconds", "gauge", "Longest time between a message being queued and the broker acknowledging it.", mqttClient.outbox.deliveryMillisMax / 1000.0);
+
+  // LAN announcements
+  _appendMetric("garagebot_lan_announcements_total", "counter", "State announcements multicast to the local network.", lanAnnouncer.sentCount);
+  _appendMetric("garagebot_lan_announcement_failures_total", "counter", "State announcements that couldn't be sent.", lanAnnouncer.failedCount);
+
+  // UDP commands
+  _append("# HELP garagebot_udp_command_requests_total UDP command requests received.\n# TYPE garagebot_udp_command_requests_total counter\n");
+  _append("garagebot_udp_command_requests_total{result=\"accepted\"} %u\n", (unsigned int)udpCommandServer.acceptedCount);
+  _append("garagebot_udp_command_requests_total{result=\"rejected\"} %u\n", (unsigned int)udpCommandServer.rejectedCount);
+  _append("garagebot_udp_command_requests_total{result=\"unauthenticated\"} %u\n", (unsigned int)udpCommandServer.unauthenticatedCount);
+
+  // mDNS
+  _appendMetric("garagebot_mdns_txt_updates_total", "counter", "mDNS TXT record changes published.", serviceAdvertiser.txtUpdateCount);
+
+  // RF receiver
+  _appendMetric("garagebot_rf_codes_received_total", "counter", "RF codes received.", rfReceiver.codesReceived);
+  _appendMetric("garagebot_rf_codes_matched_total", "counter", "RF codes received from a registered remote.", rfReceiver.codesMatched);
+  _appendMetric("garagebot_rf_codes_unmatched_total", "counter", "RF codes received from an unregistered remote.", rfReceiver.codesUnmatched);
+
+  // IR sensors
+  _append("# HELP garagebot_ir_samples_total IR sensor readings taken.\n# TYPE garagebot_ir_samples_total counter\n");
+  _append("garagebot_ir_samples_total{sensor=\"top\"} %u\n", (unsigned int)_topIRSensor->sampleCount);
+  _append("garagebot_ir_samples_total{sensor=\"bottom\"} %u\n", (unsigned int)_bottomIRSensor->sampleCount);
+  _append("# HELP garagebot_ir_detection_changes_total IR sensor detection state changes.\n# TYPE garagebot_ir_detection_changes_total counter\n");
+  _append("garagebot_ir_detection_changes_total{sensor=\"top\"} %u\n", (unsigned int)_topIRSensor->detectionChangeCount);
+  _append("garagebot_ir_detection_changes_total{sensor=\"bottom\"} %u\n", (unsigned int)_bottomIRSensor->detectionChangeCount);
+}
+
+
+/**
+ * Append to the buffer (silently truncating if the buffer is full)
+ */
+void Metrics::_append(const char *format, ...) {
+  if (_length >= (METRICS_BUFFER_SIZE - 1)) {
+    return;
+  }
+
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(_buffer + _length, METRICS_BUFFER_SIZE - _length, format, args);
+  va_end(args);
+
+  if (written > 0) {
+    _length = min(_length + written, (size_t)(METRICS_BUFFER_SIZE - 1));
+  }
+}
+
+
+/**
+ * Append a single (unlabelled) metric with its HELP and TYPE lines
+ */
+void Metrics::_appendMetric(const char *name, const char *type, const char *help, double value) {
+  _append("# HELP %s %s\n# TYPE %s %s\n%s %.10g\n", name, help, name, type, name, value);
+}
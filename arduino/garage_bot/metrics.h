@@ -0,0 +1,74 @@
+/*============================================================================*\
+ * Garage Bot - Metrics
+ * Peter Eldred 2021-08
+ *
+ * Collects the device's runtime metrics and renders them for the /metrics
+ * endpoint in the Prometheus text exposition format.
+ *
+ * The counters live on the components that update them (ie. the RF receiver
+ * counts the codes it receives) and are only read here when scraped. A scrape
+ * renders into a fixed buffer so no memory is allocated to build the response.
+\*============================================================================*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include "Arduino.h"
+#include "ESPAsyncWebServer.h"
+#include "_config.h"
+#include "irsensor.h"
+
+// The components whose run() time is measured by the main loop
+enum MetricsComponent {
+  METRICS_COMPONENT_COMMAND_QUEUE,
+  METRICS_COMPONENT_TOP_IR_SENSOR,
+  METRICS_COMPONENT_BOTTOM_IR_SENSOR,
+  METRICS_COMPONENT_LED_TIMER,
+  METRICS_COMPONENT_PANEL_BUTTON,
+  METRICS_COMPONENT_RF_RECEIVER,
+  METRICS_COMPONENT_REMOTE_REPEATER,
+  METRICS_COMPONENT_DOOR_CONTROL,
+  METRICS_COMPONENT_OTA_UPDATE_MANAGER,
+  METRICS_COMPONENT_WIFI_ENGINE,
+  METRICS_COMPONENT_LAN_ANNOUNCER,
+  METRICS_COMPONENT_UDP_COMMAND_SERVER,
+  METRICS_COMPONENT_MQTT_CLIENT,
+  METRICS_COMPONENT_COUNT
+};
+
+class Metrics {
+  public:
+    Metrics();
+
+    void init(IRSensor *topIRSensor, IRSensor *bottomIRSensor);
+
+    void countLoop(unsigned long currentMillis);  // Call once per main loop iteration
+    unsigned long recordRunTime(MetricsComponent component, unsigned long startMicros);  // Record the time a component's run() took. Returns micros() so calls can be chained.
+
+    void handleScrape(AsyncWebServerRequest *request);  // Respond to a /metrics request
+
+    uint32_t loopsPerSecond = 0;                  // The number of main loop iterations in the last full second
+
+  private:
+    IRSensor *_topIRSensor;                       // A pointer to the top IR sensor passed into the init function
+    IRSensor *_bottomIRSensor;                    // A pointer to the bottom IR sensor passed into the init function
+
+    uint32_t _loopCount = 0;                      // The number of main loop iterations in the current second
+    unsigned long _loopCountStarted = 0;          // the millis() that the current second started
+
+    uint64_t _runMicrosTotal[METRICS_COMPONENT_COUNT];  // The total time spent in each component's run() since boot (a scrape may catch one mid-update)
+    uint32_t _runMicrosMax[METRICS_COMPONENT_COUNT];    // The longest single run() of each component since boot
+
+    char _buffer[METRICS_BUFFER_SIZE];            // The rendered metrics
+    size_t _length = 0;                           // The length of the rendered metrics
+    std::atomic<bool> _scrapeInProgress;          // Set while a response is being sent from the buffer
+
+    void _render();                               // Render the metrics into the buffer
+    void _append(const char *format, ...);        // Append to the buffer
+    void _appendMetric(const char *name, const char *type, const char *help, double value);  // Append a single (unlabelled) metric
+};
+
+extern Metrics metrics;
+
+#endif
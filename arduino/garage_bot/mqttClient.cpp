@@ -4,42 +4,75 @@
  * 
  * This class is designed to connect to a MQTT broker and issue commands or
  * subscribe to topics 
+ *
+ * The client never blocks the main loop. The TCP connection is made by AsyncTCP
+ * and the packets from the broker are decoded on the AsyncTCP task, which moves
+ * the connection state along. Everything that is sent to the broker (and every
+ * state change notification) happens in run() on the main loop.
+ *
+ * State changes are published through the outbox (see mqttOutbox) with QoS 1
+ * so that they reach the broker once it is reachable again.
+ *
+ * The state topics are retained and the availability topic is set as the Last
+ * Will and Testament, so anything which subscribes (ie. Home Assistant) gets
+ * the full picture straight away. The Home Assistant discovery configs for the
+ * door (a cover) and the two IR sensors (binary sensors) are published in one
+ * batch each time the connection comes up.
+ *
+ * The raw IR sensor readings and the device health are also published (to
+ * telemetry topics) so that the broker can keep a history of them. They are
+ * only published when they change noticeably and never more often than
+ * MQTT_TELEMETRY_MIN_INTERVAL.
+ *
+ * When TLS is enabled the connection runs through the TLS layer (see mqttTLS)
+ * and the data received from the broker is decrypted and handled on the main
+ * loop instead of the AsyncTCP task.
+ *
+ * Commands are received on the command topic (door commands) and a few topics
+ * beneath it (thresholds, reboot, registering a remote). Each is routed to its
+ * handler by the topic router and handed off to the main loop.
 \*============================================================================*/
 
 #include "_config.h"
 #include "mqttClient.h"
+#include "mqttPacket.h"
 #include "wifiEngine.h"
 #include "doorControl.h"
-
-
-/**
- * This gets around the "error: invalid use of non-static member function" that I'm
- * not smart enough to circumvent yet.
- */
-void staticHandleMessageReceived(char* topic, byte* data, unsigned int len) {
-  mqttClient.handleMessageReceived(topic, data, len);
-}
+#include "commandQueue.h"
+#include "jsonScanner.h"
+#include "helpers.h"
+#include "ArduinoJson.h"
+#include "WiFi.h"
+#include "esp_timer.h"
+#include "metrics.h"
+#include "botFS.h"
 
 
 /**
  * Constructor
  */
-MQTTClient::MQTTClient(){}
+MQTTClient::MQTTClient(){
+  _connectionState.store(MQTT_CONNECTION_DISCONNECTED);
+  _connectReturnCode.store(0);
+  _lastPacketReceived.store(0);
+}
 
 
 /**
  * Initialise
  * @note: this will only be called if MQTT is enabled
  */
-void MQTTClient::init(PubSubClient *pubSubClient) {
+void MQTTClient::init(IRSensor *topIRSensor, IRSensor *bottomIRSensor) {
   #ifdef SERIAL_DEBUG
   Serial.println("Initialising MQTT Client...");
   #endif
 
   // Keep a pointer to some of the important global objects
-  _pubSubClient = pubSubClient;
+  _topIRSensor = topIRSensor;
+  _bottomIRSensor = bottomIRSensor;
 
   setMQTTState(MQTT_STATE_DISCONNECTED, "");
+  outbox.init();
 
   // Check each of the configuration requirements
   if (config.mqtt_broker_address.equals("")) {
@@ -52,14 +85,53 @@ void MQTTClient::init(PubSubClient *pubSubClient) {
     setMQTTState(MQTT_STATE_CONFIG_ERROR, "No MQTT Command Topic configured.");
   } else if (config.mqtt_state_topic.equals("")) {
     setMQTTState(MQTT_STATE_CONFIG_ERROR, "No MQTT State Topic configured.");
+  } else if (config.mqtt_tls_enabled && !tls.init(botFS.loadMQTTCACert(), config.mqtt_broker_address.c_str())) {
+    setMQTTState(MQTT_STATE_CONFIG_ERROR, String("Invalid MQTT CA certificate (" MQTT_TLS_CA_CERT_FILE "): ") + tls.getError());
   } else {
     // Calculate the unique device ID by concatenating the last four digits from the mac address with the garage bot prefix
     deviceId = config.mqtt_device_id + "_" + wifiEngine.macAddress.substring(wifiEngine.macAddress.length() - 5, wifiEngine.macAddress.length() - 3) + wifiEngine.macAddress.substring(wifiEngine.macAddress.length() - 2);
 
-    // Connect to the MQTT broker  
-    _pubSubClient->setServer(config.mqtt_broker_address.c_str(), config.mqtt_broker_port);
-    _pubSubClient->setCallback(staticHandleMessageReceived);  
-    connectToBroker();
+    _availabilityTopic = config.mqtt_state_topic + MQTT_AVAILABILITY_TOPIC_SUFFIX;
+    _topSensorTopic = config.mqtt_state_topic + MQTT_TOP_SENSOR_TOPIC_SUFFIX;
+    _bottomSensorTopic = config.mqtt_state_topic + MQTT_BOTTOM_SENSOR_TOPIC_SUFFIX;
+    _sensorTelemetryTopics[0] = config.mqtt_state_topic + MQTT_TELEMETRY_TOP_SENSOR_TOPIC_SUFFIX;
+    _sensorTelemetryTopics[1] = config.mqtt_state_topic + MQTT_TELEMETRY_BOTTOM_SENSOR_TOPIC_SUFFIX;
+    _healthTelemetryTopic = config.mqtt_state_topic + MQTT_TELEMETRY_HEALTH_TOPIC_SUFFIX;
+
+    // The topics to subscribe to (messages IN)
+    _router.add(config.mqtt_command_topic, 0, [this](const MQTTPublish &publish){
+      _handleDoorCommand(publish);
+    });
+    _router.add(config.mqtt_command_topic + MQTT_THRESHOLD_COMMAND_TOPIC_SUFFIX, 0, [this](const MQTTPublish &publish){
+      _handleThresholdCommand(publish);
+    });
+    _router.add(config.mqtt_command_topic + MQTT_REBOOT_COMMAND_TOPIC_SUFFIX, 0, [](const MQTTPublish &publish){
+      commandQueue.push(BOT_COMMAND_REBOOT);
+    });
+    _router.add(config.mqtt_command_topic + MQTT_REGISTER_REMOTE_COMMAND_TOPIC_SUFFIX, 0, [](const MQTTPublish &publish){
+      commandQueue.push(BOT_COMMAND_REGISTER_REMOTE);
+    });
+
+    // These are fired on the AsyncTCP task (or whichever task closes the connection)
+    _client.onConnect([this](void *arg, AsyncClient *client){
+      uint8_t expected = MQTT_CONNECTION_TCP_CONNECTING;
+      _connectionState.compare_exchange_strong(expected, MQTT_CONNECTION_TCP_CONNECTED);
+    });
+    _client.onData([this](void *arg, AsyncClient *client, void *data, size_t len){
+      if (config.mqtt_tls_enabled) {
+        // Only acknowledge the encrypted data once the main loop has consumed it
+        client->ackLater();
+        _lastPacketReceived.store(millis());
+        tls.received((uint8_t*)data, len);
+      } else {
+        _handleData((uint8_t*)data, len);
+      }
+    });
+    _client.onDisconnect([this](void *arg, AsyncClient *client){
+      _connectionState.store(MQTT_CONNECTION_DISCONNECTED);
+    });
+
+    // The WiFi connects in the background so the broker may not be reachable yet. run() connects once it is.
   }
 
   #ifdef SERIAL_DEBUG
@@ -84,9 +156,12 @@ void MQTTClient::setMQTTState(MQTTState newState, String error) {
 
 
 /**
- * Attempt to connect to the configured MQTT Broker
+ * Start connecting to the configured MQTT Broker
+ *
+ * This doesn't wait for the connection. The connection state is moved along by
+ * the AsyncTCP callbacks and acted upon in run().
  */
-bool MQTTClient::connectToBroker() {
+void MQTTClient::_startConnection(unsigned long currentMillis) {
   #ifdef SERIAL_DEBUG
   Serial.print("  - Connecting to MQTT Broker: "); 
   Serial.print(config.mqtt_broker_address);
@@ -96,133 +171,400 @@ bool MQTTClient::connectToBroker() {
   Serial.println(deviceId);
   #endif
 
-  bool connectSuccessful = false;
+  _lastReconnectAttempt = currentMillis;
+  _attemptInProgress = true;
+  _timedOut = false;
+  _connectionError = "";
+  _connectReturnCode.store(0);
+  _reader.reset();
 
-  // Attempt to connect with credentials
+  _connectionState.store(MQTT_CONNECTION_TCP_CONNECTING);
+  if (!_client.connect(config.mqtt_broker_address.c_str(), config.mqtt_broker_port)) {
+    _connectionState.store(MQTT_CONNECTION_DISCONNECTED);
+  }
+}
+
+
+/**
+ * Send the CONNECT once the broker has accepted the TCP connection
+ */
+void MQTTClient::_sendConnect() {
+  MQTTConnectOptions options;
+  options.clientId = deviceId.c_str();
+  options.username = config.mqtt_username.c_str();
+  options.password = config.mqtt_password.c_str();
+  options.keepAlive = MQTT_KEEP_ALIVE;
+  options.willTopic = _availabilityTopic.c_str();
+  options.willMessage = "offline";
+  options.willQos = 1;
+  options.willRetain = true;
+
+  #ifdef SERIAL_DEBUG
   if (!config.mqtt_username.equals("")) {
-    #ifdef SERIAL_DEBUG
     Serial.print("  - Username: "); 
     Serial.println(config.mqtt_username);
-    Serial.print("  - Password: "); 
-    Serial.println(config.mqtt_password);
-    #endif
-    connectSuccessful = _pubSubClient->connect(deviceId.c_str(), config.mqtt_username.c_str(), config.mqtt_password.c_str());
-  } 
-  
-  // Attempt to connect without credentials
-  else {
-    connectSuccessful = _pubSubClient->connect(deviceId.c_str());
-  }
-  
-  if (connectSuccessful) {
-    // Once connected, publish the current state (messages OUT)
-    _pubSubClient->publish(config.mqtt_state_topic.c_str(), doorControl.getDoorStateAsString().c_str());
-    // resubscribe to the command topic (messages IN)
-    _pubSubClient->subscribe(config.mqtt_command_topic.c_str());
-
-    return true;
-  } else {
-    #ifdef SERIAL_DEBUG
-    Serial.print("  ! Failed to connect to MQTT Broker: "); 
-    Serial.println(_getPubSubClientStateAsString());
-    #endif
-    setMQTTState(_getPubSubClientStateAsEnum(), "");
+  }
+  #endif
+
+  // The CONNACK may arrive as soon as the CONNECT is sent, so move the state along first
+  uint8_t expected = config.mqtt_tls_enabled ? MQTT_CONNECTION_TLS_HANDSHAKE : MQTT_CONNECTION_TCP_CONNECTED;
+  if (!_connectionState.compare_exchange_strong(expected, MQTT_CONNECTION_WAITING_FOR_CONNACK)) {
+    return;
+  }
+
+  size_t length = mqttEncodeConnect(_packet, sizeof(_packet), options);
+  if (!_send(length)) {
+    _client.close(true);
+  }
+}
+
+
+/**
+ * Check on the TLS handshake (running on its own task) and send the CONNECT once it is complete
+ */
+void MQTTClient::_runTLSHandshake() {
+  switch (tls.handshake()) {
+    case MQTT_TLS_HANDSHAKE_COMPLETE:
+      _sendConnect();
+      break;
+
+    case MQTT_TLS_HANDSHAKE_FAILED:
+      _connectionError = String("TLS handshake failed: ") + tls.getError();
+      _client.close(true);
+      break;
+
+    default:
+      break;
+  }
+}
+
+
+/**
+ * Decrypt the data received from the broker and hand it to the packet reader
+ */
+void MQTTClient::_readTLS() {
+  uint8_t buffer[MQTT_TLS_READ_CHUNK_SIZE];
+  size_t len;
+  while ((len = tls.read(buffer, sizeof(buffer))) > 0) {
+    _handleData(buffer, len);
+  }
+}
+
+
+/**
+ * Once the broker has accepted the CONNECT, publish the current state (messages OUT) and
+ * subscribe to the command topics (messages IN)
+ *
+ * The subscription, availability and discovery configs are queued up and sent together
+ * so that they go out in as few TCP segments as possible.
+ */
+void MQTTClient::_handleAccepted() {
+  uint8_t expected = MQTT_CONNECTION_ACCEPTED;
+  if (!_connectionState.compare_exchange_strong(expected, MQTT_CONNECTION_CONNECTED)) {
+    return;
+  }
+
+  #ifdef SERIAL_DEBUG
+  Serial.println("  - Connected to MQTT Broker.");
+  #endif
+
+  _attemptInProgress = false;
+  _lastReconnectAttempt = 0;
+  _lastPingSent = millis();
+  setMQTTState(MQTT_STATE_CONNECTED, "");
 
+  // The broker starts a clean session, so anything that was in flight on the previous connection needs to be sent again
+  outbox.resend();
+
+  // Publish all of the telemetry as soon as the connection is up
+  _sensorTelemetry[0].published = false;
+  _sensorTelemetry[1].published = false;
+  _healthTelemetry.published = false;
+
+  bool queued = true;
+  for (byte i = 0; queued && (i < _router.count()); i++) {
+    queued = _queue(mqttEncodeSubscribe(_packet, sizeof(_packet), _claimPacketId(), _router.topicFilter(i), _router.qos(i)));
+  }
+
+  queued = queued
+    && _publish(_availabilityTopic.c_str(), "online", true, false)
+    && _publishDiscoveryConfigs();
+
+  if (!queued || !_client.send()) {
+    _client.close(true);
+    return;
+  }
+
+  sendDoorStateToBroker();
+  sendSensorStatesToBroker();
+}
+
+
+/**
+ * Queue the Home Assistant discovery configs for the door and the IR sensors
+ *
+ * @see https://www.home-assistant.io/docs/mqtt/discovery/
+ * @return bool false if the configs couldn't be queued
+ */
+bool MQTTClient::_publishDiscoveryConfigs() {
+  String discoveryId = deviceId;
+  discoveryId.toLowerCase();
+  char json[MQTT_DISCOVERY_MESSAGE_SIZE];
+  DynamicJsonDocument doc(MQTT_DISCOVERY_MESSAGE_SIZE);
+
+  // The details of the device shared by each of the entities
+  DynamicJsonDocument device(256);
+  device["identifiers"][0] = discoveryId;
+  device["name"] = deviceId;
+  device["model"] = "Garage Bot";
+  device["manufacturer"] = "Peter Eldred";
+  device["sw_version"] = FIRMWARE_VERSION;
+
+  // The door
+  doc["name"] = "Garage Door";
+  doc["unique_id"] = discoveryId + "_door";
+  doc["device_class"] = "garage";
+  doc["command_topic"] = config.mqtt_command_topic;
+  doc["state_topic"] = config.mqtt_state_topic;
+  doc["availability_topic"] = _availabilityTopic;
+  doc["payload_open"] = "open";
+  doc["payload_close"] = "close";
+  // The door can only be stopped by activating it, which opens a closed door. A null hides the stop button.
+  doc["payload_stop"] = nullptr;
+  doc["state_open"] = "open";
+  doc["state_opening"] = "opening";
+  doc["state_closed"] = "closed";
+  doc["state_closing"] = "closing";
+  doc["device"] = device;
+  serializeJson(doc, json, sizeof(json));
+  if (!_publish((String(MQTT_DISCOVERY_PREFIX) + "/cover/" + discoveryId + "/door/config").c_str(), json, true, false)) {
     return false;
   }
+
+  // The IR sensors
+  const char *sensorNames[2] = {"Top Sensor", "Bottom Sensor"};
+  const char *sensorIds[2] = {"top_sensor", "bottom_sensor"};
+  const String *sensorTopics[2] = {&_topSensorTopic, &_bottomSensorTopic};
+  for (byte i = 0; i < 2; i++) {
+    doc.clear();
+    doc["name"] = String("Garage ") + sensorNames[i];
+    doc["unique_id"] = discoveryId + "_" + sensorIds[i];
+    doc["state_topic"] = *sensorTopics[i];
+    doc["availability_topic"] = _availabilityTopic;
+    doc["payload_on"] = "detected";
+    doc["payload_off"] = "clear";
+    doc["device"] = device;
+    serializeJson(doc, json, sizeof(json));
+    if (!_publish((String(MQTT_DISCOVERY_PREFIX) + "/binary_sensor/" + discoveryId + "/" + sensorIds[i] + "/config").c_str(), json, true, false)) {
+      return false;
+    }
+  }
+
+  return true;
 }
 
 
 /**
- * Fired when the MQTT Client receives a message from the MQTT broker
+ * Report why a connection attempt (or an established connection) ended
  */
-void MQTTClient::handleMessageReceived(char* topic, byte* data, unsigned int len) {
-  // Let's assume the message is a string.
-  char message[MQTT_MAX_PACKET_SIZE];
-  memcpy( message, data, len );
-  message[len] = '\0';
+void MQTTClient::_connectionAttemptEnded() {
+  bool wasConnected = (_mqttState == MQTT_STATE_CONNECTED);
+  _attemptInProgress = false;
+
+  if (config.mqtt_tls_enabled) {
+    tls.end();
+  }
+
+  MQTTState newState;
+  switch (_connectReturnCode.load()) {
+    case 1:
+      newState = MQTT_STATE_CONNECT_BAD_PROTOCOL;
+      break;
+    case 2:
+      newState = MQTT_STATE_CONNECT_BAD_CLIENT_ID;
+      break;
+    case 3:
+      newState = MQTT_STATE_CONNECT_UNAVAILABLE;
+      break;
+    case 4:
+      newState = MQTT_STATE_CONNECT_BAD_CREDENTIALS;
+      break;
+    case 5:
+      newState = MQTT_STATE_CONNECT_UNAUTHORIZED;
+      break;
+    default:
+      newState = _timedOut ? MQTT_STATE_CONNECTION_TIMEOUT : (wasConnected ? MQTT_STATE_CONNECTION_LOST : MQTT_STATE_CONNECT_FAILED);
+      break;
+  }
 
+  #ifdef SERIAL_DEBUG
+  Serial.print(wasConnected ? "  ! Lost connection to MQTT Broker: " : "  ! Failed to connect to MQTT Broker: ");
+  Serial.println((int)newState);
+  #endif
+
+  setMQTTState(newState, _connectionError);
+}
+
+
+/**
+ * Data received from the broker
+ * @note: fired on the AsyncTCP task
+ */
+void MQTTClient::_handleData(uint8_t *data, size_t len) {
+  _lastPacketReceived.store(millis());
+
+  while (len > 0) {
+    size_t consumed = _reader.feed(data, len);
+    data += consumed;
+    len -= consumed;
+
+    if (_reader.ready()) {
+      _handlePacket(_reader.packet());
+      _reader.next();
+    }
+  }
+}
+
+
+/**
+ * A complete packet received from the broker
+ * @note: fired on the AsyncTCP task
+ */
+void MQTTClient::_handlePacket(const MQTTPacket &packet) {
+  switch (packet.type) {
+    case MQTT_PACKET_CONNACK: {
+      uint8_t returnCode = (packet.length >= 2) ? packet.body[1] : 0xFF;
+      _connectReturnCode.store(returnCode);
+
+      uint8_t expected = MQTT_CONNECTION_WAITING_FOR_CONNACK;
+      if ((returnCode != 0) || !_connectionState.compare_exchange_strong(expected, MQTT_CONNECTION_ACCEPTED)) {
+        _client.close(true);
+      }
+      break;
+    }
+
+    case MQTT_PACKET_PUBLISH: {
+      MQTTPublish publish;
+      if (mqttParsePublish(packet, publish)) {
+        _handlePublish(publish);
+      }
+      break;
+    }
+
+    case MQTT_PACKET_PUBACK:
+      if (packet.length >= 2) {
+        outbox.acknowledge((packet.body[0] << 8) | packet.body[1], millis());
+      }
+      break;
+
+    // Nothing to do for a SUBACK or a PINGRESP (receiving anything keeps the connection alive)
+    default:
+      break;
+  }
+}
+
+
+/**
+ * Fired when the MQTT Client receives a message from the MQTT broker
+ * @note: fired on the AsyncTCP task so the handlers hand their commands off to the main loop
+ */
+void MQTTClient::_handlePublish(const MQTTPublish &publish) {
   #ifdef SERIAL_DEBUG
   Serial.println("MQTT Message Received: ");
   Serial.print("  - Topic: ");
-  Serial.println(topic);
+  Serial.write((const uint8_t*)publish.topic, publish.topicLength);
+  Serial.println();
   Serial.print("  - Message: ");
-  Serial.println(message);
+  Serial.write(publish.payload, publish.payloadLength);
+  Serial.println();
   #endif
 
+  // Every route is a command. A retained command would be replayed by the broker each time the
+  // device (re)connects, so the door would open on every reconnect. Only act on live messages.
+  if (publish.retain) {
+    #ifdef SERIAL_DEBUG
+    Serial.println("  ! Ignoring retained command");
+    #endif
+    return;
+  }
+
+  if (!_router.dispatch(publish)) {
+    #ifdef SERIAL_DEBUG
+    Serial.println("  ! Unhandled MQTT topic");
+    #endif
+  }
+}
+
+
+/**
+ * A door command: either the plain command ("open") or a json object ({"cmd":"open"})
+ * @note: fired on the AsyncTCP task
+ */
+void MQTTClient::_handleDoorCommand(const MQTTPublish &publish) {
+  const char *message = (const char*)publish.payload;
+  size_t len = publish.payloadLength;
+
+  // Pull the command out of a json payload in place
+  JsonSpan command;
+  if ((len > 0) && (message[0] == '{')) {
+    if (!jsonFindValue(message, len, "cmd", command) || (command.type != JSON_SPAN_STRING)) {
+      return;
+    }
+    message = command.ptr;
+    len = command.len;
+  }
+
   // Open command
-  if (strcmp(message, "open") == 0) {
-    doorControl.open();
+  if ((len == 4) && (memcmp(message, "open", 4) == 0)) {
+    commandQueue.push(BOT_COMMAND_VIRTUAL_BUTTON, OPEN);
   }
 
   // Close command
-  else if (strcmp(message, "close") == 0) {
-    doorControl.close();
+  else if ((len == 5) && (memcmp(message, "close", 5) == 0)) {
+    commandQueue.push(BOT_COMMAND_VIRTUAL_BUTTON, CLOSE);
   }
 
   // Activate command
-  else if (strcmp(message, "activate") == 0) {
-    doorControl.activate();
+  else if ((len == 8) && (memcmp(message, "activate", 8) == 0)) {
+    commandQueue.push(BOT_COMMAND_VIRTUAL_BUTTON, ACTIVATE);
   }
 }
 
 
 /**
- * Convert the current pubsubclient MQTT Client state into an enumerated value for our use
+ * Set an IR sensor threshold. The sensor ("top" / "bottom") is the last level of the topic and
+ * the payload is either the plain threshold ("120") or a json object ({"threshold":120}).
+ * @note: fired on the AsyncTCP task
  */
-MQTTState MQTTClient::_getPubSubClientStateAsEnum() {
-  switch (_pubSubClient->state()) {
-    case MQTT_CONNECTION_TIMEOUT:
-      return MQTT_STATE_CONNECTION_TIMEOUT;
-    case MQTT_CONNECTION_LOST:
-      return MQTT_STATE_CONNECTION_LOST;
-    case MQTT_CONNECT_FAILED:
-      return MQTT_STATE_CONNECT_FAILED;
-    case MQTT_DISCONNECTED:
-      return MQTT_STATE_DISCONNECTED;
-    case MQTT_CONNECT_BAD_PROTOCOL:
-      return MQTT_STATE_CONNECT_BAD_PROTOCOL;
-    case MQTT_CONNECT_BAD_CLIENT_ID:
-      return MQTT_STATE_CONNECT_BAD_CLIENT_ID;
-    case MQTT_CONNECT_UNAVAILABLE:
-      return MQTT_STATE_CONNECT_UNAVAILABLE;
-    case MQTT_CONNECT_BAD_CREDENTIALS:
-      return MQTT_STATE_CONNECT_BAD_CREDENTIALS;
-    case MQTT_CONNECT_UNAUTHORIZED:
-      return MQTT_STATE_CONNECT_UNAUTHORIZED;
-    default:
-      return MQTT_STATE_CONNECTED;
+void MQTTClient::_handleThresholdCommand(const MQTTPublish &publish) {
+  JsonSpan threshold;
+  if ((publish.payloadLength > 0) && (publish.payload[0] == '{')) {
+    jsonFindValue((const char*)publish.payload, publish.payloadLength, "threshold", threshold);
+  } else {
+    threshold.ptr = (const char*)publish.payload;
+    threshold.len = publish.payloadLength;
+    threshold.type = JSON_SPAN_LITERAL;
   }
-}
 
+  long newThreshold;
+  if (!jsonSpanToInt(threshold, newThreshold) || !isValidIRSensorThreshold(newThreshold)) {
+    #ifdef SERIAL_DEBUG
+    Serial.println("  ! Invalid IR sensor threshold");
+    #endif
+    return;
+  }
 
-/**
- * Convert the current MQTT PubSubClient state into a string for transport to the client
- */
-String MQTTClient::_getPubSubClientStateAsString() {
-  switch (_pubSubClient->state()) {
-    case MQTT_CONNECTION_TIMEOUT:
-      return F("MQTT_CONNECTION_TIMEOUT");
-    case MQTT_CONNECTION_LOST:
-      return F("MQTT_CONNECTION_LOST");
-    case MQTT_CONNECT_FAILED:
-      return F("MQTT_CONNECT_FAILED");
-    case MQTT_DISCONNECTED:
-      return F("MQTT_DISCONNECTED");
-    case MQTT_CONNECTED:
-      return F("MQTT_CONNECTED");
-    case MQTT_CONNECT_BAD_PROTOCOL:
-      return F("MQTT_CONNECT_BAD_PROTOCOL");
-    case MQTT_CONNECT_BAD_CLIENT_ID:
-      return F("MQTT_CONNECT_BAD_CLIENT_ID");
-    case MQTT_CONNECT_UNAVAILABLE:
-      return F("MQTT_CONNECT_UNAVAILABLE");
-    case MQTT_CONNECT_BAD_CREDENTIALS:
-      return F("MQTT_CONNECT_BAD_CREDENTIALS");
-    case MQTT_CONNECT_UNAUTHORIZED:
-      return F("MQTT_CONNECT_UNAUTHORIZED");
-    default:
-      return F("UNKNOWN");
+  // The sensor is whatever follows the last "/" of the topic
+  const char *sensor = publish.topic + publish.topicLength;
+  while ((sensor > publish.topic) && (*(sensor - 1) != '/')) {
+    sensor--;
+  }
+  size_t sensorLength = (publish.topic + publish.topicLength) - sensor;
+
+  if ((sensorLength == 3) && (memcmp(sensor, "top", 3) == 0)) {
+    commandQueue.push(BOT_COMMAND_SET_SENSOR_THRESHOLD, newThreshold, IR_SENSOR_TOP);
+  } else if ((sensorLength == 6) && (memcmp(sensor, "bottom", 6) == 0)) {
+    commandQueue.push(BOT_COMMAND_SET_SENSOR_THRESHOLD, newThreshold, IR_SENSOR_BOTTOM);
   }
 }
 
@@ -288,47 +630,288 @@ String MQTTClient::getMQTTError() {
  * @param currentMillis the current milliseconds as passed down from the main loop
  */
 void MQTTClient::run (unsigned long currentMillis) {
-  // Has the MQTT connection dropped?
-  if (!_pubSubClient->connected()) {
-    // If the reconnect interval has passed AND the wifi client is connected...
-    if (wifiEngine.connected && (currentMillis - _lastReconnectAttempt > RECONNECT_INTERVAL)) {
-      _lastReconnectAttempt = currentMillis;
-      // Attempt to reconnect
-      if (connectToBroker()) {
-        // Successful connection
-        _lastReconnectAttempt = 0;
+  // Nothing to do until the config is fixed
+  if (_mqttState == MQTT_STATE_CONFIG_ERROR) {
+    return;
+  }
+
+  // Once the TLS handshake is complete the received data is decrypted (and the packets handled) here
+  if (config.mqtt_tls_enabled && (_connectionState.load() >= MQTT_CONNECTION_WAITING_FOR_CONNACK)) {
+    _readTLS();
+  }
+
+  switch (_connectionState.load()) {
+    case MQTT_CONNECTION_DISCONNECTED:
+      // The last attempt (or connection) has ended
+      if (_attemptInProgress || (_mqttState == MQTT_STATE_CONNECTED)) {
+        _connectionAttemptEnded();
+      }
+
+      // If the reconnect interval has passed AND the wifi client is connected...
+      if (wifiEngine.connected && ((_lastReconnectAttempt == 0) || (currentMillis - _lastReconnectAttempt > RECONNECT_INTERVAL))) {
+        reconnectCount += 1;
+        _startConnection(currentMillis);
+      }
+      break;
+
+    case MQTT_CONNECTION_TCP_CONNECTED:
+      if (config.mqtt_tls_enabled) {
+        uint8_t expected = MQTT_CONNECTION_TCP_CONNECTED;
+        if (_connectionState.compare_exchange_strong(expected, MQTT_CONNECTION_TLS_HANDSHAKE) && !tls.begin(&_client)) {
+          _connectionError = "TLS handshake of the last connection is still winding down";
+          _client.close(true);
+        }
+      } else {
+        _sendConnect();
+      }
+      break;
+
+    case MQTT_CONNECTION_ACCEPTED:
+      _handleAccepted();
+      break;
+
+    case MQTT_CONNECTION_CONNECTED:
+      outbox.deliver(currentMillis, [this](MQTTOutboxMessage &message, bool dup){
+        return _publishFromOutbox(message, dup);
+      });
+      _runTelemetry(currentMillis);
+      _runKeepAlive(currentMillis);
+      break;
+
+    case MQTT_CONNECTION_TLS_HANDSHAKE:
+      _runTLSHandshake();
+      // Fall through to check the timeout
+
+    // Still waiting on the broker
+    default:
+      if ((currentMillis - _lastReconnectAttempt) > MQTT_CONNECT_TIMEOUT) {
+        _timedOut = true;
+        _client.close(true);
+      }
+      break;
+  }
+}
+
+
+/**
+ * Ping the broker when the connection is idle and drop the connection if the broker stops responding
+ */
+void MQTTClient::_runKeepAlive(unsigned long currentMillis) {
+  unsigned long keepAliveMillis = MQTT_KEEP_ALIVE * 1000UL;
+
+  // Nothing at all (not even a PINGRESP) has been received for two keep alive periods
+  if ((currentMillis - _lastPacketReceived.load()) > (keepAliveMillis * 2)) {
+    _timedOut = true;
+    _client.close(true);
+    return;
+  }
+
+  // Ping when either direction has been quiet for a keep alive period (but no more than once per period)
+  bool idle = ((currentMillis - _lastPacketSent) >= keepAliveMillis) || ((currentMillis - _lastPacketReceived.load()) >= keepAliveMillis);
+  if (idle && ((currentMillis - _lastPingSent) >= keepAliveMillis)) {
+    _lastPingSent = currentMillis;
+    _send(mqttEncodeEmpty(_packet, sizeof(_packet), MQTT_PACKET_PINGREQ));
+  }
+}
+
+
+/**
+ * Publish the IR sensor readings and device health
+ *
+ * Each is published when it has changed by more than its delta (but no more often than
+ * MQTT_TELEMETRY_MIN_INTERVAL) and at least every MQTT_TELEMETRY_MAX_INTERVAL. The json
+ * is written straight into a fixed buffer.
+ */
+void MQTTClient::_runTelemetry(unsigned long currentMillis) {
+  IRSensor *sensors[2] = {_topIRSensor, _bottomIRSensor};
+
+  for (byte i = 0; i < 2; i++) {
+    IRSensor *sensor = sensors[i];
+    SensorTelemetry *last = &_sensorTelemetry[i];
+    unsigned long elapsed = currentMillis - last->publishedAt;
+
+    // Nothing worth publishing until the sensor has taken its first readings
+    if ((sensor->detected == SENSOR_DETECTION_UNKNOWN) || (last->published && (elapsed < MQTT_TELEMETRY_MIN_INTERVAL))) {
+      continue;
+    }
+
+    bool changed = !last->published
+      || (sensor->detected != last->detected)
+      || (abs(sensor->averageAmbientReading - last->ambient) > MQTT_TELEMETRY_SENSOR_DELTA)
+      || (abs(sensor->averageActiveReading - last->active) > MQTT_TELEMETRY_SENSOR_DELTA);
+
+    if (changed || (elapsed >= MQTT_TELEMETRY_MAX_INTERVAL)) {
+      snprintf(_telemetry, sizeof(_telemetry), "{\"ambient\":%d,\"active\":%d,\"detected\":%s}",
+        sensor->averageAmbientReading, sensor->averageActiveReading, (sensor->detected == SENSOR_DETECTED) ? "true" : "false");
+
+      if (_publish(_sensorTelemetryTopics[i].c_str(), _telemetry)) {
+        last->ambient = sensor->averageAmbientReading;
+        last->active = sensor->averageActiveReading;
+        last->detected = sensor->detected;
+        last->publishedAt = currentMillis;
+        last->published = true;
       }
-      setMQTTState(_getPubSubClientStateAsEnum(), "");
     }
   }
-  
-  // Don't run the main loop code unless the MQTT client is enabled and not in error
-  else {
-    // Allow the pubSubClient to perform it's main loop code
-    _pubSubClient->loop();
 
-    // Make sure our knowledge of the MQTT state is up to date
-    if (_getPubSubClientStateAsEnum() != _mqttState) {
-      setMQTTState(_getPubSubClientStateAsEnum(), "");
+  HealthTelemetry *last = &_healthTelemetry;
+  unsigned long elapsed = currentMillis - last->publishedAt;
+  if (last->published && (elapsed < MQTT_TELEMETRY_MIN_INTERVAL)) {
+    return;
+  }
+
+  uint32_t freeHeap = ESP.getFreeHeap();
+  int rssi = WiFi.RSSI();
+  bool changed = !last->published
+    || (abs((int32_t)(freeHeap - last->freeHeap)) > MQTT_TELEMETRY_HEAP_DELTA)
+    || (abs(rssi - last->rssi) >= MQTT_TELEMETRY_RSSI_DELTA);
+
+  if (changed || (elapsed >= MQTT_TELEMETRY_MAX_INTERVAL)) {
+    snprintf(_telemetry, sizeof(_telemetry), "{\"heap\":%u,\"rssi\":%d,\"uptime\":%lu,\"loops\":%u}",
+      (unsigned int)freeHeap, rssi, (unsigned long)(esp_timer_get_time() / 1000000), (unsigned int)metrics.loopsPerSecond);
+
+    if (_publish(_healthTelemetryTopic.c_str(), _telemetry)) {
+      last->freeHeap = freeHeap;
+      last->rssi = rssi;
+      last->publishedAt = currentMillis;
+      last->published = true;
     }
   }
 }
 
 
 /**
- * Send the current door state to the MQTT broker
- * Triggered by a change in the door state
+ * Queue the current door state to be sent to the MQTT broker
+ * Triggered by a change in the door state (and by connecting to the broker)
+ *
+ * The state is queued even while the broker is unreachable, replacing any older
+ * state still waiting to be sent.
  */
 void MQTTClient::sendDoorStateToBroker() {
-  if (_pubSubClient->connected()) {
-    String doorState = doorControl.getDoorStateAsString();
+  if (_mqttState == MQTT_STATE_CONFIG_ERROR) {
+    return;
+  }
 
-    #ifdef SERIAL_DEBUG
-    Serial.print("Sending Door State to MQTT Broker: ");
-    Serial.println(doorState);
-    #endif
+  String doorState = doorControl.getDoorStateAsString();
+
+  #ifdef SERIAL_DEBUG
+  Serial.print("Sending Door State to MQTT Broker: ");
+  Serial.println(doorState);
+  #endif
+
+  doorState.toLowerCase();
+  outbox.enqueue(config.mqtt_state_topic.c_str(), doorState.c_str(), true, millis());
+}
+
+
+/**
+ * Queue the current IR sensor states to be sent to the MQTT broker
+ * Triggered by a change in either sensor state (and by connecting to the broker)
+ */
+void MQTTClient::sendSensorStatesToBroker() {
+  if (_mqttState == MQTT_STATE_CONFIG_ERROR) {
+    return;
+  }
+
+  // Nothing is known about a sensor until it has taken its first readings
+  if (_topIRSensor->detected != SENSOR_DETECTION_UNKNOWN) {
+    outbox.enqueue(_topSensorTopic.c_str(), (_topIRSensor->detected == SENSOR_DETECTED) ? "detected" : "clear", true, millis());
+  }
+  if (_bottomIRSensor->detected != SENSOR_DETECTION_UNKNOWN) {
+    outbox.enqueue(_bottomSensorTopic.c_str(), (_bottomIRSensor->detected == SENSOR_DETECTED) ? "detected" : "clear", true, millis());
+  }
+}
 
-    doorState.toLowerCase();
-    _pubSubClient->publish(config.mqtt_state_topic.c_str(), doorState.c_str());
+
+/**
+ * Publish a message to the MQTT broker
+ *
+ * @param topic the topic to publish to
+ * @param payload the message
+ * @param retain whether the broker should retain the message
+ * @param sendNow false to queue the message to go out with the next _send()
+ * @return bool whether the message was published
+ */
+bool MQTTClient::_publish(const char *topic, const char *payload, bool retain, bool sendNow) {
+  size_t length = mqttEncodePublish(_packet, sizeof(_packet), topic, (const uint8_t*)payload, strlen(payload), 0, retain, 0);
+  bool published = (_connectionState.load() == MQTT_CONNECTION_CONNECTED) && (sendNow ? _send(length) : _queue(length));
+  if (published) {
+    publishCount += 1;
+  } else {
+    publishFailures += 1;
   }
-}
\ No newline at end of file
+  return published;
+}
+
+
+/**
+ * Publish a message from the outbox with QoS 1
+ *
+ * @param message the message to publish. A packet identifier is claimed the first time it is sent on a connection.
+ * @param dup whether the message is being sent again
+ * @return bool whether the message was sent
+ */
+bool MQTTClient::_publishFromOutbox(MQTTOutboxMessage &message, bool dup) {
+  uint16_t packetId = dup ? message.packetId : _claimPacketId();
+  size_t length = mqttEncodePublish(_packet, sizeof(_packet), message.topic.c_str(), (const uint8_t*)message.payload.c_str(), message.payload.length(), 1, message.retain, packetId);
+  if (dup && (length > 0)) {
+    _packet[0] |= MQTT_PUBLISH_FLAG_DUP;
+  }
+
+  if (!_send(length)) {
+    return false;
+  }
+
+  message.packetId = packetId;
+  if (!dup) {
+    publishCount += 1;
+  }
+  return true;
+}
+
+
+/**
+ * Queue the packet that has been encoded into _packet to be sent with the next _send()
+ *
+ * @param length the length of the packet (0 if it couldn't be encoded)
+ * @return bool false if the packet couldn't be queued
+ */
+bool MQTTClient::_queue(size_t length) {
+  if ((length == 0) || (_client.space() < (length + (config.mqtt_tls_enabled ? MQTT_TLS_RECORD_OVERHEAD : 0)))) {
+    return false;
+  }
+
+  if (config.mqtt_tls_enabled) {
+    // Part of the record may have gone out, so the next packet can't follow it on this connection
+    if (!tls.write(_packet, length)) {
+      _client.close(true);
+      return false;
+    }
+  } else if (_client.add((const char*)_packet, length) != length) {
+    return false;
+  }
+
+  _lastPacketSent = millis();
+  return true;
+}
+
+
+/**
+ * Send the packet that has been encoded into _packet (along with anything queued before it)
+ *
+ * @param length the length of the packet (0 if it couldn't be encoded)
+ * @return bool false if the packet couldn't be sent
+ */
+bool MQTTClient::_send(size_t length) {
+  return _queue(length) && _client.send();
+}
+
+
+/**
+ * The next packet identifier (never 0)
+ */
+uint16_t MQTTClient::_claimPacketId() {
+  uint16_t packetId = _nextPacketId;
+  _nextPacketId = (_nextPacketId == 0xFFFF) ? 1 : (_nextPacketId + 1);
+  return packetId;
+}
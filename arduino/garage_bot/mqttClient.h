@@ -1,22 +1,29 @@
 /*============================================================================*\
  * Garage Bot - mqttClient
  * Peter Eldred 2021-05
- * 
+ *
  * This class is designed to connect to a MQTT broker and issue commands or
- * subscribe to topics 
+ * subscribe to topics
 \*============================================================================*/
 
 #ifndef MQTT_CLIENT_H
 #define MQTT_CLIENT_H
 
+#include <atomic>
+#include "AsyncTCP.h"
+#include "_config.h"
 #include "helpers.h"
-#include "PubSubClient.h"
+#include "irsensor.h"
+#include "mqttPacket.h"
+#include "mqttOutbox.h"
+#include "mqttTopicRouter.h"
+#include "mqttTLS.h"
 
 class MQTTClient {
   public:
     MQTTClient();
-    
-    void init(PubSubClient *pubSubClient);
+
+    void init(IRSensor *topIRSensor, IRSensor *bottomIRSensor);
     mqttStateChangedFunction onStateChange;
 
     MQTTState getMQTTState();
@@ -26,20 +33,83 @@ class MQTTClient {
     String deviceId;                              // The configure device id concatenated with the device MAC address to generate a unique ID for the MQTT broker
 
     void run (unsigned long currentMillis);       // Fired every time the main loop on the arduino program is fired
-    void handleMessageReceived(char* topic, byte* payload, unsigned int length); // Message received from the MQTT broker
-    void sendDoorStateToBroker();                 // Send the current door state to the MQTT broker
+    void sendDoorStateToBroker();                 // Queue the current door state to be sent to the MQTT broker
+    void sendSensorStatesToBroker();              // Queue the current IR sensor states to be sent to the MQTT broker
+
+    MQTTOutbox outbox;                            // The messages waiting to be acknowledged by the MQTT broker
+    MQTTTLS tls;                                  // The TLS layer (only used when TLS is enabled)
+
+    uint32_t publishCount = 0;                    // The number of messages published since boot
+    uint32_t publishFailures = 0;                 // The number of messages that failed to publish since boot
+    uint32_t reconnectCount = 0;                  // The number of attempts to reconnect to the broker since boot
   private:
-    PubSubClient *_pubSubClient;                  // A pointer to the PubSubClient passed into the init function
+    IRSensor *_topIRSensor;                       // A pointer to the top IR sensor passed into the init function
+    IRSensor *_bottomIRSensor;                    // A pointer to the bottom IR sensor passed into the init function
+    String _availabilityTopic;                    // The topic of the Last Will and Testament ("online" / "offline")
+    String _topSensorTopic;                       // The topic of the top IR sensor state
+    String _bottomSensorTopic;                    // The topic of the bottom IR sensor state
+    String _sensorTelemetryTopics[2];             // The topics of the top and bottom IR sensor readings
+    String _healthTelemetryTopic;                 // The topic of the device health
+
+    // The telemetry values that were last published (to work out whether they have changed enough to publish again)
+    struct SensorTelemetry {
+      int ambient;
+      int active;
+      SensorDetectionState detected;
+      unsigned long publishedAt;                  // the millis() that the readings were last published
+      bool published;                             // Whether the readings have been published on the current connection
+    };
+    struct HealthTelemetry {
+      uint32_t freeHeap;
+      int rssi;
+      unsigned long publishedAt;                  // the millis() that the health was last published
+      bool published;                             // Whether the health has been published on the current connection
+    };
+    SensorTelemetry _sensorTelemetry[2];          // The top and bottom IR sensor readings that were last published
+    HealthTelemetry _healthTelemetry;             // The device health that was last published
+    char _telemetry[MQTT_TELEMETRY_MESSAGE_SIZE]; // The telemetry json is written here (main loop only)
+
+    MQTTTopicRouter _router;                      // The topics subscribed to and the handlers of the messages received on them
+
+    AsyncClient _client;                          // The TCP connection to the broker
+    MQTTPacketReader _reader;                     // Assembles the packets received from the broker (AsyncTCP task only)
+    uint8_t _packet[MQTT_MAX_PACKET_SIZE];        // Outgoing packets are encoded here (main loop only)
 
     MQTTState _mqttState = MQTT_STATE_DISABLED;   // The current state of the MQTT Client (including our last known state)
     String _error = "";                           // Any error that the MQTT Client may have encountered
     unsigned long _lastReconnectAttempt = 0;      // the millis() that the MQTT client last attempted to connect to the configured MQTT Broker
 
+    std::atomic<uint8_t> _connectionState;        // The MQTTConnectionState. Moved along by both the AsyncTCP task and the main loop.
+    std::atomic<uint8_t> _connectReturnCode;      // The return code of the most recent CONNACK (0 = accepted)
+    std::atomic<unsigned long> _lastPacketReceived; // the millis() that a packet was last received from the broker
+    bool _attemptInProgress = false;              // Whether the main loop is waiting on a connection attempt
+    bool _timedOut = false;                       // Whether the connection was closed because the broker stopped responding
+    String _connectionError = "";                 // Why the current connection attempt failed (if known, ie. the TLS handshake failed)
+    unsigned long _lastPacketSent = 0;            // the millis() that a packet was last sent to the broker
+    unsigned long _lastPingSent = 0;              // the millis() that a PINGREQ was last sent to the broker
+    uint16_t _nextPacketId = 1;                   // The packet identifier of the next SUBSCRIBE (or QoS 1 PUBLISH)
+
     void setMQTTState(MQTTState newState, String error);  // Set the known state of the MQTT client with an optional error
-    bool connectToBroker();                       // Connect to the MQTT Broker
+    void _startConnection(unsigned long currentMillis);   // Start connecting to the MQTT Broker (doesn't wait)
+    void _connectionAttemptEnded();               // Report why the connection attempt (or connection) ended
+    void _sendConnect();                          // Send the CONNECT once the TCP connection (and TLS) is open
+    void _runTLSHandshake();                      // Check on the TLS handshake
+    void _readTLS();                              // Decrypt and handle the data received from the broker
+    void _handleAccepted();                       // Subscribe and publish the current state once the broker accepts the CONNECT
+    void _runKeepAlive(unsigned long currentMillis);  // Ping the broker and drop the connection if it stops responding
+    bool _queue(size_t length);                   // Queue the packet encoded in _packet to be sent with the next _send()
+    bool _send(size_t length);                    // Send the packet encoded in _packet (along with anything queued)
+    bool _publish(const char *topic, const char *payload, bool retain = false, bool sendNow = true);  // Publish a message (and count it)
+    bool _publishDiscoveryConfigs();              // Queue the Home Assistant discovery configs
+    void _runTelemetry(unsigned long currentMillis);  // Publish the IR sensor readings and device health when they have changed
+    bool _publishFromOutbox(MQTTOutboxMessage &message, bool dup);  // Publish a message from the outbox with QoS 1
+    uint16_t _claimPacketId();                    // The next (non zero) packet identifier
 
-    String _getPubSubClientStateAsString();
-    MQTTState _getPubSubClientStateAsEnum();
+    void _handleData(uint8_t *data, size_t len);  // Data received from the broker (AsyncTCP task)
+    void _handlePacket(const MQTTPacket &packet); // A complete packet received from the broker (AsyncTCP task)
+    void _handlePublish(const MQTTPublish &publish);  // A message received from the broker (AsyncTCP task)
+    void _handleDoorCommand(const MQTTPublish &publish);        // open / close / activate (AsyncTCP task)
+    void _handleThresholdCommand(const MQTTPublish &publish);   // Set an IR sensor threshold (AsyncTCP task)
 };
 
 extern MQTTClient mqttClient;
@@ -0,0 +1,173 @@
+/*============================================================================*\
+ * Garage Bot - mqttOutbox
+ * Peter Eldred 2021-08
+ *
+ * The messages waiting to be published to the MQTT broker. Messages are kept
+ * (in the order they were queued) until the broker acknowledges them with a
+ * PUBACK, so nothing is lost while the broker is unreachable.
+ *
+ * Only the latest message on each topic matters (ie. the current door state)
+ * so queueing a message replaces any message still waiting on the same topic.
+ * This keeps the outbox small no matter how long the broker is away. If the
+ * outbox does fill up the oldest message is dropped.
+ *
+ * Messages are published with QoS 1. A message which isn't acknowledged within
+ * MQTT_OUTBOX_RETRY_INTERVAL is sent again (flagged as a duplicate) and, as the
+ * client connects with a clean session, everything which hasn't been
+ * acknowledged is sent again after a reconnect.
+\*============================================================================*/
+
+#include <utility>
+#include "Arduino.h"
+#include "_config.h"
+#include "mqttOutbox.h"
+
+
+/**
+ * Constructor
+ */
+MQTTOutbox::MQTTOutbox() {}
+
+
+/**
+ * Initialise
+ */
+void MQTTOutbox::init() {
+  _lock = xSemaphoreCreateMutex();
+}
+
+
+/**
+ * Queue a message to be published
+ *
+ * @param topic the topic to publish to
+ * @param payload the message
+ * @param retain whether the broker should retain the message
+ * @param currentMillis the current millis()
+ */
+void MQTTOutbox::enqueue(const char *topic, const char *payload, bool retain, unsigned long currentMillis) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+
+  // A newer message on the same topic replaces the old one (even if the old one is in flight, its PUBACK will just be ignored)
+  for (byte i = 0; i < _messageCount; i++) {
+    if (_messages[i].topic.equals(topic)) {
+      _remove(i);
+      replacedCount += 1;
+      break;
+    }
+  }
+
+  if (_messageCount >= MQTT_OUTBOX_MAX_MESSAGES) {
+    _remove(0);
+    droppedCount += 1;
+  }
+
+  MQTTOutboxMessage *message = &_messages[_messageCount];
+  message->topic = topic;
+  message->payload = payload;
+  message->retain = retain;
+  message->packetId = 0;
+  message->queuedAt = currentMillis;
+  message->sentAt = 0;
+  _messageCount += 1;
+
+  xSemaphoreGive(_lock);
+}
+
+
+/**
+ * Send the messages that haven't been sent yet (or that weren't acknowledged in time)
+ *
+ * Stops at the first message that can't be sent so that the messages always go out in order.
+ *
+ * @param currentMillis the current millis()
+ * @param send called for each message to send. Sets the packetId of a message that hasn't been sent yet.
+ */
+void MQTTOutbox::deliver(unsigned long currentMillis, mqttOutboxSendFunction send) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+
+  for (byte i = 0; i < _messageCount; i++) {
+    MQTTOutboxMessage *message = &_messages[i];
+    bool dup = (message->packetId != 0);
+
+    if (dup && ((currentMillis - message->sentAt) < MQTT_OUTBOX_RETRY_INTERVAL)) {
+      continue;
+    }
+
+    if (!send(*message, dup)) {
+      break;
+    }
+
+    message->sentAt = currentMillis;
+    if (dup) {
+      retransmitCount += 1;
+    }
+  }
+
+  xSemaphoreGive(_lock);
+}
+
+
+/**
+ * The broker acknowledged a message
+ * @note: fired on the AsyncTCP task
+ *
+ * @param packetId the packet identifier from the PUBACK
+ * @param currentMillis the current millis()
+ */
+void MQTTOutbox::acknowledge(uint16_t packetId, unsigned long currentMillis) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+
+  for (byte i = 0; i < _messageCount; i++) {
+    if (_messages[i].packetId == packetId) {
+      uint32_t latency = currentMillis - _messages[i].queuedAt;
+      deliveredCount += 1;
+      deliveryMillisTotal += latency;
+      if (latency > deliveryMillisMax) {
+        deliveryMillisMax = latency;
+      }
+
+      _remove(i);
+      break;
+    }
+  }
+
+  xSemaphoreGive(_lock);
+}
+
+
+/**
+ * Forget the packet identifiers used on the previous connection so that every message is sent again
+ */
+void MQTTOutbox::resend() {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+
+  for (byte i = 0; i < _messageCount; i++) {
+    _messages[i].packetId = 0;
+  }
+
+  xSemaphoreGive(_lock);
+}
+
+
+/**
+ * The number of messages waiting
+ */
+byte MQTTOutbox::depth() {
+  return _messageCount;
+}
+
+
+/**
+ * Remove a message and move the newer messages down
+ */
+void MQTTOutbox::_remove(byte index) {
+  for (byte i = index + 1; i < _messageCount; i++) {
+    _messages[i - 1] = std::move(_messages[i]);
+  }
+  _messageCount -= 1;
+
+  // Leave the now unused slot empty
+  _messages[_messageCount].topic = "";
+  _messages[_messageCount].payload = "";
+}
@@ -0,0 +1,57 @@
+/*============================================================================*\
+ * Garage Bot - mqttOutbox
+ * Peter Eldred 2021-08
+ *
+ * The messages waiting to be published to the MQTT broker. Messages are kept
+ * (in the order they were queued) until the broker acknowledges them with a
+ * PUBACK, so nothing is lost while the broker is unreachable.
+\*============================================================================*/
+
+#ifndef MQTTOUTBOX_H
+#define MQTTOUTBOX_H
+
+#include <functional>
+#include "Arduino.h"
+#include "_config.h"
+
+// A message waiting to be published
+struct MQTTOutboxMessage {
+  String topic;
+  String payload;
+  bool retain;
+  uint16_t packetId;                              // The packet identifier used on the current connection (0 = not sent yet)
+  unsigned long queuedAt;                         // the millis() that the message was queued
+  unsigned long sentAt;                           // the millis() that the message was last sent
+};
+
+// Called for each message that needs to be sent (or sent again). Returns false if the message couldn't be sent.
+typedef std::function<bool(MQTTOutboxMessage &message, bool dup)> mqttOutboxSendFunction;
+
+class MQTTOutbox {
+  public:
+    MQTTOutbox();
+
+    void init();                                  // Create the lock. Call before any messages are queued.
+
+    void enqueue(const char *topic, const char *payload, bool retain, unsigned long currentMillis);  // Queue a message, replacing any message still waiting on the same topic
+    void deliver(unsigned long currentMillis, mqttOutboxSendFunction send);  // Send the messages that haven't been sent (or acknowledged in time), oldest first
+    void acknowledge(uint16_t packetId, unsigned long currentMillis);        // The broker acknowledged a message
+    void resend();                                // Forget what was sent on the previous connection so that everything is sent again
+    byte depth();                                 // The number of messages waiting
+
+    uint32_t deliveredCount = 0;                  // The number of messages acknowledged by the broker since boot
+    uint32_t droppedCount = 0;                    // The number of messages dropped because the outbox was full
+    uint32_t replacedCount = 0;                   // The number of messages replaced by a newer message on the same topic
+    uint32_t retransmitCount = 0;                 // The number of messages sent again because they weren't acknowledged in time
+    uint64_t deliveryMillisTotal = 0;             // The total time between messages being queued and acknowledged
+    uint32_t deliveryMillisMax = 0;               // The longest time between a message being queued and acknowledged
+
+  private:
+    MQTTOutboxMessage _messages[MQTT_OUTBOX_MAX_MESSAGES];  // The messages (oldest first)
+    byte _messageCount = 0;                       // The number of messages waiting
+    SemaphoreHandle_t _lock = NULL;               // Guards the messages. Messages are queued and sent by the main loop and acknowledged on the AsyncTCP task.
+
+    void _remove(byte index);                     // Remove a message and move the newer messages down
+};
+
+#endif
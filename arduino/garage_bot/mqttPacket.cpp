@@ -0,0 +1,373 @@
+/*============================================================================*\
+ * Garage Bot - mqttPacket
+ * Peter Eldred 2021-08
+ *
+ * A small, allocation free MQTT 3.1.1 codec. The encoders write a complete
+ * control packet into a caller supplied buffer and the reader assembles the
+ * packets received from the broker out of however the TCP stream happens to
+ * be chunked. Nothing in here touches the network.
+ *
+ * @see http://docs.oasis-open.org/mqtt/mqtt/v3.1.1/mqtt-v3.1.1.html
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "_config.h"
+#include "mqttPacket.h"
+
+// The largest value that fits in the four byte "remaining length"
+#define MQTT_MAX_REMAINING_LENGTH 268435455UL
+
+
+/**
+ * The number of bytes needed to encode a remaining length
+ */
+static size_t remainingLengthSize(size_t remainingLength) {
+  if (remainingLength < 128) {
+    return 1;
+  } else if (remainingLength < 16384) {
+    return 2;
+  } else if (remainingLength < 2097152) {
+    return 3;
+  }
+  return 4;
+}
+
+
+/**
+ * Write the fixed header of a packet
+ *
+ * @return size_t the length of the fixed header or 0 if the packet doesn't fit in the buffer
+ */
+static size_t writeFixedHeader(uint8_t *buffer, size_t size, uint8_t header, size_t remainingLength) {
+  if (remainingLength > MQTT_MAX_REMAINING_LENGTH) {
+    return 0;
+  }
+
+  size_t headerLength = 1 + remainingLengthSize(remainingLength);
+  if ((headerLength + remainingLength) > size) {
+    return 0;
+  }
+
+  buffer[0] = header;
+  size_t pos = 1;
+  do {
+    uint8_t encoded = remainingLength % 128;
+    remainingLength /= 128;
+    if (remainingLength > 0) {
+      encoded |= 0x80;
+    }
+    buffer[pos++] = encoded;
+  } while (remainingLength > 0);
+
+  return pos;
+}
+
+
+/**
+ * Write a 16 bit big endian integer
+ */
+static size_t writeUInt16(uint8_t *buffer, uint16_t value) {
+  buffer[0] = value >> 8;
+  buffer[1] = value & 0xFF;
+  return 2;
+}
+
+
+/**
+ * Write a length prefixed UTF-8 string
+ */
+static size_t writeString(uint8_t *buffer, const char *str, size_t len) {
+  writeUInt16(buffer, len);
+  memcpy(buffer + 2, str, len);
+  return 2 + len;
+}
+
+
+/**
+ * Whether an optional string has been provided
+ */
+static bool hasValue(const char *str) {
+  return (str != NULL) && (str[0] != '\0');
+}
+
+
+/**
+ * Encode a CONNECT packet
+ */
+size_t mqttEncodeConnect(uint8_t *buffer, size_t size, const MQTTConnectOptions &options) {
+  size_t clientIdLength = strlen(options.clientId);
+  size_t usernameLength = hasValue(options.username) ? strlen(options.username) : 0;
+  size_t passwordLength = hasValue(options.password) ? strlen(options.password) : 0;
+  bool hasWill = hasValue(options.willTopic);
+  size_t willTopicLength = hasWill ? strlen(options.willTopic) : 0;
+  size_t willMessageLength = (hasWill && (options.willMessage != NULL)) ? strlen(options.willMessage) : 0;
+
+  // Variable header: protocol name (6), level (1), flags (1), keep alive (2)
+  size_t remainingLength = 10 + 2 + clientIdLength;
+  if (hasWill) {
+    remainingLength += 2 + willTopicLength + 2 + willMessageLength;
+  }
+  if (usernameLength > 0) {
+    remainingLength += 2 + usernameLength;
+  }
+  if (passwordLength > 0) {
+    remainingLength += 2 + passwordLength;
+  }
+
+  size_t pos = writeFixedHeader(buffer, size, MQTT_PACKET_CONNECT << 4, remainingLength);
+  if (pos == 0) {
+    return 0;
+  }
+
+  uint8_t flags = 0;
+  if (options.cleanSession) {
+    flags |= 0x02;
+  }
+  if (hasWill) {
+    flags |= 0x04 | ((options.willQos & 0x03) << 3);
+    if (options.willRetain) {
+      flags |= 0x20;
+    }
+  }
+  if (usernameLength > 0) {
+    flags |= 0x80;
+  }
+  if (passwordLength > 0) {
+    flags |= 0x40;
+  }
+
+  pos += writeString(buffer + pos, "MQTT", 4);
+  buffer[pos++] = 4; // Protocol level 3.1.1
+  buffer[pos++] = flags;
+  pos += writeUInt16(buffer + pos, options.keepAlive);
+
+  pos += writeString(buffer + pos, options.clientId, clientIdLength);
+  if (hasWill) {
+    pos += writeString(buffer + pos, options.willTopic, willTopicLength);
+    pos += writeString(buffer + pos, options.willMessage, willMessageLength);
+  }
+  if (usernameLength > 0) {
+    pos += writeString(buffer + pos, options.username, usernameLength);
+  }
+  if (passwordLength > 0) {
+    pos += writeString(buffer + pos, options.password, passwordLength);
+  }
+
+  return pos;
+}
+
+
+/**
+ * Encode a PUBLISH packet
+ */
+size_t mqttEncodePublish(uint8_t *buffer, size_t size, const char *topic, const uint8_t *payload, size_t payloadLength, uint8_t qos, bool retain, uint16_t packetId) {
+  size_t topicLength = strlen(topic);
+  size_t remainingLength = 2 + topicLength + ((qos > 0) ? 2 : 0) + payloadLength;
+
+  uint8_t header = (MQTT_PACKET_PUBLISH << 4) | ((qos & 0x03) << 1) | (retain ? 0x01 : 0x00);
+  size_t pos = writeFixedHeader(buffer, size, header, remainingLength);
+  if (pos == 0) {
+    return 0;
+  }
+
+  pos += writeString(buffer + pos, topic, topicLength);
+  if (qos > 0) {
+    pos += writeUInt16(buffer + pos, packetId);
+  }
+  memcpy(buffer + pos, payload, payloadLength);
+
+  return pos + payloadLength;
+}
+
+
+/**
+ * Encode a SUBSCRIBE packet for a single topic filter
+ */
+size_t mqttEncodeSubscribe(uint8_t *buffer, size_t size, uint16_t packetId, const char *topicFilter, uint8_t qos) {
+  size_t topicLength = strlen(topicFilter);
+  size_t remainingLength = 2 + 2 + topicLength + 1;
+
+  // The reserved flags of a SUBSCRIBE are 0b0010
+  size_t pos = writeFixedHeader(buffer, size, (MQTT_PACKET_SUBSCRIBE << 4) | 0x02, remainingLength);
+  if (pos == 0) {
+    return 0;
+  }
+
+  pos += writeUInt16(buffer + pos, packetId);
+  pos += writeString(buffer + pos, topicFilter, topicLength);
+  buffer[pos++] = qos & 0x03;
+
+  return pos;
+}
+
+
+/**
+ * Encode a packet that has no variable header or payload (PINGREQ, DISCONNECT)
+ */
+size_t mqttEncodeEmpty(uint8_t *buffer, size_t size, MQTTPacketType type) {
+  return writeFixedHeader(buffer, size, type << 4, 0);
+}
+
+
+/**
+ * Encode a packet that only carries a packet identifier (PUBACK)
+ */
+size_t mqttEncodePacketId(uint8_t *buffer, size_t size, MQTTPacketType type, uint16_t packetId) {
+  size_t pos = writeFixedHeader(buffer, size, type << 4, 2);
+  if (pos == 0) {
+    return 0;
+  }
+  return pos + writeUInt16(buffer + pos, packetId);
+}
+
+
+/**
+ * Split a received PUBLISH packet into its topic and payload
+ */
+bool mqttParsePublish(const MQTTPacket &packet, MQTTPublish &publish) {
+  if ((packet.type != MQTT_PACKET_PUBLISH) || (packet.length < 2)) {
+    return false;
+  }
+
+  publish.qos = (packet.flags >> 1) & 0x03;
+  publish.retain = (packet.flags & 0x01) != 0;
+  publish.topicLength = (packet.body[0] << 8) | packet.body[1];
+  publish.topic = (const char*)(packet.body + 2);
+
+  size_t pos = 2 + publish.topicLength;
+  if ((publish.qos > 0) && ((pos + 2) <= packet.length)) {
+    publish.packetId = (packet.body[pos] << 8) | packet.body[pos + 1];
+    pos += 2;
+  } else if (publish.qos > 0) {
+    return false;
+  } else {
+    publish.packetId = 0;
+  }
+
+  if (pos > packet.length) {
+    return false;
+  }
+
+  publish.payload = packet.body + pos;
+  publish.payloadLength = packet.length - pos;
+
+  return true;
+}
+
+
+/**
+ * Constructor
+ */
+MQTTPacketReader::MQTTPacketReader() {
+  reset();
+}
+
+
+/**
+ * Discard anything partially received (ie. when the connection is re-established)
+ */
+void MQTTPacketReader::reset() {
+  _state = READER_FIXED_HEADER;
+  _header = 0;
+  _remainingLength = 0;
+  _lengthShift = 0;
+  _received = 0;
+}
+
+
+/**
+ * Consume received bytes up to the end of the next packet
+ *
+ * @param data the received bytes
+ * @param len the number of received bytes
+ * @return size_t the number of bytes consumed. Check ready() and feed the rest after handling the packet.
+ */
+size_t MQTTPacketReader::feed(const uint8_t *data, size_t len) {
+  size_t pos = 0;
+
+  while ((pos < len) && (_state != READER_READY)) {
+    switch (_state) {
+      case READER_FIXED_HEADER:
+        _header = data[pos++];
+        _remainingLength = 0;
+        _lengthShift = 0;
+        _received = 0;
+        _state = READER_REMAINING_LENGTH;
+        break;
+
+      case READER_REMAINING_LENGTH: {
+        uint8_t encoded = data[pos++];
+        _remainingLength |= (size_t)(encoded & 0x7F) << _lengthShift;
+        _lengthShift += 7;
+
+        // More length bytes to come (a remaining length is never more than 4 bytes)
+        if ((encoded & 0x80) && (_lengthShift < 28)) {
+          break;
+        }
+
+        if (_remainingLength > MQTT_MAX_PACKET_SIZE) {
+          skippedCount += 1;
+          _state = READER_SKIPPING;
+        } else {
+          _state = (_remainingLength == 0) ? READER_READY : READER_BODY;
+        }
+        break;
+      }
+
+      case READER_BODY: {
+        size_t chunk = min(len - pos, _remainingLength - _received);
+        memcpy(_buffer + _received, data + pos, chunk);
+        _received += chunk;
+        pos += chunk;
+        if (_received == _remainingLength) {
+          _state = READER_READY;
+        }
+        break;
+      }
+
+      case READER_SKIPPING: {
+        size_t chunk = min(len - pos, _remainingLength - _received);
+        _received += chunk;
+        pos += chunk;
+        if (_received == _remainingLength) {
+          _state = READER_FIXED_HEADER;
+        }
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+
+  return pos;
+}
+
+
+/**
+ * Whether a complete packet has been received
+ */
+bool MQTTPacketReader::ready() {
+  return _state == READER_READY;
+}
+
+
+/**
+ * The complete packet
+ */
+MQTTPacket MQTTPacketReader::packet() {
+  MQTTPacket packet;
+  packet.type = (MQTTPacketType)(_header >> 4);
+  packet.flags = _header & 0x0F;
+  packet.body = _buffer;
+  packet.length = _remainingLength;
+  return packet;
+}
+
+
+/**
+ * Start receiving the next packet
+ */
+void MQTTPacketReader::next() {
+  _state = READER_FIXED_HEADER;
+}
@@ -0,0 +1,144 @@
+/*============================================================================*\
+ * Garage Bot - mqttPacket
+ * Peter Eldred 2021-08
+ *
+ * A small, allocation free MQTT 3.1.1 codec. The encoders write a complete
+ * control packet into a caller supplied buffer and the reader assembles the
+ * packets received from the broker out of however the TCP stream happens to
+ * be chunked. Nothing in here touches the network.
+\*============================================================================*/
+
+#ifndef MQTTPACKET_H
+#define MQTTPACKET_H
+
+#include "Arduino.h"
+#include "_config.h"
+
+// MQTT control packet types (the high nibble of the first byte of a packet)
+enum MQTTPacketType {
+  MQTT_PACKET_CONNECT     = 1,
+  MQTT_PACKET_CONNACK     = 2,
+  MQTT_PACKET_PUBLISH     = 3,
+  MQTT_PACKET_PUBACK      = 4,
+  MQTT_PACKET_SUBSCRIBE   = 8,
+  MQTT_PACKET_SUBACK      = 9,
+  MQTT_PACKET_PINGREQ     = 12,
+  MQTT_PACKET_PINGRESP    = 13,
+  MQTT_PACKET_DISCONNECT  = 14,
+};
+
+// The DUP flag of a PUBLISH packet (set on the first byte when the packet is sent again)
+#define MQTT_PUBLISH_FLAG_DUP 0x08
+
+// The details of a CONNECT packet
+struct MQTTConnectOptions {
+  const char *clientId = "";
+  const char *username = NULL;                    // NULL or empty for no username
+  const char *password = NULL;                    // NULL or empty for no password
+  uint16_t keepAlive = 0;                         // Seconds
+  bool cleanSession = true;
+  const char *willTopic = NULL;                   // NULL or empty for no Last Will and Testament
+  const char *willMessage = "";                   // Published by the broker if the connection is lost without a DISCONNECT
+  uint8_t willQos = 0;
+  bool willRetain = false;
+};
+
+// A packet received from the broker. The body points into the reader's buffer.
+struct MQTTPacket {
+  MQTTPacketType type;
+  uint8_t flags;                                  // The low nibble of the first byte (PUBLISH: dup, qos, retain)
+  const uint8_t *body;                            // The variable header and payload
+  size_t length;                                  // The length of the body
+};
+
+// A PUBLISH packet received from the broker. The topic and payload point into the packet (neither are null terminated).
+struct MQTTPublish {
+  const char *topic;
+  uint16_t topicLength;
+  const uint8_t *payload;
+  size_t payloadLength;
+  uint8_t qos;
+  bool retain;
+  uint16_t packetId;                              // Only present when qos > 0
+};
+
+/**
+ * Encode a CONNECT packet
+ *
+ * @return size_t the length of the packet or 0 if it doesn't fit in the buffer
+ */
+size_t mqttEncodeConnect(uint8_t *buffer, size_t size, const MQTTConnectOptions &options);
+
+/**
+ * Encode a PUBLISH packet
+ *
+ * @param packetId ignored when qos is 0
+ * @return size_t the length of the packet or 0 if it doesn't fit in the buffer
+ */
+size_t mqttEncodePublish(uint8_t *buffer, size_t size, const char *topic, const uint8_t *payload, size_t payloadLength, uint8_t qos, bool retain, uint16_t packetId);
+
+/**
+ * Encode a SUBSCRIBE packet for a single topic filter
+ *
+ * @return size_t the length of the packet or 0 if it doesn't fit in the buffer
+ */
+size_t mqttEncodeSubscribe(uint8_t *buffer, size_t size, uint16_t packetId, const char *topicFilter, uint8_t qos);
+
+/**
+ * Encode a packet that has no variable header or payload (PINGREQ, DISCONNECT)
+ *
+ * @return size_t the length of the packet (2) or 0 if it doesn't fit in the buffer
+ */
+size_t mqttEncodeEmpty(uint8_t *buffer, size_t size, MQTTPacketType type);
+
+/**
+ * Encode a packet that only carries a packet identifier (PUBACK)
+ *
+ * @return size_t the length of the packet (4) or 0 if it doesn't fit in the buffer
+ */
+size_t mqttEncodePacketId(uint8_t *buffer, size_t size, MQTTPacketType type, uint16_t packetId);
+
+/**
+ * Split a received PUBLISH packet into its topic and payload
+ *
+ * @return bool false if the packet is malformed
+ */
+bool mqttParsePublish(const MQTTPacket &packet, MQTTPublish &publish);
+
+/**
+ * Assembles the packets received from the broker
+ *
+ * Feed it the received bytes until a packet is ready, handle the packet and then
+ * carry on feeding it the remaining bytes. Packets which are too large for the
+ * buffer are skipped.
+ */
+class MQTTPacketReader {
+  public:
+    MQTTPacketReader();
+
+    void reset();                                 // Discard anything partially received
+    size_t feed(const uint8_t *data, size_t len); // Consume bytes up to the end of the next packet. Returns the number of bytes consumed.
+    bool ready();                                 // Whether a complete packet has been received
+    MQTTPacket packet();                          // The complete packet. Call next() once it has been handled.
+    void next();                                  // Start receiving the next packet
+
+    uint32_t skippedCount = 0;                    // The number of packets skipped because they were too large
+
+  private:
+    enum ReaderState {
+      READER_FIXED_HEADER,                        // Waiting for the first byte
+      READER_REMAINING_LENGTH,                    // Decoding the variable length "remaining length"
+      READER_BODY,                                // Receiving the body
+      READER_SKIPPING,                            // Discarding the body of a packet that is too large
+      READER_READY,                               // A complete packet is waiting to be handled
+    };
+
+    ReaderState _state;
+    uint8_t _header;                              // The first byte of the packet
+    size_t _remainingLength;                      // The length of the body
+    uint8_t _lengthShift;                         // The bit shift of the next remaining length byte
+    size_t _received;                             // The number of body bytes received (or skipped)
+    uint8_t _buffer[MQTT_MAX_PACKET_SIZE];        // The body of the packet
+};
+
+#endif
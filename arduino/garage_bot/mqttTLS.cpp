@@ -0,0 +1,372 @@
+/*============================================================================*\
+ * Garage Bot - mqttTLS
+ * Peter Eldred 2021-08
+ *
+ * A TLS layer (mbedtls) that runs on top of the MQTT client's AsyncClient, so
+ * the connection to the broker can be encrypted without giving up the non
+ * blocking client. The TLS session is kept between connections so that a
+ * reconnect can resume it rather than doing a full handshake.
+ *
+ * The encrypted data received on the AsyncTCP task is only copied into the
+ * input buffer. The received data isn't acknowledged to the broker until
+ * mbedtls has consumed it, which stops the broker sending more than the
+ * buffer holds.
+ *
+ * The handshake runs on a task of its own, as the key exchange and
+ * certificate checks of a full handshake take hundreds of milliseconds on the
+ * ESP32. The main loop only polls for the result. Once the handshake is
+ * complete the task is idle and the decryption and encryption happen on the
+ * main loop.
+ *
+ * The broker's certificate must be signed by the pinned CA and match the
+ * broker address. The session (ID or ticket) negotiated by the last complete
+ * handshake is offered on the next connection. When the broker accepts it the
+ * expensive key exchange is skipped.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "mbedtls/error.h"
+#include "_config.h"
+#include "mqttTLS.h"
+
+// Identifies our use of the random number generator
+static const char *DRBG_PERSONALIZATION = "garage_bot_mqtt";
+
+
+/**
+ * Constructor
+ */
+MQTTTLS::MQTTTLS() :
+  _handshakeState(MQTT_TLS_HANDSHAKE_IN_PROGRESS),
+  _handshakeRunning(false),
+  _handshakeAborted(false) {}
+
+
+/**
+ * Configure TLS
+ *
+ * @param caCert the PEM encoded CA certificate that the broker's certificate must be signed by
+ * @param hostname the broker address (checked against the broker's certificate)
+ * @return bool false if TLS couldn't be configured (ie. the certificate is invalid)
+ */
+bool MQTTTLS::init(const String &caCert, const char *hostname) {
+  _lock = xSemaphoreCreateMutex();
+
+  mbedtls_ssl_init(&_ssl);
+  mbedtls_ssl_config_init(&_conf);
+  mbedtls_x509_crt_init(&_caCert);
+  mbedtls_entropy_init(&_entropy);
+  mbedtls_ctr_drbg_init(&_drbg);
+  mbedtls_ssl_session_init(&_session);
+
+  // The PEM parser expects the length to include the null terminator
+  _lastError = mbedtls_x509_crt_parse(&_caCert, (const unsigned char*)caCert.c_str(), caCert.length() + 1);
+  if (_lastError != 0) {
+    return false;
+  }
+
+  _lastError = mbedtls_ctr_drbg_seed(&_drbg, mbedtls_entropy_func, &_entropy, (const unsigned char*)DRBG_PERSONALIZATION, strlen(DRBG_PERSONALIZATION));
+  if (_lastError != 0) {
+    return false;
+  }
+
+  _lastError = mbedtls_ssl_config_defaults(&_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  if (_lastError != 0) {
+    return false;
+  }
+
+  mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  mbedtls_ssl_conf_ca_chain(&_conf, &_caCert, NULL);
+  mbedtls_ssl_conf_rng(&_conf, mbedtls_ctr_drbg_random, &_drbg);
+  #if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  mbedtls_ssl_conf_session_tickets(&_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+  #endif
+
+  _lastError = mbedtls_ssl_setup(&_ssl, &_conf);
+  if (_lastError != 0) {
+    return false;
+  }
+
+  _lastError = mbedtls_ssl_set_hostname(&_ssl, hostname);
+  if (_lastError != 0) {
+    return false;
+  }
+
+  mbedtls_ssl_set_bio(&_ssl, this, MQTTTLS::_send, MQTTTLS::_receive, NULL);
+
+  _handshakeRequest = xSemaphoreCreateBinary();
+  if (xTaskCreatePinnedToCore(MQTTTLS::_handshakeTaskMain, "mqttTLS", MQTT_TLS_HANDSHAKE_TASK_STACK_SIZE, this, MQTT_TLS_HANDSHAKE_TASK_PRIORITY, &_handshakeTask, MQTT_TLS_HANDSHAKE_TASK_CORE) != pdPASS) {
+    _lastError = MBEDTLS_ERR_SSL_ALLOC_FAILED;
+    return false;
+  }
+
+  return true;
+}
+
+
+/**
+ * Start a handshake on a newly opened connection
+ *
+ * @param client the connection to the broker
+ * @return bool false if the handshake task is still winding down the handshake of the last connection
+ */
+bool MQTTTLS::begin(AsyncClient *client) {
+  if (_handshakeRunning.load()) {
+    return false;
+  }
+
+  _client = client;
+  _resumed = false;
+  _lastError = 0;
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _inputLength = 0;
+  xSemaphoreGive(_lock);
+
+  mbedtls_ssl_session_reset(&_ssl);
+
+  // Offer the broker the session from the last connection
+  _offeredSession = _hasSession && (mbedtls_ssl_set_session(&_ssl, &_session) == 0);
+
+  _handshakeStarted = micros();
+  _handshakeAborted = false;
+  _handshakeState = MQTT_TLS_HANDSHAKE_IN_PROGRESS;
+  _handshakeRunning = true;
+  xSemaphoreGive(_handshakeRequest);
+
+  return true;
+}
+
+
+/**
+ * Whether the handshake is complete
+ *
+ * @return MQTTTLSHandshakeResult the state of the handshake on the current connection
+ */
+MQTTTLSHandshakeResult MQTTTLS::handshake() {
+  return (MQTTTLSHandshakeResult)_handshakeState.load();
+}
+
+
+/**
+ * The connection has closed, stop the handshake task waiting on the broker
+ */
+void MQTTTLS::end() {
+  _handshakeAborted = true;
+  if (_handshakeRunning.load()) {
+    xTaskNotifyGive(_handshakeTask);
+  }
+}
+
+
+/**
+ * Encrypted data received from the broker
+ * @note: fired on the AsyncTCP task. The caller should ackLater() so the data is only acknowledged once consumed.
+ */
+void MQTTTLS::received(const uint8_t *data, size_t len) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+
+  // The receive window is smaller than the buffer and the data isn't acknowledged until it has been consumed, so this shouldn't happen
+  size_t chunk = min(len, MQTT_TLS_INPUT_BUFFER_SIZE - _inputLength);
+  memcpy(_input + _inputLength, data, chunk);
+  _inputLength += chunk;
+
+  xSemaphoreGive(_lock);
+
+  // Wake the handshake task if it is waiting on the broker
+  if (_handshakeRunning.load()) {
+    xTaskNotifyGive(_handshakeTask);
+  }
+}
+
+
+/**
+ * Decrypt the data received from the broker
+ *
+ * @param buffer where to put the decrypted data
+ * @param size the size of the buffer
+ * @return size_t the number of decrypted bytes (0 if there is nothing to read)
+ */
+size_t MQTTTLS::read(uint8_t *buffer, size_t size) {
+  if (_handshakeState.load() != MQTT_TLS_HANDSHAKE_COMPLETE) {
+    return 0;
+  }
+
+  int result = mbedtls_ssl_read(&_ssl, buffer, size);
+  if (result > 0) {
+    return result;
+  }
+
+  if ((result != MBEDTLS_ERR_SSL_WANT_READ) && (result != MBEDTLS_ERR_SSL_WANT_WRITE)) {
+    _lastError = result;
+  }
+  return 0;
+}
+
+
+/**
+ * Encrypt data and queue it to be sent to the broker
+ * @note: when this fails part of an encrypted record may already be on the connection (or held by mbedtls to be sent
+ *        by the next write, in place of whatever that is given). The connection can't carry on and must be closed.
+ *
+ * @return bool false if the data couldn't be queued in full
+ */
+bool MQTTTLS::write(const uint8_t *data, size_t len) {
+  if (_handshakeState.load() != MQTT_TLS_HANDSHAKE_COMPLETE) {
+    return false;
+  }
+
+  while (len > 0) {
+    int result = mbedtls_ssl_write(&_ssl, data, len);
+    if (result <= 0) {
+      _lastError = result;
+      return false;
+    }
+    data += result;
+    len -= result;
+  }
+
+  return true;
+}
+
+
+/**
+ * A description of the last TLS error
+ */
+String MQTTTLS::getError() {
+  char error[100];
+  mbedtls_strerror(_lastError, error, sizeof(error));
+  return String(error);
+}
+
+
+/**
+ * The handshake task: runs a handshake each time begin() asks for one
+ */
+void MQTTTLS::_handshakeTaskMain(void *parameter) {
+  MQTTTLS *tls = (MQTTTLS*)parameter;
+
+  for (;;) {
+    xSemaphoreTake(tls->_handshakeRequest, portMAX_DELAY);
+    tls->_runHandshake();
+    tls->_handshakeRunning = false;
+  }
+}
+
+
+/**
+ * Run the handshake until it completes, fails or the connection closes
+ */
+void MQTTTLS::_runHandshake() {
+  // Forget any wake ups left over from the last connection
+  ulTaskNotifyTake(pdTRUE, 0);
+
+  for (;;) {
+    if (_handshakeAborted.load()) {
+      _handshakeState = MQTT_TLS_HANDSHAKE_FAILED;
+      return;
+    }
+
+    int result = mbedtls_ssl_handshake(&_ssl);
+    if (result == 0) {
+      break;
+    }
+
+    // Wait for the broker to send more (received() wakes us) or for room to send. Check for an abandoned handshake now and then.
+    if ((result == MBEDTLS_ERR_SSL_WANT_READ) || (result == MBEDTLS_ERR_SSL_WANT_WRITE)) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MQTT_TLS_HANDSHAKE_POLL_INTERVAL));
+      continue;
+    }
+
+    _lastError = result;
+
+    // The broker may have forgotten the session, don't offer it again
+    if (_offeredSession) {
+      _hasSession = false;
+    }
+    _handshakeState = MQTT_TLS_HANDSHAKE_FAILED;
+    return;
+  }
+
+  _handshakeCompleted();
+  _handshakeState = MQTT_TLS_HANDSHAKE_COMPLETE;
+}
+
+
+/**
+ * Keep the session to offer on the next connection and record how long the handshake took
+ */
+void MQTTTLS::_handshakeCompleted() {
+  lastHandshakeMicros = micros() - _handshakeStarted;
+
+  // Resuming a session carries its master secret over, a full handshake derives a new one
+  unsigned char offeredMaster[sizeof(_session.master)];
+  memcpy(offeredMaster, _session.master, sizeof(offeredMaster));
+
+  mbedtls_ssl_session_free(&_session);
+  mbedtls_ssl_session_init(&_session);
+  _hasSession = (mbedtls_ssl_get_session(&_ssl, &_session) == 0);
+  _resumed = _offeredSession && _hasSession && (memcmp(offeredMaster, _session.master, sizeof(offeredMaster)) == 0);
+
+  if (_resumed) {
+    resumedHandshakeCount += 1;
+    resumedHandshakeMicrosTotal += lastHandshakeMicros;
+  } else {
+    fullHandshakeCount += 1;
+    fullHandshakeMicrosTotal += lastHandshakeMicros;
+  }
+
+  #ifdef SERIAL_DEBUG
+  Serial.print(_resumed ? "  - TLS session resumed in " : "  - TLS handshake completed in ");
+  Serial.print(lastHandshakeMicros / 1000);
+  Serial.println("ms");
+  #endif
+}
+
+
+/**
+ * mbedtls BIO: queue encrypted data on the connection
+ */
+int MQTTTLS::_send(void *context, const unsigned char *buffer, size_t len) {
+  MQTTTLS *tls = (MQTTTLS*)context;
+
+  size_t space = tls->_client->space();
+  if (space == 0) {
+    return MBEDTLS_ERR_SSL_WANT_WRITE;
+  }
+
+  size_t added = tls->_client->add((const char*)buffer, min(len, space));
+  if (added == 0) {
+    return MBEDTLS_ERR_SSL_WANT_WRITE;
+  }
+  tls->_client->send();
+
+  return added;
+}
+
+
+/**
+ * mbedtls BIO: take encrypted data from the input buffer
+ */
+int MQTTTLS::_receive(void *context, unsigned char *buffer, size_t len) {
+  MQTTTLS *tls = (MQTTTLS*)context;
+
+  xSemaphoreTake(tls->_lock, portMAX_DELAY);
+
+  if (tls->_inputLength == 0) {
+    xSemaphoreGive(tls->_lock);
+    return MBEDTLS_ERR_SSL_WANT_READ;
+  }
+
+  size_t chunk = min(len, tls->_inputLength);
+  memcpy(buffer, tls->_input, chunk);
+  memmove(tls->_input, tls->_input + chunk, tls->_inputLength - chunk);
+  tls->_inputLength -= chunk;
+
+  xSemaphoreGive(tls->_lock);
+
+  // Now that the data has been consumed the broker can send more
+  tls->_client->ack(chunk);
+
+  return chunk;
+}
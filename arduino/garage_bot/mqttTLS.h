@@ -0,0 +1,84 @@
+/*============================================================================*\
+ * Garage Bot - mqttTLS
+ * Peter Eldred 2021-08
+ *
+ * A TLS layer (mbedtls) that runs on top of the MQTT client's AsyncClient, so
+ * the connection to the broker can be encrypted without giving up the non
+ * blocking client. The TLS session is kept between connections so that a
+ * reconnect can resume it rather than doing a full handshake. The handshake
+ * itself runs on a task of its own.
+\*============================================================================*/
+
+#ifndef MQTTTLS_H
+#define MQTTTLS_H
+
+#include <atomic>
+#include "Arduino.h"
+#include "AsyncTCP.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "_config.h"
+
+// The state of the TLS handshake
+enum MQTTTLSHandshakeResult {
+  MQTT_TLS_HANDSHAKE_IN_PROGRESS,               // Waiting on the broker
+  MQTT_TLS_HANDSHAKE_COMPLETE,                  // Encrypted data can now be sent and received
+  MQTT_TLS_HANDSHAKE_FAILED,                    // The handshake failed (see getError())
+};
+
+class MQTTTLS {
+  public:
+    MQTTTLS();
+
+    bool init(const String &caCert, const char *hostname);  // Configure TLS with the pinned CA certificate (PEM). False if the certificate is invalid.
+    bool begin(AsyncClient *client);              // Start a handshake on a newly opened connection (main loop). False if the last one is still winding down.
+    MQTTTLSHandshakeResult handshake();           // Whether the handshake is complete (main loop)
+    void end();                                   // The connection has closed, abandon the handshake if it is still running (main loop)
+    void received(const uint8_t *data, size_t len);  // Encrypted data received from the broker (AsyncTCP task)
+    size_t read(uint8_t *buffer, size_t size);    // Decrypt the data received from the broker (main loop)
+    bool write(const uint8_t *data, size_t len);  // Encrypt data and queue it to be sent to the broker (main loop). False means the connection must be closed.
+    String getError();                            // A description of the last TLS error
+
+    uint32_t fullHandshakeCount = 0;              // The number of full handshakes completed since boot
+    uint32_t resumedHandshakeCount = 0;           // The number of handshakes that resumed a cached session since boot
+    uint64_t fullHandshakeMicrosTotal = 0;        // The total time spent in full handshakes
+    uint64_t resumedHandshakeMicrosTotal = 0;     // The total time spent in resumed handshakes
+    uint32_t lastHandshakeMicros = 0;             // The duration of the most recent handshake
+
+  private:
+    mbedtls_ssl_context _ssl;
+    mbedtls_ssl_config _conf;
+    mbedtls_x509_crt _caCert;
+    mbedtls_entropy_context _entropy;
+    mbedtls_ctr_drbg_context _drbg;
+    mbedtls_ssl_session _session;                 // The session of the last successful handshake (offered to the broker on reconnect)
+    bool _hasSession = false;                     // Whether a session has been cached
+
+    bool _offeredSession = false;                 // Whether the cached session was offered in the current handshake
+
+    AsyncClient *_client = NULL;                  // The connection the TLS is running over
+    std::atomic<uint8_t> _handshakeState;         // The MQTTTLSHandshakeResult of the current connection. Set by the handshake task.
+    std::atomic<bool> _handshakeRunning;          // Whether the handshake task is busy with a handshake
+    std::atomic<bool> _handshakeAborted;          // Set when the connection closes to stop the handshake task waiting on the broker
+    bool _resumed = false;                        // Whether the broker agreed to resume the cached session
+    unsigned long _handshakeStarted = 0;          // the micros() that the current handshake started
+    int _lastError = 0;                           // The last mbedtls error
+
+    uint8_t _input[MQTT_TLS_INPUT_BUFFER_SIZE];   // Encrypted data received from the broker that mbedtls hasn't consumed yet
+    size_t _inputLength = 0;                      // The number of bytes in the input buffer
+    SemaphoreHandle_t _lock = NULL;               // Guards the input buffer. Data is received on the AsyncTCP task and consumed by the handshake task / main loop.
+
+    TaskHandle_t _handshakeTask = NULL;           // Runs the handshakes. Notified when data is received during a handshake.
+    SemaphoreHandle_t _handshakeRequest = NULL;   // Given by begin() to start a handshake
+
+    static void _handshakeTaskMain(void *parameter);  // The handshake task
+    void _runHandshake();                         // Run a handshake to completion (handshake task)
+    void _handshakeCompleted();                   // Keep the session and record how long the handshake took (handshake task)
+
+    static int _send(void *context, const unsigned char *buffer, size_t len);  // mbedtls BIO: send encrypted data
+    static int _receive(void *context, unsigned char *buffer, size_t len);     // mbedtls BIO: receive encrypted data
+};
+
+#endif
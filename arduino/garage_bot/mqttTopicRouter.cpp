@@ -0,0 +1,170 @@
+/*============================================================================*\
+ * Garage Bot - mqttTopicRouter
+ * Peter Eldred 2021-08
+ *
+ * Routes the messages received from the MQTT broker to a handler based on
+ * their topic. The routes are registered once (before connecting) and double
+ * as the list of topic filters to subscribe to.
+ *
+ * Routes without wildcards are kept in a small hash table keyed on a hash of
+ * the topic, so the common case (an exact topic) is found without comparing
+ * against every route. Only when that misses are the wildcard (+ / #) routes
+ * checked one by one.
+ *
+ * The routes never change once the client is connected, so dispatching (on
+ * the AsyncTCP task) doesn't need a lock.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "_config.h"
+#include "mqttTopicRouter.h"
+
+
+/**
+ * Constructor
+ */
+MQTTTopicRouter::MQTTTopicRouter() {
+  for (byte i = 0; i < MQTT_ROUTER_HASH_BUCKETS; i++) {
+    _buckets[i] = -1;
+  }
+}
+
+
+/**
+ * Register a route
+ *
+ * @param topicFilter the topic filter to route (and subscribe to)
+ * @param qos the QoS to subscribe with
+ * @param handler called (on the AsyncTCP task) with each message that matches the topic filter
+ * @return bool false if there is no room for the route
+ */
+bool MQTTTopicRouter::add(const String &topicFilter, uint8_t qos, mqttRouteFunction handler) {
+  if (_routeCount >= MQTT_ROUTER_MAX_ROUTES) {
+    return false;
+  }
+
+  Route *route = &_routes[_routeCount];
+  route->topicFilter = topicFilter;
+  route->qos = qos;
+  route->wildcard = (topicFilter.indexOf('+') >= 0) || (topicFilter.indexOf('#') >= 0);
+  route->handler = handler;
+
+  if (!route->wildcard) {
+    uint32_t bucket = _hash(topicFilter.c_str(), topicFilter.length()) % MQTT_ROUTER_HASH_BUCKETS;
+    while (_buckets[bucket] != -1) {
+      bucket = (bucket + 1) % MQTT_ROUTER_HASH_BUCKETS;
+    }
+    _buckets[bucket] = _routeCount;
+  }
+
+  _routeCount += 1;
+  return true;
+}
+
+
+/**
+ * Call the handler of the route that matches the topic of a message
+ *
+ * @param publish the message received from the broker
+ * @return bool false if no route matched
+ */
+bool MQTTTopicRouter::dispatch(const MQTTPublish &publish) {
+  // Routes without wildcards
+  uint32_t bucket = _hash(publish.topic, publish.topicLength) % MQTT_ROUTER_HASH_BUCKETS;
+  while (_buckets[bucket] != -1) {
+    Route *route = &_routes[_buckets[bucket]];
+    if ((route->topicFilter.length() == publish.topicLength) && (memcmp(route->topicFilter.c_str(), publish.topic, publish.topicLength) == 0)) {
+      route->handler(publish);
+      return true;
+    }
+    bucket = (bucket + 1) % MQTT_ROUTER_HASH_BUCKETS;
+  }
+
+  // Routes with wildcards
+  for (byte i = 0; i < _routeCount; i++) {
+    if (_routes[i].wildcard && _matches(_routes[i].topicFilter.c_str(), publish.topic, publish.topicLength)) {
+      _routes[i].handler(publish);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+/**
+ * The number of routes
+ */
+byte MQTTTopicRouter::count() {
+  return _routeCount;
+}
+
+
+/**
+ * The topic filter of a route
+ */
+const char* MQTTTopicRouter::topicFilter(byte index) {
+  return _routes[index].topicFilter.c_str();
+}
+
+
+/**
+ * The QoS of a route
+ */
+uint8_t MQTTTopicRouter::qos(byte index) {
+  return _routes[index].qos;
+}
+
+
+/**
+ * FNV-1a hash of a (not null terminated) topic
+ */
+uint32_t MQTTTopicRouter::_hash(const char *topic, size_t length) {
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)topic[i]) * 16777619UL;
+  }
+  return hash;
+}
+
+
+/**
+ * Whether a topic filter with wildcards matches a (not null terminated) topic
+ *
+ * `+` matches exactly one level and `#` (which must be last) matches any number of levels,
+ * including the parent level (ie. "garage/#" matches "garage").
+ */
+bool MQTTTopicRouter::_matches(const char *topicFilter, const char *topic, size_t topicLength) {
+  // Wildcards don't match the broker's own $ topics
+  if ((topicLength > 0) && (topic[0] == '$') && ((topicFilter[0] == '+') || (topicFilter[0] == '#'))) {
+    return false;
+  }
+
+  size_t pos = 0;
+  while (*topicFilter != '\0') {
+    if (*topicFilter == '#') {
+      return true;
+    }
+
+    if (*topicFilter == '+') {
+      while ((pos < topicLength) && (topic[pos] != '/')) {
+        pos++;
+      }
+      topicFilter++;
+      continue;
+    }
+
+    // The topic has run out. Only a trailing "/#" can still match.
+    if (pos >= topicLength) {
+      return (topicFilter[0] == '/') && (topicFilter[1] == '#') && (topicFilter[2] == '\0');
+    }
+
+    if (*topicFilter != topic[pos]) {
+      return false;
+    }
+    topicFilter++;
+    pos++;
+  }
+
+  return pos == topicLength;
+}
@@ -0,0 +1,48 @@
+/*============================================================================*\
+ * Garage Bot - mqttTopicRouter
+ * Peter Eldred 2021-08
+ *
+ * Routes the messages received from the MQTT broker to a handler based on
+ * their topic. The routes are registered once (before connecting) and double
+ * as the list of topic filters to subscribe to.
+\*============================================================================*/
+
+#ifndef MQTTTOPICROUTER_H
+#define MQTTTOPICROUTER_H
+
+#include <functional>
+#include "Arduino.h"
+#include "_config.h"
+#include "mqttPacket.h"
+
+// Called with a message that matched a route
+typedef std::function<void(const MQTTPublish &publish)> mqttRouteFunction;
+
+class MQTTTopicRouter {
+  public:
+    MQTTTopicRouter();
+
+    bool add(const String &topicFilter, uint8_t qos, mqttRouteFunction handler);  // Register a route (call before connecting). False if there is no room.
+    bool dispatch(const MQTTPublish &publish);    // Call the handler of the route that matches the topic of a message. False if nothing matched.
+
+    byte count();                                 // The number of routes
+    const char* topicFilter(byte index);          // The topic filter of a route (to subscribe to)
+    uint8_t qos(byte index);                      // The QoS of a route (to subscribe with)
+
+  private:
+    struct Route {
+      String topicFilter;                         // The topic filter (may contain + and # wildcards)
+      uint8_t qos;                                // The QoS to subscribe with
+      bool wildcard;                              // Whether the topic filter contains a wildcard
+      mqttRouteFunction handler;
+    };
+
+    Route _routes[MQTT_ROUTER_MAX_ROUTES];
+    byte _routeCount = 0;
+    int8_t _buckets[MQTT_ROUTER_HASH_BUCKETS];    // Open addressed hash table of the routes without wildcards (the index of the route or -1)
+
+    static uint32_t _hash(const char *topic, size_t length);  // FNV-1a hash of a topic
+    static bool _matches(const char *topicFilter, const char *topic, size_t topicLength);  // Whether a wildcard topic filter matches a topic
+};
+
+#endif
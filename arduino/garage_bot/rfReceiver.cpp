@@ -53,6 +53,7 @@ void RFReceiver::run(unsigned long currentMillis) {
   } else {
     if (gbSwitch.available()) {
       int receivedCode = gbSwitch.getReceivedValue();
+      codesReceived += 1;
 
       // When listening for registered RF Codes to activate the door
       if (_mode == RF_RECEIVER_MODE_NORMAL) {
@@ -80,8 +81,11 @@ void RFReceiver::run(unsigned long currentMillis) {
           Serial.println("' received");
           #endif
 
+          codesMatched += 1;
           _handleButtonPressed(currentMillis);
         } else {
+          codesUnmatched += 1;
+
           #ifdef SERIAL_DEBUG
           Serial.print("Unregistered code '");
           Serial.print(receivedCode);
@@ -23,6 +23,10 @@ class RFReceiver {
     receiverModeChangedFunction onModeChanged;
     errorFunction onError;
 
+    uint32_t codesReceived = 0;                     // The number of RF codes received since boot
+    uint32_t codesMatched = 0;                      // The number of received RF codes that matched a registered remote
+    uint32_t codesUnmatched = 0;                    // The number of received RF codes that didn't match a registered remote
+
   private:
     RFReceiverMode _mode = RF_RECEIVER_MODE_NORMAL; // Whether the RF Receiver is registering a new remote or simply awaiting input
     bool _buttonPressed = false;                    // Whether the button on an RF Receiver is depressed
@@ -0,0 +1,107 @@
+/*============================================================================*\
+ * Garage Bot - serviceAdvertiser
+ * Peter Eldred 2021-08
+ *
+ * Advertises the web server and the Garage Bot API as mDNS services, with the
+ * firmware version, device name, door state and API capabilities in the TXT
+ * records, so that the apps can find the device (and its basic status)
+ * without opening a connection to it.
+ *
+ *   _http._tcp       path=/
+ *   _garagebot._tcp  fw=<firmware version>
+ *                    name=<device name>
+ *                    door=<OPEN | CLOSING | CLOSED | OPENING | UNKNOWN>
+ *                    api=<comma separated capabilities, ie. "ws,sse,metrics,mqtt,udp">
+ *                    udp_port=<the port of the UDP command server> (only when enabled)
+ *
+ * The responder re-announces a service whenever one of its TXT records is
+ * changed, so the records are only set when their value actually changes.
+ * The config (device name, capabilities) only changes across a reboot but is
+ * compared along with the door state all the same.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "ESPmDNS.h"
+#include "_config.h"
+#include "serviceAdvertiser.h"
+#include "doorControl.h"
+
+
+/**
+ * Constructor
+ */
+ServiceAdvertiser::ServiceAdvertiser() {}
+
+
+/**
+ * Add the services to the mDNS responder and set their TXT records
+ * @note: call once mDNS has been started (ie. each time the WiFi connects)
+ */
+void ServiceAdvertiser::advertise() {
+  if (!_advertised) {
+    MDNS.addService(MDNS_HTTP_SERVICE, "tcp", WEB_SERVER_PORT);
+    MDNS.addServiceTxt(MDNS_HTTP_SERVICE, "tcp", "path", "/");
+
+    MDNS.addService(MDNS_BOT_SERVICE, "tcp", WEB_SERVER_PORT);
+    MDNS.addServiceTxt(MDNS_BOT_SERVICE, "tcp", "fw", FIRMWARE_VERSION);
+    if (!config.udp_command_key.equals("")) {
+      MDNS.addServiceTxt(MDNS_BOT_SERVICE, "tcp", "udp_port", String(UDP_COMMAND_PORT).c_str());
+    }
+
+    _advertised = true;
+
+    // Make sure every record is set below
+    _deviceName = "";
+    _doorState = "";
+    _capabilities = "";
+  }
+
+  update();
+}
+
+
+/**
+ * Update any of the TXT records that have changed
+ */
+void ServiceAdvertiser::update() {
+  if (!_advertised) {
+    return;
+  }
+
+  _setTXT("name", _deviceName, config.device_name);
+  _setTXT("door", _doorState, doorControl.getDoorStateAsString());
+  _setTXT("api", _capabilities, _getCapabilities());
+}
+
+
+/**
+ * The comma separated list of the APIs that are available
+ */
+String ServiceAdvertiser::_getCapabilities() {
+  String capabilities = "ws,sse,metrics";
+  if (config.mqtt_enabled) {
+    capabilities += ",mqtt";
+  }
+  if (!config.udp_command_key.equals("")) {
+    capabilities += ",udp";
+  }
+  return capabilities;
+}
+
+
+/**
+ * Publish a TXT record of the Garage Bot service if it has changed
+ *
+ * @param key the TXT record key
+ * @param published the value that was last published (updated)
+ * @param value the current value
+ */
+void ServiceAdvertiser::_setTXT(const char *key, String &published, const String &value) {
+  if (published.equals(value)) {
+    return;
+  }
+
+  published = value;
+  MDNS.addServiceTxt(MDNS_BOT_SERVICE, "tcp", key, published.c_str());
+  txtUpdateCount += 1;
+}
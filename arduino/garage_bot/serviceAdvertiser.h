@@ -0,0 +1,41 @@
+/*============================================================================*\
+ * Garage Bot - serviceAdvertiser
+ * Peter Eldred 2021-08
+ *
+ * Advertises the web server and the Garage Bot API as mDNS services, with the
+ * firmware version, device name, door state and API capabilities in the TXT
+ * records, so that the apps can find the device (and its basic status)
+ * without opening a connection to it.
+\*============================================================================*/
+
+#ifndef SERVICEADVERTISER_H
+#define SERVICEADVERTISER_H
+
+#include "Arduino.h"
+#include "_config.h"
+#include "helpers.h"
+
+class ServiceAdvertiser {
+  public:
+    ServiceAdvertiser();
+
+    void advertise();                             // Add the services (once mDNS has been started) and set their TXT records
+    void update();                                // Update any of the TXT records that have changed
+
+    uint32_t txtUpdateCount = 0;                  // The number of TXT record changes published since boot
+
+  private:
+    bool _advertised = false;                     // Whether the services have been added to the mDNS responder
+
+    // The TXT record values that were last published (to work out whether they have changed)
+    String _deviceName;
+    String _doorState;
+    String _capabilities;
+
+    String _getCapabilities();                    // The comma separated list of the APIs that are available
+    void _setTXT(const char *key, String &published, const String &value);  // Publish a TXT record if it has changed
+};
+
+extern ServiceAdvertiser serviceAdvertiser;
+
+#endif
@@ -0,0 +1,156 @@
+/*============================================================================*\
+ * Garage Bot - socketEventHistory
+ * Peter Eldred 2021-08
+ *
+ * Every event broadcast to the web socket and server-sent event clients is
+ * stamped with a sequence number and the most recent events are kept here,
+ * so that a client which reconnects can be sent only the events it missed
+ * rather than a full snapshot of the config and status.
+ *
+ * The json of the events is packed (oldest first) into a fixed buffer. When
+ * a new event doesn't fit, the oldest events are dropped and the remainder
+ * are moved to the front of the buffer.
+ *
+ * The sequence starts at a random number each boot, so a client holding a
+ * sequence number from before a reboot will (almost certainly) fall outside
+ * of the history and be sent a full snapshot.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "esp_system.h"
+#include "_config.h"
+#include "socketEventHistory.h"
+
+
+/**
+ * Constructor
+ */
+SocketEventHistory::SocketEventHistory() {
+  _sequence = 0;
+}
+
+
+/**
+ * Initialise
+ */
+void SocketEventHistory::init() {
+  _lock = xSemaphoreCreateMutex();
+  _sequence = (esp_random() >> 1) + 1;
+}
+
+
+/**
+ * The sequence number of the most recent event
+ */
+uint32_t SocketEventHistory::lastSequence() {
+  return _sequence;
+}
+
+
+/**
+ * Claim the sequence number for a new event
+ */
+uint32_t SocketEventHistory::nextSequence() {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _sequence += 1;
+  uint32_t sequence = _sequence;
+  xSemaphoreGive(_lock);
+
+  return sequence;
+}
+
+
+/**
+ * Remember a broadcast event so that it can be replayed to reconnecting clients
+ *
+ * @param sequence the sequence number claimed for the event with nextSequence()
+ * @param eventName the server-sent event name of the event
+ * @param json the serialized event
+ * @param length the length of the serialized event
+ */
+void SocketEventHistory::add(uint32_t sequence, const char *eventName, const char *json, size_t length) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+
+  // An event which can never fit breaks the history. Clients will have to be sent a snapshot.
+  if ((length + 1) > SOCKET_EVENT_HISTORY_BUFFER_SIZE) {
+    _eventCount = 0;
+    _bufferUsed = 0;
+    xSemaphoreGive(_lock);
+    return;
+  }
+
+  // Make room
+  while ((_eventCount >= SOCKET_EVENT_HISTORY_MAX_EVENTS) || ((_bufferUsed + length + 1) > SOCKET_EVENT_HISTORY_BUFFER_SIZE)) {
+    _dropOldest();
+  }
+
+  Event *event = &_events[_eventCount];
+  event->sequence = sequence;
+  event->eventName = eventName;
+  event->offset = _bufferUsed;
+  event->length = length;
+  memcpy(_buffer + _bufferUsed, json, length);
+  _buffer[_bufferUsed + length] = '\0';
+
+  _bufferUsed += length + 1;
+  _eventCount += 1;
+
+  xSemaphoreGive(_lock);
+}
+
+
+/**
+ * Replay the events that a reconnecting client missed
+ *
+ * @param sequence the sequence number of the last event the client received
+ * @param replay called for each event after the sequence number (oldest first)
+ * @return bool false if the client is too far behind (or from a previous boot) and needs a full snapshot
+ */
+bool SocketEventHistory::replaySince(uint32_t sequence, socketEventReplayFunction replay) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+
+  bool available;
+
+  // Nothing was missed
+  if (sequence == _sequence) {
+    available = true;
+  }
+
+  // The client is ahead of us (probably from before a reboot) or the events it missed have already been dropped
+  else if (((int32_t)(_sequence - sequence) < 0) || (_eventCount == 0) || ((int32_t)(sequence - (_events[0].sequence - 1)) < 0)) {
+    available = false;
+  }
+
+  else {
+    available = true;
+    for (byte i = 0; i < _eventCount; i++) {
+      if ((int32_t)(_events[i].sequence - sequence) > 0) {
+        replay(_events[i].sequence, _events[i].eventName, _buffer + _events[i].offset, _events[i].length);
+      }
+    }
+  }
+
+  xSemaphoreGive(_lock);
+
+  return available;
+}
+
+
+/**
+ * Remove the oldest event from the history and move the remaining events to the front of the buffer
+ */
+void SocketEventHistory::_dropOldest() {
+  if (_eventCount == 0) {
+    return;
+  }
+
+  size_t removed = _events[0].length + 1;
+  memmove(_buffer, _buffer + removed, _bufferUsed - removed);
+  _bufferUsed -= removed;
+
+  for (byte i = 1; i < _eventCount; i++) {
+    _events[i - 1] = _events[i];
+    _events[i - 1].offset -= removed;
+  }
+  _eventCount -= 1;
+}
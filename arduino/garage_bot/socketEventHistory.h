@@ -0,0 +1,50 @@
+/*============================================================================*\
+ * Garage Bot - socketEventHistory
+ * Peter Eldred 2021-08
+ *
+ * Every event broadcast to the web socket and server-sent event clients is
+ * stamped with a sequence number and the most recent events are kept here,
+ * so that a client which reconnects can be sent only the events it missed
+ * rather than a full snapshot of the config and status.
+\*============================================================================*/
+
+#ifndef SOCKETEVENTHISTORY_H
+#define SOCKETEVENTHISTORY_H
+
+#include <functional>
+#include "Arduino.h"
+#include "_config.h"
+
+// Called for each event that is replayed to a reconnecting client
+typedef std::function<void(uint32_t sequence, const char *eventName, const char *json, size_t length)> socketEventReplayFunction;
+
+class SocketEventHistory {
+  public:
+    SocketEventHistory();
+
+    void init();                                  // Create the lock. Call before any events are added.
+
+    uint32_t lastSequence();                      // The sequence number of the most recent event
+    uint32_t nextSequence();                      // Claim the sequence number for a new event
+    void add(uint32_t sequence, const char *eventName, const char *json, size_t length);  // Remember a broadcast event
+    bool replaySince(uint32_t sequence, socketEventReplayFunction replay);                // Replay the events after a sequence number. False if they are no longer all available.
+
+  private:
+    struct Event {
+      uint32_t sequence;                          // The sequence number of the event
+      const char *eventName;                      // The server-sent event name of the event
+      uint16_t offset;                            // Where the event's json starts in the buffer
+      uint16_t length;                            // The length of the event's json (excluding the null terminator)
+    };
+
+    Event _events[SOCKET_EVENT_HISTORY_MAX_EVENTS];   // The events (oldest first)
+    byte _eventCount = 0;                         // The number of events in the history
+    char _buffer[SOCKET_EVENT_HISTORY_BUFFER_SIZE];   // The json of the events (oldest first, null terminated)
+    size_t _bufferUsed = 0;                       // The number of bytes of the buffer in use
+    uint32_t _sequence;                           // The sequence number of the most recent event
+    SemaphoreHandle_t _lock = NULL;               // Guards the history. Events are added by the main loop and replayed on the AsyncTCP task.
+
+    void _dropOldest();                           // Remove the oldest event from the history
+};
+
+#endif
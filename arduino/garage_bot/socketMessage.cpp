@@ -0,0 +1,87 @@
+/*============================================================================*\
+ * Garage Bot - socketMessage
+ * Peter Eldred 2021-08
+ *
+ * Parses a complete message received from a web socket client in place and
+ * turns it into the command to hand off to the main loop. Nothing in here
+ * touches the network (see WiFiEngine::handleWebSocketData for the assembly
+ * of fragmented messages).
+ *
+ * Every message is in the form {"m":"XX","p":{...}} where "XX" is one of the
+ * SOCKET_CLIENT_MESSAGE_* codes. The two character code is packed into an
+ * integer with SOCKET_MESSAGE_CODE so that it can be dispatched with a switch.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "_config.h"
+#include "socketMessage.h"
+#include "jsonScanner.h"
+
+
+/**
+ * Parse a complete web socket message in place
+ */
+SocketMessageResult parseSocketMessage(const char *message, size_t len, BotCommand &command) {
+  // The app falls back to a text "PING" when it hasn't heard from the device for a while.
+  if ((len == 4) && (memcmp(message, "PING", 4) == 0)) {
+    return SOCKET_MESSAGE_PING;
+  }
+
+  JsonSpan messageType;
+  JsonSpan payload;
+  if (!jsonFindValue(message, len, "m", messageType) || (messageType.type != JSON_SPAN_STRING) || (messageType.len != 2)) {
+    return SOCKET_MESSAGE_INVALID;
+  }
+  jsonFindValue(message, len, "p", payload);
+
+  command.value = 0;
+  command.target = 0;
+  command.data = NULL;
+
+  switch (SOCKET_MESSAGE_CODE(messageType.ptr)) {
+    case SOCKET_MESSAGE_CODE(SOCKET_CLIENT_MESSAGE_BUTTON_PRESS): {
+      JsonSpan virtualButton;
+      jsonFindValue(payload, "b", virtualButton);
+
+      command.type = BOT_COMMAND_VIRTUAL_BUTTON;
+      command.value = toVirtualButtonType(virtualButton.ptr, virtualButton.len);
+      return SOCKET_MESSAGE_COMMAND;
+    }
+
+    case SOCKET_MESSAGE_CODE(SOCKET_CLIENT_MESSAGE_SET_SENSOR_THRESHOLD): {
+      JsonSpan sensorType;
+      JsonSpan threshold;
+      long newThreshold;
+      jsonFindValue(payload, "s", sensorType);
+      if (!jsonFindValue(payload, "t", threshold) || !jsonSpanToInt(threshold, newThreshold) || !isValidIRSensorThreshold(newThreshold)) {
+        return SOCKET_MESSAGE_INVALID;
+      }
+
+      command.type = BOT_COMMAND_SET_SENSOR_THRESHOLD;
+      command.value = newThreshold;
+      if (jsonSpanEquals(sensorType, "TOP")) {
+        command.target = IR_SENSOR_TOP;
+      } else if (jsonSpanEquals(sensorType, "BOTTOM")) {
+        command.target = IR_SENSOR_BOTTOM;
+      } else {
+        return SOCKET_MESSAGE_INVALID;
+      }
+      return SOCKET_MESSAGE_COMMAND;
+    }
+
+    case SOCKET_MESSAGE_CODE(SOCKET_CLIENT_MESSAGE_REBOOT):
+      command.type = BOT_COMMAND_REBOOT;
+      return SOCKET_MESSAGE_COMMAND;
+
+    case SOCKET_MESSAGE_CODE(SOCKET_CLIENT_MESSAGE_FORGET_WIFI):
+      command.type = BOT_COMMAND_FORGET_WIFI;
+      return SOCKET_MESSAGE_COMMAND;
+
+    case SOCKET_MESSAGE_CODE(SOCKET_CLIENT_MESSAGE_RESET_TO_FACTORY_DEFAULTS):
+      command.type = BOT_COMMAND_FACTORY_RESET;
+      return SOCKET_MESSAGE_COMMAND;
+
+    default:
+      return SOCKET_MESSAGE_UNHANDLED;
+  }
+}
@@ -0,0 +1,35 @@
+/*============================================================================*\
+ * Garage Bot - socketMessage
+ * Peter Eldred 2021-08
+ *
+ * Parses a complete message received from a web socket client in place and
+ * turns it into the command to hand off to the main loop. Nothing in here
+ * touches the network (see WiFiEngine::handleWebSocketData for the assembly
+ * of fragmented messages).
+\*============================================================================*/
+
+#ifndef SOCKETMESSAGE_H
+#define SOCKETMESSAGE_H
+
+#include "Arduino.h"
+#include "_config.h"
+#include "helpers.h"
+
+// What a message received from a web socket client turned out to be
+enum SocketMessageResult {
+  SOCKET_MESSAGE_INVALID,       // Not in the form {"m":"XX","p":{...}} (or the payload doesn't make sense)
+  SOCKET_MESSAGE_UNHANDLED,     // A well formed message of an unknown type
+  SOCKET_MESSAGE_PING,          // The app's text "PING" keep alive (answer with a "PONG")
+  SOCKET_MESSAGE_COMMAND,       // A command to hand off to the main loop
+};
+
+/**
+ * Parse a complete web socket message in place
+ *
+ * @param message the message (not null terminated)
+ * @param len the length of the message
+ * @param command populated with the command when SOCKET_MESSAGE_COMMAND is returned
+ */
+SocketMessageResult parseSocketMessage(const char *message, size_t len, BotCommand &command);
+
+#endif
@@ -0,0 +1,139 @@
+/*============================================================================*\
+ * Garage Bot - StaticFileHandler
+ * Peter Eldred 2021-08
+ *
+ * Serves the static app files (bundles, styles, images etc...) out of the
+ * asset partition or the LITTLEFS file system.
+ *
+ * Whether a file exists (and how it should be sent) is looked up in the
+ * StaticFileManifest which is built once at boot. Files in the flash mapped
+ * asset partition are sent straight out of flash. Otherwise the file system
+ * is only touched to actually stream a file's contents.
+ *
+ * The build pre-compresses most assets, so the gzipped variant (`<file>.gz`)
+ * is preferred and sent with `Content-Encoding: gzip`. The content hashed
+ * bundles and styles never change for a given URL so they are marked as
+ * immutable. Everything else is sent with an ETag so that the browser can
+ * revalidate with `If-None-Match` and get a 304 instead of the whole file.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "LITTLEFS.h"
+#include "ESPAsyncWebServer.h"
+#include "_config.h"
+#include "helpers.h"
+#include "staticFileManifest.h"
+#include "staticFileHandler.h"
+#include "wifiEngine.h"
+
+
+/**
+ * Whether the request refers to a file in the static file manifest.
+ * This is answered from memory without touching the file system.
+ */
+bool StaticFileHandler::canHandle(AsyncWebServerRequest *request) {
+  if (request->method() != HTTP_GET) {
+    return false;
+  }
+
+  if (!staticFileManifest.find(request->url().c_str())) {
+    return false;
+  }
+
+  // Otherwise the web server discards the header before we get to handle the request
+  request->addInterestingHeader("If-None-Match");
+
+  return true;
+}
+
+
+/**
+ * Send the file (or a 304 if the browser already has it)
+ */
+void StaticFileHandler::handleRequest(AsyncWebServerRequest *request) {
+  const StaticFileEntry *entry = staticFileManifest.find(request->url().c_str());
+  if (!entry) {
+    request->send(404);
+    return;
+  }
+
+  // Compiled templates are sent from their cached render in one go
+  if (entry->htmlTemplate) {
+    const HTMLTemplateRender *render = entry->htmlTemplate->acquireRender();
+    if (render) {
+      _sendRenderedTemplate(request, entry, render);
+      return;
+    }
+  }
+
+  // Templates populated on the fly can't be identified by an ETag
+  bool useETag = !entry->immutable && !entry->isTemplate;
+
+  // The browser already has this version of the file
+  if (useETag && request->hasHeader("If-None-Match") && request->header("If-None-Match").equals(entry->etag)) {
+    AsyncWebServerResponse *response = request->beginResponse(304);
+    response->addHeader("ETag", entry->etag);
+    request->send(response);
+    return;
+  }
+
+  AwsTemplateProcessor processor = entry->isTemplate ? WiFiEngine::templateProcessor : NULL;
+  AsyncWebServerResponse *response;
+
+  // Stream straight out of the mapped asset partition
+  if (entry->data) {
+    response = request->beginResponse_P(200, entry->mimeType, entry->data, entry->size, processor);
+    if (entry->gzipped) {
+      response->addHeader("Content-Encoding", "gzip");
+    }
+  }
+
+  // Stream from the file system
+  else {
+    File file = LITTLEFS.open(entry->filePath, "r");
+    if (!file) {
+      request->send(404);
+      return;
+    }
+
+    // Passing the request path means the response picks up the ".gz" on the file name and adds the Content-Encoding header
+    response = request->beginResponse(file, entry->path, entry->mimeType, false, processor);
+  }
+
+  if (entry->immutable) {
+    response->addHeader("Cache-Control", STATIC_ASSET_IMMUTABLE_CACHE_CONTROL);
+  } else {
+    response->addHeader("Cache-Control", "no-cache");
+    if (useETag) {
+      response->addHeader("ETag", entry->etag);
+    }
+  }
+  request->send(response);
+}
+
+
+/**
+ * Send the cached render of a compiled HTML template (or a 304 if the browser already has it)
+ *
+ * @param render a reference from acquireRender(). Released once the response has been sent.
+ */
+void StaticFileHandler::_sendRenderedTemplate(AsyncWebServerRequest *request, const StaticFileEntry *entry, const HTMLTemplateRender *render) {
+  if (request->hasHeader("If-None-Match") && request->header("If-None-Match").equals(render->etag)) {
+    AsyncWebServerResponse *response = request->beginResponse(304);
+    response->addHeader("ETag", render->etag);
+    request->send(response);
+    HTMLTemplate::releaseRender(render);
+    return;
+  }
+
+  // The render is sent in place. It is never modified, and holding the reference keeps it alive if the
+  // template is re-rendered while the response is in flight.
+  request->onDisconnect([render](){
+    HTMLTemplate::releaseRender(render);
+  });
+
+  AsyncWebServerResponse *response = request->beginResponse_P(200, entry->mimeType, (const uint8_t*)render->page, render->length);
+  response->addHeader("Cache-Control", "no-cache");
+  response->addHeader("ETag", render->etag);
+  request->send(response);
+}
@@ -0,0 +1,33 @@
+/*============================================================================*\
+ * Garage Bot - StaticFileHandler
+ * Peter Eldred 2021-08
+ *
+ * Serves the static app files (bundles, styles, images etc...) out of the
+ * asset partition or the LITTLEFS file system.
+ *
+ * The build pre-compresses most assets, so the gzipped variant (`<file>.gz`)
+ * is preferred and sent with `Content-Encoding: gzip`. The content hashed
+ * bundles and styles never change for a given URL so they are marked as
+ * immutable. Everything else is sent with an ETag so that the browser can
+ * revalidate with `If-None-Match` and get a 304 instead of the whole file.
+\*============================================================================*/
+
+#ifndef STATIC_FILE_HANDLER_H
+#define STATIC_FILE_HANDLER_H
+
+#include "ESPAsyncWebServer.h"
+#include "staticFileManifest.h"
+
+class StaticFileHandler : public AsyncWebHandler {
+  public:
+    StaticFileHandler() {}
+    virtual ~StaticFileHandler() {}
+
+    bool canHandle(AsyncWebServerRequest *request);       // Whether the request refers to a file in the file system
+    void handleRequest(AsyncWebServerRequest *request);   // Send the file (or a 304)
+
+  private:
+    void _sendRenderedTemplate(AsyncWebServerRequest *request, const StaticFileEntry *entry, const HTMLTemplateRender *render);  // Send a compiled HTML template
+};
+
+#endif
@@ -0,0 +1,351 @@
+/*============================================================================*\
+ * Garage Bot - StaticFileManifest
+ * Peter Eldred 2021-08
+ *
+ * An in-memory table of every static file the web server can serve. It is
+ * built once at boot so that serving a request never needs to probe the file
+ * system to find out whether a file (or its gzipped variant) exists, what its
+ * mime type is or what its ETag is.
+ *
+ * When the flash mapped asset partition holds a valid blob of the same build
+ * as the web app in LITTLEFS the entries point directly at the file contents
+ * in flash. Otherwise the LITTLEFS file system is walked and the files are
+ * streamed from there.
+ *
+ * The app's client side routes (/config, /calibration etc...) are registered
+ * as aliases of the HTML page so they resolve through the same table.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "FS.h"
+#include "_config.h"
+#include "helpers.h"
+#include "assetPartition.h"
+#include "staticFileManifest.h"
+
+// Files in the file system which must never be served
+static const char *PRIVATE_FILES[] = {
+  CONFIG_JSON_FILE,
+  CONFIG_SLOT_FILE_A,
+  CONFIG_SLOT_FILE_B,
+};
+
+// The client side routes of the app which are served by the root document
+static const char *APP_ROUTES[] = {
+  "/config",
+  "/calibration",
+  "/about",
+};
+
+
+/**
+ * Used by qsort / bsearch to order the entries by path
+ */
+static int compareEntries(const void *a, const void *b) {
+  return strcmp(((const StaticFileEntry*)a)->path, ((const StaticFileEntry*)b)->path);
+}
+
+
+/**
+ * Constructor
+ */
+StaticFileManifest::StaticFileManifest() {}
+
+
+/**
+ * Initialise
+ *
+ * @param fs the file system to walk when the asset partition isn't available
+ * @param rootDocument the file to serve for "/" and the app routes (ie. "/index.html")
+ */
+void StaticFileManifest::init(fs::FS &fs, const char *rootDocument) {
+  #ifdef SERIAL_DEBUG
+  Serial.print("Building static file manifest...");
+  #endif
+
+  _fs = &fs;
+  count = 0;
+
+  if (_useAssetPartition(rootDocument)) {
+    _addAssetPartition();
+  } else {
+    _addDirectory("/");
+  }
+
+  // Before the aliases are added so that they share the compiled templates
+  _compileTemplates();
+
+  // The root document and the app routes all serve the same page
+  _addAlias("/", rootDocument);
+  for (byte i = 0; i < (sizeof(APP_ROUTES) / sizeof(APP_ROUTES[0])); i++) {
+    _addAlias(APP_ROUTES[i], rootDocument);
+  }
+
+  // Sort the entries so that they can be binary searched
+  qsort(_entries, count, sizeof(StaticFileEntry), compareEntries);
+
+  #ifdef SERIAL_DEBUG
+  Serial.print(" done. ");
+  Serial.print(count);
+  Serial.println(" entries.");
+  #endif
+}
+
+
+/**
+ * Find the entry for a request path
+ *
+ * @param path the request path (ie. "/js/control.bnd.js")
+ * @return StaticFileEntry* the entry or NULL if the path can't be served
+ */
+const StaticFileEntry* StaticFileManifest::find(const char *path) {
+  // Binary search against a key with only the path populated
+  int low = 0;
+  int high = (int)count - 1;
+
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    int comparison = strcmp(path, _entries[mid].path);
+    if (comparison == 0) {
+      return &_entries[mid];
+    } else if (comparison < 0) {
+      high = mid - 1;
+    } else {
+      low = mid + 1;
+    }
+  }
+
+  return NULL;
+}
+
+
+/**
+ * Whether the files should be served from the asset partition rather than the file system
+ *
+ * A U_SPIFFS OTA update replaces the web app in LITTLEFS but leaves the asset partition alone. The blob
+ * is only used when LITTLEFS holds the same build, or when LITTLEFS doesn't hold the web app at all.
+ *
+ * @param rootDocument the file that must exist for LITTLEFS to hold the web app (ie. "/index.html")
+ */
+bool StaticFileManifest::_useAssetPartition(const char *rootDocument) {
+  if (!assetPartition.available) {
+    return false;
+  }
+
+  File buildIdFile = _fs->open(ASSET_PARTITION_BUILD_ID_FILE, "r");
+  if (!buildIdFile) {
+    // A web app uploaded without a build id can't be compared, so it can't be assumed to be older than the blob
+    bool hasWebApp = _fs->exists(rootDocument) || _fs->exists(String(rootDocument) + ".gz");
+    #ifdef SERIAL_DEBUG
+    if (hasWebApp) {
+      Serial.print("\n  ! LITTLEFS holds a web app without a build id. Ignoring the asset partition.");
+    }
+    #endif
+    return !hasWebApp;
+  }
+
+  char buildId[9] = {0};
+  buildIdFile.read((uint8_t*)buildId, 8);
+  buildIdFile.close();
+
+  bool current = (strtoul(buildId, NULL, 16) == assetPartition.buildId);
+
+  #ifdef SERIAL_DEBUG
+  if (!current) {
+    Serial.print("\n  ! The asset partition holds a different build to LITTLEFS. Ignoring the asset partition.");
+  }
+  #endif
+
+  return current;
+}
+
+
+/**
+ * Add all of the files in a directory (recursively)
+ *
+ * @param dirPath the path of the directory
+ */
+void StaticFileManifest::_addDirectory(const String &dirPath) {
+  File dir = _fs->open(dirPath);
+  if (!dir || !dir.isDirectory()) {
+    return;
+  }
+
+  File file = dir.openNextFile();
+  while (file) {
+    // Depending on the core version the name is either the full path or just the file name
+    String filePath = file.name();
+    if (!filePath.startsWith("/")) {
+      filePath = (dirPath.endsWith("/") ? dirPath : dirPath + "/") + filePath;
+    }
+
+    if (file.isDirectory()) {
+      _addDirectory(filePath);
+    } else {
+      _addFile(filePath, file.size(), (uint32_t)file.getLastWrite(), NULL);
+    }
+
+    file.close();
+    file = dir.openNextFile();
+  }
+
+  dir.close();
+}
+
+
+/**
+ * Add all of the files in the mapped asset partition
+ */
+void StaticFileManifest::_addAssetPartition() {
+  for (uint16_t i = 0; i < assetPartition.entryCount; i++) {
+    const AssetBlobEntry *assetEntry = assetPartition.getEntry(i);
+    _addFile(String(assetEntry->path), assetEntry->length, assetEntry->hash, assetPartition.getData(assetEntry));
+  }
+}
+
+
+/**
+ * Add a single file to the manifest
+ *
+ * @param filePath the path of the file in the file system (or asset partition)
+ * @param size the size of the file
+ * @param version changes whenever the file does (last write time or content hash). Used for the ETag.
+ * @param data the contents of the file in the mapped asset partition (NULL when served from the file system)
+ */
+void StaticFileManifest::_addFile(const String &filePath, uint32_t size, uint32_t version, const uint8_t *data) {
+  if (filePath.length() >= STATIC_FILE_MAX_PATH_LENGTH) {
+    #ifdef SERIAL_DEBUG
+    Serial.print("\n  ! Path too long for the static file manifest: ");
+    Serial.print(filePath);
+    #endif
+    return;
+  }
+
+  // The request path is the file path without the ".gz"
+  bool gzipped = filePath.endsWith(".gz");
+  String path = gzipped ? filePath.substring(0, filePath.length() - 3) : filePath;
+
+  for (byte i = 0; i < (sizeof(PRIVATE_FILES) / sizeof(PRIVATE_FILES[0])); i++) {
+    if (path.equals(PRIVATE_FILES[i])) {
+      return;
+    }
+  }
+
+  // Both the plain and gzipped variant may exist. Prefer the gzipped one.
+  StaticFileEntry *entry = _findEntry(path.c_str());
+  if (entry) {
+    if (!gzipped) {
+      return;
+    }
+  } else {
+    if (count >= STATIC_FILE_MANIFEST_MAX_ENTRIES) {
+      #ifdef SERIAL_DEBUG
+      Serial.print("\n  ! Static file manifest full. Ignoring: ");
+      Serial.print(filePath);
+      #endif
+      return;
+    }
+    entry = &_entries[count];
+    count += 1;
+  }
+
+  strcpy(entry->path, path.c_str());
+  strcpy(entry->filePath, filePath.c_str());
+  entry->size = size;
+  entry->mimeType = getMimeType(path);
+  entry->gzipped = gzipped;
+  entry->immutable = isImmutableAssetPath(path);
+  entry->isTemplate = path.endsWith(".html");
+  entry->data = data;
+  entry->htmlTemplate = NULL;
+
+  // The ETag only has to change when the file does. A hash of the path, size and version is plenty.
+  uint32_t hash = 2166136261UL;
+  for (const char *c = entry->filePath; *c; c++) {
+    hash = (hash ^ (uint8_t)*c) * 16777619UL;
+  }
+  hash = (hash ^ size) * 16777619UL;
+  hash = (hash ^ version) * 16777619UL;
+  snprintf(entry->etag, sizeof(entry->etag), "\"%08x\"", (unsigned int)hash);
+}
+
+
+/**
+ * Compile the HTML templates found in the manifest
+ *
+ * Templates in the asset partition are compiled in place. Templates in the file system are read into RAM.
+ */
+void StaticFileManifest::_compileTemplates() {
+  _templateCount = 0;
+
+  for (byte i = 0; i < count; i++) {
+    StaticFileEntry *entry = &_entries[i];
+    if (!entry->isTemplate || entry->gzipped) {
+      continue;
+    }
+
+    if (_templateCount >= STATIC_FILE_MANIFEST_MAX_TEMPLATES) {
+      #ifdef SERIAL_DEBUG
+      Serial.print("\n  ! Too many HTML templates. Not compiling: ");
+      Serial.print(entry->path);
+      #endif
+      continue;
+    }
+
+    HTMLTemplate *htmlTemplate = &_templates[_templateCount];
+    bool compiled = false;
+
+    if (entry->data) {
+      compiled = htmlTemplate->compile((const char*)entry->data, entry->size, false);
+    } else {
+      char *source = (char*)malloc(entry->size);
+      File file = _fs->open(entry->filePath, "r");
+      if (source && file && (file.read((uint8_t*)source, entry->size) == entry->size)) {
+        compiled = htmlTemplate->compile(source, entry->size, true);
+      } else {
+        free(source);
+      }
+      if (file) {
+        file.close();
+      }
+    }
+
+    if (compiled) {
+      entry->htmlTemplate = htmlTemplate;
+      _templateCount += 1;
+    }
+  }
+}
+
+
+/**
+ * Add a route that serves the same file as another path
+ *
+ * @param path the request path of the route (ie. "/config")
+ * @param targetPath the request path of the file to serve (ie. "/index.html")
+ */
+void StaticFileManifest::_addAlias(const char *path, const char *targetPath) {
+  StaticFileEntry *target = _findEntry(targetPath);
+  if (!target || _findEntry(path) || (count >= STATIC_FILE_MANIFEST_MAX_ENTRIES)) {
+    return;
+  }
+
+  StaticFileEntry *entry = &_entries[count];
+  count += 1;
+
+  *entry = *target;
+  strcpy(entry->path, path);
+}
+
+
+/**
+ * Linear search used while the manifest is being built (before it has been sorted)
+ */
+StaticFileEntry* StaticFileManifest::_findEntry(const char *path) {
+  for (byte i = 0; i < count; i++) {
+    if (strcmp(_entries[i].path, path) == 0) {
+      return &_entries[i];
+    }
+  }
+  return NULL;
+}
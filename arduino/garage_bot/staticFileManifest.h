@@ -0,0 +1,67 @@
+/*============================================================================*\
+ * Garage Bot - StaticFileManifest
+ * Peter Eldred 2021-08
+ *
+ * An in-memory table of every static file the web server can serve. It is
+ * built once at boot so that serving a request never needs to probe the file
+ * system to find out whether a file (or its gzipped variant) exists, what its
+ * mime type is or what its ETag is.
+ *
+ * When the flash mapped asset partition holds a valid blob of the same build
+ * as the web app in LITTLEFS the entries point directly at the file contents
+ * in flash. Otherwise the LITTLEFS file system is walked and the files are
+ * streamed from there.
+ *
+ * The app's client side routes (/config, /calibration etc...) are registered
+ * as aliases of the HTML page so they resolve through the same table.
+\*============================================================================*/
+
+#ifndef STATIC_FILE_MANIFEST_H
+#define STATIC_FILE_MANIFEST_H
+
+#include "Arduino.h"
+#include "FS.h"
+#include "_config.h"
+#include "htmlTemplate.h"
+
+// Describes a single file that can be served
+struct StaticFileEntry {
+  char path[STATIC_FILE_MAX_PATH_LENGTH];       // The request path (ie. "/js/control.bnd.js")
+  char filePath[STATIC_FILE_MAX_PATH_LENGTH];   // The path of the file in the file system (ie. "/js/control.bnd.js.gz")
+  uint32_t size;                                // The size of the file (as stored)
+  const char *mimeType;                         // The mime type of the (uncompressed) file
+  bool gzipped;                                 // Whether the stored file is gzipped
+  bool immutable;                               // Whether the file is content hashed and can be cached forever
+  bool isTemplate;                              // Whether the file contains %TEMPLATE% variables
+  char etag[11];                                // The quoted ETag of the file
+  const uint8_t *data;                          // The contents of the file in the mapped asset partition (NULL when served from the file system)
+  HTMLTemplate *htmlTemplate;                   // The compiled template (NULL if the file isn't a template or couldn't be compiled)
+};
+
+class StaticFileManifest {
+  public:
+    StaticFileManifest();
+
+    void init(fs::FS &fs, const char *rootDocument);          // Walk the file system and build the manifest
+    const StaticFileEntry* find(const char *path);            // Find the entry for a request path (or NULL)
+
+    byte count = 0;                                           // The number of entries in the manifest
+
+  private:
+    fs::FS *_fs;
+    StaticFileEntry _entries[STATIC_FILE_MANIFEST_MAX_ENTRIES];
+    HTMLTemplate _templates[STATIC_FILE_MANIFEST_MAX_TEMPLATES];
+    byte _templateCount = 0;
+
+    bool _useAssetPartition(const char *rootDocument);        // Whether to serve the asset partition rather than the file system
+    void _addDirectory(const String &dirPath);                // Add all of the files in a directory (recursively)
+    void _addAssetPartition();                                // Add all of the files in the mapped asset partition
+    void _addFile(const String &filePath, uint32_t size, uint32_t version, const uint8_t *data);  // Add a single file
+    void _compileTemplates();                                 // Compile the HTML templates found in the manifest
+    void _addAlias(const char *path, const char *targetPath); // Add a route that serves the same file as another path
+    StaticFileEntry* _findEntry(const char *path);            // Linear search used while the manifest is being built
+};
+
+extern StaticFileManifest staticFileManifest;
+
+#endif
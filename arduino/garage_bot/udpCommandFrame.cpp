@@ -0,0 +1,119 @@
+/*============================================================================*\
+ * Garage Bot - udpCommandFrame
+ * Peter Eldred 2021-08
+ *
+ * The signed request / response frames of the UDP command protocol (see
+ * udpCommandServer.cpp for the layout). Nothing in here touches the network,
+ * so the frames can be checked on a host.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "mbedtls/md.h"
+#include "_config.h"
+#include "udpCommandFrame.h"
+
+
+/**
+ * Read a big endian integer
+ */
+static uint64_t readUInt(const uint8_t *data, byte len) {
+  uint64_t value = 0;
+  for (byte i = 0; i < len; i++) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+
+/**
+ * Write a big endian integer
+ */
+static void writeUInt(uint8_t *data, uint64_t value, byte len) {
+  for (byte i = len; i > 0; i--) {
+    data[i - 1] = value & 0xFF;
+    value >>= 8;
+  }
+}
+
+
+/**
+ * Encode a signed request
+ */
+size_t udpEncodeRequest(uint8_t *buffer, size_t size, const UDPCommandRequest &request, const uint8_t *key, size_t keyLength) {
+  if (size < UDP_COMMAND_REQUEST_SIZE) {
+    return 0;
+  }
+
+  buffer[0] = 'G';
+  buffer[1] = 'C';
+  buffer[2] = UDP_COMMAND_VERSION;
+  buffer[3] = request.command;
+  writeUInt(buffer + 4, request.session, 4);
+  writeUInt(buffer + 8, request.nonce, 8);
+  udpCommandSign(buffer, UDP_COMMAND_REQUEST_SIZE - UDP_COMMAND_MAC_SIZE, key, keyLength, buffer + UDP_COMMAND_REQUEST_SIZE - UDP_COMMAND_MAC_SIZE);
+
+  return UDP_COMMAND_REQUEST_SIZE;
+}
+
+
+/**
+ * Decode a request, checking its size, header and signature
+ */
+bool udpDecodeRequest(const uint8_t *data, size_t length, const uint8_t *key, size_t keyLength, UDPCommandRequest &request) {
+  if ((length != UDP_COMMAND_REQUEST_SIZE) || (data[0] != 'G') || (data[1] != 'C') || (data[2] != UDP_COMMAND_VERSION)) {
+    return false;
+  }
+
+  // Compare the whole MAC so the time taken doesn't give away how much of it matched
+  uint8_t mac[UDP_COMMAND_MAC_SIZE];
+  udpCommandSign(data, UDP_COMMAND_REQUEST_SIZE - UDP_COMMAND_MAC_SIZE, key, keyLength, mac);
+  uint8_t difference = 0;
+  for (byte i = 0; i < UDP_COMMAND_MAC_SIZE; i++) {
+    difference |= mac[i] ^ data[UDP_COMMAND_REQUEST_SIZE - UDP_COMMAND_MAC_SIZE + i];
+  }
+  if (difference != 0) {
+    return false;
+  }
+
+  request.command = (UDPCommand)data[3];
+  request.session = readUInt(data + 4, 4);
+  request.nonce = readUInt(data + 8, 8);
+  return true;
+}
+
+
+/**
+ * Encode a signed response
+ */
+size_t udpEncodeResponse(uint8_t *buffer, size_t size, const UDPCommandResponse &response, const uint8_t *key, size_t keyLength) {
+  if (size < UDP_COMMAND_RESPONSE_SIZE) {
+    return 0;
+  }
+
+  buffer[0] = 'G';
+  buffer[1] = 'R';
+  buffer[2] = UDP_COMMAND_VERSION;
+  buffer[3] = response.result;
+  writeUInt(buffer + 4, response.session, 4);
+  writeUInt(buffer + 8, response.nonce, 8);
+  writeUInt(buffer + 16, response.lastNonce, 8);
+  buffer[24] = response.command;
+  buffer[25] = response.doorState;
+  buffer[26] = response.topSensorState;
+  buffer[27] = response.bottomSensorState;
+  udpCommandSign(buffer, UDP_COMMAND_RESPONSE_SIZE - UDP_COMMAND_MAC_SIZE, key, keyLength, buffer + UDP_COMMAND_RESPONSE_SIZE - UDP_COMMAND_MAC_SIZE);
+
+  return UDP_COMMAND_RESPONSE_SIZE;
+}
+
+
+/**
+ * HMAC-SHA256
+ *
+ * @param data the bytes to sign
+ * @param length the number of bytes to sign
+ * @param mac populated with the UDP_COMMAND_MAC_SIZE byte MAC
+ */
+void udpCommandSign(const uint8_t *data, size_t length, const uint8_t *key, size_t keyLength, uint8_t *mac) {
+  mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key, keyLength, data, length, mac);
+}
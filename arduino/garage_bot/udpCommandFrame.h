@@ -0,0 +1,80 @@
+/*============================================================================*\
+ * Garage Bot - udpCommandFrame
+ * Peter Eldred 2021-08
+ *
+ * The signed request / response frames of the UDP command protocol (see
+ * udpCommandServer.cpp for the layout). Nothing in here touches the network,
+ * so the frames can be checked on a host.
+\*============================================================================*/
+
+#ifndef UDPCOMMANDFRAME_H
+#define UDPCOMMANDFRAME_H
+
+#include "Arduino.h"
+#include "_config.h"
+
+// The command of a request (byte 3 of a request)
+enum UDPCommand {
+  UDP_COMMAND_STATUS    = 1,                    // Just report the door state
+  UDP_COMMAND_ACTIVATE  = 2,
+  UDP_COMMAND_OPEN      = 3,
+  UDP_COMMAND_CLOSE     = 4,
+};
+
+// The result of a request (byte 3 of a response)
+enum UDPCommandResult {
+  UDP_RESULT_OK             = 0,                // The command has been queued (or the status reported)
+  UDP_RESULT_BAD_SESSION    = 1,                // The session is from a previous boot. Use the session in the response.
+  UDP_RESULT_REPLAYED       = 2,                // The nonce isn't greater than the last one accepted in the session (carried in the response)
+  UDP_RESULT_BAD_COMMAND    = 3,                // The command isn't recognised
+  UDP_RESULT_BUSY           = 4,                // The command queue is full
+};
+
+// A request from a client
+struct UDPCommandRequest {
+  UDPCommand command;
+  uint32_t session;                             // The session the client believes the device is in
+  uint64_t nonce;                               // Must be greater than the last nonce accepted in the session
+};
+
+// The response to a request
+struct UDPCommandResponse {
+  UDPCommandResult result;
+  uint32_t session;                             // The device's current session
+  uint64_t nonce;                               // The nonce of the request
+  uint64_t lastNonce;                           // The last nonce accepted in the session. The next request must use a greater one.
+  UDPCommand command;                           // The command of the request
+  uint8_t doorState;                            // DoorState
+  uint8_t topSensorState;                       // SensorDetectionState of the top sensor
+  uint8_t bottomSensorState;                    // SensorDetectionState of the bottom sensor
+};
+
+/**
+ * Encode a signed request
+ *
+ * @return size_t the length of the frame (UDP_COMMAND_REQUEST_SIZE) or 0 if it doesn't fit in the buffer
+ */
+size_t udpEncodeRequest(uint8_t *buffer, size_t size, const UDPCommandRequest &request, const uint8_t *key, size_t keyLength);
+
+/**
+ * Decode a request, checking its size, header and signature
+ *
+ * @return bool false if the frame is malformed or fails authentication
+ */
+bool udpDecodeRequest(const uint8_t *data, size_t length, const uint8_t *key, size_t keyLength, UDPCommandRequest &request);
+
+/**
+ * Encode a signed response
+ *
+ * @return size_t the length of the frame (UDP_COMMAND_RESPONSE_SIZE) or 0 if it doesn't fit in the buffer
+ */
+size_t udpEncodeResponse(uint8_t *buffer, size_t size, const UDPCommandResponse &response, const uint8_t *key, size_t keyLength);
+
+/**
+ * HMAC-SHA256
+ *
+ * @param mac populated with the UDP_COMMAND_MAC_SIZE byte MAC
+ */
+void udpCommandSign(const uint8_t *data, size_t length, const uint8_t *key, size_t keyLength, uint8_t *mac);
+
+#endif
@@ -0,0 +1,190 @@
+/*============================================================================*\
+ * Garage Bot - udpCommandServer
+ * Peter Eldred 2021-08
+ *
+ * A small authenticated UDP request / response protocol so that scripts on the
+ * local network can activate / open / close the door (or ask for its status)
+ * with a single datagram, without a broker or a web socket.
+ *
+ * Every frame is a fixed size and ends with an HMAC-SHA256 (keyed with the
+ * configured udp_command_key) of the bytes before it. Datagrams which are the
+ * wrong size or fail authentication are silently ignored. Multi-byte values
+ * are big endian.
+ *
+ * Request (UDP_COMMAND_REQUEST_SIZE bytes):
+ *   0-1    "GC"
+ *   2      version (UDP_COMMAND_VERSION)
+ *   3      UDPCommand
+ *   4-7    session
+ *   8-15   nonce
+ *   16-47  HMAC-SHA256 of bytes 0-15
+ *
+ * Response (UDP_COMMAND_RESPONSE_SIZE bytes), sent straight back to the sender:
+ *   0-1    "GR"
+ *   2      version (UDP_COMMAND_VERSION)
+ *   3      UDPCommandResult
+ *   4-7    session (the device's current session)
+ *   8-15   nonce (from the request)
+ *   16-23  the last nonce accepted in the session
+ *   24     UDPCommand (from the request)
+ *   25     DoorState
+ *   26     SensorDetectionState of the top sensor
+ *   27     SensorDetectionState of the bottom sensor
+ *   28-59  HMAC-SHA256 of bytes 0-27
+ *
+ * Replay protection: the device picks a random session each boot and only
+ * accepts a request when its nonce is greater than that of the last request
+ * it accepted in the session. A client which doesn't know the session (or
+ * holds one from before a reboot) gets a signed UDP_RESULT_BAD_SESSION
+ * response carrying the current session and sends the request again. A
+ * millisecond timestamp makes a convenient nonce.
+ *
+ * The clients share the key, so they share the one nonce high-water mark. The
+ * sender's address isn't covered by the signature, so tracking nonces per
+ * address would let a captured request be replayed from another address.
+ * Instead every response carries the last accepted nonce. A client whose
+ * clock (or counter) is behind another's gets a signed UDP_RESULT_REPLAYED
+ * and sends the request again with a greater nonce.
+ *
+ * A command is acknowledged as soon as it is handed to the main loop through
+ * the command queue, so the response doesn't wait on the door.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "esp_system.h"
+#include "_config.h"
+#include "udpCommandServer.h"
+#include "udpCommandFrame.h"
+#include "commandQueue.h"
+#include "doorControl.h"
+#include "wifiEngine.h"
+
+
+/**
+ * Constructor
+ */
+UDPCommandServer::UDPCommandServer() {}
+
+
+/**
+ * Initialise
+ */
+void UDPCommandServer::init(IRSensor *topIRSensor, IRSensor *bottomIRSensor) {
+  _topIRSensor = topIRSensor;
+  _bottomIRSensor = bottomIRSensor;
+  _enabled = !config.udp_command_key.equals("");
+  _session = esp_random() | 1;
+}
+
+
+/**
+ * Listen for requests while the WiFi is connected
+ *
+ * @param currentMillis the current milliseconds as passed down from the main loop
+ */
+void UDPCommandServer::run(unsigned long currentMillis) {
+  if (!_enabled) {
+    return;
+  }
+
+  if (!wifiEngine.connected) {
+    if (_listening) {
+      _udp.close();
+      _listening = false;
+    }
+    return;
+  }
+
+  if (!_listening) {
+    _listening = _udp.listen(UDP_COMMAND_PORT);
+    if (_listening) {
+      _udp.onPacket([this](AsyncUDPPacket packet){
+        _handlePacket(packet);
+      });
+    }
+  }
+}
+
+
+/**
+ * A datagram received
+ * @note: fired on the async_udp task
+ */
+void UDPCommandServer::_handlePacket(AsyncUDPPacket &packet) {
+  UDPCommandRequest request;
+  if (!udpDecodeRequest(packet.data(), packet.length(), (const uint8_t*)config.udp_command_key.c_str(), config.udp_command_key.length(), request)) {
+    unauthenticatedCount += 1;
+    return;
+  }
+
+  if (request.session != _session) {
+    rejectedCount += 1;
+    _respond(packet, UDP_RESULT_BAD_SESSION, request);
+    return;
+  }
+
+  if (request.nonce <= _lastNonce) {
+    rejectedCount += 1;
+    _respond(packet, UDP_RESULT_REPLAYED, request);
+    return;
+  }
+
+  // Hand the command off to the main loop
+  bool queued;
+  switch (request.command) {
+    case UDP_COMMAND_STATUS:
+      queued = true;
+      break;
+
+    case UDP_COMMAND_ACTIVATE:
+      queued = commandQueue.push(BOT_COMMAND_VIRTUAL_BUTTON, ACTIVATE);
+      break;
+
+    case UDP_COMMAND_OPEN:
+      queued = commandQueue.push(BOT_COMMAND_VIRTUAL_BUTTON, OPEN);
+      break;
+
+    case UDP_COMMAND_CLOSE:
+      queued = commandQueue.push(BOT_COMMAND_VIRTUAL_BUTTON, CLOSE);
+      break;
+
+    default:
+      rejectedCount += 1;
+      _respond(packet, UDP_RESULT_BAD_COMMAND, request);
+      return;
+  }
+
+  // The nonce is used up even if the queue was full, the client can send again with a new one
+  _lastNonce = request.nonce;
+
+  if (!queued) {
+    rejectedCount += 1;
+    _respond(packet, UDP_RESULT_BUSY, request);
+    return;
+  }
+
+  acceptedCount += 1;
+  _respond(packet, UDP_RESULT_OK, request);
+}
+
+
+/**
+ * Send a signed response back to the sender of a request
+ */
+void UDPCommandServer::_respond(AsyncUDPPacket &packet, UDPCommandResult result, const UDPCommandRequest &request) {
+  UDPCommandResponse response;
+  response.result = result;
+  response.session = _session;
+  response.nonce = request.nonce;
+  response.lastNonce = _lastNonce;
+  response.command = request.command;
+
+  // The state is only read (never changed) here, a slightly stale value is fine
+  response.doorState = doorControl.getDoorState();
+  response.topSensorState = _topIRSensor->detected;
+  response.bottomSensorState = _bottomIRSensor->detected;
+
+  uint8_t frame[UDP_COMMAND_RESPONSE_SIZE];
+  size_t length = udpEncodeResponse(frame, sizeof(frame), response, (const uint8_t*)config.udp_command_key.c_str(), config.udp_command_key.length());
+  packet.write(frame, length);
+}
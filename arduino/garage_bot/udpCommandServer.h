@@ -0,0 +1,46 @@
+/*============================================================================*\
+ * Garage Bot - udpCommandServer
+ * Peter Eldred 2021-08
+ *
+ * A small authenticated UDP request / response protocol so that scripts on the
+ * local network can activate / open / close the door (or ask for its status)
+ * with a single datagram, without a broker or a web socket.
+\*============================================================================*/
+
+#ifndef UDPCOMMANDSERVER_H
+#define UDPCOMMANDSERVER_H
+
+#include "Arduino.h"
+#include "AsyncUDP.h"
+#include "_config.h"
+#include "helpers.h"
+#include "irsensor.h"
+#include "udpCommandFrame.h"
+
+class UDPCommandServer {
+  public:
+    UDPCommandServer();
+
+    void init(IRSensor *topIRSensor, IRSensor *bottomIRSensor); // Pick the session for this boot. Does nothing without a configured key.
+    void run(unsigned long currentMillis);        // Listen for requests while the WiFi is connected
+
+    uint32_t acceptedCount = 0;                   // The number of requests accepted since boot
+    uint32_t rejectedCount = 0;                   // The number of requests rejected (bad session, replayed, bad command or busy) since boot
+    uint32_t unauthenticatedCount = 0;            // The number of datagrams ignored because they were malformed or failed authentication since boot
+
+  private:
+    IRSensor *_topIRSensor;                       // A pointer to the top IR sensor passed into the init function
+    IRSensor *_bottomIRSensor;                    // A pointer to the bottom IR sensor passed into the init function
+    AsyncUDP _udp;
+    bool _enabled = false;                        // Whether a key has been configured
+    bool _listening = false;                      // Whether the server is listening on the current WiFi connection
+    uint32_t _session = 0;                        // A random number picked at boot that every request must carry
+    uint64_t _lastNonce = 0;                      // The nonce of the last accepted request from any client (async_udp task only)
+
+    void _handlePacket(AsyncUDPPacket &packet);   // A datagram received (async_udp task)
+    void _respond(AsyncUDPPacket &packet, UDPCommandResult result, const UDPCommandRequest &request);  // Send a signed response
+};
+
+extern UDPCommandServer udpCommandServer;
+
+#endif
@@ -24,23 +24,71 @@
 #include "helpers.h"
 #include "wifiEngine.h"
 #include "wifiCaptivePortalHandler.h"
+#include "htmlTemplate.h"
+#include "staticFileManifest.h"
+#include "staticFileHandler.h"
 #include "botFS.h"
 #include "doorControl.h"
 #include "mqttClient.h"
 #include "irsensor.h"
 #include "reboot.h"
+#include "commandQueue.h"
+#include "socketEventHistory.h"
+#include "socketMessage.h"
+#include "jsonScanner.h"
+#include "metrics.h"
+#include "serviceAdvertiser.h"
 #include "Update.h"
+#include "rom/crc.h"
+
+// The BSSID, channel and IP address of the last successful WiFi connection.
+// Kept in RTC memory so that it survives a reboot (but not a power cycle) without wearing the flash.
+// RTC_DATA_ATTR is re-initialised by the bootloader on a software reset (esp_restart), so the cache
+// lives in the no-init section instead. That memory holds garbage after a power cycle, which the
+// magic and CRC reject.
+struct WiFiConnectionCache {
+  uint32_t magic;                                 // WIFI_CONNECTION_CACHE_MAGIC when the cache is valid
+  char ssid[33];                                  // The SSID the cache applies to
+  uint8_t bssid[6];                               // The MAC address of the access point
+  int32_t channel;                                // The channel of the access point
+  uint32_t localIP;                               // The DHCP lease
+  uint32_t gatewayIP;
+  uint32_t subnetMask;
+  uint32_t dnsIP;
+  uint32_t crc;                                   // CRC32 of everything above
+};
+RTC_NOINIT_ATTR static WiFiConnectionCache wifiConnectionCache;
+
+
+/**
+ * The CRC of the connection cache (excluding the CRC itself)
+ */
+static uint32_t wifiConnectionCacheCRC() {
+  return crc32_le(0, (const uint8_t*)&wifiConnectionCache, offsetof(WiFiConnectionCache, crc));
+}
+
+
+/**
+ * Whether the connection cache holds a connection (rather than garbage left in RTC memory after a power cycle)
+ */
+static bool wifiConnectionCacheValid() {
+  return (wifiConnectionCache.magic == WIFI_CONNECTION_CACHE_MAGIC) && (wifiConnectionCache.crc == wifiConnectionCacheCRC());
+}
+
 
 /**
  * Constructor
  */
-WiFiEngine::WiFiEngine(){}
+WiFiEngine::WiFiEngine(){
+  _gotIPEvent.store(false);
+  _disconnectedEvent.store(false);
+}
 
 
 /**
  * Initialise
  */
-bool WiFiEngine::init(AsyncWebServer *webServer, AsyncWebSocket *webSocket, DNSServer *dnsServer, IRSensor *topIRSensor, IRSensor *bottomIRSensor) {
+bool WiFiEngine::init(AsyncWebServer *webServer, AsyncWebSocket *webSocket, AsyncEventSource *eventSource, DNSServer *dnsServer, IRSensor *topIRSensor, IRSensor *bottomIRSensor) {
   #ifdef SERIAL_DEBUG
   Serial.println("Initialising WiFi engine...");
   #endif
@@ -48,16 +96,19 @@ bool WiFiEngine::init(AsyncWebServer *webServer, AsyncWebSocket *webSocket, DNSS
   // Keep a pointer to some of the important global objects
   _webServer = webServer;
   _webSocket = webSocket;
+  _eventSource = eventSource;
   _dnsServer = dnsServer;
   _topIRSensor = topIRSensor;
   _bottomIRSensor = bottomIRSensor;
 
+  _eventHistory.init();
+
   // At this point we can consider ourselves uninitialized
   wifiEngineMode = WEM_UNINIT;
   macAddress = WiFi.macAddress();
   
   // Has the WiFi hotspot been configured?
-  if (!config.wifi_ssid.equals("")) {
+  if (config.wifi_network_count > 0) {
     connectToHotSpot();
   }
 
@@ -97,6 +148,10 @@ bool WiFiEngine::init(AsyncWebServer *webServer, AsyncWebSocket *webSocket, DNSS
 
 /**
  * Once the device has been initialised and the WiFi is connected, incoming websockets will be allowed
+ *
+ * Read-only clients (ie. wall mounted dashboards) can subscribe to the status and config
+ * changes on /events instead. A server-sent event stream never sends anything to the device
+ * so it is much cheaper to serve than a web socket.
  */
 void WiFiEngine::allowIncomingWebSockets() {
   #ifdef SERIAL_DEBUG
@@ -107,47 +162,442 @@ void WiFiEngine::allowIncomingWebSockets() {
     onWsEvent(client, type, arg, data, len);
   });
   _webServer->addHandler(_webSocket);
+
+  _eventSource->onConnect([&](AsyncEventSourceClient *eventClient){
+    _handleEventSourceConnect(eventClient);
+  });
+  _webServer->addHandler(_eventSource);
 }
 
 
 /**
- * Attempt to connect to the configured WiFi hotspot
+ * Start connecting to the configured WiFi hotspot
+ *
+ * This doesn't wait for the connection. The result arrives via the WiFi events
+ * and is acted upon by the connection state machine in run().
  */
 bool WiFiEngine::connectToHotSpot() {
-  if (WiFi.status() != WL_CONNECTED) {
-    // Don't bother if we don't have a configuration yet
-    if (!config.wifi_ssid.equals("")) {
+  // Don't bother if we don't have a configuration yet
+  if (config.wifi_network_count == 0) {
+    return false;
+  }
+
+  #ifdef SERIAL_DEBUG
+  Serial.print("  - Connecting to one of: "); 
+  for (byte i = 0; i < config.wifi_network_count; i++) {
+    Serial.print(i > 0 ? ", '" : "'");
+    Serial.print(config.wifi_networks[i].ssid);
+    Serial.print("'");
+  }
+  Serial.println();
+  #endif
+
+  // The connection state machine is responsible for reconnecting (with backoff)
+  WiFi.onEvent(_handleWiFiEvent);
+  WiFi.setAutoReconnect(false);
+
+  // Set the host name so that other devices recognise this device as the garage bot
+  WiFi.hostname(config.mdns_name.c_str());
+
+  wifiEngineMode = WEM_CLIENT;
+
+  // Attempt to connect to the configured wifi hotspot
+  _beginConnection(millis());
+
+  return true;
+}
+
+
+/**
+ * Start a connection attempt.
+ *
+ * If the connection cache is valid for a known network the access point is joined
+ * directly on the cached channel / BSSID. Otherwise an asynchronous scan is started
+ * and the strongest known network is joined once the scan completes.
+ */
+void WiFiEngine::_beginConnection(unsigned long currentMillis) {
+  _connectAttemptStarted = currentMillis;
+
+  int cachedNetwork = wifiConnectionCacheValid() ? _findKnownNetwork(wifiConnectionCache.ssid) : -1;
+  _fastConnectAttempt = (cachedNetwork >= 0);
+
+  if (_fastConnectAttempt) {
+    #ifdef SERIAL_DEBUG
+    Serial.print("  - Fast connecting to '");
+    Serial.print(wifiConnectionCache.ssid);
+    Serial.print("' on channel ");
+    Serial.println(wifiConnectionCache.channel);
+    #endif
+
+    #ifdef WIFI_REUSE_CACHED_IP
+    WiFi.config(IPAddress(wifiConnectionCache.localIP), IPAddress(wifiConnectionCache.gatewayIP), IPAddress(wifiConnectionCache.subnetMask), IPAddress(wifiConnectionCache.dnsIP));
+    #endif
+
+    _connectToNetwork(cachedNetwork, wifiConnectionCache.channel, wifiConnectionCache.bssid, currentMillis);
+    return;
+  }
+
+  #ifdef SERIAL_DEBUG
+  Serial.println("  - Scanning for known WiFi networks...");
+  #endif
+
+  WiFi.scanNetworks(true);
+  _setConnectionState(WCS_SCANNING, currentMillis);
+}
+
+
+/**
+ * Join a known network. Passing a channel and BSSID joins a specific access point without scanning.
+ */
+void WiFiEngine::_connectToNetwork(byte networkIndex, int32_t channel, const uint8_t *bssid, unsigned long currentMillis) {
+  WiFiNetwork &network = config.wifi_networks[networkIndex];
+
+  // A fast connect may be re-using the cached IP address (see _beginConnection). Everything else uses DHCP.
+  if (!_fastConnectAttempt) {
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE, INADDR_NONE);
+  }
+  WiFi.begin(network.ssid.c_str(), network.password.c_str(), channel, bssid);
+
+  _currentNetwork = networkIndex;
+  _setConnectionState(WCS_CONNECTING, currentMillis);
+}
+
+
+/**
+ * Find the index of a known network by its SSID
+ *
+ * @return int the index in config.wifi_networks or -1 if the network isn't known
+ */
+int WiFiEngine::_findKnownNetwork(const char *ssid) {
+  for (byte i = 0; i < config.wifi_network_count; i++) {
+    if (config.wifi_networks[i].ssid.equals(ssid)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+/**
+ * Find the strongest access point of any known network in the completed scan results
+ *
+ * @param resultCount the number of scan results
+ * @param networkIndex populated with the index of the known network
+ * @param channel populated with the channel of the access point
+ * @param bssid populated with the BSSID of the access point
+ * @param rssi populated with the RSSI of the access point
+ * @return bool whether any known network was found
+ */
+bool WiFiEngine::_selectStrongestNetwork(int resultCount, byte &networkIndex, int32_t &channel, uint8_t *bssid, int32_t &rssi) {
+  bool found = false;
+
+  for (int i = 0; i < resultCount; i++) {
+    int knownNetwork = _findKnownNetwork(WiFi.SSID(i).c_str());
+    if ((knownNetwork >= 0) && (!found || (WiFi.RSSI(i) > rssi))) {
+      found = true;
+      networkIndex = knownNetwork;
+      channel = WiFi.channel(i);
+      rssi = WiFi.RSSI(i);
+      memcpy(bssid, WiFi.BSSID(i), 6);
+    }
+  }
+
+  return found;
+}
+
+
+/**
+ * Fired when a connection attempt fails (or an established connection is lost).
+ * A failed fast connect falls straight back to a scan. Otherwise back off before trying again.
+ */
+void WiFiEngine::_connectionAttemptFailed(unsigned long currentMillis) {
+  if (_fastConnectAttempt && (_connectionState == WCS_CONNECTING)) {
+    #ifdef SERIAL_DEBUG
+    Serial.println("  ! Fast connect failed. Falling back to a scan.");
+    #endif
+
+    // The access point may have moved channel or been replaced
+    wifiConnectionCache.magic = 0;
+    WiFi.disconnect();
+    _beginConnection(currentMillis);
+    return;
+  }
+
+  _scheduleReconnect(currentMillis);
+}
+
+
+/**
+ * Remember the BSSID, channel and IP address of the current connection for the next connection attempt
+ */
+void WiFiEngine::_updateConnectionCache() {
+  // Clear the padding too so the CRC only depends on the values
+  memset(&wifiConnectionCache, 0, sizeof(wifiConnectionCache));
+  strncpy(wifiConnectionCache.ssid, WiFi.SSID().c_str(), sizeof(wifiConnectionCache.ssid) - 1);
+  wifiConnectionCache.ssid[sizeof(wifiConnectionCache.ssid) - 1] = '\0';
+  memcpy(wifiConnectionCache.bssid, WiFi.BSSID(), sizeof(wifiConnectionCache.bssid));
+  wifiConnectionCache.channel = WiFi.channel();
+  wifiConnectionCache.localIP = (uint32_t)WiFi.localIP();
+  wifiConnectionCache.gatewayIP = (uint32_t)WiFi.gatewayIP();
+  wifiConnectionCache.subnetMask = (uint32_t)WiFi.subnetMask();
+  wifiConnectionCache.dnsIP = (uint32_t)WiFi.dnsIP();
+  wifiConnectionCache.magic = WIFI_CONNECTION_CACHE_MAGIC;
+  wifiConnectionCache.crc = wifiConnectionCacheCRC();
+}
+
+
+/**
+ * Fired on the WiFi event task whenever the state of the WiFi client changes.
+ * The events are only flagged here and acted upon by the main loop.
+ */
+void WiFiEngine::_handleWiFiEvent(WiFiEvent_t event, WiFiEventInfo_t info) {
+  switch (event) {
+    case SYSTEM_EVENT_STA_GOT_IP:
+      wifiEngine._gotIPEvent.store(true);
+      break;
+    case SYSTEM_EVENT_STA_DISCONNECTED:
+      // Caused by our own call to WiFi.disconnect() before a reconnect attempt (or roam)
+      if (info.disconnected.reason == WIFI_REASON_ASSOC_LEAVE) {
+        break;
+      }
+      wifiEngine._disconnectedEvent.store(true);
+      break;
+    case SYSTEM_EVENT_STA_LOST_IP:
+      wifiEngine._disconnectedEvent.store(true);
+      break;
+    default:
+      break;
+  }
+}
+
+
+/**
+ * Act on the WiFi events, scan results, connection timeouts and reconnect delays
+ */
+void WiFiEngine::_runConnectionStateMachine(unsigned long currentMillis) {
+  // Connection lost (or the connection attempt failed)
+  if (_disconnectedEvent.exchange(false)) {
+    // A disconnect that arrives after an IP has been assigned means the IP is no longer valid
+    _gotIPEvent.store(false);
+
+    if (connected) {
       #ifdef SERIAL_DEBUG
-      Serial.print("  - Connecting to: "); 
-      Serial.println(config.wifi_ssid);
+      Serial.println("WiFi connection lost.");
       #endif
+      _handleWiFiDisconnected();
+    }
+
+    if ((_connectionState == WCS_CONNECTING) || (_connectionState == WCS_CONNECTED)) {
+      _roamScanInProgress = false;
+      _connectionAttemptFailed(currentMillis);
+    }
+  }
+
+  // Connected and assigned an IP address
+  if (_gotIPEvent.exchange(false)) {
+    // Record how long the connection took so that the benefit of the connection cache can be measured
+    if (_connectionState == WCS_CONNECTING) {
+      lastConnectDuration = currentMillis - _connectAttemptStarted;
+      lastConnectWasFast = _fastConnectAttempt;
+      connectCount += 1;
+      if (_fastConnectAttempt) {
+        fastConnectCount += 1;
+      }
+
+      #ifdef SERIAL_DEBUG
+      Serial.print("  - WiFi connected to '");
+      Serial.print(WiFi.SSID());
+      Serial.print("' in ");
+      Serial.print(lastConnectDuration);
+      Serial.println(_fastConnectAttempt ? "ms (fast connect)" : "ms (scan)");
+      #endif
+    }
 
-      // Set the host name so that other devices recognise this device as the garage bot
-      WiFi.hostname(config.mdns_name.c_str());
-      WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE, INADDR_NONE);
+    _setConnectionState(WCS_CONNECTED, currentMillis);
+    _reconnectBackoff = WIFI_RECONNECT_BACKOFF_MIN;
+    _updateConnectionCache();
 
-      wifiEngineMode = WEM_CLIENT;
+    // The RSSI history only applies to the current access point
+    _rssiHistoryCount = 0;
+    _lastRSSISample = currentMillis;
 
-      // Attempt to connect to the configured wifi hotspot
-      WiFi.begin(config.wifi_ssid.c_str(), config.wifi_password.c_str()); 
+    if (!connected) {
+      _handleWiFiConnected();
+    }
+  }
 
-      // Wait for the connect result
-      if (WiFi.waitForConnectResult() != WL_CONNECTED) {
+  switch (_connectionState) {
+    case WCS_SCANNING: {
+      int resultCount = WiFi.scanComplete();
+      if (resultCount == WIFI_SCAN_RUNNING) {
+        if ((currentMillis - _connectionStateChanged) >= WIFI_CONNECT_TIMEOUT) {
           #ifdef SERIAL_DEBUG
-          Serial.println("  ! Failed to connect!");
+          Serial.println("  ! Timed out scanning for WiFi networks.");
           #endif
-          _lastReconnectAttempt = millis();
-          connected = false;
-          return false;
-      }       
+          _connectionAttemptFailed(currentMillis);
+        }
+        break;
+      }
 
-      _handleWiFiConnected();
+      byte networkIndex;
+      int32_t channel;
+      uint8_t bssid[6];
+      int32_t rssi;
+      if ((resultCount > 0) && _selectStrongestNetwork(resultCount, networkIndex, channel, bssid, rssi)) {
+        #ifdef SERIAL_DEBUG
+        Serial.print("  - Strongest known network: '");
+        Serial.print(config.wifi_networks[networkIndex].ssid);
+        Serial.print("' (");
+        Serial.print(rssi);
+        Serial.println("dBm)");
+        #endif
+        _connectToNetwork(networkIndex, channel, bssid, currentMillis);
+      }
+
+      // None of the known networks were seen (they may be hidden). Try each of them in turn.
+      else {
+        byte blindNetworkIndex = _blindNetworkIndex % config.wifi_network_count;
+        _blindNetworkIndex = (blindNetworkIndex + 1) % config.wifi_network_count;
+        _connectToNetwork(blindNetworkIndex, 0, NULL, currentMillis);
+      }
 
-      return true;
+      WiFi.scanDelete();
+      break;
+    }
+
+    case WCS_CONNECTING:
+      if ((currentMillis - _connectionStateChanged) >= WIFI_CONNECT_TIMEOUT) {
+        #ifdef SERIAL_DEBUG
+        Serial.println("  ! Timed out connecting to WiFi.");
+        #endif
+        _connectionAttemptFailed(currentMillis);
+      }
+      break;
+
+    case WCS_CONNECTED:
+      _runRoaming(currentMillis);
+      break;
+
+    case WCS_WAITING_TO_RETRY:
+      if ((currentMillis - _connectionStateChanged) >= _reconnectDelay) {
+        #ifdef SERIAL_DEBUG
+        Serial.println("Reconnecting to WiFi...");
+        #endif
+        WiFi.disconnect();
+        _beginConnection(currentMillis);
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+
+/**
+ * Sample the RSSI of the current connection and, if it stays weak, look for (and move to) a
+ * stronger access point of any of the known networks in the background.
+ */
+void WiFiEngine::_runRoaming(unsigned long currentMillis) {
+  // Sample the RSSI
+  if ((currentMillis - _lastRSSISample) >= WIFI_RSSI_SAMPLE_INTERVAL) {
+    _lastRSSISample = currentMillis;
+    _rssiHistory[_rssiHistoryIndex] = WiFi.RSSI();
+    _rssiHistoryIndex = (_rssiHistoryIndex + 1) % WIFI_RSSI_HISTORY_SIZE;
+    if (_rssiHistoryCount < WIFI_RSSI_HISTORY_SIZE) {
+      _rssiHistoryCount += 1;
+    }
+
+    // Has the link been weak for the last few samples?
+    if (!_roamScanInProgress && (_rssiHistoryCount >= WIFI_ROAM_RSSI_SAMPLE_COUNT) && ((_lastRoamScan == 0) || ((currentMillis - _lastRoamScan) >= WIFI_ROAM_SCAN_INTERVAL))) {
+      int32_t total = 0;
+      for (byte i = 1; i <= WIFI_ROAM_RSSI_SAMPLE_COUNT; i++) {
+        total += _rssiHistory[(_rssiHistoryIndex + WIFI_RSSI_HISTORY_SIZE - i) % WIFI_RSSI_HISTORY_SIZE];
+      }
+
+      if ((total / WIFI_ROAM_RSSI_SAMPLE_COUNT) < WIFI_ROAM_RSSI_THRESHOLD) {
+        #ifdef SERIAL_DEBUG
+        Serial.print("Weak WiFi signal (");
+        Serial.print(total / WIFI_ROAM_RSSI_SAMPLE_COUNT);
+        Serial.println("dBm). Scanning for a better access point...");
+        #endif
+        WiFi.scanNetworks(true);
+        _roamScanInProgress = true;
+        _lastRoamScan = currentMillis;
+      }
     }
   }
 
-  return false;
+  // Wait for the roaming scan to complete
+  if (!_roamScanInProgress) {
+    return;
+  }
+
+  int resultCount = WiFi.scanComplete();
+  if (resultCount == WIFI_SCAN_RUNNING) {
+    return;
+  }
+  _roamScanInProgress = false;
+
+  byte networkIndex;
+  int32_t channel;
+  uint8_t bssid[6];
+  int32_t rssi;
+  bool found = (resultCount > 0) && _selectStrongestNetwork(resultCount, networkIndex, channel, bssid, rssi);
+  WiFi.scanDelete();
+
+  // Only move if the other access point is a lot stronger so that we don't flip flop between them
+  int32_t currentRSSI = WiFi.RSSI();
+  if (!found || (memcmp(bssid, WiFi.BSSID(), 6) == 0) || (rssi < (currentRSSI + WIFI_ROAM_HYSTERESIS))) {
+    return;
+  }
+
+  #ifdef SERIAL_DEBUG
+  Serial.print("Roaming to '");
+  Serial.print(config.wifi_networks[networkIndex].ssid);
+  Serial.print("' on channel ");
+  Serial.print(channel);
+  Serial.print(" (");
+  Serial.print(currentRSSI);
+  Serial.print("dBm -> ");
+  Serial.print(rssi);
+  Serial.println("dBm)");
+  #endif
+
+  roamCount += 1;
+  _handleWiFiDisconnected();
+  WiFi.disconnect();
+  _connectAttemptStarted = currentMillis;
+  _fastConnectAttempt = false;
+  _connectToNetwork(networkIndex, channel, bssid, currentMillis);
+}
+
+
+/**
+ * Move the connection state machine into a new state
+ */
+void WiFiEngine::_setConnectionState(WiFiConnectionState newState, unsigned long currentMillis) {
+  _connectionState = newState;
+  _connectionStateChanged = currentMillis;
+}
+
+
+/**
+ * Wait before the next connection attempt.
+ * The delay doubles after each failed attempt and is randomised so that a
+ * house full of devices doesn't hammer the hotspot in lock step after an outage.
+ */
+void WiFiEngine::_scheduleReconnect(unsigned long currentMillis) {
+  // Somewhere between half and all of the current backoff
+  _reconnectDelay = (_reconnectBackoff / 2) + (esp_random() % ((_reconnectBackoff / 2) + 1));
+  _reconnectBackoff = min(_reconnectBackoff * 2, (unsigned long)WIFI_RECONNECT_BACKOFF_MAX);
+  _setConnectionState(WCS_WAITING_TO_RETRY, currentMillis);
+
+  #ifdef SERIAL_DEBUG
+  Serial.print("  - Retrying WiFi connection in ");
+  Serial.print(_reconnectDelay);
+  Serial.println("ms");
+  #endif
 }
 
 
@@ -171,6 +621,7 @@ bool WiFiEngine::broadcastAP() {
 
   wifiEngineMode = WEM_AP;
   ipAddress = WiFi.softAPIP().toString();
+  HTMLTemplate::invalidateAll();
   macAddress = WiFi.softAPmacAddress();
 
   #ifdef SERIAL_DEBUG
@@ -195,6 +646,7 @@ void WiFiEngine::_handleWiFiDisconnected() {
   connected = false;
 
   ipAddress = "";
+  HTMLTemplate::invalidateAll();
   
   // Notify listeners
   if (onConnectedChanged) {
@@ -209,6 +661,7 @@ void WiFiEngine::_handleWiFiDisconnected() {
 void WiFiEngine::_handleWiFiConnected() {
   connected = true;
   ipAddress = WiFi.localIP().toString();
+  HTMLTemplate::invalidateAll();
 
   #ifdef SERIAL_DEBUG
   Serial.print("  - WiFi connected."); 
@@ -230,6 +683,11 @@ void WiFiEngine::_handleWiFiConnected() {
     #endif
   }
 
+  // Advertise the web server and the Garage Bot API (with the door state etc...)
+  else {
+    serviceAdvertiser.advertise();
+  }
+
   // TODO: establish if the Web Server needs to be re-created etc...
 
   // Notify listeners
@@ -239,6 +697,31 @@ void WiFiEngine::_handleWiFiConnected() {
 }
 
 
+/**
+ * The number of connected web socket clients
+ */
+byte WiFiEngine::getSocketClientCount() {
+  return _connectedSocketClientCount;
+}
+
+
+/**
+ * The number of messages waiting to be sent to a web socket client
+ *
+ * @param slot the client slot (0 to MAX_SOCKET_CONNECTIONS - 1)
+ * @param clientId populated with the id of the client in the slot (0 if the slot is free)
+ */
+size_t WiFiEngine::getSocketClientQueueLength(byte slot, uint32_t &clientId) {
+  clientId = _socketClients[slot].clientId;
+  if (clientId == 0) {
+    return 0;
+  }
+
+  AsyncWebSocketClient *client = _webSocket->client(clientId);
+  return client ? client->queueLen() : 0;
+}
+
+
 /**
  * Initialise the routes for serving the web app content
  * 
@@ -246,54 +729,42 @@ void WiFiEngine::_handleWiFiConnected() {
  */
 void WiFiEngine::initRoutes() {
   
-  // Route for root / web page (apmode.html)
-  _webServer->on("/", HTTP_GET, [&](AsyncWebServerRequest *request){
-    if (wifiEngineMode == WEM_AP) {
-      #ifdef SERIAL_DEBUG
-      Serial.println("Sending APMODE");
-      #endif
-      
-      request->send(LITTLEFS, "/apmode.html", String(), false, templateProcessor);
-    } else {
-      #ifdef SERIAL_DEBUG
-      Serial.println("Sending INDEX");
-      #endif
-      
-      request->send(LITTLEFS, "/index.html", String(), false, templateProcessor);
-    }
-  });
+  // Index the static files. The root document (and the app's routes) depends on the mode.
+  staticFileManifest.init(LITTLEFS, (wifiEngineMode == WEM_AP) ? "/apmode.html" : "/index.html");
 
-  // Route for control panel pages. These just prevent the device from 404ing when a control panel page is reloaded
-  // TODO: come up with a better way of falling back onto these routes
-  _webServer->on("/config", HTTP_GET, [&](AsyncWebServerRequest *request) {
-    request->send(LITTLEFS, "/index.html", String(), false, templateProcessor);
-  });
-  _webServer->on("/calibration", HTTP_GET, [&](AsyncWebServerRequest *request) {
-    request->send(LITTLEFS, "/index.html", String(), false, templateProcessor);
+  // Set the wifi access point details
+  _webServer->on("/setwifi", HTTP_POST, [&](AsyncWebServerRequest *request){
+    _handleSetWiFi(request);
+  }, NULL, [&](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total){
+    _receiveRequestBody(request, data, len, index, total);
   });
-  _webServer->on("/about", HTTP_GET, [&](AsyncWebServerRequest *request) {
-    request->send(LITTLEFS, "/index.html", String(), false, templateProcessor);
+
+  // Set the config
+  _webServer->on("/setconfig", HTTP_POST, [&](AsyncWebServerRequest *request){
+    _handleSetConfig(request);
+  }, NULL, [&](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total){
+    _receiveRequestBody(request, data, len, index, total);
   });
 
-  // Set the wifi access point details
-  _webServer->on("/setwifi", HTTP_POST, [&](AsyncWebServerRequest *request){}, NULL, [&](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total){
-    _handleSetWiFi(request, data, len);
+  // Upload (or remove) the CA certificate used by the MQTT client when TLS is enabled. The body is the PEM itself.
+  _webServer->on("/setmqttcacert", HTTP_POST, [&](AsyncWebServerRequest *request){
+    _handleSetMQTTCACert(request);
+  }, NULL, [&](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total){
+    _receiveRequestBody(request, data, len, index, total, MQTT_TLS_CA_CERT_MAX_SIZE);
   });
 
-  // Set the config
-  _webServer->on("/setconfig", HTTP_POST, [&](AsyncWebServerRequest *request){}, NULL, [&](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total){
-    _handleSetConfig(request, data, len);
+  // Runtime metrics in the Prometheus text format
+  _webServer->on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request){
+    metrics.handleScrape(request);
   });
 
+  // Static files (and app routes) from the static file manifest
+  _webServer->addHandler(new StaticFileHandler());
+
   // All other Files / Routes
   _webServer->onNotFound([](AsyncWebServerRequest *request){
-    // Attempt to load the file from the LITTLEFS file system
-    if ((request->method() == HTTP_GET) && LITTLEFS.exists(request->url())) {
-      request->send(LITTLEFS, request->url(), getMimeType(request->url()));
-    }
-
     // Handle HTTP_OPTIONS
-    else if (request->method() == HTTP_OPTIONS) {
+    if (request->method() == HTTP_OPTIONS) {
       request->send(200);
     }
 
@@ -312,6 +783,95 @@ void WiFiEngine::initRoutes() {
 }
 
 
+/**
+ * The most recent ping round trip time of a web socket client
+ *
+ * @param slot the client slot (0 to MAX_SOCKET_CONNECTIONS - 1)
+ * @param clientId populated with the id of the client in the slot (0 if the slot is free)
+ * @return uint32_t the round trip time in microseconds (0 if it hasn't been measured yet)
+ */
+uint32_t WiFiEngine::getSocketClientRTT(byte slot, uint32_t &clientId) {
+  clientId = _socketClients[slot].clientId;
+  return (clientId == 0) ? 0 : _socketClients[slot].rtt;
+}
+
+
+/**
+ * The number of connected server-sent event (/events) clients
+ */
+size_t WiFiEngine::getEventSourceClientCount() {
+  // The event source isn't assigned until the engine is initialised (it never is when WiFi is disabled)
+  return _eventSource ? _eventSource->count() : 0;
+}
+
+
+/**
+ * Fired when a client subscribes to /events
+ *
+ * @param eventClient - the new event source client
+ */
+void WiFiEngine::_handleEventSourceConnect(AsyncEventSourceClient *eventClient) {
+  #ifdef SERIAL_DEBUG
+  Serial.println("New incoming event source connection.");
+  #endif
+
+  // A reconnecting client sends the id of the last event it received (Last-Event-ID). If the events it
+  // missed are still in the history, send just those. Otherwise send the current device config and status.
+  bool resumed = (eventClient->lastId() != 0) && _eventHistory.replaySince(eventClient->lastId(), [eventClient](uint32_t sequence, const char *eventName, const char *json, size_t length){
+    eventClient->send(json, eventName, sequence, SSE_RECONNECT_DELAY);
+  });
+
+  if (!resumed) {
+    sendConfigToClients(NULL, eventClient);
+    sendStatusToClients(NULL, eventClient);
+  }
+}
+
+
+/**
+ * Send a serialized message to a specific client, or to all of the connected
+ * web socket and event source clients.
+ *
+ * The message is only serialized once regardless of how many clients it is sent to.
+ * Broadcast events are also kept in the event history for reconnecting clients.
+ *
+ * @param json        - the serialized message
+ * @param length      - the length of the serialized message
+ * @param eventName   - the server-sent event name (NULL if the message isn't sent to the event source clients)
+ * @param sequence    - the sequence number the message is stamped with (0 if it isn't an event)
+ * @param client      - (Optional) A specific web socket client to send the message to
+ * @param eventClient - (Optional) A specific event source client to send the message to
+ */
+void WiFiEngine::_sendToClients(const char *json, size_t length, const char *eventName, uint32_t sequence, AsyncWebSocketClient *client, AsyncEventSourceClient *eventClient) {
+  // Send the message to a specific client
+  if (client != NULL) {
+    if (client->status() == WS_CONNECTED) {
+      client->text(json, length);
+    }
+    return;
+  }
+  if (eventClient != NULL) {
+    if (eventClient->connected()) {
+      eventClient->send(json, eventName, sequence, SSE_RECONNECT_DELAY);
+    }
+    return;
+  }
+
+  // Remember the event (even if nobody is connected right now) for clients that reconnect
+  if (sequence != 0) {
+    _eventHistory.add(sequence, eventName, json, length);
+  }
+
+  // Send the message to all clients
+  if (_connectedSocketClientCount > 0) {
+    _webSocket->textAll(json, length);
+  }
+  if ((eventName != NULL) && (getEventSourceClientCount() > 0)) {
+    _eventSource->send(json, eventName, sequence);
+  }
+}
+
+
 /**
  * Fired when a webSocket event occurs
  * @see: https://github.com/me-no-dev/ESPAsyncWebServer/blob/master/examples/ESP_AsyncFSBrowser/ESP_AsyncFSBrowser.ino
@@ -327,6 +887,12 @@ void WiFiEngine::onWsEvent(AsyncWebSocketClient *client, AwsEventType type, void
   if (type == WS_EVT_CONNECT){
     // increment the connected socket client count
     _connectedSocketClientCount += 1;
+    SocketClientSlot *slot = _findSocketClient(0);
+    if (slot) {
+      slot->clientId = client->id();
+      slot->rtt = 0;
+      slot->messageLength = 0;
+    }
 
     #ifdef SERIAL_DEBUG
     Serial.println("New incoming WebSocket connection.");
@@ -334,10 +900,22 @@ void WiFiEngine::onWsEvent(AsyncWebSocketClient *client, AwsEventType type, void
     Serial.println(_connectedSocketClientCount);
     #endif
 
-    // Send the current device config and status to the connected client
-    sendConfigToClients(client);
-    sendStatusToClients(client);
-    sendSensorDataToClients(client);
+    // A reconnecting client sends the sequence number of the last event it received (/ws?s=1234). If the events
+    // it missed are still in the history, send just those. Otherwise send the current device config and status.
+    AsyncWebServerRequest *request = (AsyncWebServerRequest*)arg;
+    bool resumed = false;
+    if (request && request->hasParam("s")) {
+      uint32_t lastSequence = strtoul(request->getParam("s")->value().c_str(), NULL, 10);
+      resumed = _eventHistory.replaySince(lastSequence, [client](uint32_t sequence, const char *eventName, const char *json, size_t length){
+        client->text(json, length);
+      });
+    }
+
+    if (!resumed) {
+      sendConfigToClients(client);
+      sendStatusToClients(client);
+      sendSensorDataToClients(client);
+    }
   }
 
   // Fired when a websocket client disconnects
@@ -345,6 +923,13 @@ void WiFiEngine::onWsEvent(AsyncWebSocketClient *client, AwsEventType type, void
     // decrement the connected client count
     _connectedSocketClientCount -= 1;
 
+    // Free up the client's slot (and its message buffer)
+    SocketClientSlot *slot = _findSocketClient(client->id());
+    if (slot) {
+      slot->clientId = 0;
+      slot->messageLength = 0;
+    }
+
     #ifdef SERIAL_DEBUG
     Serial.println("WebSocket connection terminated.");
     Serial.print("Total active WebSocket connetctions: ");
@@ -357,6 +942,11 @@ void WiFiEngine::onWsEvent(AsyncWebSocketClient *client, AwsEventType type, void
     // Pass the data parsing off to a more detailed function
     handleWebSocketData(client, arg, data, len);
   }
+
+  // Fired when a websocket client answers a ping
+  else if (type == WS_EVT_PONG) {
+    _handleSocketPong(client, data, len);
+  }
 }
 
 
@@ -365,45 +955,48 @@ void WiFiEngine::onWsEvent(AsyncWebSocketClient *client, AwsEventType type, void
  * Typically happens just after connection and when the config changes.
  *
  * @param client - (Optional) A specific client to send the config to
+ * @param eventClient - (Optional) A specific event source client to send the config to
  */
-void WiFiEngine::sendConfigToClients(AsyncWebSocketClient *client) {
-  // Don't bother if we're not sending to a direct client and there are no active connections
-  if (!client && (_connectedSocketClientCount == 0)) {
+void WiFiEngine::sendConfigToClients(AsyncWebSocketClient *client, AsyncEventSourceClient *eventClient) {
+  // Clients are only accepted (and events only recorded) in client mode
+  if (wifiEngineMode != WEM_CLIENT) {
     return;
   }
 
+  // A broadcast is a new event. A message to a specific client is a snapshot as of the most recent event.
+  uint32_t sequence = (!client && !eventClient) ? _eventHistory.nextSequence() : _eventHistory.lastSequence();
+
   DynamicJsonDocument doc(MAX_SOCKET_SERVER_MESSAGE_SIZE);
   doc["m"] = SOCKET_SERVER_MESSAGE_CONFIG_CHANGE;
+  doc["s"] = sequence;
   JsonObject payload = doc.createNestedObject("p");
   payload["firmware_version"]           = FIRMWARE_VERSION;
   payload["ip_address"]                 = ipAddress;
   payload["mac_address"]                = macAddress;
   payload["mdns_name"]                  = config.mdns_name;
   payload["device_name"]                = config.device_name;
-  payload["wifi_ssid"]                  = config.wifi_ssid;
+  payload["wifi_ssid"]                  = connected ? WiFi.SSID() : ((config.wifi_network_count > 0) ? config.wifi_networks[0].ssid : "");
+  JsonArray wifiNetworks = payload.createNestedArray("wifi_networks");
+  for (byte i = 0; i < config.wifi_network_count; i++) {
+    wifiNetworks.add(config.wifi_networks[i].ssid);
+  }
   payload["mqtt_enabled"]               = config.mqtt_enabled;
   payload["mqtt_broker_address"]        = config.mqtt_broker_address;
   payload["mqtt_broker_port"]           = config.mqtt_broker_port;
+  payload["mqtt_tls_enabled"]           = config.mqtt_tls_enabled;
   payload["mqtt_device_id"]             = config.mqtt_device_id;
   payload["mqtt_username"]              = config.mqtt_username;
   payload["mqtt_password"]              = config.mqtt_password.equals("") ? "" : "********";
   payload["mqtt_command_topic"]         = config.mqtt_command_topic;
   payload["mqtt_state_topic"]           = config.mqtt_state_topic;
+  payload["udp_command_key"]            = config.udp_command_key.equals("") ? "" : "********";
   payload["top_ir_sensor_threshold"]    = config.top_ir_sensor_threshold;
   payload["bottom_ir_sensor_threshold"] = config.bottom_ir_sensor_threshold;
   
   char json[MAX_SOCKET_SERVER_MESSAGE_SIZE];
-  serializeJsonPretty(doc, json);
+  size_t length = serializeJson(doc, json);
   
-  // Send the config to a specific client
-  if (client != NULL && (client->status() == WS_CONNECTED)) {
-    client->text(json);
-  } 
-
-  // Send the config to all clients
-  else {
-    _webSocket->textAll(json);
-  }
+  _sendToClients(json, length, SSE_EVENT_CONFIG_CHANGE, sequence, client, eventClient);
 }
 
 
@@ -412,34 +1005,40 @@ void WiFiEngine::sendConfigToClients(AsyncWebSocketClient *client) {
  * Typically happens just after connection and when the config changes.
  *
  * @param client - (Optional) A specific client to send the config to
+ * @param eventClient - (Optional) A specific event source client to send the config to
  */
-void WiFiEngine::sendStatusToClients(AsyncWebSocketClient *client) {
-  // Don't bother if we're not sending to a direct client and there are no active connections
-  if (!client && (_connectedSocketClientCount == 0)) {
+void WiFiEngine::sendStatusToClients(AsyncWebSocketClient *client, AsyncEventSourceClient *eventClient) {
+  // Clients are only accepted (and events only recorded) in client mode
+  if (wifiEngineMode != WEM_CLIENT) {
     return;
   }
 
+  // A broadcast is a new event. A message to a specific client is a snapshot as of the most recent event.
+  uint32_t sequence = (!client && !eventClient) ? _eventHistory.nextSequence() : _eventHistory.lastSequence();
+
   DynamicJsonDocument doc(MAX_SOCKET_SERVER_MESSAGE_SIZE);
   doc["m"] = SOCKET_SERVER_MESSAGE_STATUS_CHANGE;
+  doc["s"] = sequence;
   JsonObject payload = doc.createNestedObject("p");
   
   // Add the door status
   payload["door_state"] = doorControl.getDoorStateAsString();
   payload["mqtt_client_state"] = mqttClient.getMQTTStateAsString();
   payload["mqtt_client_error"] = mqttClient.getMQTTError();
+  payload["wifi_connect_ms"] = lastConnectDuration;
+  payload["wifi_fast_connect"] = lastConnectWasFast;
+  payload["wifi_ssid"] = connected ? WiFi.SSID() : "";
+  payload["wifi_rssi"] = connected ? WiFi.RSSI() : 0;
+  payload["wifi_roam_count"] = roamCount;
+  JsonArray rssiHistory = payload.createNestedArray("wifi_rssi_history");
+  for (byte i = 0; i < _rssiHistoryCount; i++) {
+    rssiHistory.add(_rssiHistory[(_rssiHistoryIndex + WIFI_RSSI_HISTORY_SIZE - _rssiHistoryCount + i) % WIFI_RSSI_HISTORY_SIZE]);
+  }
   
   char json[MAX_SOCKET_SERVER_MESSAGE_SIZE];
-  serializeJsonPretty(doc, json);
+  size_t length = serializeJson(doc, json);
   
-  // Send the config to a specific client
-  if (client != NULL && (client->status() == WS_CONNECTED)) {
-    client->text(json);
-  } 
-
-  // Send the config to all clients
-  else {
-    _webSocket->textAll(json);
-  }
+  _sendToClients(json, length, SSE_EVENT_STATUS_CHANGE, sequence, client, eventClient);
 }
 
 
@@ -448,8 +1047,8 @@ void WiFiEngine::sendStatusToClients(AsyncWebSocketClient *client) {
  * Happens just after the device is requested to reboot
  */
 void WiFiEngine::sendRebootingToClients() {
-  // Don't bother if we're not sending to a direct client and there are no active connections
-  if (_connectedSocketClientCount == 0) {
+  // Don't bother if there are no active connections
+  if ((_connectedSocketClientCount == 0) && (getEventSourceClientCount() == 0)) {
     return;
   }
 
@@ -458,10 +1057,10 @@ void WiFiEngine::sendRebootingToClients() {
   JsonObject payload = doc.createNestedObject("p");
   
   char json[MAX_SOCKET_SERVER_MESSAGE_SIZE];
-  serializeJsonPretty(doc, json);
+  size_t length = serializeJson(doc, json);
   
-  // Send the config to all clients
-  _webSocket->textAll(json);
+  // Send the message to all clients. There's no point remembering it, the history won't survive the reboot.
+  _sendToClients(json, length, SSE_EVENT_REBOOTING, 0, NULL, NULL);
 }
 
 
@@ -524,31 +1123,30 @@ void WiFiEngine::run (unsigned long currentMillis) {
   // If the wifiEngine is in normal wifi client mode
   else {
     // evaluate the state of the WiFi connection and establish if it needs to be re-connected etc...
-    if ((WiFi.status() != WL_CONNECTED) && ((currentMillis - _lastReconnectAttempt) >= RECONNECT_INTERVAL)) {
-      // To our knowledge, are we supposed to be connected?!
-      if (connected) {
-        _handleWiFiDisconnected();
-      }
-      
-      #ifdef SERIAL_DEBUG
-      Serial.println("Reconnecting to WiFi...");
-      #endif
-
-      WiFi.disconnect();
-      WiFi.reconnect();
-      _lastReconnectAttempt = currentMillis;
-    }
-
-    // If the wifi is connected but we aren't aware of it, update the connected state and notify listeners
-    else if ((WiFi.status() == WL_CONNECTED) && !connected) {
-      _handleWiFiConnected();
-    }
+    _runConnectionStateMachine(currentMillis);
     
     // If the appropriate amount of time has passed and the button is stable, register the change
     if ((currentMillis - _lastSensorBroadcast) > SENSOR_BROADCAST_INTERVAL) {
       sendSensorDataToClients();
       _lastSensorBroadcast = currentMillis;
     }
+
+    // Ping the socket clients with a websocket control frame. The browser answers with a pong carrying the
+    // same payload (the micros() the ping was sent) without the app or the message handling being involved.
+    if ((_connectedSocketClientCount > 0) && ((currentMillis - _lastSocketPing) > WS_PING_INTERVAL)) {
+      uint32_t pingMicros = micros();
+      _webSocket->pingAll((uint8_t*)&pingMicros, sizeof(pingMicros));
+      _lastSocketPing = currentMillis;
+    }
+
+    // Keep idle event streams alive through proxies and the browser's own timeouts. The event has
+    // no data so the browser doesn't dispatch it, it just refreshes the reconnect delay.
+    if ((currentMillis - _lastEventSourceKeepAlive) > SSE_KEEPALIVE_INTERVAL) {
+      if (getEventSourceClientCount() > 0) {
+        _eventSource->send(NULL, NULL, 0, SSE_RECONNECT_DELAY);
+      }
+      _lastEventSourceKeepAlive = currentMillis;
+    }
   }
 }
 
@@ -578,39 +1176,174 @@ String WiFiEngine::templateProcessor(const String& var){
 
 
 /**
- * Handles setting new WiFi connection details
- * 
- * @param request   - the incoming HTTP Post Request that triggered the action
- * @param body      - the body of the HTTP Post Request
+ * Receive a chunk of an HTTP request body
+ *
+ * The body can arrive over several TCP packets, so each chunk is appended to an
+ * arena (sized to the route's maximum) which is attached to the request (and
+ * freed along with it). Bodies which exceed the maximum are never buffered.
+ * They are flagged so that the request handler can respond with a 413.
+ *
+ * @param request   - the incoming HTTP Request
+ * @param data      - this chunk of the body
+ * @param len       - the length of this chunk
+ * @param index     - the offset of this chunk within the body
+ * @param total     - the total length of the body (Content-Length)
+ * @param maxSize   - the largest body the route accepts
  */
-void WiFiEngine::_handleSetWiFi(AsyncWebServerRequest *request, uint8_t *data, size_t len){
-  // Make sure we only capture a string of the exact message size. Also add a null terminator to the end.
-  char body[len + 1];
-  memcpy( body, data, len );
-  body[len] = '\0';
+void WiFiEngine::_receiveRequestBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total, size_t maxSize) {
+  HTTPBodyArena *arena = (HTTPBodyArena*)request->_tempObject;
+
+  // First chunk - allocate the arena. The request frees it with free() when it is destroyed.
+  // A body that is already known to be too large only gets the header (to record the 413), not the data buffer.
+  if (!arena) {
+    bool tooLarge = (total > maxSize);
+    arena = (HTTPBodyArena*)malloc(sizeof(HTTPBodyArena) + (tooLarge ? 0 : (maxSize + 1)));
+    if (!arena) {
+      return;
+    }
+    arena->length = 0;
+    arena->status = tooLarge ? HTTP_BODY_TOO_LARGE : HTTP_BODY_RECEIVING;
+    request->_tempObject = arena;
+  }
+
+  if (arena->status != HTTP_BODY_RECEIVING) {
+    return;
+  }
+
+  // Chunks must arrive in order and must not exceed the arena
+  if ((index != arena->length) || ((arena->length + len) > maxSize)) {
+    arena->status = (index != arena->length) ? HTTP_BODY_MALFORMED : HTTP_BODY_TOO_LARGE;
+    return;
+  }
+
+  memcpy(arena->data + arena->length, data, len);
+  arena->length += len;
+
+  // Final chunk - null terminate the body (for the benefit of the debug output)
+  if (arena->length == total) {
+    arena->data[arena->length] = '\0';
+    arena->status = HTTP_BODY_COMPLETE;
+  }
+}
+
+
+/**
+ * Check the JSON body that was assembled by _receiveRequestBody
+ *
+ * The body is not parsed into a document. The handlers pull the values they
+ * need straight out of the arena with the jsonScanner (so the strings are only
+ * copied once, into the update that is handed to the main loop). If the body
+ * isn't a complete JSON object, an appropriate error response is sent.
+ *
+ * @param request   - the incoming HTTP Request
+ * @param body      - populated with the location of the JSON object in the arena
+ * @return bool true if the body holds a JSON object
+ */
+bool WiFiEngine::_parseRequestBody(AsyncWebServerRequest *request, JsonSpan &body) {
+  HTTPBodyArena *arena = (HTTPBodyArena*)request->_tempObject;
+
+  if (arena && (arena->status == HTTP_BODY_TOO_LARGE)) {
+    request->send(413, "text/json", F("{\"success\":false,\"error\":\"Request body too large\"}"));
+    return false;
+  }
+
+  if (!arena || (arena->status != HTTP_BODY_COMPLETE)) {
+    request->send(400, "text/json", F("{\"success\":false,\"error\":\"Incomplete request body\"}"));
+    return false;
+  }
 
-  // Deserialize the message
-  DynamicJsonDocument doc(CONFIG_FILE_MAX_SIZE);
-  DeserializationError error = deserializeJson(doc, body);
+  // Trim any whitespace from around the object
+  size_t start = 0;
+  size_t end = arena->length;
+  while ((start < end) && isspace((unsigned char)arena->data[start])) {
+    start++;
+  }
+  while ((end > start) && isspace((unsigned char)arena->data[end - 1])) {
+    end--;
+  }
 
-  // Check for an error parsing the json
-  if (error) {
+  if (((end - start) < 2) || (arena->data[start] != '{') || (arena->data[end - 1] != '}')) {
     #ifdef SERIAL_DEBUG
-    Serial.print(F("deserializeJson() failed: "));
-    Serial.println(error.f_str());
+    Serial.print(F("Request body is not a JSON object: "));
+    Serial.println(arena->data);
     #endif
 
-    // TODO: embed the error in the JSON
-    request->send(400, "text/json", F("{\"success\":false}"));
+    request->send(400, "text/json", F("{\"success\":false,\"error\":\"Malformed JSON\"}"));
+    return false;
+  }
+
+  body.ptr = arena->data + start;
+  body.len = end - start;
+  body.type = JSON_SPAN_OBJECT;
+  return true;
+}
+
+
+/**
+ * Get a non-empty string value from a json body or return a default value if not specified
+ *
+ * @param body          - the json body
+ * @param key           - the key of the value
+ * @param defaultValue  - the value to return if the key is missing, null, not a string or empty
+ */
+static String jsonStringOrDefault(const JsonSpan &body, const char *key, const char *defaultValue) {
+  JsonSpan value;
+  String result;
+  if (jsonFindValue(body, key, value) && jsonSpanToString(value, result) && (result.length() > 0)) {
+    return result;
+  }
+  return String(defaultValue);
+}
+
+
+/**
+ * Get a write-only (secret) string value from a json body or keep the current value if not specified
+ *
+ * The config payload only ever sends a mask in place of a secret, so a client that
+ * didn't change it sends null (or leaves it out). An empty string clears it.
+ *
+ * @param body          - the json body
+ * @param key           - the key of the value
+ * @param currentValue  - the value to keep if the key is missing, null or not a string
+ */
+static String jsonSecretOrCurrent(const JsonSpan &body, const char *key, const String &currentValue) {
+  JsonSpan value;
+  String result;
+  if (jsonFindValue(body, key, value) && jsonSpanToString(value, result)) {
+    return result;
+  }
+  return currentValue;
+}
+
+
+/**
+ * Handles setting new WiFi connection details
+ * 
+ * @param request   - the incoming HTTP Post Request that triggered the action
+ */
+void WiFiEngine::_handleSetWiFi(AsyncWebServerRequest *request){
+  JsonSpan body;
+  if (!_parseRequestBody(request, body)) {
     return;
   }
 
-  // Apply the new config  
-  String wifiSSID = doc["wifiSSID"];
-  String wifiPassword = doc["wifiPassword"];
+  // Extract the new config
+  WiFiSettingsUpdate *update = new WiFiSettingsUpdate();
+  update->ssid = jsonStringOrDefault(body, "wifiSSID", "");
+  update->password = jsonStringOrDefault(body, "wifiPassword", "");
 
-  // Call the FileSystem method responsible for updating the WiFi config
-  botFS.setWiFiSettings(wifiSSID, wifiPassword);
+  if (update->ssid.equals("")) {
+    delete update;
+    request->send(400, "text/json", F("{\"success\":false,\"error\":\"No SSID provided\"}"));
+    return;
+  }
+
+  // Hand the update off to the main loop which will save it to the file system
+  if (!commandQueue.push(BOT_COMMAND_SET_WIFI, 0, 0, update)) {
+    delete update;
+    request->send(503, "text/json", F("{\"success\":false}"));
+    return;
+  }
 
   // Return a 200 - Success
   request->send(200, "text/json", F("{\"success\":true}"));
@@ -621,52 +1354,100 @@ void WiFiEngine::_handleSetWiFi(AsyncWebServerRequest *request, uint8_t *data, s
  * Handles setting new config details
  * 
  * @param request   - the incoming HTTP Post Request that triggered the action
- * @param body      - the body of the HTTP Post Request
  */
-void WiFiEngine::_handleSetConfig(AsyncWebServerRequest *request, uint8_t *data, size_t len){
-  // Make sure we only capture a string of the exact message size. Also add a null terminator to the end.
-  char body[len + 1];
-  memcpy( body, data, len );
-  body[len] = '\0';
+void WiFiEngine::_handleSetConfig(AsyncWebServerRequest *request){
+  JsonSpan body;
+  if (!_parseRequestBody(request, body)) {
+    return;
+  }
 
-  // Deserialize the message
-  DynamicJsonDocument doc(CONFIG_FILE_MAX_SIZE);
-  DeserializationError error = deserializeJson(doc, body);
+  // Extract the new config
+  JsonSpan value;
+  bool mqttEnabled = config.mqtt_enabled;
+  if (jsonFindValue(body, "mqtt_enabled", value)) {
+    jsonSpanToBool(value, mqttEnabled);
+  }
 
-  // Check for an error parsing the json
-  if (error) {
-    #ifdef SERIAL_DEBUG
-    Serial.print(F("deserializeJson() failed: "));
-    Serial.println(error.f_str());
-    #endif
+  bool mqttTLSEnabled = config.mqtt_tls_enabled;
+  if (jsonFindValue(body, "mqtt_tls_enabled", value)) {
+    jsonSpanToBool(value, mqttTLSEnabled);
+  }
 
-    // TODO: embed the error in the JSON
-    request->send(400, "text/json", F("{\"success\":false}"));
+  long mqttBrokerPort = DEFAULT_CONFIG_MQTT_BROKER_PORT;
+  if (jsonFindValue(body, "mqtt_broker_port", value) && !jsonSpanIsNull(value) && !jsonSpanToInt(value, mqttBrokerPort)) {
+    mqttBrokerPort = 0;
+  }
+
+  if ((mqttBrokerPort <= 0) || (mqttBrokerPort > 65535)) {
+    request->send(400, "text/json", F("{\"success\":false,\"error\":\"Invalid MQTT Broker Port\"}"));
     return;
   }
-  
-  // TODO: create a static helper to "get a string value from a json doc + return default value if not specified"
 
-  // Extract the new config
-  String mdnsName = (doc.containsKey("mdns_name") && !doc["mdns_name"].isNull() && (doc["mdns_name"].as<String>() != "")) ? doc["mdns_name"].as<String>() : DEFAULT_CONFIG_MDNS_NAME;
-  String deviceName = (doc.containsKey("device_name") && !doc["device_name"].isNull() && (doc["device_name"].as<String>() != "")) ? doc["device_name"].as<String>() : DEFAULT_CONFIG_DEVICE_NAME;
+  GeneralConfigUpdate *update = new GeneralConfigUpdate();
+  update->mdnsName = jsonStringOrDefault(body, "mdns_name", DEFAULT_CONFIG_MDNS_NAME);
+  update->deviceName = jsonStringOrDefault(body, "device_name", DEFAULT_CONFIG_DEVICE_NAME);
+  update->mqttEnabled = mqttEnabled;
+  update->mqttBrokerAddress = jsonStringOrDefault(body, "mqtt_broker_address", "");
+  update->mqttBrokerPort = mqttBrokerPort;
+  update->mqttTLSEnabled = mqttTLSEnabled;
+  update->mqttDeviceId = jsonStringOrDefault(body, "mqtt_device_id", DEFAULT_CONFIG_MQTT_DEVICE_ID);
+  update->mqttUsername = jsonStringOrDefault(body, "mqtt_username", "");
+  update->mqttPassword = jsonSecretOrCurrent(body, "mqtt_password", config.mqtt_password);
+  update->mqttCommandTopic = jsonStringOrDefault(body, "mqtt_command_topic", DEFAULT_CONFIG_MQTT_DEVICE_COMMAND_TOPIC);
+  update->mqttStateTopic = jsonStringOrDefault(body, "mqtt_state_topic", DEFAULT_CONFIG_MQTT_DEVICE_STATE_TOPIC);
+  update->udpCommandKey = jsonSecretOrCurrent(body, "udp_command_key", config.udp_command_key);
+
+  // Hand the update off to the main loop which will save it to the file system
+  if (!commandQueue.push(BOT_COMMAND_SET_CONFIG, 0, 0, update)) {
+    delete update;
+    request->send(503, "text/json", F("{\"success\":false}"));
+    return;
+  }
+
+  // Return a 200 - Success
+  request->send(200, "text/json", F("{\"success\":true}"));
+}
+
 
-  JsonVariant mqttEnabledValue = doc["mqtt_enabled"];
-  bool mqttEnabled = mqttEnabledValue.isNull() ? config.mqtt_enabled : mqttEnabledValue.as<bool>();
+/**
+ * Handles uploads of the CA certificate that the MQTT broker's certificate must be signed by
+ *
+ * The body is the PEM encoded certificate (or chain) itself, sent as text/plain or
+ * application/x-pem-file (a form encoded body would be parsed into parameters instead).
+ * An empty body removes the certificate. The certificate is written on the main loop,
+ * which then reboots so that the MQTT client picks it up.
+ *
+ * @param request   - the incoming HTTP Post Request that triggered the action
+ */
+void WiFiEngine::_handleSetMQTTCACert(AsyncWebServerRequest *request){
+  HTTPBodyArena *arena = (HTTPBodyArena*)request->_tempObject;
 
-  String mqttBrokerAddres = (doc.containsKey("mqtt_broker_address") && !doc["mqtt_broker_address"].isNull() && (doc["mqtt_broker_address"].as<String>() != "")) ? doc["mqtt_broker_address"].as<String>() : "";
+  if (arena && (arena->status == HTTP_BODY_TOO_LARGE)) {
+    request->send(413, "text/json", F("{\"success\":false,\"error\":\"Certificate too large\"}"));
+    return;
+  }
 
-  JsonVariant mqttBrokerPortValue = doc["mqtt_broker_port"];
-  unsigned int mqttBrokerPort = mqttBrokerPortValue.isNull() ? DEFAULT_CONFIG_MQTT_BROKER_PORT : mqttBrokerPortValue.as<unsigned int>();
+  // An empty body never reaches _receiveRequestBody, so there is no arena for it
+  if (arena && (arena->status != HTTP_BODY_COMPLETE)) {
+    request->send(400, "text/json", F("{\"success\":false,\"error\":\"Incomplete request body\"}"));
+    return;
+  }
 
-  String mqttDeviceId = (doc.containsKey("mqtt_device_id") && !doc["mqtt_device_id"].isNull() && (doc["mqtt_device_id"].as<String>() != "")) ? doc["mqtt_device_id"].as<String>() : DEFAULT_CONFIG_MQTT_DEVICE_ID;
-  String mqttUsername = (doc.containsKey("mqtt_username") && !doc["mqtt_username"].isNull() && (doc["mqtt_username"].as<String>() != "")) ? doc["mqtt_username"].as<String>() : "";
-  String mqttPassword = (doc.containsKey("mqtt_password") && !doc["mqtt_password"].isNull() && (doc["mqtt_password"].as<String>() != "")) ? doc["mqtt_password"].as<String>() : "";
-  String mqttCommandTopic = (doc.containsKey("mqtt_command_topic") && !doc["mqtt_command_topic"].isNull() && (doc["mqtt_command_topic"].as<String>() != "")) ? doc["mqtt_command_topic"].as<String>() : DEFAULT_CONFIG_MQTT_DEVICE_COMMAND_TOPIC;
-  String mqttStateTopic = (doc.containsKey("mqtt_state_topic") && !doc["mqtt_state_topic"].isNull() && (doc["mqtt_state_topic"].as<String>() != "")) ? doc["mqtt_state_topic"].as<String>() : DEFAULT_CONFIG_MQTT_DEVICE_STATE_TOPIC;
+  String *cert = new String(arena ? arena->data : "");
+  cert->trim();
 
-  // Call the FileSystem methods responsible for updating the config
-  botFS.setGeneralConfig(mdnsName, deviceName, mqttEnabled, mqttBrokerAddres, mqttBrokerPort, mqttDeviceId, mqttUsername, mqttPassword, mqttCommandTopic, mqttStateTopic);
+  if (!cert->equals("") && (!cert->startsWith("-----BEGIN CERTIFICATE-----") || (cert->indexOf("-----END CERTIFICATE-----") < 0))) {
+    delete cert;
+    request->send(400, "text/json", F("{\"success\":false,\"error\":\"Not a PEM encoded certificate\"}"));
+    return;
+  }
+
+  // Hand the certificate off to the main loop which will save it to the file system
+  if (!commandQueue.push(BOT_COMMAND_SET_MQTT_CA_CERT, 0, 0, cert)) {
+    delete cert;
+    request->send(503, "text/json", F("{\"success\":false}"));
+    return;
+  }
 
   // Return a 200 - Success
   request->send(200, "text/json", F("{\"success\":true}"));
@@ -674,77 +1455,150 @@ void WiFiEngine::_handleSetConfig(AsyncWebServerRequest *request, uint8_t *data,
 
 
 /**
- * Parse and handle a websocket data message
+ * Receive a websocket data message (or a fragment of one)
+ *
+ * Messages that arrive in a single chunk are parsed in place. Fragmented
+ * messages are assembled into the client's fixed size message buffer first.
+ * Anything larger than MAX_SOCKET_CLIENT_MESSAGE_SIZE is rejected and the
+ * client is disconnected.
  */
 void WiFiEngine::handleWebSocketData(AsyncWebSocketClient *client, void *arg, uint8_t *data, size_t len) {
   AwsFrameInfo *info = (AwsFrameInfo*)arg;
-  if (info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT) {
-    
-    // We know we're only really receiving strings here so make sure the data is null-terminated
-    char message[MAX_SOCKET_CLIENT_MESSAGE_SIZE];
-    memcpy( message, data, len );
-    message[len] = '\0';
 
-    // First, compare the data against the "PING" string.
-    if (strcmp(message, "PING") == 0) {
+  // We only expect text messages from the client
+  if (info->message_opcode != WS_TEXT) {
+    return;
+  }
+
+  // Don't even attempt to deal with a frame that can't fit in the buffer
+  if (info->len > MAX_SOCKET_CLIENT_MESSAGE_SIZE) {
+    _rejectSocketMessage(client);
+    return;
+  }
+
+  // The whole message arrived in one go. No need to copy it anywhere.
+  if (info->final && (info->num == 0) && (info->index == 0) && (info->len == len)) {
+    _handleSocketMessage(client, (const char*)data, len);
+    return;
+  }
+
+  // Fragmented message. Assemble it in the client's message buffer.
+  SocketClientSlot *slot = _findSocketClient(client->id());
+  if (!slot) {
+    return;
+  }
+
+  // The first chunk of the first frame starts a new message
+  if ((info->num == 0) && (info->index == 0)) {
+    slot->messageLength = 0;
+  }
+
+  if ((slot->messageLength + len) > MAX_SOCKET_CLIENT_MESSAGE_SIZE) {
+    slot->messageLength = 0;
+    _rejectSocketMessage(client);
+    return;
+  }
+
+  memcpy(slot->message + slot->messageLength, data, len);
+  slot->messageLength += len;
+
+  // The last chunk of the last frame completes the message
+  if (info->final && ((info->index + len) == info->len)) {
+    _handleSocketMessage(client, slot->message, slot->messageLength);
+    slot->messageLength = 0;
+  }
+}
+
+
+/**
+ * Handle the pong sent by a client in response to one of the pings sent by run()
+ *
+ * @param client the client that sent the pong
+ * @param data the payload of the pong (the micros() that the ping was sent)
+ * @param len the length of the payload
+ */
+void WiFiEngine::_handleSocketPong(AsyncWebSocketClient *client, uint8_t *data, size_t len) {
+  uint32_t pingMicros;
+  if (len != sizeof(pingMicros)) {
+    return;
+  }
+  memcpy(&pingMicros, data, sizeof(pingMicros));
+
+  // Never report 0 (not measured) for a measured round trip
+  SocketClientSlot *slot = _findSocketClient(client->id());
+  if (slot) {
+    slot->rtt = max((uint32_t)(micros() - pingMicros), (uint32_t)1);
+  }
+}
+
+
+/**
+ * Reject a message that is too large to be handled by disconnecting the client
+ */
+void WiFiEngine::_rejectSocketMessage(AsyncWebSocketClient *client) {
+  #ifdef SERIAL_DEBUG
+  Serial.print("Socket Message from client #");
+  Serial.print(client->id());
+  Serial.println(" exceeds MAX_SOCKET_CLIENT_MESSAGE_SIZE. Disconnecting.");
+  #endif
+
+  client->close(WS_CLOSE_CODE_MESSAGE_TOO_BIG, "Message too big");
+}
+
+
+/**
+ * Find the slot of a connected websocket client
+ *
+ * @param clientId the id of the websocket client (0 to find a free slot)
+ * @return SocketClientSlot* the slot or NULL if the client doesn't have one (or there are no free slots)
+ */
+WiFiEngine::SocketClientSlot* WiFiEngine::_findSocketClient(uint32_t clientId) {
+  for (byte i = 0; i < MAX_SOCKET_CONNECTIONS; i++) {
+    if (_socketClients[i].clientId == clientId) {
+      return &_socketClients[i];
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ * Parse and handle a complete websocket message in place
+ *
+ * @param client the client that sent the message
+ * @param message the message (not null terminated)
+ * @param len the length of the message
+ */
+void WiFiEngine::_handleSocketMessage(AsyncWebSocketClient *client, const char *message, size_t len) {
+  BotCommand command;
+
+  switch (parseSocketMessage(message, len, command)) {
+    case SOCKET_MESSAGE_PING:
       // Send back a "PONG"
       client->text("PONG");
-    }
+      break;
 
-    // Otherwise, attempt to parse the massage as JSON
-    else {
+    case SOCKET_MESSAGE_COMMAND:
       #ifdef SERIAL_DEBUG
       Serial.print("Socket Message Received: '");
-      Serial.print(message);
+      Serial.write((const uint8_t*)message, len);
       Serial.println("'");
       #endif
 
-      DynamicJsonDocument json(MAX_SOCKET_CLIENT_MESSAGE_SIZE);
-      deserializeJson(json, message);
-      
-      String message = json["m"].as<String>();
-      JsonVariant payload = json["p"];
+      // Hand the command off to the main loop
+      commandQueue.push(command.type, command.value, command.target);
+      break;
 
-      // SOCKET_CLIENT_MESSAGE_BUTTON_PRESS
-      if (message == SOCKET_CLIENT_MESSAGE_BUTTON_PRESS) {
-        String virtualButton = payload["b"];
-
-        #ifdef SERIAL_DEBUG
-        Serial.print("SOCKET_CLIENT_MESSAGE_BUTTON_PRESS: ");
-        Serial.println(virtualButton);
-        #endif
-
-        // Notify Listeners
-        if (onVirtualButtonPressed) {
-          onVirtualButtonPressed(toVirtualButtonType(virtualButton));
-        }
-      }
-
-      // SOCKET_CLIENT_MESSAGE_REBOOT
-      else if (message == SOCKET_CLIENT_MESSAGE_REBOOT) {
-        reboot();
-      }
-
-      // SOCKET_CLIENT_MESSAGE_FORGET_WIFI
-      else if (message == SOCKET_CLIENT_MESSAGE_FORGET_WIFI) {
-        botFS.resetWiFiConfig(true);
-      }
+    case SOCKET_MESSAGE_UNHANDLED:
+      #ifdef SERIAL_DEBUG
+      Serial.println("  ! Unhandled socket message");
+      #endif
+      break;
 
-      // SOCKET_CLIENT_SET_SENSOR_THRESHOLD
-      else if (message == SOCKET_CLIENT_MESSAGE_SET_SENSOR_THRESHOLD) {
-        String sensorType = payload["s"];
-        JsonVariant newThresholdVariant = payload["t"];
-        int newThreshold = newThresholdVariant.isNull() ? 0 : newThresholdVariant.as<int>();
-        // int newThreshold = payload["t"] || 0;
-
-        if (sensorType == "TOP") {
-          _topIRSensor->setThreshold(newThreshold);
-          sendConfigToClients();
-        } else if (sensorType == "BOTTOM") {
-          _bottomIRSensor->setThreshold(newThreshold);
-          sendConfigToClients();
-        }
-      }
-    }
+    default:
+      #ifdef SERIAL_DEBUG
+      Serial.println("  ! Invalid socket message");
+      #endif
+      break;
   }
 }
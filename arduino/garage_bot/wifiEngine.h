@@ -14,16 +14,21 @@
 #ifndef WIFI_ENGINE_H
 #define WIFI_ENGINE_H
 
+#include <atomic>
+#include "WiFi.h"
 #include "AsyncTCP.h"
 #include "ESPAsyncWebServer.h"
 #include "DNSServer.h"
+#include "jsonScanner.h"
+#include "_config.h"
 #include "helpers.h"
 #include "irsensor.h"
+#include "socketEventHistory.h"
 
 class WiFiEngine {
   public:
     WiFiEngine();
-    bool init(AsyncWebServer *webServer, AsyncWebSocket *webSocket, DNSServer *dnsServer, IRSensor *topIRSensor, IRSensor *bottomIRSensor);
+    bool init(AsyncWebServer *webServer, AsyncWebSocket *webSocket, AsyncEventSource *eventSource, DNSServer *dnsServer, IRSensor *topIRSensor, IRSensor *bottomIRSensor);
 
     WiFiEngineMode wifiEngineMode = WEM_UNINIT;               // The current mode of the WiFi engine (uninitialised, client or AP mode)
     bool connected = false;                                   // Whether the WiFi client is connected to the configured hotspot
@@ -31,41 +36,118 @@ class WiFiEngine {
     String macAddress;                                        // The MAC address of the wifi adaptor
 
     boolValueChangedFunction onConnectedChanged;              // Fired when connected changes from true to false etc...
-    virtualButtonPressedFunction onVirtualButtonPressed;      // Fired when a socket message is received when the user pressed a virtual button
 
-    void allowIncomingWebSockets();                           // Once the device has initialised, incoming web sockets will be allowed
+    unsigned long lastConnectDuration = 0;                    // How many milliseconds the most recent successful connection took (from WiFi.begin() to IP address)
+    bool lastConnectWasFast = false;                          // Whether the most recent successful connection used the cached BSSID / channel
+    uint32_t connectCount = 0;                                // The number of successful connections since boot
+    uint32_t fastConnectCount = 0;                            // The number of successful connections since boot that used the cache
+    uint32_t roamCount = 0;                                   // The number of times the device has moved to a stronger access point since boot
 
-    void sendConfigToClients(AsyncWebSocketClient *client = NULL);  // Send the current device config to (a) connected client(s)
-    void sendStatusToClients(AsyncWebSocketClient *client = NULL);  // Send the current device status to (a) connected client(s)
+    void allowIncomingWebSockets();                           // Once the device has initialised, incoming web sockets (and event streams) will be allowed
+
+    void sendConfigToClients(AsyncWebSocketClient *client = NULL, AsyncEventSourceClient *eventClient = NULL);  // Send the current device config to (a) connected client(s)
+    void sendStatusToClients(AsyncWebSocketClient *client = NULL, AsyncEventSourceClient *eventClient = NULL);  // Send the current device status to (a) connected client(s)
     void sendRebootingToClients();                                  // Send information about the device rebooting to connected client(s)
     void sendSensorDataToClients(AsyncWebSocketClient *client = NULL);  // Send the current sensor readings to (a) connected client(s)
     
     void run (unsigned long currentMillis);                   // Send sensor data to connected web socket clients
 
+    byte getSocketClientCount();                              // The number of connected web socket clients
+    size_t getSocketClientQueueLength(byte slot, uint32_t &clientId);  // The number of messages waiting to be sent to a web socket client (slot 0 to MAX_SOCKET_CONNECTIONS - 1)
+    uint32_t getSocketClientRTT(byte slot, uint32_t &clientId);  // The most recent ping round trip time (micros) of a web socket client (slot 0 to MAX_SOCKET_CONNECTIONS - 1)
+    size_t getEventSourceClientCount();                       // The number of connected server-sent event (/events) clients
+
+    static String templateProcessor(const String& var);       // Used when serving HTML files to replace key variables in the HTML
+
   private:
     AsyncWebServer *_webServer;                   // A pointer to the web server passed into the init function
     AsyncWebSocket *_webSocket;                   // A pointer to the web socket passed into the init function
+    AsyncEventSource *_eventSource = NULL;        // A pointer to the server-sent event source passed into the init function
     DNSServer *_dnsServer;                        // A pointer to the dns server passed into the init function
 
     byte _connectedSocketClientCount = 0;         // the number of actively connected clients
+    unsigned long _lastSocketPing = 0;            // the millis() that the socket clients were last sent a ping
 
     unsigned long _lastSensorBroadcast = 0;       // the millis() that the sensor data was last broadcast to connected socket clients
-    unsigned long _lastReconnectAttempt = 0;      // the millis() that the WiFi client last attempted to connect to the configured access point
-
-    bool connectToHotSpot();                      // Connect to the configured hot spot and put the device in client mode
+    unsigned long _lastEventSourceKeepAlive = 0;  // the millis() that the last keep alive was sent to the connected event source clients
+    WiFiConnectionState _connectionState = WCS_IDLE;  // Where the WiFi client is in the connection state machine
+    unsigned long _connectionStateChanged = 0;    // the millis() that the connection state last changed
+    unsigned long _reconnectDelay = 0;            // how long to wait in WCS_WAITING_TO_RETRY before the next connection attempt
+    unsigned long _reconnectBackoff = WIFI_RECONNECT_BACKOFF_MIN; // the upper bound of the next reconnect delay. Doubles after each failed attempt.
+    bool _fastConnectAttempt = false;             // Whether the current connection attempt is using the connection cache
+    unsigned long _connectAttemptStarted = 0;     // the millis() that the current connection attempt started (including any scan)
+    byte _currentNetwork = 0;                     // The index of the known network being connected to (or connected)
+    byte _blindNetworkIndex = 0;                  // Cycles through the known networks when none of them appear in a scan (ie. hidden networks)
+
+    int8_t _rssiHistory[WIFI_RSSI_HISTORY_SIZE];  // The most recent RSSI samples of the current connection (ring buffer)
+    byte _rssiHistoryIndex = 0;                   // Where the next RSSI sample will be written
+    byte _rssiHistoryCount = 0;                   // The number of valid RSSI samples
+    unsigned long _lastRSSISample = 0;            // the millis() that the RSSI was last sampled
+    unsigned long _lastRoamScan = 0;              // the millis() that the last roaming scan was started
+    bool _roamScanInProgress = false;             // Whether a background scan for a stronger access point is running
+
+    std::atomic<bool> _gotIPEvent;                // Set by the WiFi event task when an IP address is assigned
+    std::atomic<bool> _disconnectedEvent;         // Set by the WiFi event task when the connection is lost (or an attempt fails)
+
+    bool connectToHotSpot();                      // Start connecting to the configured hot spot and put the device in client mode
+    void _beginConnection(unsigned long currentMillis); // Fast connect using the connection cache or start a scan for the known networks
+    void _connectToNetwork(byte networkIndex, int32_t channel, const uint8_t *bssid, unsigned long currentMillis); // Join a known network (or a specific access point of it)
+    int _findKnownNetwork(const char *ssid);      // Find the index of a known network by SSID (or -1)
+    bool _selectStrongestNetwork(int resultCount, byte &networkIndex, int32_t &channel, uint8_t *bssid, int32_t &rssi); // Find the strongest known access point in the scan results
+    void _runRoaming(unsigned long currentMillis);  // Sample the RSSI and move to a stronger access point when the link stays weak
+    void _connectionAttemptFailed(unsigned long currentMillis); // Fall back to a full scan or back off before the next attempt
+    void _updateConnectionCache();                // Remember the BSSID, channel and IP address of the current connection
+    void _runConnectionStateMachine(unsigned long currentMillis); // Act on WiFi events, timeouts and reconnect delays
+    void _setConnectionState(WiFiConnectionState newState, unsigned long currentMillis);
+    void _scheduleReconnect(unsigned long currentMillis);   // Wait (with exponential backoff and jitter) before the next attempt
+    static void _handleWiFiEvent(WiFiEvent_t event, WiFiEventInfo_t info);  // Fired on the WiFi event task
     bool broadcastAP();                           // Broadcast the Access Point putting the device in AP mode
     void _handleWiFiConnected();                  // processes actions required after the device connects to the configured WiFi access point
     void _handleWiFiDisconnected();               // processes actions required after the device is disconnected from the configured WiFi access point
 
-    static String templateProcessor(const String& var);   // Used when serving HTML files to replace key variables in the HTML
-    
     void initRoutes();                            // Initialise the AP mode Web Server routes
 
+    // Everything kept for a single connected websocket client
+    struct SocketClientSlot {
+      uint32_t clientId = 0;                      // The client in the slot (0 = free slot)
+      uint32_t rtt = 0;                           // The most recent ping round trip time in micros (0 = not measured yet)
+      size_t messageLength = 0;                   // The number of bytes of a fragmented message assembled so far
+      char message[MAX_SOCKET_CLIENT_MESSAGE_SIZE];  // Fragmented messages are assembled here
+    };
+    SocketClientSlot _socketClients[MAX_SOCKET_CONNECTIONS];
+
+    SocketEventHistory _eventHistory;             // The most recent broadcast events (for clients that reconnect)
+
+    void _sendToClients(const char *json, size_t length, const char *eventName, uint32_t sequence, AsyncWebSocketClient *client, AsyncEventSourceClient *eventClient);  // Send a serialized message to one client or all of the socket and event source clients
+    void _handleEventSourceConnect(AsyncEventSourceClient *eventClient);  // Send the current config and status to a new event source client
+
     void onWsEvent(AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len); // Handle websocket events
-    void handleWebSocketData(AsyncWebSocketClient *client, void *arg, uint8_t *data, size_t len);     // Handle a websocket data message
+    void handleWebSocketData(AsyncWebSocketClient *client, void *arg, uint8_t *data, size_t len);     // Handle a websocket data message (or fragment)
+    void _handleSocketPong(AsyncWebSocketClient *client, uint8_t *data, size_t len);                  // Measure the round trip time of a ping sent by run()
+    void _handleSocketMessage(AsyncWebSocketClient *client, const char *message, size_t len);         // Parse and handle a complete websocket message
+    void _rejectSocketMessage(AsyncWebSocketClient *client);                                          // Disconnect a client that sent an oversize message
+    SocketClientSlot* _findSocketClient(uint32_t clientId);          // Find the slot of a connected client (pass 0 to find a free slot)
     
-    void _handleSetWiFi(AsyncWebServerRequest *request, uint8_t *body, size_t len);  // Handle calls to set the WiFi Access Point
-    void _handleSetConfig(AsyncWebServerRequest *request, uint8_t *body, size_t len);  // Handle calls to set the device config
+    // The state of an HTTP request body being assembled
+    enum HTTPBodyStatus {
+      HTTP_BODY_RECEIVING,                        // Still waiting on more chunks
+      HTTP_BODY_COMPLETE,                         // The entire body has been received
+      HTTP_BODY_TOO_LARGE,                        // The body exceeds the maximum size of the route (413)
+      HTTP_BODY_MALFORMED,                        // The chunks arrived out of order (400)
+    };
+
+    // An arena for assembling an HTTP request body. Attached to the request's _tempObject.
+    struct HTTPBodyArena {
+      HTTPBodyStatus status;
+      size_t length;
+      char data[];                                // Allocated to the maximum body size of the route (plus a null terminator)
+    };
+
+    void _receiveRequestBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total, size_t maxSize = MAX_HTTP_REQUEST_BODY_SIZE); // Assemble a chunk of a request body
+    bool _parseRequestBody(AsyncWebServerRequest *request, JsonSpan &body);    // Check an assembled JSON body is an object (sends a 400 / 413 on failure)
+    void _handleSetWiFi(AsyncWebServerRequest *request);    // Handle calls to set the WiFi Access Point
+    void _handleSetConfig(AsyncWebServerRequest *request);  // Handle calls to set the device config
+    void _handleSetMQTTCACert(AsyncWebServerRequest *request);  // Handle uploads of the MQTT CA certificate
 
     // References to other objects required during broadcasts and message handling
     IRSensor *_topIRSensor;       // The Top IR sensor
@@ -0,0 +1,118 @@
+/*============================================================================*\
+ * Garage Bot - asset partition tests
+ * Peter Eldred 2021-08
+ *
+ * Blobs are built here the same way `app/pack-assets.js` builds them.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "testHarness.h"
+#include "assetPartition.h"
+
+static const uint32_t PARTITION_SIZE = 4096;
+
+/**
+ * Build a blob holding a single file
+ */
+static uint32_t buildBlob(uint8_t *blob, const char *path, const char *content) {
+  memset(blob, 0xFF, PARTITION_SIZE);
+
+  uint32_t dataOffset = sizeof(AssetBlobHeader) + sizeof(AssetBlobEntry);
+  uint32_t length = strlen(content);
+  uint32_t blobSize = (dataOffset + length + 3) & ~3;
+
+  AssetBlobHeader header;
+  memcpy(header.magic, ASSET_PARTITION_MAGIC, 4);
+  header.version = ASSET_PARTITION_VERSION;
+  header.entryCount = 1;
+  header.blobSize = blobSize;
+  header.buildId = 0x12345678;
+  memcpy(blob, &header, sizeof(header));
+
+  AssetBlobEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  strncpy(entry.path, path, sizeof(entry.path) - 1);
+  entry.offset = dataOffset;
+  entry.length = length;
+  memcpy(blob + sizeof(AssetBlobHeader), &entry, sizeof(entry));
+
+  memcpy(blob + dataOffset, content, length);
+
+  return blobSize;
+}
+
+static AssetBlobHeader* headerOf(uint8_t *blob) {
+  return (AssetBlobHeader*)blob;
+}
+
+static AssetBlobEntry* entryOf(uint8_t *blob) {
+  return (AssetBlobEntry*)(blob + sizeof(AssetBlobHeader));
+}
+
+
+TEST(layoutMatchesThePacker) {
+  // app/pack-assets.js HEADER_SIZE and ENTRY_SIZE
+  CHECK_EQUAL(16, sizeof(AssetBlobHeader));
+  CHECK_EQUAL(80, sizeof(AssetBlobEntry));
+}
+
+
+TEST(acceptsAValidBlob) {
+  uint8_t blob[PARTITION_SIZE];
+  buildBlob(blob, "/index.html", "<html></html>");
+  CHECK(assetBlobIsValid(blob, PARTITION_SIZE));
+}
+
+
+TEST(rejectsAnErasedPartition) {
+  uint8_t blob[PARTITION_SIZE];
+  memset(blob, 0xFF, sizeof(blob));
+  CHECK(!assetBlobIsValid(blob, PARTITION_SIZE));
+  CHECK(!assetBlobIsValid(blob, 8));
+}
+
+
+TEST(rejectsOtherVersions) {
+  uint8_t blob[PARTITION_SIZE];
+  buildBlob(blob, "/index.html", "<html></html>");
+  headerOf(blob)->version = ASSET_PARTITION_VERSION - 1;
+  CHECK(!assetBlobIsValid(blob, PARTITION_SIZE));
+}
+
+
+TEST(rejectsABlobLargerThanThePartition) {
+  uint8_t blob[PARTITION_SIZE];
+  uint32_t blobSize = buildBlob(blob, "/index.html", "<html></html>");
+  CHECK(assetBlobIsValid(blob, blobSize));
+  CHECK(!assetBlobIsValid(blob, blobSize - 4));
+}
+
+
+TEST(rejectsAnEntryTableLargerThanTheBlob) {
+  uint8_t blob[PARTITION_SIZE];
+  buildBlob(blob, "/index.html", "<html></html>");
+  headerOf(blob)->entryCount = 100;
+  CHECK(!assetBlobIsValid(blob, PARTITION_SIZE));
+}
+
+
+TEST(rejectsEntriesOutsideOfTheBlob) {
+  uint8_t blob[PARTITION_SIZE];
+  uint32_t blobSize = buildBlob(blob, "/index.html", "<html></html>");
+
+  entryOf(blob)->offset = blobSize + 4;
+  CHECK(!assetBlobIsValid(blob, PARTITION_SIZE));
+
+  // Overflowing offset + length mustn't wrap around
+  buildBlob(blob, "/index.html", "<html></html>");
+  entryOf(blob)->length = 0xFFFFFFF0;
+  CHECK(!assetBlobIsValid(blob, PARTITION_SIZE));
+}
+
+
+TEST(rejectsUnterminatedPaths) {
+  uint8_t blob[PARTITION_SIZE];
+  buildBlob(blob, "/index.html", "<html></html>");
+  memset(entryOf(blob)->path, 'a', ASSET_PARTITION_MAX_PATH_LENGTH);
+  CHECK(!assetBlobIsValid(blob, PARTITION_SIZE));
+}
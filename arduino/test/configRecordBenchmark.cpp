@@ -0,0 +1,176 @@
+/*============================================================================*\
+ * Garage Bot - configRecord benchmark
+ * Peter Eldred 2021-08
+ *
+ * Compares the binary config record with the config.json it replaced: the
+ * size of each and how many times per second each can be written and read
+ * back (on the host, so compare the numbers relative to one another rather
+ * than to the device).
+ *
+ * ArduinoJson isn't available on the host, so the json side is written with
+ * String concatenation and read with the in place jsonScanner. The scanner
+ * only locates the values (without building a document), which makes the
+ * json numbers a best case for json.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "testHarness.h"
+#include "_config.h"
+#include "configRecord.h"
+#include "jsonScanner.h"
+
+#define CONFIG_RECORD_BENCHMARK_ITERATIONS 200000UL
+
+static const char *JSON_STRING_KEYS[] = {
+  "mdns_name", "device_name", "mqtt_broker_address", "mqtt_device_id", "mqtt_username",
+  "mqtt_password", "mqtt_command_topic", "mqtt_state_topic", "udp_command_key",
+};
+
+static const char *JSON_LITERAL_KEYS[] = {
+  "wifi_enabled", "mqtt_enabled", "mqtt_broker_port", "mqtt_tls_enabled",
+  "stored_rf_code_count", "top_ir_sensor_threshold", "bottom_ir_sensor_threshold",
+};
+
+/**
+ * A typical config (two networks, MQTT and a couple of remotes)
+ */
+static Config typicalConfig() {
+  Config typical;
+  typical.wifi_enabled = true;
+  typical.wifi_network_count = 2;
+  typical.wifi_networks[0].ssid = "HomeNetwork";
+  typical.wifi_networks[0].password = "correct horse battery";
+  typical.wifi_networks[1].ssid = "HomeNetwork-Garage";
+  typical.wifi_networks[1].password = "staple";
+  typical.mqtt_enabled = true;
+  typical.mqtt_broker_address = "192.168.1.10";
+  typical.mqtt_username = "homeassistant";
+  typical.mqtt_password = "s3cr3t";
+  typical.udp_command_key = "0123456789abcdef";
+  typical.stored_rf_code_count = 2;
+  typical.rf_codes[0] = 5592405;
+  typical.rf_codes[1] = 11184810;
+  typical.top_ir_sensor_threshold = 220;
+  typical.bottom_ir_sensor_threshold = 180;
+  return typical;
+}
+
+static void appendString(String &json, const char *key, const String &value) {
+  json += "\"";
+  json += key;
+  json += "\":\"";
+  json += value;
+  json += "\",";
+}
+
+static void appendLiteral(String &json, const char *key, const String &value) {
+  json += "\"";
+  json += key;
+  json += "\":";
+  json += value;
+  json += ",";
+}
+
+/**
+ * The config.json that older firmware wrote for the config (compact, as serializeJson writes it)
+ */
+static void writeJSON(const Config &config, String &json) {
+  json = "{";
+  appendString(json, "mdns_name", config.mdns_name);
+  appendString(json, "device_name", config.device_name);
+  appendLiteral(json, "wifi_enabled", config.wifi_enabled ? "true" : "false");
+  json += "\"wifi_networks\":[";
+  for (byte i = 0; i < config.wifi_network_count; i++) {
+    json += (i > 0) ? ",{" : "{";
+    appendString(json, "ssid", config.wifi_networks[i].ssid);
+    json += "\"password\":\"";
+    json += config.wifi_networks[i].password;
+    json += "\"}";
+  }
+  json += "],";
+  appendLiteral(json, "mqtt_enabled", config.mqtt_enabled ? "true" : "false");
+  appendString(json, "mqtt_broker_address", config.mqtt_broker_address);
+  appendLiteral(json, "mqtt_broker_port", String(config.mqtt_broker_port));
+  appendLiteral(json, "mqtt_tls_enabled", config.mqtt_tls_enabled ? "true" : "false");
+  appendString(json, "mqtt_device_id", config.mqtt_device_id);
+  appendString(json, "mqtt_username", config.mqtt_username);
+  appendString(json, "mqtt_password", config.mqtt_password);
+  appendString(json, "mqtt_command_topic", config.mqtt_command_topic);
+  appendString(json, "mqtt_state_topic", config.mqtt_state_topic);
+  appendString(json, "udp_command_key", config.udp_command_key);
+  appendLiteral(json, "stored_rf_code_count", String((unsigned int)config.stored_rf_code_count));
+  json += "\"rf_codes\":[";
+  for (byte i = 0; i < 5; i++) {
+    json += (i > 0) ? "," : "";
+    json += String(config.rf_codes[i]);
+  }
+  json += "],";
+  appendLiteral(json, "top_ir_sensor_threshold", String(config.top_ir_sensor_threshold));
+  json += "\"bottom_ir_sensor_threshold\":";
+  json += String(config.bottom_ir_sensor_threshold);
+  json += "}";
+}
+
+/**
+ * Locate every top level value of a config.json
+ *
+ * @return size_t the number of values found
+ */
+static size_t scanJSON(const String &json) {
+  size_t found = 0;
+  JsonSpan value;
+  for (const char *key : JSON_STRING_KEYS) {
+    found += jsonFindValue(json.c_str(), json.length(), key, value) ? 1 : 0;
+  }
+  for (const char *key : JSON_LITERAL_KEYS) {
+    long number;
+    found += (jsonFindValue(json.c_str(), json.length(), key, value) && (jsonSpanToInt(value, number) || (value.len > 0))) ? 1 : 0;
+  }
+  found += jsonFindValue(json.c_str(), json.length(), "wifi_networks", value) ? 1 : 0;
+  found += jsonFindValue(json.c_str(), json.length(), "rf_codes", value) ? 1 : 0;
+  return found;
+}
+
+
+BENCHMARK(configRecordVersusJSON) {
+  Config typical = typicalConfig();
+
+  uint8_t record[CONFIG_RECORD_MAX_SIZE];
+  size_t recordLength = configRecordEncode(record, sizeof(record), typical, 1);
+  String json;
+  writeJSON(typical, json);
+  printf("  binary record %u bytes, config.json %u bytes\n", (unsigned int)recordLength, (unsigned int)json.length());
+
+  {
+    BenchmarkTimer timer("binary encode", CONFIG_RECORD_BENCHMARK_ITERATIONS);
+    for (unsigned long i = 0; i < CONFIG_RECORD_BENCHMARK_ITERATIONS; i++) {
+      keepResult(configRecordEncode(record, sizeof(record), typical, i));
+      keepResult(record);
+    }
+  }
+
+  {
+    BenchmarkTimer timer("json write", CONFIG_RECORD_BENCHMARK_ITERATIONS);
+    for (unsigned long i = 0; i < CONFIG_RECORD_BENCHMARK_ITERATIONS; i++) {
+      writeJSON(typical, json);
+      keepResult(json);
+    }
+  }
+
+  {
+    Config decoded;
+    uint32_t generation;
+    BenchmarkTimer timer("binary validate + decode", CONFIG_RECORD_BENCHMARK_ITERATIONS);
+    for (unsigned long i = 0; i < CONFIG_RECORD_BENCHMARK_ITERATIONS; i++) {
+      keepResult(configRecordValidate(record, recordLength, generation) && configRecordDecode(record, recordLength, decoded));
+      keepResult(decoded);
+    }
+  }
+
+  {
+    BenchmarkTimer timer("json scan (locate values only)", CONFIG_RECORD_BENCHMARK_ITERATIONS);
+    for (unsigned long i = 0; i < CONFIG_RECORD_BENCHMARK_ITERATIONS; i++) {
+      keepResult(scanJSON(json));
+    }
+  }
+}
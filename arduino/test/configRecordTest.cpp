@@ -0,0 +1,197 @@
+/*============================================================================*\
+ * Garage Bot - configRecord tests
+ * Peter Eldred 2021-08
+ *
+ * A fully populated config is taken through a record and back, and damaged
+ * records (flipped bits, cut short by a power loss, written by another
+ * version) are checked to be refused. The CRC comes from the zlib backed
+ * rom/crc.h stub.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "testHarness.h"
+#include "rom/crc.h"
+#include "_config.h"
+#include "configRecord.h"
+
+/**
+ * A config with every value moved away from its default
+ */
+static Config populatedConfig() {
+  Config populated;
+  populated.mdns_name = "garage-left";
+  populated.device_name = "Left Garage Door";
+  populated.wifi_enabled = true;
+  populated.wifi_network_count = MAX_WIFI_NETWORKS;
+  for (byte i = 0; i < MAX_WIFI_NETWORKS; i++) {
+    populated.wifi_networks[i].ssid = String("network-") + String((int)i);
+    populated.wifi_networks[i].password = String("password \"with\" quotes ") + String((int)i);
+  }
+  populated.mqtt_enabled = true;
+  populated.mqtt_broker_address = "192.168.1.10";
+  populated.mqtt_broker_port = 8883;
+  populated.mqtt_tls_enabled = true;
+  populated.mqtt_device_id = "garage_left";
+  populated.mqtt_username = "homeassistant";
+  populated.mqtt_password = "s3cr3t";
+  populated.mqtt_command_topic = "garage/left/command";
+  populated.mqtt_state_topic = "garage/left/state";
+  populated.udp_command_key = "udp-key";
+  populated.stored_rf_code_count = 5;
+  for (byte i = 0; i < 5; i++) {
+    populated.rf_codes[i] = 0xF0000000UL + i;
+  }
+  populated.top_ir_sensor_threshold = 4095;
+  populated.bottom_ir_sensor_threshold = 0;
+  return populated;
+}
+
+static bool equalConfigs(const Config &a, const Config &b) {
+  if ((a.wifi_network_count != b.wifi_network_count) || (a.stored_rf_code_count != b.stored_rf_code_count)) {
+    return false;
+  }
+  for (byte i = 0; i < a.wifi_network_count; i++) {
+    if (!a.wifi_networks[i].ssid.equals(b.wifi_networks[i].ssid) || !a.wifi_networks[i].password.equals(b.wifi_networks[i].password)) {
+      return false;
+    }
+  }
+  for (byte i = 0; i < 5; i++) {
+    if (a.rf_codes[i] != b.rf_codes[i]) {
+      return false;
+    }
+  }
+  return a.mdns_name.equals(b.mdns_name) && a.device_name.equals(b.device_name) && (a.wifi_enabled == b.wifi_enabled) &&
+    (a.mqtt_enabled == b.mqtt_enabled) && a.mqtt_broker_address.equals(b.mqtt_broker_address) && (a.mqtt_broker_port == b.mqtt_broker_port) &&
+    (a.mqtt_tls_enabled == b.mqtt_tls_enabled) && a.mqtt_device_id.equals(b.mqtt_device_id) && a.mqtt_username.equals(b.mqtt_username) &&
+    a.mqtt_password.equals(b.mqtt_password) && a.mqtt_command_topic.equals(b.mqtt_command_topic) && a.mqtt_state_topic.equals(b.mqtt_state_topic) &&
+    a.udp_command_key.equals(b.udp_command_key) && (a.top_ir_sensor_threshold == b.top_ir_sensor_threshold) &&
+    (a.bottom_ir_sensor_threshold == b.bottom_ir_sensor_threshold);
+}
+
+/**
+ * Re-write the payload length and CRC of a record whose payload has been edited
+ */
+static size_t resealRecord(uint8_t *record, size_t payloadLength) {
+  record[6] = payloadLength & 0xFF;
+  record[7] = payloadLength >> 8;
+  size_t crcPos = 12 + payloadLength;
+  uint32_t crc = crc32_le(0, record, crcPos);
+  for (byte i = 0; i < 4; i++) {
+    record[crcPos + i] = (crc >> (8 * i)) & 0xFF;
+  }
+  return crcPos + 4;
+}
+
+
+TEST(roundTripsEveryValue) {
+  Config original = populatedConfig();
+  uint8_t record[CONFIG_RECORD_MAX_SIZE];
+  size_t length = configRecordEncode(record, sizeof(record), original, 42);
+  CHECK(length > 0);
+
+  uint32_t generation = 0;
+  CHECK(configRecordValidate(record, length, generation));
+  CHECK_EQUAL((uint32_t)42, generation);
+
+  Config decoded;
+  CHECK(configRecordDecode(record, length, decoded));
+  CHECK(equalConfigs(original, decoded));
+}
+
+
+TEST(roundTripsTheDefaults) {
+  Config defaults;
+  uint8_t record[CONFIG_RECORD_MAX_SIZE];
+  size_t length = configRecordEncode(record, sizeof(record), defaults, 1);
+
+  Config decoded = populatedConfig();
+  uint32_t generation;
+  CHECK(configRecordValidate(record, length, generation));
+  CHECK(configRecordDecode(record, length, decoded));
+  CHECK(equalConfigs(defaults, decoded));
+
+  // Networks beyond the decoded count are cleared rather than left behind
+  CHECK(decoded.wifi_networks[0].ssid.equals(""));
+}
+
+
+TEST(refusesEveryFlippedBit) {
+  uint8_t record[CONFIG_RECORD_MAX_SIZE];
+  size_t length = configRecordEncode(record, sizeof(record), populatedConfig(), 7);
+
+  uint32_t generation;
+  for (size_t bit = 0; bit < length * 8; bit++) {
+    record[bit / 8] ^= (1 << (bit % 8));
+    CHECK(!configRecordValidate(record, length, generation));
+    record[bit / 8] ^= (1 << (bit % 8));
+  }
+  CHECK(configRecordValidate(record, length, generation));
+}
+
+
+TEST(refusesARecordCutShort) {
+  uint8_t record[CONFIG_RECORD_MAX_SIZE];
+  size_t length = configRecordEncode(record, sizeof(record), populatedConfig(), 7);
+
+  uint32_t generation;
+  for (size_t cut = 0; cut < length; cut++) {
+    CHECK(!configRecordValidate(record, cut, generation));
+  }
+}
+
+
+TEST(refusesAnotherVersion) {
+  uint8_t record[CONFIG_RECORD_MAX_SIZE];
+  size_t length = configRecordEncode(record, sizeof(record), populatedConfig(), 7);
+
+  record[4] = CONFIG_RECORD_VERSION + 1;
+  resealRecord(record, length - 16);
+
+  uint32_t generation;
+  CHECK(!configRecordValidate(record, length, generation));
+}
+
+
+TEST(loadsARecordFromOlderFirmware) {
+  Config original = populatedConfig();
+  original.udp_command_key = "";
+  uint8_t record[CONFIG_RECORD_MAX_SIZE];
+  size_t length = configRecordEncode(record, sizeof(record), original, 3);
+
+  // Older firmware didn't have the UDP command key (the last value, an empty string is its one length byte)
+  length = resealRecord(record, length - 16 - 1);
+
+  Config decoded;
+  decoded.udp_command_key = "left alone";
+  uint32_t generation;
+  CHECK(configRecordValidate(record, length, generation));
+  CHECK(configRecordDecode(record, length, decoded));
+  CHECK(decoded.udp_command_key.equals("left alone"));
+  CHECK(decoded.mqtt_state_topic.equals("garage/left/state"));
+}
+
+
+TEST(refusesAStringRunningPastThePayload) {
+  uint8_t record[CONFIG_RECORD_MAX_SIZE];
+  size_t length = configRecordEncode(record, sizeof(record), populatedConfig(), 3);
+
+  // Cut the payload part way through the UDP command key
+  length = resealRecord(record, length - 16 - 3);
+
+  Config decoded;
+  uint32_t generation;
+  CHECK(configRecordValidate(record, length, generation));
+  CHECK(!configRecordDecode(record, length, decoded));
+  CHECK(decoded.mdns_name.equals(DEFAULT_CONFIG_MDNS_NAME));
+}
+
+
+TEST(doesNotEncodeWhatDoesNotFit) {
+  Config populated = populatedConfig();
+  uint8_t record[CONFIG_RECORD_MAX_SIZE];
+  size_t length = configRecordEncode(record, sizeof(record), populated, 1);
+  CHECK_EQUAL((size_t)0, configRecordEncode(record, length - 1, populated, 1));
+
+  populated.device_name = String(std::string(256, 'x'));
+  CHECK_EQUAL((size_t)0, configRecordEncode(record, sizeof(record), populated, 1));
+}
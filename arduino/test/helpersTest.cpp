@@ -0,0 +1,51 @@
+/*============================================================================*\
+ * Garage Bot - helpers tests
+ * Peter Eldred 2021-08
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "testHarness.h"
+#include "_config.h"
+#include "helpers.h"
+
+
+TEST(contentHashedAssetsAreImmutable) {
+  CHECK(isImmutableAssetPath("/js/control.1-0-0.3fa81c0d.bnd.js"));
+  CHECK(isImmutableAssetPath("/styles/control.d59c16c6344878e94173.css"));
+  CHECK(isImmutableAssetPath("/img/logo.0123456789abcdef.svg"));
+}
+
+
+TEST(assetsWithoutAContentHashAreNotImmutable) {
+  // Only versioned, so a rebuild of the same version keeps the same name
+  CHECK(!isImmutableAssetPath("/js/control.1-0-0.bnd.js"));
+  CHECK(!isImmutableAssetPath("/js/runtime.1-0-0.bnd.js"));
+  CHECK(!isImmutableAssetPath("/styles/control.css"));
+  CHECK(!isImmutableAssetPath("/index.html"));
+  CHECK(!isImmutableAssetPath("/favicon.ico"));
+
+  // Too short to be a hash (or not hex)
+  CHECK(!isImmutableAssetPath("/js/control.abc123.bnd.js"));
+  CHECK(!isImmutableAssetPath("/js/control.3fa81c0g.bnd.js"));
+
+  // The name of the file and the hash of a directory don't count
+  CHECK(!isImmutableAssetPath("/deadbeef.js"));
+  CHECK(!isImmutableAssetPath("/js.3fa81c0d/control.js"));
+}
+
+
+TEST(validatesIRSensorThresholds) {
+  CHECK(isValidIRSensorThreshold(IR_SENSOR_THRESHOLD_MIN));
+  CHECK(isValidIRSensorThreshold(DEFAULT_IR_THRESHOLD));
+  CHECK(isValidIRSensorThreshold(IR_SENSOR_THRESHOLD_MAX));
+  CHECK(!isValidIRSensorThreshold(IR_SENSOR_THRESHOLD_MIN - 1));
+  CHECK(!isValidIRSensorThreshold(IR_SENSOR_THRESHOLD_MAX + 1));
+}
+
+
+TEST(convertsVirtualButtonTypes) {
+  CHECK_EQUAL(OPEN, toVirtualButtonType("OPEN", 4));
+  CHECK_EQUAL(CLOSE, toVirtualButtonType("CLOSE", 5));
+  CHECK_EQUAL(ACTIVATE, toVirtualButtonType("ACTIVATE", 8));
+  CHECK_EQUAL(ACTIVATE, toVirtualButtonType("OPENED", 6));
+}
@@ -0,0 +1,157 @@
+/*============================================================================*\
+ * Garage Bot - jsonScanner tests
+ * Peter Eldred 2021-08
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "testHarness.h"
+#include "jsonScanner.h"
+
+static bool find(const char *json, const char *key, JsonSpan &value) {
+  return jsonFindValue(json, strlen(json), key, value);
+}
+
+
+TEST(findsEachKindOfValue) {
+  const char *json = "{\"s\":\"text\", \"o\":{\"a\":[1,2]}, \"a\":[{\"x\":\"]\"}], \"n\":-42, \"b\":true}";
+  JsonSpan value;
+
+  CHECK(find(json, "s", value));
+  CHECK_EQUAL(JSON_SPAN_STRING, value.type);
+  CHECK_SPAN("text", value.ptr, value.len);
+
+  CHECK(find(json, "o", value));
+  CHECK_EQUAL(JSON_SPAN_OBJECT, value.type);
+  CHECK_SPAN("{\"a\":[1,2]}", value.ptr, value.len);
+
+  CHECK(find(json, "a", value));
+  CHECK_EQUAL(JSON_SPAN_ARRAY, value.type);
+  CHECK_SPAN("[{\"x\":\"]\"}]", value.ptr, value.len);
+
+  CHECK(find(json, "n", value));
+  CHECK_EQUAL(JSON_SPAN_LITERAL, value.type);
+  long number = 0;
+  CHECK(jsonSpanToInt(value, number));
+  CHECK_EQUAL(-42, number);
+
+  CHECK(find(json, "b", value));
+  bool flag = false;
+  CHECK(jsonSpanToBool(value, flag));
+  CHECK(flag);
+}
+
+
+TEST(onlyMatchesTopLevelKeys) {
+  JsonSpan value;
+  CHECK(!find("{\"p\":{\"b\":\"OPEN\"}}", "b", value));
+  CHECK_EQUAL(JSON_SPAN_NONE, value.type);
+
+  JsonSpan payload;
+  CHECK(find("{\"p\":{\"b\":\"OPEN\"}}", "p", payload));
+  CHECK(jsonFindValue(payload, "b", value));
+  CHECK(jsonSpanEquals(value, "OPEN"));
+}
+
+
+TEST(skipsEscapedQuotes) {
+  JsonSpan value;
+  CHECK(find("{\"a\":\"say \\\"hi\\\"\",\"b\":1}", "b", value));
+  CHECK_SPAN("1", value.ptr, value.len);
+}
+
+
+TEST(doesNotReadPastTheLength) {
+  const char *json = "{\"a\":\"12345\"}";
+  JsonSpan value;
+
+  // Cut the message off part way through the value
+  CHECK(!jsonFindValue(json, 8, "a", value));
+  CHECK(!jsonFindValue(json, 0, "a", value));
+}
+
+
+TEST(rejectsMalformedJson) {
+  JsonSpan value;
+  CHECK(!find("", "a", value));
+  CHECK(!find("[1,2]", "a", value));
+  CHECK(!find("{a:1}", "a", value));
+  CHECK(!find("{\"a\" 1}", "a", value));
+  CHECK(!find("{\"a\":}", "a", value));
+  CHECK(!find("{\"a\":{\"b\":1", "a", value));
+}
+
+
+TEST(convertsIntegers) {
+  JsonSpan value;
+  long number = 0;
+
+  CHECK(find("{\"t\":150.9}", "t", value));
+  CHECK(jsonSpanToInt(value, number));
+  CHECK_EQUAL(150, number);
+
+  CHECK(find("{\"t\":\"150\"}", "t", value));
+  CHECK(!jsonSpanToInt(value, number));
+
+  CHECK(find("{\"t\":1e3}", "t", value));
+  CHECK(!jsonSpanToInt(value, number));
+
+  CHECK(find("{\"t\":-}", "t", value));
+  CHECK(!jsonSpanToInt(value, number));
+
+  // Too large to be anything sensible
+  CHECK(find("{\"t\":12345678901}", "t", value));
+  CHECK(!jsonSpanToInt(value, number));
+}
+
+
+TEST(unescapesStrings) {
+  JsonSpan value;
+  String text;
+
+  CHECK(find("{\"s\":\"plain\"}", "s", value));
+  CHECK(jsonSpanToString(value, text));
+  CHECK(text.equals("plain"));
+
+  CHECK(find("{\"s\":\"say \\\"hi\\\" \\\\ \\/ \\t\\n\"}", "s", value));
+  CHECK(jsonSpanToString(value, text));
+  CHECK(text.equals("say \"hi\" \\ / \t\n"));
+
+  // A two byte, a three byte and a surrogate pair (four byte) code point
+  CHECK(find("{\"s\":\"\\u00e9\\u20AC\\ud83d\\ude97\"}", "s", value));
+  CHECK(jsonSpanToString(value, text));
+  CHECK(text.equals("\xC3\xA9\xE2\x82\xAC\xF0\x9F\x9A\x97"));
+
+  CHECK(find("{\"s\":\"\"}", "s", value));
+  CHECK(jsonSpanToString(value, text));
+  CHECK(text.equals(""));
+}
+
+
+TEST(rejectsMalformedEscapes) {
+  JsonSpan value;
+  String text;
+
+  CHECK(find("{\"s\":\"\\x\"}", "s", value));
+  CHECK(!jsonSpanToString(value, text));
+
+  CHECK(find("{\"s\":\"\\u12\"}", "s", value));
+  CHECK(!jsonSpanToString(value, text));
+
+  CHECK(find("{\"s\":\"\\u12g4\"}", "s", value));
+  CHECK(!jsonSpanToString(value, text));
+
+  // Unpaired surrogates
+  CHECK(find("{\"s\":\"\\ud83d\"}", "s", value));
+  CHECK(!jsonSpanToString(value, text));
+
+  CHECK(find("{\"s\":\"\\ude97\"}", "s", value));
+  CHECK(!jsonSpanToString(value, text));
+
+  // Only strings can be copied out
+  CHECK(find("{\"s\":null}", "s", value));
+  CHECK(jsonSpanIsNull(value));
+  CHECK(!jsonSpanToString(value, text));
+
+  CHECK(find("{\"s\":\"null\"}", "s", value));
+  CHECK(!jsonSpanIsNull(value));
+}
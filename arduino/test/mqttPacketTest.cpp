@@ -0,0 +1,408 @@
+/*============================================================================*\
+ * Garage Bot - mqttPacket tests
+ * Peter Eldred 2021-08
+ *
+ * The encoders are checked against hand assembled packets from the MQTT 3.1.1
+ * spec. The reader is fed the same streams in every possible chunking, and a
+ * small in-process fake broker (built from the same reader) runs a whole
+ * session against the encoders.
+\*============================================================================*/
+
+#include <vector>
+#include "Arduino.h"
+#include "testHarness.h"
+#include "mqttPacket.h"
+
+typedef std::vector<uint8_t> Bytes;
+
+static Bytes bytes(std::initializer_list<int> values) {
+  Bytes result;
+  for (int value : values) {
+    result.push_back((uint8_t)value);
+  }
+  return result;
+}
+
+static bool equalBytes(const Bytes &expected, const uint8_t *actual, size_t length) {
+  return (expected.size() == length) && (memcmp(expected.data(), actual, length) == 0);
+}
+
+/**
+ * Feed a stream to a reader in chunks of a fixed size, collecting every packet
+ */
+static std::vector<Bytes> readPackets(MQTTPacketReader &reader, const Bytes &stream, size_t chunkSize, std::vector<uint8_t> *headers = NULL) {
+  std::vector<Bytes> packets;
+  size_t offset = 0;
+  while (offset < stream.size()) {
+    size_t chunk = min(chunkSize, stream.size() - offset);
+    size_t pos = 0;
+    while (pos < chunk) {
+      pos += reader.feed(stream.data() + offset + pos, chunk - pos);
+      if (reader.ready()) {
+        MQTTPacket packet = reader.packet();
+        packets.push_back(Bytes(packet.body, packet.body + packet.length));
+        if (headers) {
+          headers->push_back((packet.type << 4) | packet.flags);
+        }
+        reader.next();
+      }
+    }
+    offset += chunk;
+  }
+  return packets;
+}
+
+
+TEST(encodesConnect) {
+  uint8_t buffer[128];
+  MQTTConnectOptions options;
+  options.clientId = "gb";
+  options.keepAlive = 15;
+
+  size_t length = mqttEncodeConnect(buffer, sizeof(buffer), options);
+  CHECK(equalBytes(bytes({0x10, 14, 0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, 0, 15, 0, 2, 'g', 'b'}), buffer, length));
+}
+
+
+TEST(encodesConnectWithCredentialsAndWill) {
+  uint8_t buffer[128];
+  MQTTConnectOptions options;
+  options.clientId = "gb";
+  options.username = "u";
+  options.password = "p";
+  options.keepAlive = 60;
+  options.willTopic = "t/a";
+  options.willMessage = "off";
+  options.willQos = 1;
+  options.willRetain = true;
+
+  size_t length = mqttEncodeConnect(buffer, sizeof(buffer), options);
+  CHECK(equalBytes(bytes({
+    0x10, 30,
+    0, 4, 'M', 'Q', 'T', 'T', 4,
+    0x80 | 0x40 | 0x20 | 0x08 | 0x04 | 0x02,  // username, password, will retain, will qos 1, will, clean session
+    0, 60,
+    0, 2, 'g', 'b',
+    0, 3, 't', '/', 'a',
+    0, 3, 'o', 'f', 'f',
+    0, 1, 'u',
+    0, 1, 'p',
+  }), buffer, length));
+}
+
+
+TEST(encodesPublish) {
+  uint8_t buffer[64];
+  const uint8_t payload[] = {'o', 'n'};
+
+  size_t length = mqttEncodePublish(buffer, sizeof(buffer), "a/b", payload, sizeof(payload), 0, false, 99);
+  CHECK(equalBytes(bytes({0x30, 7, 0, 3, 'a', '/', 'b', 'o', 'n'}), buffer, length));
+
+  // QoS 1 carries the packet id. The retain flag is bit 0.
+  length = mqttEncodePublish(buffer, sizeof(buffer), "a/b", payload, sizeof(payload), 1, true, 0x1234);
+  CHECK(equalBytes(bytes({0x33, 9, 0, 3, 'a', '/', 'b', 0x12, 0x34, 'o', 'n'}), buffer, length));
+}
+
+
+TEST(encodesSubscribePingAndPuback) {
+  uint8_t buffer[64];
+
+  size_t length = mqttEncodeSubscribe(buffer, sizeof(buffer), 7, "a/#", 1);
+  CHECK(equalBytes(bytes({0x82, 8, 0, 7, 0, 3, 'a', '/', '#', 1}), buffer, length));
+
+  length = mqttEncodeEmpty(buffer, sizeof(buffer), MQTT_PACKET_PINGREQ);
+  CHECK(equalBytes(bytes({0xC0, 0}), buffer, length));
+
+  length = mqttEncodeEmpty(buffer, sizeof(buffer), MQTT_PACKET_DISCONNECT);
+  CHECK(equalBytes(bytes({0xE0, 0}), buffer, length));
+
+  length = mqttEncodePacketId(buffer, sizeof(buffer), MQTT_PACKET_PUBACK, 0xBEEF);
+  CHECK(equalBytes(bytes({0x40, 2, 0xBE, 0xEF}), buffer, length));
+}
+
+
+TEST(encodesMultiByteRemainingLengths) {
+  static uint8_t buffer[20000];
+  static uint8_t payload[16384];
+  memset(payload, 'x', sizeof(payload));
+
+  // 2 + 1 + 125 = 128 is the first remaining length that needs two bytes
+  size_t length = mqttEncodePublish(buffer, sizeof(buffer), "t", payload, 125, 0, false, 0);
+  CHECK_EQUAL(1 + 2 + 128, length);
+  CHECK_EQUAL(0x80, buffer[1]);
+  CHECK_EQUAL(0x01, buffer[2]);
+
+  // 16384 needs three
+  length = mqttEncodePublish(buffer, sizeof(buffer), "t", payload, 16384 - 3, 0, false, 0);
+  CHECK_EQUAL(1 + 3 + 16384, length);
+  CHECK_EQUAL(0x80, buffer[1]);
+  CHECK_EQUAL(0x80, buffer[2]);
+  CHECK_EQUAL(0x01, buffer[3]);
+}
+
+
+TEST(refusesPacketsThatDoNotFitTheBuffer) {
+  uint8_t buffer[8];
+  const uint8_t payload[] = {'o', 'n'};
+  MQTTConnectOptions options;
+  options.clientId = "gb";
+
+  CHECK_EQUAL(0, mqttEncodeConnect(buffer, sizeof(buffer), options));
+  CHECK_EQUAL(0, mqttEncodePublish(buffer, sizeof(buffer), "a/b/c", payload, sizeof(payload), 0, false, 0));
+  CHECK_EQUAL(0, mqttEncodeSubscribe(buffer, sizeof(buffer), 1, "a/b/c", 0));
+  CHECK_EQUAL(0, mqttEncodeEmpty(buffer, 1, MQTT_PACKET_PINGREQ));
+  CHECK_EQUAL(0, mqttEncodePacketId(buffer, 3, MQTT_PACKET_PUBACK, 1));
+
+  // Exactly big enough
+  CHECK_EQUAL(9, mqttEncodePublish(buffer, 9, "a/b", payload, sizeof(payload), 0, false, 0));
+}
+
+
+TEST(readsPacketsInAnyChunking) {
+  uint8_t buffer[MQTT_MAX_PACKET_SIZE];
+  const uint8_t payload[] = "open";
+  Bytes stream;
+
+  // CONNACK, a QoS 1 publish, a PINGRESP (no body) and a QoS 0 publish back to back
+  Bytes connack = bytes({0x20, 2, 0, 0});
+  stream.insert(stream.end(), connack.begin(), connack.end());
+  size_t length = mqttEncodePublish(buffer, sizeof(buffer), "garage/door/command", payload, 4, 1, false, 42);
+  stream.insert(stream.end(), buffer, buffer + length);
+  stream.push_back(0xD0);
+  stream.push_back(0);
+  length = mqttEncodePublish(buffer, sizeof(buffer), "garage/door/command/threshold/top", payload, 4, 0, true, 0);
+  stream.insert(stream.end(), buffer, buffer + length);
+
+  for (size_t chunkSize = 1; chunkSize <= stream.size(); chunkSize++) {
+    MQTTPacketReader reader;
+    std::vector<uint8_t> headers;
+    std::vector<Bytes> packets = readPackets(reader, stream, chunkSize, &headers);
+
+    CHECK_EQUAL(4, packets.size());
+    if (packets.size() != 4) {
+      printf("  with %u byte chunks\n", (unsigned int)chunkSize);
+      continue;
+    }
+
+    CHECK_EQUAL(0x20, headers[0]);
+    CHECK_EQUAL(0x32, headers[1]);
+    CHECK_EQUAL(0xD0, headers[2]);
+    CHECK_EQUAL(0x31, headers[3]);
+    CHECK_EQUAL(0, packets[2].size());
+
+    MQTTPacket packet = {MQTT_PACKET_PUBLISH, (uint8_t)(headers[1] & 0x0F), packets[1].data(), packets[1].size()};
+    MQTTPublish publish;
+    CHECK(mqttParsePublish(packet, publish));
+    CHECK_SPAN("garage/door/command", publish.topic, publish.topicLength);
+    CHECK_SPAN("open", publish.payload, publish.payloadLength);
+    CHECK_EQUAL(1, publish.qos);
+    CHECK_EQUAL(42, publish.packetId);
+    CHECK(!publish.retain);
+
+    packet = {MQTT_PACKET_PUBLISH, (uint8_t)(headers[3] & 0x0F), packets[3].data(), packets[3].size()};
+    CHECK(mqttParsePublish(packet, publish));
+    CHECK_SPAN("garage/door/command/threshold/top", publish.topic, publish.topicLength);
+    CHECK_EQUAL(0, publish.qos);
+    CHECK_EQUAL(0, publish.packetId);
+    CHECK(publish.retain);
+  }
+}
+
+
+TEST(skipsPacketsTooLargeForTheBuffer) {
+  static uint8_t buffer[MQTT_MAX_PACKET_SIZE * 2];
+  static uint8_t payload[MQTT_MAX_PACKET_SIZE];
+  memset(payload, 'x', sizeof(payload));
+
+  Bytes stream;
+  size_t length = mqttEncodePublish(buffer, sizeof(buffer), "big", payload, sizeof(payload), 0, false, 0);
+  stream.insert(stream.end(), buffer, buffer + length);
+  Bytes ping = bytes({0xD0, 0});
+  stream.insert(stream.end(), ping.begin(), ping.end());
+
+  for (size_t chunkSize : {1, 7, 100, 2000}) {
+    MQTTPacketReader reader;
+    std::vector<uint8_t> headers;
+    std::vector<Bytes> packets = readPackets(reader, stream, chunkSize, &headers);
+    CHECK_EQUAL(1, packets.size());
+    CHECK_EQUAL(1, reader.skippedCount);
+    if (headers.size() == 1) {
+      CHECK_EQUAL(0xD0, headers[0]);
+    }
+  }
+}
+
+
+TEST(resetDiscardsAPartialPacket) {
+  MQTTPacketReader reader;
+  Bytes partial = bytes({0x30, 10, 0, 3, 'a'});
+  CHECK_EQUAL(partial.size(), reader.feed(partial.data(), partial.size()));
+  CHECK(!reader.ready());
+
+  reader.reset();
+  Bytes connack = bytes({0x20, 2, 0, 0});
+  CHECK_EQUAL(4, reader.feed(connack.data(), connack.size()));
+  CHECK(reader.ready());
+  CHECK_EQUAL(MQTT_PACKET_CONNACK, reader.packet().type);
+}
+
+
+TEST(rejectsMalformedPublishes) {
+  MQTTPublish publish;
+
+  // The topic length runs past the end of the packet
+  Bytes body = bytes({0, 10, 'a', 'b'});
+  MQTTPacket packet = {MQTT_PACKET_PUBLISH, 0, body.data(), body.size()};
+  CHECK(!mqttParsePublish(packet, publish));
+
+  // QoS 1 without a packet id
+  body = bytes({0, 2, 'a', 'b'});
+  packet = {MQTT_PACKET_PUBLISH, 0x02, body.data(), body.size()};
+  CHECK(!mqttParsePublish(packet, publish));
+
+  // Too short for a topic length
+  body = bytes({0});
+  packet = {MQTT_PACKET_PUBLISH, 0, body.data(), body.size()};
+  CHECK(!mqttParsePublish(packet, publish));
+
+  // Not a publish
+  body = bytes({0, 0});
+  packet = {MQTT_PACKET_PUBACK, 0, body.data(), body.size()};
+  CHECK(!mqttParsePublish(packet, publish));
+
+  // An empty payload is fine
+  body = bytes({0, 2, 'a', 'b'});
+  packet = {MQTT_PACKET_PUBLISH, 0, body.data(), body.size()};
+  CHECK(mqttParsePublish(packet, publish));
+  CHECK_EQUAL(0, publish.payloadLength);
+}
+
+
+/**
+ * Just enough of a broker to hold a session with the encoders. Client packets are
+ * decoded with the same reader the device uses for the broker's packets.
+ */
+class FakeBroker {
+  public:
+    Bytes toClient;                               // Everything the broker has sent
+    std::vector<std::string> subscriptions;
+    std::vector<std::string> published;           // "topic=payload" of every publish received
+    std::vector<uint16_t> acknowledged;           // The packet ids of the PUBACKs received
+    bool connected = false;
+    bool disconnected = false;
+
+    void receive(const uint8_t *data, size_t len) {
+      size_t pos = 0;
+      while (pos < len) {
+        pos += _reader.feed(data + pos, len - pos);
+        if (_reader.ready()) {
+          _handle(_reader.packet());
+          _reader.next();
+        }
+      }
+    }
+
+  private:
+    MQTTPacketReader _reader;
+
+    void _send(const Bytes &packet) {
+      toClient.insert(toClient.end(), packet.begin(), packet.end());
+    }
+
+    void _handle(const MQTTPacket &packet) {
+      switch (packet.type) {
+        case MQTT_PACKET_CONNECT:
+          connected = (packet.length >= 10) && (memcmp(packet.body, "\0\4MQTT\4", 7) == 0);
+          _send(bytes({0x20, 2, 0, connected ? 0 : 1}));
+          break;
+
+        case MQTT_PACKET_SUBSCRIBE: {
+          uint16_t topicLength = (packet.body[2] << 8) | packet.body[3];
+          subscriptions.push_back(std::string((const char*)packet.body + 4, topicLength));
+          _send(bytes({0x90, 3, packet.body[0], packet.body[1], packet.body[4 + topicLength]}));
+          break;
+        }
+
+        case MQTT_PACKET_PUBLISH: {
+          MQTTPublish publish;
+          if (mqttParsePublish(packet, publish)) {
+            published.push_back(std::string(publish.topic, publish.topicLength) + "=" + std::string((const char*)publish.payload, publish.payloadLength));
+            if (publish.qos == 1) {
+              _send(bytes({0x40, 2, publish.packetId >> 8, publish.packetId & 0xFF}));
+            }
+          }
+          break;
+        }
+
+        case MQTT_PACKET_PUBACK:
+          acknowledged.push_back((packet.body[0] << 8) | packet.body[1]);
+          break;
+
+        case MQTT_PACKET_PINGREQ:
+          _send(bytes({0xD0, 0}));
+          break;
+
+        case MQTT_PACKET_DISCONNECT:
+          disconnected = true;
+          break;
+
+        default:
+          break;
+      }
+    }
+};
+
+
+TEST(holdsASessionWithAFakeBroker) {
+  FakeBroker broker;
+  MQTTPacketReader reader;
+  uint8_t buffer[MQTT_MAX_PACKET_SIZE];
+  size_t length;
+
+  MQTTConnectOptions options;
+  options.clientId = "Garage_Bot";
+  options.keepAlive = 15;
+  options.willTopic = "garage/door/availability";
+  options.willMessage = "offline";
+  options.willRetain = true;
+  length = mqttEncodeConnect(buffer, sizeof(buffer), options);
+  broker.receive(buffer, length);
+
+  length = mqttEncodeSubscribe(buffer, sizeof(buffer), 1, "garage/door/command/#", 1);
+  broker.receive(buffer, length);
+
+  const uint8_t state[] = "closed";
+  length = mqttEncodePublish(buffer, sizeof(buffer), "garage/door/state", state, 6, 1, true, 2);
+  broker.receive(buffer, length);
+
+  length = mqttEncodeEmpty(buffer, sizeof(buffer), MQTT_PACKET_PINGREQ);
+  broker.receive(buffer, length);
+
+  CHECK(broker.connected);
+  CHECK_EQUAL(1, broker.subscriptions.size());
+  CHECK(broker.subscriptions.size() == 1 && broker.subscriptions[0] == "garage/door/command/#");
+  CHECK(broker.published.size() == 1 && broker.published[0] == "garage/door/state=closed");
+
+  // The broker's replies arrive in whatever chunks the TCP stream delivers them
+  std::vector<uint8_t> headers;
+  std::vector<Bytes> replies = readPackets(reader, broker.toClient, 3, &headers);
+  CHECK_EQUAL(4, replies.size());
+  if (replies.size() == 4) {
+    CHECK_EQUAL(0x20, headers[0]);
+    CHECK(equalBytes(bytes({0, 0}), replies[0].data(), replies[0].size()));
+    CHECK_EQUAL(0x90, headers[1]);
+    CHECK(equalBytes(bytes({0, 1, 1}), replies[1].data(), replies[1].size()));
+    CHECK_EQUAL(0x40, headers[2]);
+    CHECK(equalBytes(bytes({0, 2}), replies[2].data(), replies[2].size()));
+    CHECK_EQUAL(0xD0, headers[3]);
+  }
+
+  // A command from the broker is acknowledged by packet id
+  length = mqttEncodePacketId(buffer, sizeof(buffer), MQTT_PACKET_PUBACK, 300);
+  broker.receive(buffer, length);
+  CHECK(broker.acknowledged.size() == 1 && broker.acknowledged[0] == 300);
+
+  length = mqttEncodeEmpty(buffer, sizeof(buffer), MQTT_PACKET_DISCONNECT);
+  broker.receive(buffer, length);
+  CHECK(broker.disconnected);
+}
@@ -0,0 +1,35 @@
+/*============================================================================*\
+ * Garage Bot - socketMessage benchmark
+ * Peter Eldred 2021-08
+ *
+ * Measures how many web socket messages per second the in place parser can
+ * turn into commands (on the host, so compare the numbers relative to one
+ * another rather than to the device).
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "testHarness.h"
+#include "socketMessage.h"
+
+#define SOCKET_MESSAGE_BENCHMARK_ITERATIONS 2000000UL
+
+static void benchmarkMessage(const char *name, const char *message) {
+  size_t len = strlen(message);
+  BotCommand command;
+
+  BenchmarkTimer timer(name, SOCKET_MESSAGE_BENCHMARK_ITERATIONS);
+  for (unsigned long i = 0; i < SOCKET_MESSAGE_BENCHMARK_ITERATIONS; i++) {
+    SocketMessageResult result = parseSocketMessage(message, len, command);
+    keepResult(result);
+    keepResult(command);
+  }
+}
+
+
+BENCHMARK(socketMessagesPerSecond) {
+  benchmarkMessage("PING", "PING");
+  benchmarkMessage("BP (button press)", "{\"m\":\"BP\",\"p\":{\"b\":\"ACTIVATE\"}}");
+  benchmarkMessage("ST (set sensor threshold)", "{\"m\":\"ST\",\"p\":{\"s\":\"BOTTOM\",\"t\":220}}");
+  benchmarkMessage("RB (reboot, no payload)", "{\"m\":\"RB\"}");
+  benchmarkMessage("unhandled message type", "{\"m\":\"ZZ\",\"p\":{\"x\":[1,2,3],\"y\":\"padding padding\"}}");
+}
@@ -0,0 +1,92 @@
+/*============================================================================*\
+ * Garage Bot - socketMessage tests
+ * Peter Eldred 2021-08
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "testHarness.h"
+#include "socketMessage.h"
+
+static SocketMessageResult parse(const char *message, BotCommand &command) {
+  return parseSocketMessage(message, strlen(message), command);
+}
+
+
+TEST(answersPing) {
+  BotCommand command;
+  CHECK_EQUAL(SOCKET_MESSAGE_PING, parse("PING", command));
+  CHECK_EQUAL(SOCKET_MESSAGE_INVALID, parse("PINGS", command));
+}
+
+
+TEST(parsesButtonPresses) {
+  BotCommand command;
+  CHECK_EQUAL(SOCKET_MESSAGE_COMMAND, parse("{\"m\":\"BP\",\"p\":{\"b\":\"OPEN\"}}", command));
+  CHECK_EQUAL(BOT_COMMAND_VIRTUAL_BUTTON, command.type);
+  CHECK_EQUAL(OPEN, command.value);
+
+  CHECK_EQUAL(SOCKET_MESSAGE_COMMAND, parse("{ \"p\" : { \"b\" : \"CLOSE\" }, \"m\" : \"BP\" }", command));
+  CHECK_EQUAL(CLOSE, command.value);
+
+  CHECK_EQUAL(SOCKET_MESSAGE_COMMAND, parse("{\"m\":\"BP\",\"p\":{\"b\":\"ACTIVATE\"}}", command));
+  CHECK_EQUAL(ACTIVATE, command.value);
+}
+
+
+TEST(parsesSensorThresholds) {
+  BotCommand command;
+  CHECK_EQUAL(SOCKET_MESSAGE_COMMAND, parse("{\"m\":\"ST\",\"p\":{\"s\":\"BOTTOM\",\"t\":220}}", command));
+  CHECK_EQUAL(BOT_COMMAND_SET_SENSOR_THRESHOLD, command.type);
+  CHECK_EQUAL(IR_SENSOR_BOTTOM, command.target);
+  CHECK_EQUAL(220, command.value);
+
+  CHECK_EQUAL(SOCKET_MESSAGE_INVALID, parse("{\"m\":\"ST\",\"p\":{\"s\":\"MIDDLE\",\"t\":220}}", command));
+
+  // The full range of the sensors is accepted
+  CHECK_EQUAL(SOCKET_MESSAGE_COMMAND, parse("{\"m\":\"ST\",\"p\":{\"s\":\"TOP\",\"t\":0}}", command));
+  CHECK_EQUAL(0, command.value);
+  CHECK_EQUAL(SOCKET_MESSAGE_COMMAND, parse("{\"m\":\"ST\",\"p\":{\"s\":\"TOP\",\"t\":4095}}", command));
+  CHECK_EQUAL(4095, command.value);
+}
+
+
+TEST(rejectsMissingAndOutOfRangeThresholds) {
+  BotCommand command;
+  CHECK_EQUAL(SOCKET_MESSAGE_INVALID, parse("{\"m\":\"ST\",\"p\":{\"s\":\"TOP\"}}", command));
+  CHECK_EQUAL(SOCKET_MESSAGE_INVALID, parse("{\"m\":\"ST\",\"p\":{\"s\":\"TOP\",\"t\":\"high\"}}", command));
+  CHECK_EQUAL(SOCKET_MESSAGE_INVALID, parse("{\"m\":\"ST\",\"p\":{\"s\":\"TOP\",\"t\":-1}}", command));
+  CHECK_EQUAL(SOCKET_MESSAGE_INVALID, parse("{\"m\":\"ST\",\"p\":{\"s\":\"TOP\",\"t\":4096}}", command));
+  CHECK_EQUAL(SOCKET_MESSAGE_INVALID, parse("{\"m\":\"ST\",\"p\":{\"s\":\"TOP\",\"t\":99999999999999999999}}", command));
+}
+
+
+TEST(parsesCommandsWithoutAPayload) {
+  BotCommand command;
+  CHECK_EQUAL(SOCKET_MESSAGE_COMMAND, parse("{\"m\":\"RB\"}", command));
+  CHECK_EQUAL(BOT_COMMAND_REBOOT, command.type);
+  CHECK_EQUAL(SOCKET_MESSAGE_COMMAND, parse("{\"m\":\"FW\"}", command));
+  CHECK_EQUAL(BOT_COMMAND_FORGET_WIFI, command.type);
+  CHECK_EQUAL(SOCKET_MESSAGE_COMMAND, parse("{\"m\":\"RF\"}", command));
+  CHECK_EQUAL(BOT_COMMAND_FACTORY_RESET, command.type);
+}
+
+
+TEST(rejectsUnknownAndMalformedMessages) {
+  BotCommand command;
+  CHECK_EQUAL(SOCKET_MESSAGE_UNHANDLED, parse("{\"m\":\"ZZ\"}", command));
+  CHECK_EQUAL(SOCKET_MESSAGE_INVALID, parse("{\"m\":\"BPX\"}", command));
+  CHECK_EQUAL(SOCKET_MESSAGE_INVALID, parse("{\"m\":1}", command));
+  CHECK_EQUAL(SOCKET_MESSAGE_INVALID, parse("{\"p\":{}}", command));
+  CHECK_EQUAL(SOCKET_MESSAGE_INVALID, parse("not json", command));
+  CHECK_EQUAL(SOCKET_MESSAGE_INVALID, parse("", command));
+}
+
+
+TEST(doesNotReadPastTheLength) {
+  const char *message = "{\"m\":\"RB\"}";
+  BotCommand command;
+  // (the scanner doesn't validate, so only the closing brace of the object itself may be missing)
+  for (size_t len = 0; len < (strlen(message) - 1); len++) {
+    CHECK(parseSocketMessage(message, len, command) != SOCKET_MESSAGE_COMMAND);
+  }
+}
@@ -0,0 +1,111 @@
+/*============================================================================*\
+ * Garage Bot - host test stubs
+ * Peter Eldred 2021-08
+ *
+ * Just enough of the Arduino core to compile the sketch's pure modules (the
+ * codecs and parsers) on a Linux host.
+\*============================================================================*/
+
+#ifndef ARDUINO_STUB_H
+#define ARDUINO_STUB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+using std::min;
+using std::max;
+
+#define F(str) (str)
+#define PROGMEM
+#define IRAM_ATTR
+
+// The clock can be moved along by a test (ie. to expire a timeout without waiting for it)
+extern unsigned long hostClockOffsetMicros;
+
+inline unsigned long micros() {
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() + hostClockOffsetMicros;
+}
+
+inline unsigned long millis() {
+  return micros() / 1000;
+}
+
+inline void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+/**
+ * The subset of the Arduino String used by the sketch
+ */
+class String {
+  public:
+    String() {}
+    String(const char *str) : _str(str ? str : "") {}
+    String(const std::string &str) : _str(str) {}
+    String(char c) : _str(1, c) {}
+    String(int value) : _str(std::to_string(value)) {}
+    String(unsigned int value) : _str(std::to_string(value)) {}
+    String(long value) : _str(std::to_string(value)) {}
+    String(unsigned long value) : _str(std::to_string(value)) {}
+
+    const char* c_str() const { return _str.c_str(); }
+    unsigned int length() const { return _str.length(); }
+    bool reserve(unsigned int size) { _str.reserve(size); return true; }
+    char charAt(unsigned int index) const { return (index < _str.length()) ? _str[index] : 0; }
+    char operator[](unsigned int index) const { return charAt(index); }
+
+    bool equals(const String &other) const { return _str == other._str; }
+    bool equals(const char *other) const { return _str == other; }
+    bool startsWith(const String &prefix) const { return _str.compare(0, prefix._str.length(), prefix._str) == 0; }
+    bool endsWith(const String &suffix) const { return (_str.length() >= suffix._str.length()) && (_str.compare(_str.length() - suffix._str.length(), suffix._str.length(), suffix._str) == 0); }
+    int indexOf(char c, unsigned int from = 0) const { size_t pos = _str.find(c, from); return (pos == std::string::npos) ? -1 : (int)pos; }
+    int indexOf(const String &str, unsigned int from = 0) const { size_t pos = _str.find(str._str, from); return (pos == std::string::npos) ? -1 : (int)pos; }
+    int lastIndexOf(char c) const { size_t pos = _str.rfind(c); return (pos == std::string::npos) ? -1 : (int)pos; }
+    String substring(unsigned int from) const { return (from < _str.length()) ? String(_str.substr(from)) : String(); }
+    String substring(unsigned int from, unsigned int to) const { return (from < to) && (from < _str.length()) ? String(_str.substr(from, to - from)) : String(); }
+    long toInt() const { return atol(_str.c_str()); }
+    void toLowerCase() { for (char &c : _str) { c = tolower(c); } }
+
+    String& operator+=(const String &other) { _str += other._str; return *this; }
+    String& operator+=(const char *other) { _str += other; return *this; }
+    String& operator+=(char c) { _str += c; return *this; }
+    bool concat(const String &other) { _str += other._str; return true; }
+
+    bool operator==(const String &other) const { return _str == other._str; }
+    bool operator==(const char *other) const { return _str == other; }
+    bool operator!=(const String &other) const { return _str != other._str; }
+    bool operator!=(const char *other) const { return _str != other; }
+
+    friend String operator+(const String &a, const String &b) { return String(a._str + b._str); }
+    friend String operator+(const String &a, const char *b) { return String(a._str + b); }
+
+  private:
+    std::string _str;
+};
+
+/**
+ * Serial output is discarded
+ */
+class HostSerial {
+  public:
+    void begin(unsigned long baud) {}
+    template <typename T> void print(T value) {}
+    template <typename T> void println(T value) {}
+    void println() {}
+    size_t write(const uint8_t *data, size_t len) { return len; }
+};
+
+extern HostSerial Serial;
+
+#endif
@@ -0,0 +1,54 @@
+/*============================================================================*\
+ * Garage Bot - host test stubs
+ * Peter Eldred 2021-08
+ *
+ * The flash partition API. There are no partitions on the host, so nothing
+ * is ever found or mapped.
+\*============================================================================*/
+
+#ifndef ESP_PARTITION_STUB_H
+#define ESP_PARTITION_STUB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+typedef uint32_t spi_flash_mmap_handle_t;
+
+typedef enum {
+  ESP_PARTITION_TYPE_APP = 0x00,
+  ESP_PARTITION_TYPE_DATA = 0x01,
+} esp_partition_type_t;
+
+typedef enum {
+  ESP_PARTITION_SUBTYPE_ANY = 0xff,
+} esp_partition_subtype_t;
+
+typedef enum {
+  SPI_FLASH_MMAP_DATA,
+  SPI_FLASH_MMAP_INST,
+} spi_flash_mmap_memory_t;
+
+typedef struct {
+  esp_partition_type_t type;
+  esp_partition_subtype_t subtype;
+  uint32_t address;
+  uint32_t size;
+  char label[17];
+  bool encrypted;
+} esp_partition_t;
+
+inline const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label) {
+  return NULL;
+}
+
+inline esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size, spi_flash_mmap_memory_t memory, const void **outPtr, spi_flash_mmap_handle_t *outHandle) {
+  return ESP_FAIL;
+}
+
+inline void spi_flash_munmap(spi_flash_mmap_handle_t handle) {}
+
+#endif
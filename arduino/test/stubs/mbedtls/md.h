@@ -0,0 +1,37 @@
+/*============================================================================*\
+ * Garage Bot - host test stubs
+ * Peter Eldred 2021-08
+ *
+ * The mbedtls message digest API, backed by OpenSSL on the host (link with
+ * -lcrypto). Only HMAC-SHA256 is used by the sketch.
+\*============================================================================*/
+
+#ifndef MBEDTLS_MD_STUB_H
+#define MBEDTLS_MD_STUB_H
+
+#include <stddef.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+typedef enum {
+  MBEDTLS_MD_SHA256 = 6,
+} mbedtls_md_type_t;
+
+typedef struct {
+  mbedtls_md_type_t type;
+} mbedtls_md_info_t;
+
+inline const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t type) {
+  static const mbedtls_md_info_t sha256 = { MBEDTLS_MD_SHA256 };
+  return (type == MBEDTLS_MD_SHA256) ? &sha256 : NULL;
+}
+
+inline int mbedtls_md_hmac(const mbedtls_md_info_t *info, const unsigned char *key, size_t keyLength, const unsigned char *input, size_t length, unsigned char *output) {
+  if (info == NULL) {
+    return -1;
+  }
+  unsigned int outputLength = 0;
+  return (HMAC(EVP_sha256(), key, (int)keyLength, input, length, output, &outputLength) != NULL) ? 0 : -1;
+}
+
+#endif
@@ -0,0 +1,19 @@
+/*============================================================================*\
+ * Garage Bot - host test stubs
+ * Peter Eldred 2021-08
+ *
+ * The ESP32 ROM CRC functions, backed by zlib on the host (link with -lz).
+ * crc32_le with a 0 seed is the standard CRC-32 that zlib computes.
+\*============================================================================*/
+
+#ifndef ROM_CRC_STUB_H
+#define ROM_CRC_STUB_H
+
+#include <stdint.h>
+#include <zlib.h>
+
+inline uint32_t crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len) {
+  return (uint32_t)crc32(crc, buf, len);
+}
+
+#endif
@@ -0,0 +1,37 @@
+/*============================================================================*\
+ * Garage Bot - testHarness
+ * Peter Eldred 2021-08
+ *
+ * Runs every test (or benchmark) linked into the executable.
+\*============================================================================*/
+
+#include "Arduino.h"
+#include "testHarness.h"
+
+unsigned long hostClockOffsetMicros = 0;
+HostSerial Serial;
+int testFailures = 0;
+
+std::vector<TestCase>& registeredTests() {
+  static std::vector<TestCase> tests;
+  return tests;
+}
+
+int main(int argc, char **argv) {
+  for (const TestCase &test : registeredTests()) {
+    // Optionally only run the tests whose name contains the first argument
+    if ((argc > 1) && !strstr(test.name, argv[1])) {
+      continue;
+    }
+
+    int failuresBefore = testFailures;
+    printf("%s\n", test.name);
+    test.run();
+    if (testFailures != failuresBefore) {
+      printf("  FAILED\n");
+    }
+  }
+
+  printf("%s: %d failure(s)\n", argv[0], testFailures);
+  return (testFailures == 0) ? 0 : 1;
+}
@@ -0,0 +1,89 @@
+/*============================================================================*\
+ * Garage Bot - testHarness
+ * Peter Eldred 2021-08
+ *
+ * A minimal test and benchmark harness for the host tests. Each test file
+ * registers its tests with TEST() and each benchmark file its benchmarks with
+ * BENCHMARK(). The harness main() runs everything registered.
+\*============================================================================*/
+
+#ifndef TESTHARNESS_H
+#define TESTHARNESS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+typedef void (*testFunction)();
+
+struct TestCase {
+  const char *name;
+  testFunction run;
+};
+
+std::vector<TestCase>& registeredTests();
+extern int testFailures;
+
+struct TestRegistration {
+  TestRegistration(const char *name, testFunction run) {
+    registeredTests().push_back({name, run});
+  }
+};
+
+// Register a test (or benchmark) function
+#define TEST(name) \
+  static void name(); \
+  static TestRegistration name##Registration(#name, name); \
+  static void name()
+
+#define BENCHMARK(name) TEST(name)
+
+// Record a failure (and carry on with the test)
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      printf("  %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      testFailures += 1; \
+    } \
+  } while (0)
+
+#define CHECK_EQUAL(expected, actual) \
+  do { \
+    long long expectedValue = (long long)(expected); \
+    long long actualValue = (long long)(actual); \
+    if (expectedValue != actualValue) { \
+      printf("  %s:%d: CHECK_EQUAL(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #expected, #actual, expectedValue, actualValue); \
+      testFailures += 1; \
+    } \
+  } while (0)
+
+// Compare a (not null terminated) span against a null terminated string
+#define CHECK_SPAN(expected, ptr, len) CHECK((strlen(expected) == (len)) && (memcmp((expected), (ptr), (len)) == 0))
+
+/**
+ * Times a block of work run a number of times and reports the rate
+ */
+class BenchmarkTimer {
+  public:
+    BenchmarkTimer(const char *name, unsigned long iterations) : _name(name), _iterations(iterations) {
+      _start = std::chrono::steady_clock::now();
+    }
+
+    ~BenchmarkTimer() {
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+      printf("  %-48s %10lu ops %10.3f ms %14.0f ops/s %10.1f ns/op\n", _name, _iterations, seconds * 1000.0, _iterations / seconds, (seconds * 1e9) / _iterations);
+    }
+
+  private:
+    const char *_name;
+    unsigned long _iterations;
+    std::chrono::steady_clock::time_point _start;
+};
+
+// Stop the optimiser from discarding the result of a benchmarked call
+template <typename T> inline void keepResult(const T &value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+#endif
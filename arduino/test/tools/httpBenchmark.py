@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+"""
+Garage Bot - static file benchmark
+
+Measures the time to first byte and the throughput of the static files served
+by a device. Run it once with the asset partition flashed and once without
+(or against two devices) to compare serving from flash with LITTLEFS.
+
+Usage: httpBenchmark.py [-n requests] host [path ...]
+
+  httpBenchmark.py garagebot.local
+  httpBenchmark.py -n 50 192.168.1.50 /index.html /js/control.bnd.js
+"""
+
+import argparse
+import http.client
+import statistics
+import time
+
+DEFAULT_PATHS = ['/', '/index.html', '/manifest.json', '/favicon.ico']
+
+
+def fetch(host, port, path):
+    """Fetch a path on a fresh connection (the device closes each connection)"""
+    connection = http.client.HTTPConnection(host, port, timeout=10)
+    start = time.perf_counter()
+    connection.request('GET', path, headers={'Accept-Encoding': 'gzip'})
+    response = connection.getresponse()
+    first_byte = time.perf_counter()
+    body = response.read()
+    end = time.perf_counter()
+    connection.close()
+    return response.status, len(body), first_byte - start, end - start
+
+
+def benchmark(host, port, path, requests):
+    ttfbs = []
+    totals = []
+    size = 0
+    for _ in range(requests):
+        status, size, ttfb, total = fetch(host, port, path)
+        if status != 200:
+            print(f'  {path:<40} HTTP {status}')
+            return
+        ttfbs.append(ttfb)
+        totals.append(total)
+
+    throughput = (size * len(totals)) / sum(totals) / 1024
+    print(f'  {path:<40} {size:>8} B  ttfb p50 {statistics.median(ttfbs) * 1000:7.1f} ms'
+          f'  max {max(ttfbs) * 1000:7.1f} ms  total p50 {statistics.median(totals) * 1000:7.1f} ms'
+          f'  {throughput:8.1f} KB/s')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Measure the TTFB and throughput of a device\'s static files')
+    parser.add_argument('-n', '--requests', type=int, default=20, help='requests per path (default 20)')
+    parser.add_argument('-p', '--port', type=int, default=80)
+    parser.add_argument('host')
+    parser.add_argument('paths', nargs='*', default=DEFAULT_PATHS)
+    args = parser.parse_args()
+
+    print(f'{args.requests} requests per path to {args.host}:{args.port}')
+    for path in args.paths:
+        benchmark(args.host, args.port, path, args.requests)
+
+
+if __name__ == '__main__':
+    main()
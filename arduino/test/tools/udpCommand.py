@@ -0,0 +1,266 @@
+#!/usr/bin/env python3
+"""
+Garage Bot - UDP command client and latency benchmark
+
+Sends signed commands to a device's UDP command server (see
+udpCommandServer.cpp for the frame layout) and reports the door state. The
+bench command measures the round trip of STATUS requests. bench-ws measures
+the round trip of the websocket's text PING / PONG for comparison. Both are
+answered without touching the door.
+
+Commands sent over the websocket (BP) or MQTT aren't timed. Each of them
+moves the door (or rewrites the config), which isn't something to do a few
+hundred times in a row, and the state they publish depends on how long the
+door takes to move rather than on the transport.
+
+The key is the device's udp_command_key (set on the config page), taken from
+--key or the GARAGEBOT_UDP_KEY environment variable. bench-ws doesn't need it.
+
+Usage: udpCommand.py [-k key] host {status,activate,open,close,bench,bench-ws} [-n requests]
+
+  udpCommand.py -k secret garagebot.local status
+  GARAGEBOT_UDP_KEY=secret udpCommand.py 192.168.1.50 open
+  udpCommand.py -k secret 192.168.1.50 bench -n 500
+  udpCommand.py 192.168.1.50 bench-ws -n 500
+"""
+
+import argparse
+import base64
+import hashlib
+import hmac
+import os
+import socket
+import statistics
+import struct
+import sys
+import time
+
+PORT = 47167
+HTTP_PORT = 80
+VERSION = 2
+MAC_SIZE = 32
+RESPONSE_SIZE = 60
+
+COMMANDS = {'status': 1, 'activate': 2, 'open': 3, 'close': 4}
+RESULTS = {0: 'OK', 1: 'BAD_SESSION', 2: 'REPLAYED', 3: 'BAD_COMMAND', 4: 'BUSY'}
+DOOR_STATES = {0: 'UNKNOWN', 1: 'OPEN', 2: 'CLOSING', 3: 'CLOSED', 4: 'OPENING'}
+SENSOR_STATES = {0: 'UNKNOWN', 1: 'CLEAR', 2: 'DETECTED'}
+
+RESULT_OK = 0
+RESULT_BAD_SESSION = 1
+RESULT_REPLAYED = 2
+
+
+class Client:
+    """Keeps track of the device's session and the last nonce so each request is accepted first time"""
+
+    def __init__(self, host, port, key, timeout):
+        self.address = (socket.gethostbyname(host), port)
+        self.key = key
+        self.session = 0
+        self.nonce = 0
+        self.socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.socket.settimeout(timeout)
+
+    def _next_nonce(self):
+        # A millisecond timestamp, or one more than the last if the clock hasn't moved on
+        self.nonce = max(int(time.time() * 1000), self.nonce + 1)
+        return self.nonce
+
+    def _sign(self, data):
+        return hmac.new(self.key, data, hashlib.sha256).digest()
+
+    def _exchange(self, command):
+        nonce = self._next_nonce()
+        body = b'GC' + bytes([VERSION, command]) + struct.pack('>IQ', self.session, nonce)
+        self.socket.sendto(body + self._sign(body), self.address)
+
+        while True:
+            data, _ = self.socket.recvfrom(RESPONSE_SIZE + 1)
+            if len(data) != RESPONSE_SIZE or data[:2] != b'GR' or data[2] != VERSION:
+                continue
+            if not hmac.compare_digest(self._sign(data[:-MAC_SIZE]), data[-MAC_SIZE:]):
+                continue
+            result = data[3]
+            session, response_nonce, last_nonce = struct.unpack('>IQQ', data[4:24])
+            # Ignore late responses to earlier requests
+            if response_nonce == nonce:
+                return result, session, last_nonce, data[24:28]
+
+    def send(self, command):
+        """Send a command, taking on the device's session / nonce and trying again when they were stale"""
+        for _ in range(3):
+            result, session, last_nonce, state = self._exchange(command)
+            if result == RESULT_BAD_SESSION:
+                self.session = session
+            elif result == RESULT_REPLAYED:
+                self.nonce = max(self.nonce, last_nonce)
+            else:
+                return result, state
+        return result, state
+
+
+class SocketClient:
+    """Just enough of a websocket client to exchange text messages with the device's /ws"""
+
+    def __init__(self, host, port, timeout):
+        self.socket = socket.create_connection((host, port), timeout)
+        self.socket.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        key = base64.b64encode(os.urandom(16)).decode()
+        self.socket.sendall((f'GET /ws HTTP/1.1\r\nHost: {host}\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n'
+                             f'Sec-WebSocket-Key: {key}\r\nSec-WebSocket-Version: 13\r\n\r\n').encode())
+
+        response = b''
+        while b'\r\n\r\n' not in response:
+            response += self._receive_some()
+        head, self.buffer = response.split(b'\r\n\r\n', 1)
+        status = head.split(b'\r\n')[0].decode(errors='replace')
+        if ' 101 ' not in status + ' ':
+            raise ConnectionError(f'websocket upgrade refused ({status})')
+
+    def _receive_some(self):
+        data = self.socket.recv(4096)
+        if not data:
+            raise ConnectionError('connection closed by the device')
+        return data
+
+    def _read(self, count):
+        while len(self.buffer) < count:
+            self.buffer += self._receive_some()
+        data, self.buffer = self.buffer[:count], self.buffer[count:]
+        return data
+
+    def _send_frame(self, opcode, payload):
+        # Client frames are always masked
+        mask = os.urandom(4)
+        header = bytes([0x80 | opcode])
+        if len(payload) < 126:
+            header += bytes([0x80 | len(payload)])
+        else:
+            header += bytes([0x80 | 126]) + struct.pack('>H', len(payload))
+        self.socket.sendall(header + mask + bytes(b ^ mask[i % 4] for i, b in enumerate(payload)))
+
+    def send(self, text):
+        self._send_frame(0x1, text.encode())
+
+    def receive(self):
+        """The next text message (pings are answered and anything else is skipped)"""
+        while True:
+            first, second = self._read(2)
+            length = second & 0x7F
+            if length == 126:
+                length, = struct.unpack('>H', self._read(2))
+            elif length == 127:
+                length, = struct.unpack('>Q', self._read(8))
+            payload = self._read(length)
+
+            opcode = first & 0x0F
+            if opcode == 0x1:
+                return payload.decode(errors='replace')
+            if opcode == 0x8:
+                raise ConnectionError('websocket closed by the device')
+            if opcode == 0x9:
+                self._send_frame(0xA, payload)
+
+    def ping(self):
+        """Send the app's text PING and wait for the PONG (skipping the status and sensor messages)"""
+        self.send('PING')
+        while self.receive() != 'PONG':
+            pass
+
+
+def describe(result, state):
+    _, door, top, bottom = state
+    return (f'{RESULTS.get(result, result)}  door {DOOR_STATES.get(door, door)}'
+            f'  top {SENSOR_STATES.get(top, top)}  bottom {SENSOR_STATES.get(bottom, bottom)}')
+
+
+def report(label, times, requests, lost):
+    if not times:
+        print('no responses')
+        return 1
+
+    times.sort()
+    print(f'{len(times)} of {requests} {label} answered ({lost} lost)')
+    print(f'  round trip p50 {statistics.median(times) * 1000:7.2f} ms'
+          f'  p90 {times[int(len(times) * 0.9)] * 1000:7.2f} ms'
+          f'  p99 {times[int(len(times) * 0.99)] * 1000:7.2f} ms'
+          f'  max {times[-1] * 1000:7.2f} ms')
+    return 0
+
+
+def bench(client, requests):
+    # The first request picks up the session, so it isn't timed
+    client.send(COMMANDS['status'])
+
+    times = []
+    lost = 0
+    for _ in range(requests):
+        start = time.perf_counter()
+        try:
+            result, _ = client.send(COMMANDS['status'])
+        except socket.timeout:
+            lost += 1
+            continue
+        if result == RESULT_OK:
+            times.append(time.perf_counter() - start)
+
+    return report('STATUS requests', times, requests, lost)
+
+
+def bench_ws(client, requests):
+    # The device sends the config and status to a new client, so get those out of the way before timing
+    client.ping()
+
+    times = []
+    lost = 0
+    for _ in range(requests):
+        start = time.perf_counter()
+        try:
+            client.ping()
+        except socket.timeout:
+            # Any late PONG is skipped by the next wait (it can only make that one look quicker)
+            lost += 1
+            continue
+        times.append(time.perf_counter() - start)
+
+    return report('websocket PINGs', times, requests, lost)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Send signed commands to a device\'s UDP command server')
+    parser.add_argument('-k', '--key', default=os.environ.get('GARAGEBOT_UDP_KEY'), help='the device\'s udp_command_key')
+    parser.add_argument('-p', '--port', type=int, default=PORT)
+    parser.add_argument('--http-port', type=int, default=HTTP_PORT, help='the web server port for bench-ws (default 80)')
+    parser.add_argument('-t', '--timeout', type=float, default=1.0, help='seconds to wait for a response (default 1)')
+    parser.add_argument('-n', '--requests', type=int, default=100, help='requests to time with bench / bench-ws (default 100)')
+    parser.add_argument('host')
+    parser.add_argument('command', choices=list(COMMANDS) + ['bench', 'bench-ws'])
+    args = parser.parse_args()
+
+    if args.command == 'bench-ws':
+        try:
+            return bench_ws(SocketClient(args.host, args.http_port, args.timeout), args.requests)
+        except OSError as error:
+            print(error)
+            return 1
+
+    if not args.key:
+        parser.error('a key is required (--key or GARAGEBOT_UDP_KEY)')
+
+    client = Client(args.host, args.port, args.key.encode(), args.timeout)
+
+    if args.command == 'bench':
+        return bench(client, args.requests)
+
+    try:
+        result, state = client.send(COMMANDS[args.command])
+    except socket.timeout:
+        print('no response')
+        return 1
+    print(describe(result, state))
+    return 0 if result == RESULT_OK else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())